@@ -47,6 +47,17 @@
 #define QCDT_BOARD_TAG "qcom,board-id = <"
 #define QCDT_PMIC_TAG  "qcom,pmic-id = <"
 
+#define QCDT_DT_PROP    "qcom,msm-id"
+#define QCDT_BOARD_PROP "qcom,board-id"
+#define QCDT_PMIC_PROP  "qcom,pmic-id"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 0x1
+#define FDT_END_NODE   0x2
+#define FDT_PROP       0x3
+#define FDT_NOP        0x4
+#define FDT_END        0x9
+
 
 #define PAGE_SIZE_DEF  2048
 #define PAGE_SIZE_MAX  (1024*1024)
@@ -101,6 +112,15 @@ struct chipPt_t {
   struct chipPt_t *t_next;
 };
 
+struct fdt_blob {
+    uint8_t  *data;
+    uint32_t size;
+    uint32_t off_struct;
+    uint32_t size_struct;
+    uint32_t off_strings;
+    uint32_t size_strings;
+};
+
 char *input_dir;
 char *output_file;
 char *dtc_path;
@@ -251,9 +271,12 @@ void chip_deleteall()
   For v2 Extract 'qcom,msm-id', 'qcom,board-id' parameter double from DTB
       qcom,msm-id = <x z> i.e chipset, revision number;
       qcom,board-id = <y y'> i.e platform and sub-type;
+
+  Parses the output of dtc, only used when the blob can't be read
+  natively (see getChipInfo below).
  */
 
-struct chipInfo_t *getChipInfo(const char *filename, int *num, uint32_t msmversion)
+struct chipInfo_t *getChipInfoDtc(const char *filename, int *num, uint32_t msmversion)
 {
 
     const char str1[] = "dtc -I dtb -O dts \"";
@@ -638,7 +661,7 @@ struct chipInfo_t *getChipInfo(const char *filename, int *num, uint32_t msmversi
 }
 
 /* Get the version-id based on dtb files */
-int GetVersionInfo(const char *filename)
+int GetVersionInfoDtc(const char *filename)
 {
     const char str1[] = "dtc -I dtb -O dts \"";
     const char str2[] = "\" 2>&1";
@@ -696,6 +719,344 @@ int GetVersionInfo(const char *filename)
     return v;
 }
 
+/*
+  Native flattened device tree reader. Reading the properties straight
+  from the blob saves spawning dtc twice per DTB and parsing its text
+  output. Anything that doesn't look like a sane FDT is left to the dtc
+  based parsers above.
+ */
+static uint32_t fdt32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint32_t fdt_align(uint32_t len)
+{
+    return (len + 3) & ~3U;
+}
+
+int fdt_load(const char *filename, struct fdt_blob *fdt)
+{
+    struct stat st;
+    uint32_t version;
+    FILE *pfile;
+
+    memset(fdt, 0, sizeof(struct fdt_blob));
+    if (stat(filename, &st) != 0 || st.st_size < 40 ||
+        st.st_size > 0x7fffffff)
+        return RC_ERROR;
+
+    fdt->data = (uint8_t *)malloc(st.st_size);
+    if (!fdt->data) {
+        log_err("Out of memory\n");
+        return RC_ERROR;
+    }
+
+    pfile = fopen(filename, "rb");
+    if (pfile == NULL) {
+        free(fdt->data);
+        fdt->data = NULL;
+        return RC_ERROR;
+    }
+    fdt->size = fread(fdt->data, 1, st.st_size, pfile);
+    fclose(pfile);
+
+    if (fdt->size != (uint32_t)st.st_size ||
+        fdt32(fdt->data) != FDT_MAGIC ||
+        fdt32(fdt->data + 4) > fdt->size)
+        goto invalid;
+
+    fdt->size = fdt32(fdt->data + 4);
+    fdt->off_struct = fdt32(fdt->data + 8);
+    fdt->off_strings = fdt32(fdt->data + 12);
+    version = fdt32(fdt->data + 20);
+    if (fdt->off_struct >= fdt->size || fdt->off_strings > fdt->size)
+        goto invalid;
+
+    /* Sizes of the blocks are only in the header since v3 and v17 */
+    fdt->size_strings = fdt->size - fdt->off_strings;
+    if (version >= 3)
+        fdt->size_strings = fdt32(fdt->data + 32);
+    fdt->size_struct = fdt->size - fdt->off_struct;
+    if (version >= 17)
+        fdt->size_struct = fdt32(fdt->data + 36);
+    if (fdt->size_strings > fdt->size - fdt->off_strings ||
+        fdt->size_struct > fdt->size - fdt->off_struct)
+        goto invalid;
+
+    return RC_SUCCESS;
+
+invalid:
+    free(fdt->data);
+    fdt->data = NULL;
+    return RC_ERROR;
+}
+
+/*
+  Walk the structure block and call cb() with the cells of every
+  property called 'name', in the same order dtc would print them.
+  Returns how many were found, or RC_ERROR if the blob is malformed.
+  The walk stops early when cb() returns non zero.
+ */
+int fdt_for_each_prop(const struct fdt_blob *fdt, const char *name,
+                      int (*cb)(const uint8_t *val, uint32_t len, void *arg),
+                      void *arg)
+{
+    const uint8_t *base = fdt->data + fdt->off_struct;
+    const char *strings = (const char *)fdt->data + fdt->off_strings;
+    uint32_t off = 0, len, nameoff;
+    int count = 0;
+    const char *p;
+
+    while (off + 4 <= fdt->size_struct) {
+        uint32_t token = fdt32(base + off);
+        off += 4;
+        switch (token) {
+        case FDT_BEGIN_NODE:
+            p = memchr(base + off, 0, fdt->size_struct - off);
+            if (!p)
+                return RC_ERROR;
+            off += fdt_align(p - (const char *)(base + off) + 1);
+            break;
+        case FDT_END_NODE:
+        case FDT_NOP:
+            break;
+        case FDT_PROP:
+            if (off + 8 > fdt->size_struct)
+                return RC_ERROR;
+            len = fdt32(base + off);
+            nameoff = fdt32(base + off + 4);
+            off += 8;
+            if (len > fdt->size_struct - off || nameoff >= fdt->size_strings ||
+                !memchr(strings + nameoff, 0, fdt->size_strings - nameoff))
+                return RC_ERROR;
+            if (strcmp(strings + nameoff, name) == 0) {
+                count++;
+                if (cb && cb(base + off, len, arg))
+                    return count;
+            }
+            off += fdt_align(len);
+            break;
+        case FDT_END:
+            return count;
+        default:
+            return RC_ERROR;
+        }
+    }
+
+    return RC_ERROR;
+}
+
+struct fdt_chip_cells {
+    uint32_t *cells;
+    uint32_t num;
+};
+
+/* Collect the cells of all occurrences of a property */
+static int fdt_collect_cells(const uint8_t *val, uint32_t len, void *arg)
+{
+    struct fdt_chip_cells *c = (struct fdt_chip_cells *)arg;
+    uint32_t *cells, i;
+
+    if (len < 4)
+        return 0;
+
+    cells = (uint32_t *)realloc(c->cells,
+                                (c->num + len / 4) * sizeof(uint32_t));
+    if (!cells) {
+        log_err("Out of memory\n");
+        return 1;
+    }
+    c->cells = cells;
+    for (i = 0; i < len / 4; i++)
+        c->cells[c->num++] = fdt32(val + i * 4);
+
+    return 0;
+}
+
+/* v1 only ever looked at the first 'qcom,msm-id' */
+static int fdt_collect_first(const uint8_t *val, uint32_t len, void *arg)
+{
+    fdt_collect_cells(val, len, arg);
+    return 1;
+}
+
+static struct chipInfo_t *fdt_chip_new(struct chipInfo_t **chip)
+{
+    struct chipInfo_t *tmp;
+
+    tmp = (struct chipInfo_t *)malloc(sizeof(struct chipInfo_t));
+    if (!tmp) {
+        log_err("Out of memory\n");
+        return NULL;
+    }
+    memset(tmp, 0, sizeof(struct chipInfo_t));
+
+    /* Same ordering as the dtc parser: head first, the rest after it */
+    if (!*chip) {
+        *chip = tmp;
+    } else {
+        tmp->t_next = (*chip)->t_next;
+        (*chip)->t_next = tmp;
+    }
+    tmp->master = *chip;
+
+    return tmp;
+}
+
+/*
+  The dtc parser kept each of its id, board and pmic lists as the first
+  entry followed by the rest newest first, and built the chips from
+  those lists. Walking the cells in the same order keeps the output
+  identical, down to the order of entries that only differ in pmic.
+ */
+static uint32_t dtc_list_order(uint32_t n, uint32_t count)
+{
+    return n == 0 ? 0 : count - n;
+}
+
+/*
+  Returns RC_ERROR only if the blob can't be walked, so the caller can
+  still try with dtc. *chip is left NULL if the tags are missing.
+ */
+int getChipInfoFdt(const struct fdt_blob *fdt, struct chipInfo_t **chip,
+                   int *num, uint32_t msmversion)
+{
+    struct fdt_chip_cells dt = {NULL, 0}, st = {NULL, 0}, pt = {NULL, 0};
+    struct chipInfo_t *tmp;
+    uint32_t i, j, k, ndt, nst, npt;
+    int rc = RC_SUCCESS;
+
+    *chip = NULL;
+    if (msmversion == 1) {
+        if (fdt_for_each_prop(fdt, QCDT_DT_PROP, fdt_collect_first,
+                              &dt) < 0) {
+            rc = RC_ERROR;
+            goto out;
+        }
+        if (dt.num == 0) {
+            log_err("... skip, incorrect '%s' format\n", QCDT_DT_TAG);
+            goto out;
+        }
+        for (i = 0; i + 3 <= dt.num; i += 3) {
+            tmp = fdt_chip_new(chip);
+            if (!tmp)
+                break;
+            tmp->chipset  = dt.cells[i];
+            tmp->platform = dt.cells[i + 1];
+            tmp->revNum   = dt.cells[i + 2];
+        }
+        *num = dt.num / 3;
+        goto out;
+    }
+
+    if (fdt_for_each_prop(fdt, QCDT_DT_PROP, fdt_collect_cells, &dt) < 0 ||
+        fdt_for_each_prop(fdt, QCDT_BOARD_PROP, fdt_collect_cells, &st) < 0 ||
+        fdt_for_each_prop(fdt, QCDT_PMIC_PROP, fdt_collect_cells, &pt) < 0) {
+        rc = RC_ERROR;
+        goto out;
+    }
+
+    if (dt.num < 2) {
+        log_err("... skip, incorrect '%s' format\n", QCDT_DT_TAG);
+        goto out;
+    }
+    if (st.num < 2) {
+        log_err("... skip, incorrect '%s' format\n", QCDT_BOARD_TAG);
+        goto out;
+    }
+    if (pt.num < 4 && msmversion == 3) {
+        log_err("... skip, incorrect '%s' format\n", QCDT_PMIC_TAG);
+        goto out;
+    }
+
+    ndt = dt.num / 2;
+    nst = st.num / 2;
+    npt = (msmversion == 3) ? pt.num / 4 : 1;
+    for (i = 0; i < ndt; i++) {
+        for (j = 0; j < nst; j++) {
+            for (k = 0; k < npt; k++) {
+                tmp = fdt_chip_new(chip);
+                if (!tmp)
+                    goto out;
+                tmp->chipset  = dt.cells[dtc_list_order(i, ndt) * 2];
+                tmp->revNum   = dt.cells[dtc_list_order(i, ndt) * 2 + 1];
+                tmp->platform = st.cells[dtc_list_order(j, nst) * 2];
+                tmp->subtype  = st.cells[dtc_list_order(j, nst) * 2 + 1];
+                if (msmversion == 3)
+                    memcpy(tmp->pmic_model,
+                           &pt.cells[dtc_list_order(k, npt) * 4],
+                           sizeof(tmp->pmic_model));
+            }
+        }
+    }
+    *num = dt.num / 2;
+
+out:
+    free(dt.cells);
+    free(st.cells);
+    free(pt.cells);
+    return rc;
+}
+
+/*
+  For v1 Extract 'qcom,msm-id' parameter triplet from DTB
+      qcom,msm-id = <x y z>;
+
+  For v2 Extract 'qcom,msm-id', 'qcom,board-id' parameter double from DTB
+      qcom,msm-id = <x z> i.e chipset, revision number;
+      qcom,board-id = <y y'> i.e platform and sub-type;
+
+  Reads the DTB directly and only falls back to dtc for blobs the
+  native reader can't make sense of.
+ */
+struct chipInfo_t *getChipInfo(const char *filename, int *num, uint32_t msmversion)
+{
+    struct fdt_blob fdt;
+    struct chipInfo_t *chip = NULL;
+    int rc;
+
+    if (fdt_load(filename, &fdt) != RC_SUCCESS) {
+        log_dbg("... not a valid FDT, trying with dtc\n");
+        return getChipInfoDtc(filename, num, msmversion);
+    }
+
+    rc = getChipInfoFdt(&fdt, &chip, num, msmversion);
+    free(fdt.data);
+    if (rc != RC_SUCCESS) {
+        log_dbg("... malformed FDT, trying with dtc\n");
+        return getChipInfoDtc(filename, num, msmversion);
+    }
+
+    return chip;
+}
+
+/* Get the version-id based on dtb files */
+int GetVersionInfo(const char *filename)
+{
+    struct fdt_blob fdt;
+    int board, pmic;
+    int v = 1;
+
+    if (fdt_load(filename, &fdt) != RC_SUCCESS)
+        return GetVersionInfoDtc(filename);
+
+    board = fdt_for_each_prop(&fdt, QCDT_BOARD_PROP, NULL, NULL);
+    pmic = fdt_for_each_prop(&fdt, QCDT_PMIC_PROP, NULL, NULL);
+    free(fdt.data);
+    if (board < 0 || pmic < 0)
+        return GetVersionInfoDtc(filename);
+
+    if (pmic > 0)
+        v = 3;
+    else if (board > 0)
+        v = 2;
+    log_info("Version:%d\n", v);
+
+    return v;
+}
+
 /* Extract 'qcom,msm-id' 'qcom,board-id' parameter from DTB
    v1 format:
       qcom,msm-id = <x y z> [, <x2 y2 z2> ...];
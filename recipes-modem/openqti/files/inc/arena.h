@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCRATCH_ARENA_SIZE 8192 // Per thread, from first use to its exit
+#define SCRATCH_ALIGN 8
+
+struct scratch_chunk;
+
+struct scratch_mark {
+  size_t used;
+  struct scratch_chunk *overflow;
+};
+
+struct scratch_stats {
+  uint32_t threads;    // Running threads that have an arena
+  uint32_t high_water; // Most bytes any of them had in use
+  uint64_t overflows;  // Allocations that didn't fit
+};
+
+void *scratch_alloc(size_t size);
+struct scratch_mark scratch_save();
+void scratch_restore(struct scratch_mark mark);
+struct scratch_stats get_scratch_stats();
+#endif
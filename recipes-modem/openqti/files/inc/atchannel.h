@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _ATCHANNEL_H_
+#define _ATCHANNEL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AT_CHANNEL_QUEUE_SIZE 16
+#define AT_CHANNEL_MAX_CMD_SIZE 256
+#define AT_CHANNEL_MAX_RESPONSE_SIZE 4096
+#define AT_CHANNEL_MAX_LINE_SIZE 1024
+#define AT_CHANNEL_MAX_URC_HANDLERS 8
+#define AT_CHANNEL_REOPEN_DELAY_MS 1000
+#define AT_DEFAULT_TIMEOUT_MS 1500
+#define AT_CHANNEL_DRAIN_MAX_MS 5000
+/* Sent after a timeout to find where the late response ends */
+#define AT_CHANNEL_SYNC_CMD "AT+CMEE?\r\n"
+#define AT_CHANNEL_SYNC_REPLY "+CMEE:"
+
+enum {
+  AT_RESULT_OK = 0,
+  AT_RESULT_ERROR = 1,   // ERROR, +CME ERROR, +CMS ERROR...
+  AT_RESULT_TIMEOUT = 2, // No final result code in time
+  AT_RESULT_IO_ERROR = 3 // Port went away while the request was in flight
+};
+
+/*
+ * Callbacks always run from the AT channel thread. The response
+ * contains every line received for the request (including the final
+ * result code), NULL terminated, and is only valid during the call
+ */
+typedef void (*at_response_cb)(int result, char *response, size_t len,
+                               void *data);
+typedef void (*at_urc_cb)(char *line, size_t len, void *data);
+
+int at_channel_init();
+void *at_channel_thread();
+int at_send_async(const char *command, size_t len, uint32_t timeout_ms,
+                  at_response_cb callback, void *data);
+int at_send_sync(const char *command, size_t len, char *response,
+                 size_t response_sz, uint32_t timeout_ms);
+int at_register_urc_handler(const char *prefix, at_urc_cb callback,
+                            void *data);
+#endif
@@ -125,6 +125,7 @@ struct pcm {
   unsigned flags;
   unsigned format;
   unsigned running : 1;
+  unsigned null_sink : 1; // Emulated device, see devices.c
   int underruns;
   unsigned buffer_size;
   unsigned period_size;
@@ -210,6 +211,14 @@ unsigned int pcm_get_buffer_size(const struct pcm *pcm);
 unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames);
 void setup_codec();
 
+/* Text to speech, see pico2aud.c */
+#define TTS_STREAM_RING_SIZE 32768 // 1 second of 16KHz mono audio
+#define TTS_STREAM_CHUNK 2048      // Bytes per pcm_write()
+int init_tts_engine();
+int tts_stream_start(struct pcm *pcm);
+void tts_stream_drain();
+void tts_stream_abort();
+void tts_stream_stop();
 int pico2aud(char *text, size_t len);
 void set_multimedia_mixer();
 void stop_multimedia_mixer();
@@ -113,6 +113,8 @@ struct call_status_meta {
   uint8_t is_multiparty; // 0x00 || 0x01 TRUE 
   uint8_t als;
 } __attribute__((packed));
+/* Payload we need from TLV_CALL_INFO, from num_instances to call_mode */
+#define META_TLV_LEN 6
 
 struct remote_party_data {
   uint8_t num_instances;
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define VOLATILE_CAPTURE_PATH "/var/log/openqti.qcap"
+#define PERSISTENT_CAPTURE_PATH "/persist/openqti.qcap"
+
+#define QCAP_MAGIC 0x50414351 // "QCAP" when read as little endian
+#define QCAP_VERSION_MAJOR 1
+#define QCAP_VERSION_MINOR 0
+
+#define QCAP_BUFFER_SIZE 16384
+#define QCAP_FLUSH_INTERVAL_MS 1000
+#define QCAP_MAX_FILE_SIZE (2 * 1024 * 1024) // Then rotated to .1
+
+/*
+ * QCAP file format (all fields little endian):
+ *  One qcap_file_header, followed by records. Each record is a
+ *  qcap_record_header followed by caplen bytes of the raw frame as it
+ *  was read from the port, starting with the QMUX header.
+ */
+struct qcap_file_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  uint32_t snaplen; // Max bytes stored per record
+  uint32_t reserved;
+} __attribute__((packed));
+
+struct qcap_record_header {
+  uint32_t ts_sec;  // CLOCK_REALTIME
+  uint32_t ts_nsec;
+  uint8_t direction; // FROM_DSP, FROM_HOST, FROM_OPENQTI (host bound)
+  uint8_t service;   // QMUX service, for quick filtering
+  uint16_t reserved;
+  uint32_t caplen;  // Bytes stored after this header
+  uint32_t origlen; // Bytes in the original frame
+} __attribute__((packed));
+
+void set_packet_capture_state(bool en);
+void capture_packet(uint8_t direction, const void *buf, size_t len);
+bool is_packet_capture_pending();
+void flush_packet_capture();
+
+#endif
@@ -12,6 +12,8 @@
 #define GET_COMMON_IND "AT+CIND?\r\n"
 #define GET_COMMON_IND_RESPONSE_PROTO "+CIND:"
 #define GET_IMSI "AT+CIMI\r\n"
+#define AT_CELL_TIMEOUT_MS 500
+#define NETWORK_REFRESH_INTERVAL_MS 2000 // Min time between AT refreshes
 
 struct gsm_neighbour {
   int arfcn;
@@ -144,6 +146,8 @@ uint8_t get_network_type();
 uint8_t get_signal_strength();
 int is_network_in_service();
 void update_network_data(uint8_t network_type, uint8_t signal_level);
+void queue_network_update(uint8_t network_type, uint8_t signal_level);
+void *network_state_thread();
 struct network_state get_network_status();
 struct cell_report get_current_cell_report();
 #endif
@@ -3,6 +3,7 @@
 #ifndef _COMMAND_H_
 #define _COMMAND_H_
 #include "../inc/helpers.h"
+#include "../inc/proxy.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -56,6 +57,12 @@ static const struct {
     {33, "callwait auto hangup", "I will automatically terminate all incoming calls while you're talking", "Automatically kills any new incoming call while you're talking"},
     {34, "callwait auto ignore", "I will just inform you that there's a new call waiting", "Automatically ignores any new incoming call while you're talking"},
     {35, "callwait mode default", "I will let the host handle multiple calls", "Disables automatic hang up of incoming calls while you're talking"},
+    {36, "enable capture", "Packet capture: enabled", "Store all QMI traffic to a binary capture file"},
+    {37, "disable capture", "Packet capture: disabled", "Stop capturing QMI traffic"},
+    {38, "qmi stats", "QMI handlers (calls, time):", "Show how often each QMI handler ran and how long it took"},
+    {39, "dump stats", "Proxy stats written to", "Write all the proxy counters and latencies to a file"},
+    {40, "gps fix", "Last GPS fix", "Show the last position reported by the GPS"},
+    {41, "last messages", "Last messages:", "Show the last messages in the SMS history"},
 };
 
 static const struct {
@@ -72,7 +79,9 @@ static const struct {
     {104, "wake me up ", "Will wake you up ",
      "Wake you up [at/in] hh[:xx min]"},
     {105, "delete task ", "Removing task ",
-     "delete task X: Removes task X from the scheduler"}};
+     "delete task X: Removes task X from the scheduler"},
+    {106, "messages from ", "Messages from ",
+     "messages from X: Last messages from number X"}};
 static const struct {
   unsigned int id;
   const char *answer;
@@ -94,6 +103,11 @@ char *get_rt_modem_name();
 char *get_rt_user_name();
 
 void set_cmd_runtime_defaults();
+void send_qmi_handler_stats();
+void send_gps_fix();
+void send_stored_messages(const char *number);
+void send_latency_stats(const char *name, struct pkt_stats *stats,
+                        bool has_handler);
 uint8_t parse_command(uint8_t *command);
 
 #endif
@@ -19,6 +19,11 @@ struct config_prototype {
   uint8_t signal_tracking;
   uint8_t sms_logging;
   uint8_t callwait_autohangup;
+  uint8_t packet_capture;
+  uint8_t gps_suspend_policy;
+  uint8_t gps_suspend_buffer_kb;
+  uint16_t gps_rate_limit_ms;
+  uint16_t sms_queue_size;
   bool first_boot;
 };
 
@@ -61,4 +66,17 @@ void set_sms_logging(bool en);
 int callwait_auto_hangup_operation_mode();
 void enable_call_waiting_autohangup(uint8_t en);
 
+/* QMI packet capture */
+int is_packet_capture_enabled();
+void enable_packet_capture(bool en);
+
+/* What the GPS proxy does with NMEA data while USB is suspended */
+uint8_t get_gps_suspend_policy();
+uint8_t get_gps_suspend_buffer_kb();
+/* Minimum time between two NMEA sentences of the same type, 0 is off */
+uint16_t get_gps_rate_limit_ms();
+
+/* Messages openqti can have waiting to be delivered to the host */
+uint16_t get_sms_queue_size();
+
 #endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 #ifndef _DEVICES_H_
 #define _DEVICES_H_
 
+#include <stdbool.h>
+
 /* Devices */
 /* Dynamic Port Mapper */
 #define DPM_CTL "/dev/dpl_ctrl"
@@ -36,4 +38,20 @@
 #define USB_EN_PATH "/sys/class/android_usb/android0/enable"
 #define SUSPEND_INHIBIT_PATH                                                   \
   "/sys/devices/78d9000.usb/msm_hsusb/isr_inhibit_suspend"
-#endif
\ No newline at end of file
+#define USB_SUSPEND_STATE_PATH                                                 \
+  "/sys/devices/78d9000.usb/msm_hsusb/isr_suspend_state"
+
+/*
+ * Device emulation
+ *  If this variable is set, every path above is looked up under the
+ *  directory it points to instead (see tools/devemu.c)
+ */
+#define DEVICE_ROOT_ENV "OPENQTI_DEVROOT"
+#define DEVICE_MAP_SIZE 64
+#define DEVICE_PATH_MAX 256
+
+void init_device_root();
+bool is_device_emulation();
+const char *get_device_path(const char *path);
+int open_device(const char *path, int flags);
+#endif
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _DISPATCH_H_
+#define _DISPATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define QMI_MSGID_ANY -1 // Every message of the service without its own entry
+#define QMI_DIR_ANY 0xff // Both FROM_DSP and FROM_HOST
+
+#define DISPATCH_MAX_HANDLERS 32
+#define DISPATCH_HASH_SIZE 128 // Power of two, > 2 * DISPATCH_MAX_HANDLERS
+#define DISPATCH_MAX_SERVICES 256
+
+/*
+ * Handlers get the message and return the action process_packet should
+ * take with it (PACKET_PASS_TRHU, PACKET_BYPASS, PACKET_FORCED_PT...)
+ */
+typedef uint8_t (*qmi_handler_fn)(uint8_t source, uint8_t *pkt, size_t len,
+                                  uint16_t msgid, int adspfd, int usbfd);
+
+struct qmi_handler_stats {
+  const char *name;
+  uint8_t service;
+  int32_t msgid;     // QMI_MSGID_ANY for service wide handlers
+  uint8_t direction; // FROM_DSP, FROM_HOST or QMI_DIR_ANY
+  uint32_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+int register_qmi_handler(uint8_t service, int32_t msgid, uint8_t direction,
+                         const char *name, qmi_handler_fn handler);
+uint8_t dispatch_qmi_message(uint8_t source, uint8_t service, uint16_t msgid,
+                             uint8_t *pkt, size_t len, int adspfd, int usbfd);
+int get_qmi_handler_stats(struct qmi_handler_stats *stats, int max);
+void reset_qmi_handler_stats();
+#endif
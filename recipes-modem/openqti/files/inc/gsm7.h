@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _GSM7_H_
+#define _GSM7_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GSM7_ESCAPE 0x1b
+/* Bytes it takes to pack a number of septets */
+#define GSM7_PACKED_SIZE(septets) (((septets) * 7 + 7) / 8)
+
+/* Alphabet, from the Data Coding Scheme (3GPP TS 23.038, 4) */
+enum {
+  SMS_ALPHABET_GSM7 = 0,
+  SMS_ALPHABET_8BIT = 1,
+  SMS_ALPHABET_UCS2 = 2,
+};
+
+int gsm7_char_len(uint8_t c);
+int ascii_to_gsm7(const uint8_t *text, uint8_t *out, int first_septet);
+size_t gsm7_unpack(const uint8_t *in, size_t len, size_t first_septet,
+                   uint8_t *septets, size_t count);
+size_t gsm7_decode(const uint8_t *in, size_t len, size_t first_septet,
+                   char *out, size_t count);
+int gsm7_to_ascii(const uint8_t *buffer, int buffer_length, char *output,
+                  int septets);
+size_t utf8_to_ucs2(const uint8_t *text, size_t len, uint8_t *out);
+size_t ucs2_to_utf8(const uint8_t *in, size_t len, char *out,
+                    size_t out_size);
+int get_dcs_alphabet(uint8_t dcs);
+size_t decode_user_data(uint8_t dcs, const uint8_t *ud, size_t ud_len,
+                        uint8_t udl, char *out, size_t out_size);
+#endif
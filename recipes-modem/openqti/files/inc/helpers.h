@@ -14,6 +14,8 @@
 #define INPUT_DEV "/dev/input/event0"
 
 #define MSG_DELETE_PARTIAL_CMD "AT+CMGD="
+#define MSG_DELETE_ALL_CMD "AT+CMGD=0,4\r\n" // delflag 4: whole storage
+#define MSG_STORAGE_MAX_INDEX 100
 
 int write_to(const char *path, const char *val, int flags);
 uint32_t get_curr_timestamp();
@@ -35,7 +37,7 @@ int get_int_from_str(char *str, int offset);
 void *power_key_event();
 int read_adsp_version();
 int wipe_message_storage();
-void add_message_to_queue(uint8_t *message, size_t len);
+int add_message_to_queue(uint8_t *message, size_t len);
 int send_at_command(char *at_command, size_t cmdlen, char *response, size_t response_sz);
 
 #endif
\ No newline at end of file
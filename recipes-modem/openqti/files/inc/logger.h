@@ -13,6 +13,17 @@
 #define VOLATILE_THERMAL_LOGFILE "/var/log/thermal.log"
 #define PERSISTENT_THERMAL_LOGFILE "/persist/thermal.log"
 
+#define LOG_RING_SLOTS 256 // Must be a power of two
+#define LOG_SLOT_SIZE 1024 // Longer lines are truncated
+#define LOG_WRITE_BATCH 64
+#define LOG_WRITER_MAX_SLEEP_MS 1000
+
+enum {
+  LOG_TARGET_MAIN = 0,
+  LOG_TARGET_THERMAL,
+  LOG_TARGET_MAX
+};
+
 void reset_logtime();
 double get_elapsed_time();
 void logger(uint8_t level, char *format, ...);
@@ -22,6 +33,8 @@ uint8_t get_log_level();
 void set_log_level(uint8_t level);
 void set_log_method(bool ttyout);
 void dump_pkt_raw(uint8_t *buf, int pktsize);
+void flush_log();
+uint32_t get_log_dropped_count();
 int mask_phone_number(uint8_t *orig, char *dest, uint8_t len);
 #endif
 
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Shared memory metrics page
+ *  openqti keeps a struct openqti_metrics mapped in a file under /tmp
+ *  (tmpfs) and refreshes it every METRICS_UPDATE_INTERVAL_MS. Readers
+ *  map the same file read only and never talk to openqti.
+ *  Updates are protected by a sequence counter: it is odd while the
+ *  page is being written, so readers copy the page and retry if seq
+ *  was odd or changed while they were copying (see tools/qmetrics.c).
+ *  Only fixed width fields in here, this header is shared with the
+ *  tools. Bump METRICS_VERSION when the layout changes, and only add
+ *  fields at the end.
+ */
+#define METRICS_PATH "/tmp/openqti.metrics"
+#define METRICS_MAGIC 0x4d54514f // "OQTM"
+#define METRICS_VERSION 2
+#define METRICS_UPDATE_INTERVAL_MS 500
+#define METRICS_THERMAL_ZONES 8
+
+/* Nanoseconds, from struct latency_summary */
+struct metrics_latency {
+  uint64_t count;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+};
+
+struct metrics_proxy {
+  uint64_t bypassed;
+  uint64_t empty;
+  uint64_t discarded;
+  uint64_t allowed;
+  uint64_t failed;
+  uint64_t other;
+  struct metrics_latency forward[2]; // FROM_DSP, FROM_HOST
+  struct metrics_latency handler[2];
+};
+
+struct openqti_metrics {
+  /* Header */
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; // sizeof(struct openqti_metrics) in the writer
+  uint32_t pid;
+  uint32_t update_interval_ms;
+  _Atomic uint32_t seq; // Odd while writing
+  uint64_t updated_ns;  // CLOCK_MONOTONIC
+  uint64_t start_ns;
+
+  /* Proxy */
+  struct metrics_proxy rmnet;
+  struct metrics_proxy gps;
+
+  /* Internal state */
+  uint32_t sms_queue_depth;
+  uint32_t pending_tasks;
+  uint32_t tracked_clients;
+  uint32_t dirty_reconnects;
+  uint32_t log_dropped;
+  uint32_t usb_suspended;
+  int32_t thermal[METRICS_THERMAL_ZONES]; // Degrees C
+
+  /* Network */
+  uint32_t network_type;
+  uint32_t signal_level;
+  uint32_t signal_bars;
+  uint32_t in_service;
+  uint32_t in_call;
+  uint32_t reserved;
+
+  /* SMS queue, since version 2 */
+  uint32_t sms_queue_capacity;
+  uint32_t sms_queue_high_water;
+  uint64_t sms_queue_rejected;
+};
+
+int init_metrics();
+void *metrics_thread();
+#endif
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _NMEA_H_
+#define _NMEA_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* What to do with NMEA data while the host is suspended */
+enum {
+  NMEA_SUSPEND_DISCARD = 0,     // Throw it away
+  NMEA_SUSPEND_LATEST = 1,      // Keep the last sentence of each type
+  NMEA_SUSPEND_DROP_OLDEST = 2, // Ring buffer, oldest sentences go first
+  NMEA_SUSPEND_KEEP_ALL = 3,    // Keep everything until the buffer is full
+};
+
+#define NMEA_SUSPEND_DEFAULT_POLICY NMEA_SUSPEND_LATEST
+#define NMEA_SUSPEND_DEFAULT_KB 16
+#define NMEA_SUSPEND_MAX_KB 64
+#define NMEA_MAX_SENTENCE 128 // Spec says 82, leave room for vendor ones
+#define NMEA_MAX_ADDRESS 8    // "GPGSV" plus the GSV message number
+#define NMEA_LATEST_SLOTS 24
+#define NMEA_MAX_FIELDS 24
+#define NMEA_MAX_TALKERS 6  // GP, GL, GA, GB, BD, GN...
+#define NMEA_OUT_SIZE 4224  // MAX_PACKET_SIZE plus a held sentence
+
+/* Last known position, from GGA, RMC, GSA and GSV */
+struct nmea_fix {
+  bool valid;          // RMC status A, or GGA quality > 0
+  uint64_t updated_ns; // Last time any of it changed, CLOCK_MONOTONIC
+  char utc_time[12];   // hhmmss.ss
+  char date[8];        // ddmmyy
+  double latitude;     // Degrees, negative is south
+  double longitude;    // Degrees, negative is west
+  float altitude;      // Meters above mean sea level
+  float speed_knots;
+  float course;
+  float pdop;
+  float hdop;
+  float vdop;
+  uint8_t quality;  // GGA fix quality
+  uint8_t fix_type; // GSA: 1 no fix, 2 2D, 3 3D
+  uint8_t sats_used;
+  uint8_t sats_in_view; // Sum of every constellation's GSV
+};
+
+struct nmea_parser_stats {
+  uint64_t sentences;
+  uint64_t parsed;     // GGA, RMC, GSA or GSV
+  uint64_t bad_checksum;
+  uint64_t malformed;  // No checksum, or too long
+  uint64_t rate_limited;
+};
+
+struct nmea_buffer_stats {
+  uint8_t policy;
+  uint32_t size;     // Bytes currently held
+  uint64_t stored;   // Bytes accepted while suspended
+  uint64_t dropped;  // Bytes lost to the policy or the size limit
+  uint64_t flushed;  // Bytes sent to the host on resume
+  uint64_t flushes;
+};
+
+int init_nmea_buffer(uint8_t policy, size_t max_bytes);
+void nmea_buffer_store(const uint8_t *buf, size_t len);
+bool nmea_buffer_pending();
+int nmea_buffer_flush(int fd);
+struct nmea_buffer_stats get_nmea_buffer_stats();
+const char *get_nmea_policy_name(uint8_t policy);
+
+void init_nmea_parser(uint16_t rate_limit_ms);
+const uint8_t *process_nmea_data(const uint8_t *buf, size_t *len);
+struct nmea_fix get_last_fix();
+struct nmea_parser_stats get_nmea_parser_stats();
+#endif
@@ -3,20 +3,53 @@
 #ifndef _PROXY_H
 #define _PROXY_H
 
+#include "../inc/stats.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
+#define PROXY_MAX_EVENTS 8
+#define PROXY_TICK_INTERVAL_MS 500 // Retry tick while injecting data
+#define SUSPEND_MAX_LISTENERS 4
+#define SUSPEND_POLL_FALLBACK_MS 100 // Only until sysfs_notify is seen
+
+/* Live counters, only the owning proxy thread updates them */
+struct proxy_stats {
+  _Atomic uint64_t bypassed;
+  _Atomic uint64_t empty;
+  _Atomic uint64_t discarded;
+  _Atomic uint64_t allowed;
+  _Atomic uint64_t failed;
+  _Atomic uint64_t other;
+  /* Indexed by source, FROM_DSP or FROM_HOST */
+  struct latency_histogram forward[2]; // From read() to write()
+  struct latency_histogram handler[2]; // process_packet(), rmnet only
+};
+
+/* Snapshot handed out to readers */
 struct pkt_stats {
-  uint32_t bypassed;
-  uint32_t empty;
-  uint32_t discarded;
-  uint32_t allowed;
-  uint32_t failed;
-  uint32_t other;
+  uint64_t bypassed;
+  uint64_t empty;
+  uint64_t discarded;
+  uint64_t allowed;
+  uint64_t failed;
+  uint64_t other;
+  struct latency_summary forward[2];
+  struct latency_summary handler[2];
 };
 struct pkt_stats get_rmnet_stats();
 struct pkt_stats get_gps_stats();
+void dump_proxy_stats(FILE *fp);
+int write_proxy_stats(const char *path);
 int get_transceiver_suspend_state();
+int add_suspend_state_listener(int evfd);
+void *suspend_monitor_thread();
+void init_proxy_runtime();
+void request_proxy_injection();
+uint8_t process_packet(uint8_t source, uint8_t *pkt, size_t pkt_size,
+                       int adspfd, int usbfd);
+uint8_t is_inject_needed();
 void *gps_proxy();
 void *rmnet_proxy(void *node_data);
 #endif
\ No newline at end of file
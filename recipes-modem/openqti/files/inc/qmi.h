@@ -90,9 +90,23 @@ struct tlv_position {
   uint16_t size;
 };
 
+/* TLV IDs are a single byte, so the index has a slot for each one */
+#define QMI_TLV_INDEX_SIZE 256
+struct qmi_tlv_index {
+  const uint8_t *pkt;
+  size_t pkt_len;
+  uint16_t num_tlvs;
+  uint16_t offset[QMI_TLV_INDEX_SIZE]; // 0 if the TLV isn't in the packet
+  uint16_t len[QMI_TLV_INDEX_SIZE];
+};
+
 uint8_t get_qmux_service_id(void *bytes, size_t len);
 uint16_t get_message_id(void *bytes, size_t len);
 uint16_t get_transaction_id(void *bytes, size_t len);
-uint16_t get_tlv_offset_by_id(uint8_t *bytes, size_t len, uint8_t tlvid);
+int build_tlv_index(struct qmi_tlv_index *index, uint8_t *bytes, size_t len);
+int pin_tlv_index(uint8_t *bytes, size_t len);
+void unpin_tlv_index();
+int get_tlv_offset_by_id(uint8_t *bytes, size_t len, uint8_t tlvid);
+int get_tlv_len_by_id(uint8_t *bytes, size_t len, uint8_t tlvid);
 
 #endif
\ No newline at end of file
@@ -52,5 +52,6 @@ struct task_p {
 void *start_scheduler_thread();
 int add_task(struct task_p task);
 void dump_pending_tasks();
+int get_num_pending_tasks();
 int remove_task(int taskID);
 #endif
\ No newline at end of file
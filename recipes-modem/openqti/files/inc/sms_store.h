@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _SMS_STORE_H_
+#define _SMS_STORE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define VOLATILE_SMS_STORE_PATH "/var/log/sms"
+#define PERSISTENT_SMS_STORE_PATH "/persist/sms"
+
+#define SMS_STORE_MAGIC 0x48534d53       // "SMSH" when read as little endian
+#define SMS_STORE_INDEX_MAGIC 0x49534d53 // "SMSI"
+#define SMS_STORE_VERSION 1
+
+#define SMS_STORE_MAX_SEGMENTS 4 // The oldest one is deleted after this
+#define SMS_STORE_SEGMENT_SIZE (64 * 1024)
+#define SMS_STORE_SEGMENT_RECORDS 256
+#define SMS_STORE_MAX_RECORDS                                                  \
+  (SMS_STORE_MAX_SEGMENTS * SMS_STORE_SEGMENT_RECORDS)
+#define SMS_STORE_NUMBER_SIZE 24 // NUL included
+#define SMS_STORE_TEXT_SIZE 256  // NUL included, longer texts are cut
+#define SMS_STORE_QUERY_SIZE 5   // Messages shown by the bot commands
+
+/*
+ * SMS store format (all fields little endian):
+ *  The store is a directory of numbered segments, each one a pair of
+ *  files: NNNNNNNN.msg holds the messages and NNNNNNNN.idx is its
+ *  index. Both start with a sms_store_file_header.
+ *  Every message is a sms_store_record followed by number_len bytes of
+ *  the number and text_len bytes of text (UTF-8), with no terminators.
+ *  The index has one sms_store_index_entry per message, in the same
+ *  order, and can be rebuilt from the .msg file if it's lost.
+ */
+struct sms_store_file_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t segment;
+} __attribute__((packed));
+
+struct sms_store_record {
+  uint32_t timestamp; // CLOCK_REALTIME
+  uint8_t direction;  // FROM_DSP: received, FROM_HOST: sent
+  uint8_t number_len;
+  uint16_t text_len;
+} __attribute__((packed));
+
+struct sms_store_index_entry {
+  uint32_t timestamp;
+  uint32_t number_hash; // FNV-1a of the number
+  uint32_t offset;      // Of the record in the .msg file
+} __attribute__((packed));
+
+struct sms_store_message {
+  uint32_t timestamp;
+  uint8_t direction;
+  char number[SMS_STORE_NUMBER_SIZE];
+  char text[SMS_STORE_TEXT_SIZE];
+};
+
+int store_sms_message(uint8_t direction, const char *number,
+                      const char *text);
+int get_last_sms_messages(const char *number, struct sms_store_message *out,
+                          int count);
+uint32_t get_sms_store_count();
+#endif
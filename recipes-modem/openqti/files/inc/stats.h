@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define VOLATILE_STATS_PATH "/var/log/openqti.stats"
+
+/*
+ * Log scale latency histogram in nanoseconds: values below 8 get their
+ * own bucket, after that every power of two is split in
+ * 2^STATS_HIST_SUB_BITS buckets, so the error is under 25%.
+ * 128 buckets go up to ~8.6s, slower samples end up in the last one.
+ */
+#define STATS_HIST_SUB_BITS 2
+#define STATS_HIST_BUCKETS 128
+
+struct latency_histogram {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum_ns;
+  _Atomic uint64_t max_ns;
+  _Atomic uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+/* What the readers get, all in nanoseconds */
+struct latency_summary {
+  uint64_t count;
+  uint64_t avg_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+};
+
+#define stat_inc(counter)                                                      \
+  atomic_fetch_add_explicit(&(counter), 1, memory_order_relaxed)
+#define stat_read(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+uint64_t stats_now_ns();
+void histogram_record(struct latency_histogram *hist, uint64_t ns);
+void histogram_record_since(struct latency_histogram *hist, uint64_t start_ns);
+uint64_t histogram_percentile(struct latency_histogram *hist,
+                              uint32_t permille);
+struct latency_summary histogram_summary(struct latency_histogram *hist);
+void histogram_reset(struct latency_histogram *hist);
+void dump_histogram(FILE *fp, const char *name, struct latency_histogram *hist);
+#endif
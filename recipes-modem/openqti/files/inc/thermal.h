@@ -12,6 +12,7 @@
 #define THERMAL_TEMP_CRITICAL 90
 #define THERMAL_TEMP_WARNING 87
 #define THERMAL_TEMP_INFO 81
+int get_thermal_readings(int *temps, int max);
 void *thermal_monitoring_thread();
 
 #endif
\ No newline at end of file
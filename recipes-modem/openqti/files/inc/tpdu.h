@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _TPDU_H_
+#define _TPDU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* TP-MTI, in the first octet. Only what travels to or from the MS */
+enum {
+  TPDU_DELIVER = 0x00,
+  TPDU_SUBMIT = 0x01,
+};
+
+#define TPDU_MTI_MASK 0x03
+#define TPDU_VPF_MASK 0x18  // SUBMIT only
+#define TPDU_UDHI 0x40      // User data starts with a header
+#define TPDU_MAX_SMSC_SIZE 11  // Length octet not included
+#define TPDU_MAX_ADDRESS_DIGITS 20
+#define TPDU_TIMESTAMP_SIZE 7
+#define TPDU_MAX_UD_SIZE 140
+
+/* Type of number, in the type of address */
+#define TPDU_TON_MASK 0x70
+#define TPDU_TON_INTERNATIONAL 0x10
+#define TPDU_TON_ALPHANUMERIC 0x50
+
+/* Information element identifiers in the UDH */
+#define TPDU_IEI_CONCAT_8BIT 0x00
+#define TPDU_IEI_CONCAT_16BIT 0x08
+
+/* Room for any address or text once converted, NUL included */
+#define TPDU_ADDRESS_STRING_SIZE (TPDU_MAX_ADDRESS_DIGITS + 2)
+#define TPDU_TEXT_SIZE 256
+
+/*
+ * Everything in here points into the PDU it was decoded from, which
+ * has to outlive it. Nothing is copied.
+ */
+struct tpdu_address {
+  uint8_t type;         // Type of address, 0 if there isn't one
+  uint8_t digits;       // Semi-octets, as in the address length
+  const uint8_t *value; // BCD, or packed GSM-7 if alphanumeric
+  uint8_t size;         // Octets in value
+};
+
+struct tpdu_ie {
+  uint8_t iei;
+  uint8_t size;
+  const uint8_t *data;
+};
+
+struct tpdu {
+  uint8_t mti;
+  uint8_t first_octet;
+  struct tpdu_address smsc;
+  struct tpdu_address address; // Originator or destination
+  uint8_t message_ref;         // SUBMIT only
+  uint8_t pid;
+  uint8_t dcs;
+  uint8_t alphabet;           // SMS_ALPHABET_*
+  const uint8_t *timestamp;   // Service centre time stamp, DELIVER only
+  const uint8_t *validity;    // SUBMIT only, NULL if it has none
+  uint8_t validity_size;
+  uint8_t udl;                // Septets in GSM-7, octets otherwise
+  const uint8_t *ud;          // User data, header included
+  size_t ud_size;             // Octets in ud
+  const uint8_t *udh;         // Information elements, NULL without UDH
+  uint8_t udh_size;           // Octets in udh, UDHL not included
+  size_t text_start;          // Septet or octet where the text starts
+  size_t text_len;            // Septets or octets of text
+};
+
+int tpdu_decode(const uint8_t *pdu, size_t len, bool with_smsc,
+                struct tpdu *tpdu);
+int tpdu_next_ie(const struct tpdu *tpdu, size_t *offset, struct tpdu_ie *ie);
+bool tpdu_get_concat(const struct tpdu *tpdu, uint16_t *ref, uint8_t *parts,
+                     uint8_t *part);
+size_t tpdu_address_to_string(const struct tpdu_address *address, char *out,
+                              size_t out_size);
+size_t tpdu_text(const struct tpdu *tpdu, char *out, size_t out_size);
+#endif
@@ -29,5 +29,6 @@ void send_rmnet_ioctls(int fd);
 void reset_client_handler();
 void reset_dirty_reconnects();
 uint8_t get_dirty_reconnects();
+int get_num_tracked_clients();
 
 #endif
\ No newline at end of file
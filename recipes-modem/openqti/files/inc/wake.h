@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef _WAKE_H_
+#define _WAKE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAKE_MAX_PARKED 16
+#define WAKE_MAX_PARKED_SIZE 512    // WMS indications are way smaller
+#define WAKE_RESUME_TIMEOUT_MS 3000 // Pulse again if the host isn't back
+#define WAKE_MAX_PULSES 3
+
+struct host_wake_stats {
+  uint32_t parked;      // Indications waiting for the host right now
+  uint64_t requests;    // Wake ups asked for
+  uint64_t pulses;      // RING_IN pulses actually sent
+  uint64_t delivered;   // Indications sent to the host after resuming
+  uint64_t dropped;     // Didn't fit, or couldn't be written
+  uint64_t max_wait_ms; // Longest an indication has been parked
+};
+
+void request_host_wakeup();
+int park_host_indication(const uint8_t *pkt, size_t len);
+bool host_indications_parked();
+int deliver_parked_indications(int usbfd);
+struct host_wake_stats get_host_wake_stats();
+void *host_wake_thread();
+#endif
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/arena.h"
+#include "../inc/logger.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Scratch arenas
+ *  Every thread gets its own bump allocator for short lived buffers:
+ *  replies, packets being built, parsed commands... Memory comes back
+ *  zeroed, like calloc(), and nothing is freed one by one. Instead,
+ *  whoever owns the unit of work saves a mark before it and restores
+ *  it afterwards, which releases everything allocated in between:
+ *
+ *    struct scratch_mark mark = scratch_save();
+ *    pkt = scratch_alloc(sizeof(*pkt));
+ *    ...
+ *    scratch_restore(mark);
+ *
+ *  dispatch_qmi_message() does this around every QMI handler, so what
+ *  they allocate is gone once the packet is handled, even if they
+ *  return early.
+ *  Marks nest, so helpers that can be called from anywhere take their
+ *  own. Requests that don't fit in the arena fall back to the heap and
+ *  are freed by the same restore.
+ *  The arena goes away with its thread, so threads that only live for
+ *  one command don't leak it.
+ */
+
+/* Anything that doesn't fit goes to the heap, until the next restore */
+struct scratch_chunk {
+  struct scratch_chunk *next;
+  uint8_t data[] __attribute__((aligned(SCRATCH_ALIGN)));
+};
+
+struct thread_arena {
+  uint8_t *base;
+  size_t used;
+  struct scratch_chunk *overflow;
+};
+
+static __thread struct thread_arena arena;
+
+struct {
+  _Atomic uint32_t threads;
+  _Atomic uint32_t high_water;
+  _Atomic uint64_t overflows;
+  pthread_once_t key_once;
+  pthread_key_t key;
+} scratch_rt = {
+    .key_once = PTHREAD_ONCE_INIT,
+};
+
+/* Runs when a thread that used its arena exits */
+static void free_thread_arena(void *ptr) {
+  struct thread_arena *thread_arena = ptr;
+  struct scratch_chunk *chunk;
+
+  while (thread_arena->overflow != NULL) {
+    chunk = thread_arena->overflow;
+    thread_arena->overflow = chunk->next;
+    free(chunk);
+  }
+  free(thread_arena->base);
+  thread_arena->base = NULL;
+  thread_arena->used = 0;
+  atomic_fetch_sub_explicit(&scratch_rt.threads, 1, memory_order_relaxed);
+}
+
+static void create_arena_key() {
+  if (pthread_key_create(&scratch_rt.key, free_thread_arena) != 0)
+    logger(MSG_ERROR, "%s: Can't create the arena key\n", __func__);
+}
+
+static int init_thread_arena() {
+  pthread_once(&scratch_rt.key_once, create_arena_key);
+  arena.base = malloc(SCRATCH_ARENA_SIZE);
+  if (arena.base == NULL) {
+    logger(MSG_ERROR, "%s: Can't allocate the scratch arena\n", __func__);
+    return -1;
+  }
+  arena.used = 0;
+  pthread_setspecific(scratch_rt.key, &arena);
+  atomic_fetch_add_explicit(&scratch_rt.threads, 1, memory_order_relaxed);
+  return 0;
+}
+
+static void *overflow_alloc(size_t size) {
+  struct scratch_chunk *chunk;
+
+  chunk = calloc(1, sizeof(struct scratch_chunk) + size);
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = arena.overflow;
+  arena.overflow = chunk;
+  if (atomic_fetch_add_explicit(&scratch_rt.overflows, 1,
+                                memory_order_relaxed) == 0)
+    logger(MSG_WARN, "%s: Scratch arena is too small for %zu bytes\n",
+           __func__, size);
+  return chunk->data;
+}
+
+void *scratch_alloc(size_t size) {
+  uint32_t high_water;
+  size_t start;
+  void *ptr;
+
+  if (arena.base == NULL && init_thread_arena() < 0)
+    return overflow_alloc(size);
+
+  start = (arena.used + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+  if (size > SCRATCH_ARENA_SIZE || start > SCRATCH_ARENA_SIZE - size)
+    return overflow_alloc(size);
+
+  ptr = arena.base + start;
+  memset(ptr, 0, size);
+  arena.used = start + size;
+
+  high_water =
+      atomic_load_explicit(&scratch_rt.high_water, memory_order_relaxed);
+  while (arena.used > high_water &&
+         !atomic_compare_exchange_weak_explicit(
+             &scratch_rt.high_water, &high_water, arena.used,
+             memory_order_relaxed, memory_order_relaxed))
+    ;
+  return ptr;
+}
+
+struct scratch_mark scratch_save() {
+  struct scratch_mark mark = {
+      .used = arena.used,
+      .overflow = arena.overflow,
+  };
+  return mark;
+}
+
+void scratch_restore(struct scratch_mark mark) {
+  struct scratch_chunk *chunk;
+
+  while (arena.overflow != NULL && arena.overflow != mark.overflow) {
+    chunk = arena.overflow;
+    arena.overflow = chunk->next;
+    free(chunk);
+  }
+  if (mark.used < arena.used)
+    arena.used = mark.used;
+}
+
+struct scratch_stats get_scratch_stats() {
+  struct scratch_stats stats;
+  stats.threads =
+      atomic_load_explicit(&scratch_rt.threads, memory_order_relaxed);
+  stats.high_water =
+      atomic_load_explicit(&scratch_rt.high_water, memory_order_relaxed);
+  stats.overflows =
+      atomic_load_explicit(&scratch_rt.overflows, memory_order_relaxed);
+  return stats;
+}
@@ -0,0 +1,549 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/atchannel.h"
+#include "../inc/devices.h"
+#include "../inc/logger.h"
+#include "../inc/openqti.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * AT Channel
+ *  A single thread owns the secondary AT port (SMD_SEC_AT) and keeps it
+ *  open. Everyone else submits requests to a small queue and gets called
+ *  back when the modem returns a final result code, the request times
+ *  out or the port dies. Requests are sent one at a time, in order.
+ *
+ *  Incoming data is split in lines. Lines matching a registered URC
+ *  prefix go to their handler, everything else belongs to the request
+ *  in flight (if there's any)
+ *
+ *  AT responses don't say which command they answer, so when a request
+ *  times out its response could still be on the way. Instead of sending
+ *  the next request right away, the channel drains: it sends
+ *  AT_CHANNEL_SYNC_CMD and throws away every non URC line until the
+ *  reply to it and its final result code come back. Whatever the timed
+ *  out command answered arrives before that. If the modem stays quiet
+ *  for AT_CHANNEL_DRAIN_MAX_MS the drain gives up and queued requests
+ *  go out again.
+ */
+
+struct at_request {
+  char command[AT_CHANNEL_MAX_CMD_SIZE];
+  size_t len;
+  uint32_t timeout_ms;
+  at_response_cb callback;
+  void *data;
+};
+
+struct at_urc_handler {
+  char prefix[32];
+  size_t prefix_len;
+  at_urc_cb callback;
+  void *data;
+};
+
+struct {
+  bool initialized;
+  pthread_mutex_t mutex;
+  pthread_t thread;
+  int fd;
+  int wake_evfd;
+  /* Pending requests, protected by the mutex */
+  struct at_request queue[AT_CHANNEL_QUEUE_SIZE];
+  uint8_t queue_head;
+  uint8_t queue_count;
+  /* URC handlers, protected by the mutex */
+  struct at_urc_handler urc[AT_CHANNEL_MAX_URC_HANDLERS];
+  uint8_t num_urc_handlers;
+  /* Only touched from the channel thread */
+  bool reopen_wait;
+  bool busy;
+  bool draining;
+  bool sync_seen; // Reply to AT_CHANNEL_SYNC_CMD arrived while draining
+  struct at_request current;
+  struct timespec deadline; // Of the request in flight, or the drain
+  char response[AT_CHANNEL_MAX_RESPONSE_SIZE];
+  size_t response_len;
+  char line[AT_CHANNEL_MAX_LINE_SIZE];
+  size_t line_len;
+} at_channel = {
+    .initialized = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+    .wake_evfd = -1,
+    .reopen_wait = false,
+};
+
+/* Final result codes end the request in flight */
+static const char *at_final_ok[] = {"OK", "CONNECT"};
+static const char *at_final_error[] = {"ERROR",      "+CME ERROR", "+CMS ERROR",
+                                       "NO CARRIER", "NO ANSWER",  "NO DIALTONE",
+                                       "BUSY"};
+
+int at_channel_init() {
+  pthread_mutex_lock(&at_channel.mutex);
+  if (!at_channel.initialized) {
+    at_channel.wake_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (at_channel.wake_evfd < 0) {
+      pthread_mutex_unlock(&at_channel.mutex);
+      logger(MSG_ERROR, "%s: Cannot create eventfd\n", __func__);
+      return -EINVAL;
+    }
+    at_channel.queue_head = 0;
+    at_channel.queue_count = 0;
+    at_channel.num_urc_handlers = 0;
+    at_channel.initialized = true;
+  }
+  pthread_mutex_unlock(&at_channel.mutex);
+  return 0;
+}
+
+static void at_channel_wakeup() {
+  uint64_t val = 1;
+  if (write(at_channel.wake_evfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+    logger(MSG_ERROR, "%s: Failed to wake up the AT channel\n", __func__);
+}
+
+int at_send_async(const char *command, size_t len, uint32_t timeout_ms,
+                  at_response_cb callback, void *data) {
+  struct at_request *req;
+
+  /* Some callers pass sizeof(), don't send the terminator to the modem */
+  len = strnlen(command, len);
+  if (len == 0 || len >= AT_CHANNEL_MAX_CMD_SIZE) {
+    logger(MSG_ERROR, "%s: Invalid command size (%i)\n", __func__, (int)len);
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&at_channel.mutex);
+  if (!at_channel.initialized) {
+    pthread_mutex_unlock(&at_channel.mutex);
+    logger(MSG_ERROR, "%s: AT channel is not initialized\n", __func__);
+    return -ENODEV;
+  }
+  if (at_channel.queue_count >= AT_CHANNEL_QUEUE_SIZE) {
+    pthread_mutex_unlock(&at_channel.mutex);
+    logger(MSG_WARN, "%s: Queue is full, dropping %.*s\n", __func__, (int)len,
+           command);
+    return -EAGAIN;
+  }
+  req = &at_channel.queue[(at_channel.queue_head + at_channel.queue_count) %
+                          AT_CHANNEL_QUEUE_SIZE];
+  memcpy(req->command, command, len);
+  req->command[len] = 0;
+  req->len = len;
+  req->timeout_ms = timeout_ms > 0 ? timeout_ms : AT_DEFAULT_TIMEOUT_MS;
+  req->callback = callback;
+  req->data = data;
+  at_channel.queue_count++;
+  pthread_mutex_unlock(&at_channel.mutex);
+
+  at_channel_wakeup();
+  return 0;
+}
+
+/* Blocking wrapper, for threads that don't mind waiting */
+struct at_sync_waiter {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool done;
+  int result;
+  char *response;
+  size_t response_sz;
+};
+
+static void at_sync_callback(int result, char *response, size_t len,
+                             void *data) {
+  struct at_sync_waiter *waiter = (struct at_sync_waiter *)data;
+  pthread_mutex_lock(&waiter->mutex);
+  if (waiter->response != NULL && waiter->response_sz > 0) {
+    if (len >= waiter->response_sz)
+      len = waiter->response_sz - 1;
+    memcpy(waiter->response, response, len);
+    waiter->response[len] = 0;
+  }
+  waiter->result = result;
+  waiter->done = true;
+  pthread_cond_signal(&waiter->cond);
+  pthread_mutex_unlock(&waiter->mutex);
+}
+
+int at_send_sync(const char *command, size_t len, char *response,
+                 size_t response_sz, uint32_t timeout_ms) {
+  int ret;
+  struct at_sync_waiter waiter = {
+      .mutex = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+      .done = false,
+      .result = AT_RESULT_IO_ERROR,
+      .response = response,
+      .response_sz = response_sz,
+  };
+
+  if (at_channel.initialized && pthread_equal(pthread_self(), at_channel.thread)) {
+    logger(MSG_ERROR, "%s: Can't block from the AT channel thread\n",
+           __func__);
+    return -EDEADLK;
+  }
+  if (response != NULL && response_sz > 0)
+    response[0] = 0;
+
+  ret = at_send_async(command, len, timeout_ms, at_sync_callback, &waiter);
+  if (ret < 0)
+    return ret;
+
+  /* Every queued request is completed, at worst by its timeout */
+  pthread_mutex_lock(&waiter.mutex);
+  while (!waiter.done)
+    pthread_cond_wait(&waiter.cond, &waiter.mutex);
+  pthread_mutex_unlock(&waiter.mutex);
+
+  switch (waiter.result) {
+  case AT_RESULT_OK:
+    return 0;
+  case AT_RESULT_ERROR:
+    return -EBADMSG;
+  case AT_RESULT_TIMEOUT:
+    return -ETIMEDOUT;
+  default:
+    return -EIO;
+  }
+}
+
+int at_register_urc_handler(const char *prefix, at_urc_cb callback,
+                            void *data) {
+  struct at_urc_handler *handler;
+  if (prefix == NULL || callback == NULL ||
+      strlen(prefix) >= sizeof(handler->prefix)) {
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&at_channel.mutex);
+  if (at_channel.num_urc_handlers >= AT_CHANNEL_MAX_URC_HANDLERS) {
+    pthread_mutex_unlock(&at_channel.mutex);
+    logger(MSG_ERROR, "%s: No room for more URC handlers\n", __func__);
+    return -ENOSPC;
+  }
+  handler = &at_channel.urc[at_channel.num_urc_handlers];
+  strcpy(handler->prefix, prefix);
+  handler->prefix_len = strlen(prefix);
+  handler->callback = callback;
+  handler->data = data;
+  at_channel.num_urc_handlers++;
+  pthread_mutex_unlock(&at_channel.mutex);
+  return 0;
+}
+
+static bool at_line_matches(const char *line, const char *prefix) {
+  return strncmp(line, prefix, strlen(prefix)) == 0;
+}
+
+static int at_get_final_result(const char *line) {
+  int i;
+  for (i = 0; i < sizeof(at_final_ok) / sizeof(at_final_ok[0]); i++) {
+    if (at_line_matches(line, at_final_ok[i]))
+      return AT_RESULT_OK;
+  }
+  for (i = 0; i < sizeof(at_final_error) / sizeof(at_final_error[0]); i++) {
+    if (at_line_matches(line, at_final_error[i]))
+      return AT_RESULT_ERROR;
+  }
+  return -1;
+}
+
+static void at_set_deadline(struct timespec *deadline, uint32_t ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (ms % 1000) * 1000000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+static bool at_deadline_passed(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > deadline->tv_sec ||
+         (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/* Throw away whatever is left of a request that timed out */
+static int at_start_drain() {
+  at_channel.draining = true;
+  at_channel.sync_seen = false;
+  at_set_deadline(&at_channel.deadline, AT_CHANNEL_DRAIN_MAX_MS);
+  if (write(at_channel.fd, AT_CHANNEL_SYNC_CMD, strlen(AT_CHANNEL_SYNC_CMD)) !=
+      strlen(AT_CHANNEL_SYNC_CMD)) {
+    logger(MSG_ERROR, "%s: Can't write to %s\n", __func__, SMD_SEC_AT);
+    return -EIO;
+  }
+  return 0;
+}
+
+static void at_stop_drain(const char *reason) {
+  if (!at_channel.draining)
+    return;
+  at_channel.draining = false;
+  logger(MSG_INFO, "%s: Channel in sync again (%s)\n", __func__, reason);
+}
+
+static void at_complete_request(int result) {
+  struct at_request *req = &at_channel.current;
+  if (!at_channel.busy)
+    return;
+
+  at_channel.busy = false;
+  at_channel.response[at_channel.response_len] = 0;
+  if (result != AT_RESULT_OK) {
+    logger(MSG_WARN, "%s: %.*s finished with result %i\n", __func__,
+           (int)strcspn(req->command, "\r\n"), req->command, result);
+  }
+  if (req->callback != NULL) {
+    req->callback(result, at_channel.response, at_channel.response_len,
+                  req->data);
+  }
+}
+
+static void at_fail_queued_requests(int result) {
+  struct at_request req;
+  while (1) {
+    pthread_mutex_lock(&at_channel.mutex);
+    if (at_channel.queue_count == 0) {
+      pthread_mutex_unlock(&at_channel.mutex);
+      return;
+    }
+    req = at_channel.queue[at_channel.queue_head];
+    at_channel.queue_head = (at_channel.queue_head + 1) % AT_CHANNEL_QUEUE_SIZE;
+    at_channel.queue_count--;
+    pthread_mutex_unlock(&at_channel.mutex);
+
+    if (req.callback != NULL)
+      req.callback(result, "", 0, req.data);
+  }
+}
+
+static bool at_dispatch_urc(char *line, size_t len) {
+  int i;
+  at_urc_cb callback = NULL;
+  void *data = NULL;
+
+  pthread_mutex_lock(&at_channel.mutex);
+  for (i = 0; i < at_channel.num_urc_handlers; i++) {
+    if (len >= at_channel.urc[i].prefix_len &&
+        memcmp(line, at_channel.urc[i].prefix, at_channel.urc[i].prefix_len) ==
+            0) {
+      callback = at_channel.urc[i].callback;
+      data = at_channel.urc[i].data;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&at_channel.mutex);
+
+  if (callback == NULL)
+    return false;
+
+  callback(line, len, data);
+  return true;
+}
+
+static void at_handle_line(char *line, size_t len) {
+  int result;
+  if (at_dispatch_urc(line, len))
+    return;
+
+  if (at_channel.draining) {
+    if (strncmp(line, AT_CHANNEL_SYNC_REPLY, strlen(AT_CHANNEL_SYNC_REPLY)) ==
+        0) {
+      at_channel.sync_seen = true;
+    } else if (at_channel.sync_seen && at_get_final_result(line) >= 0) {
+      at_stop_drain("sync reply received");
+    } else {
+      logger(MSG_DEBUG, "%s: Discarding late response: %s\n", __func__,
+             line);
+    }
+    return;
+  }
+
+  if (!at_channel.busy) {
+    logger(MSG_DEBUG, "%s: Unsolicited: %s\n", __func__, line);
+    return;
+  }
+
+  /* Keep the CRLF so existing parsers can walk the lines */
+  if (at_channel.response_len + len + 2 < AT_CHANNEL_MAX_RESPONSE_SIZE) {
+    memcpy(at_channel.response + at_channel.response_len, line, len);
+    at_channel.response_len += len;
+    at_channel.response[at_channel.response_len++] = '\r';
+    at_channel.response[at_channel.response_len++] = '\n';
+  } else {
+    logger(MSG_WARN, "%s: Response too big, truncating\n", __func__);
+  }
+
+  result = at_get_final_result(line);
+  if (result >= 0)
+    at_complete_request(result);
+}
+
+/* Streaming line splitter, input can be split at any point */
+static void at_feed_parser(char *buf, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (buf[i] == '\r' || buf[i] == '\n') {
+      if (at_channel.line_len > 0) {
+        at_channel.line[at_channel.line_len] = 0;
+        at_handle_line(at_channel.line, at_channel.line_len);
+        at_channel.line_len = 0;
+      }
+    } else if (at_channel.line_len < AT_CHANNEL_MAX_LINE_SIZE - 1) {
+      at_channel.line[at_channel.line_len++] = buf[i];
+    }
+  }
+}
+
+static void at_close_port() {
+  if (at_channel.fd >= 0) {
+    close(at_channel.fd);
+    at_channel.fd = -1;
+  }
+  at_channel.reopen_wait = true;
+  at_channel.line_len = 0;
+  at_channel.draining = false; // Nothing from before survives a reopen
+  at_complete_request(AT_RESULT_IO_ERROR);
+}
+
+static bool at_send_next_request() {
+  struct at_request *req = &at_channel.current;
+  pthread_mutex_lock(&at_channel.mutex);
+  if (at_channel.queue_count == 0) {
+    pthread_mutex_unlock(&at_channel.mutex);
+    return false;
+  }
+  *req = at_channel.queue[at_channel.queue_head];
+  at_channel.queue_head = (at_channel.queue_head + 1) % AT_CHANNEL_QUEUE_SIZE;
+  at_channel.queue_count--;
+  pthread_mutex_unlock(&at_channel.mutex);
+
+  at_channel.busy = true;
+  at_channel.response_len = 0;
+  at_set_deadline(&at_channel.deadline, req->timeout_ms);
+
+  logger(MSG_DEBUG, "%s: Sending %s\n", __func__, req->command);
+  if (write(at_channel.fd, req->command, req->len) != req->len) {
+    logger(MSG_ERROR, "%s: Failed to write to %s\n", __func__, SMD_SEC_AT);
+    at_close_port();
+  }
+  return true;
+}
+
+/*
+ * Milliseconds left for the request in flight or the drain, -1 if
+ * there's nothing to wait for
+ */
+static int at_get_poll_timeout() {
+  struct timespec now;
+  long long remaining;
+  if (!at_channel.busy && !at_channel.draining)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  remaining = (at_channel.deadline.tv_sec - now.tv_sec) * 1000LL +
+              (at_channel.deadline.tv_nsec - now.tv_nsec) / 1000000;
+  return remaining > 0 ? (int)remaining : 0;
+}
+
+void *at_channel_thread() {
+  struct pollfd fds[2];
+  char buf[512];
+  uint64_t val;
+  int ret, timeout;
+
+  if (at_channel_init() < 0)
+    return NULL;
+
+  at_channel.thread = pthread_self();
+  logger(MSG_INFO, "%s: Initialize AT channel thread.\n", __func__);
+
+  while (1) {
+    if (at_channel.fd < 0) {
+      if (at_channel.reopen_wait) {
+        /* Don't leave anyone waiting for a port we don't have */
+        at_fail_queued_requests(AT_RESULT_IO_ERROR);
+        fds[0].fd = at_channel.wake_evfd;
+        fds[0].events = POLLIN;
+        poll(fds, 1, AT_CHANNEL_REOPEN_DELAY_MS);
+        if (read(at_channel.wake_evfd, &val, sizeof(val)) < 0) {
+          // Nothing was pending
+        }
+      }
+      at_channel.fd = open_device(SMD_SEC_AT, O_RDWR | O_NOCTTY | O_CLOEXEC);
+      if (at_channel.fd < 0) {
+        logger(MSG_ERROR, "%s: Cannot open %s, retrying\n", __func__,
+               SMD_SEC_AT);
+        at_channel.reopen_wait = true;
+        continue;
+      }
+      at_channel.reopen_wait = false;
+    }
+
+    if (at_channel.draining && at_deadline_passed(&at_channel.deadline))
+      at_stop_drain("gave up waiting");
+
+    if (!at_channel.busy && !at_channel.draining)
+      at_send_next_request();
+
+    timeout = at_get_poll_timeout();
+    fds[0].fd = at_channel.fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = at_channel.wake_evfd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    ret = poll(fds, 2, timeout);
+    if (ret < 0) {
+      if (errno != EINTR)
+        logger(MSG_ERROR, "%s: poll failed: %i\n", __func__, errno);
+      continue;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      if (read(at_channel.wake_evfd, &val, sizeof(val)) < 0) {
+        logger(MSG_WARN, "%s: Error draining eventfd\n", __func__);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      ret = read(at_channel.fd, buf, sizeof(buf));
+      if (ret > 0) {
+        at_feed_parser(buf, ret);
+      } else {
+        logger(MSG_ERROR, "%s: Read failed, reopening %s\n", __func__,
+               SMD_SEC_AT);
+        at_close_port();
+        continue;
+      }
+    } else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      logger(MSG_ERROR, "%s: %s went away, reopening\n", __func__, SMD_SEC_AT);
+      at_close_port();
+      continue;
+    }
+
+    if (at_channel.busy && at_get_poll_timeout() == 0) {
+      logger(MSG_ERROR, "%s: No response in time from %s\n", __func__,
+             SMD_SEC_AT);
+      at_complete_request(AT_RESULT_TIMEOUT);
+      if (at_start_drain() < 0)
+        at_close_port();
+    }
+  }
+
+  return NULL;
+}
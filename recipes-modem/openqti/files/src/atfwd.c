@@ -14,8 +14,10 @@
 #include <unistd.h>
 
 #include "../inc/adspfw.h"
+#include "../inc/arena.h"
 #include "../inc/atfwd.h"
 #include "../inc/audio.h"
+#include "../inc/capture.h"
 #include "../inc/config.h"
 #include "../inc/devices.h"
 #include "../inc/helpers.h"
@@ -46,9 +48,9 @@ bool get_sms_notification_pending_state() {
 void set_adb_runtime(bool mode) { atfwd_runtime_state.adb_enabled = mode; }
 
 void build_atcommand_reg_request(int tid, const char *command, char *buf) {
+  struct scratch_mark mark = scratch_save();
   struct atcmd_reg_request *atcmd;
-  atcmd =
-      (struct atcmd_reg_request *)calloc(1, sizeof(struct atcmd_reg_request));
+  atcmd = scratch_alloc(sizeof(struct atcmd_reg_request));
   atcmd->ctlid = 0x00;
   atcmd->transaction_id = htole16(tid);
   atcmd->msgid = htole16(32);
@@ -64,7 +66,7 @@ void build_atcommand_reg_request(int tid, const char *command, char *buf) {
   memcpy(buf, atcmd, sizeof(struct atcmd_reg_request));
   memcpy(buf + sizeof(struct atcmd_reg_request), command,
          (sizeof(char) * strlen(command)));
-  free(atcmd);
+  scratch_restore(mark);
   atcmd = NULL;
 }
 
@@ -88,6 +90,7 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
   uint8_t cmdsize;
   char *parsedcmd;
   int cmd_id = -1;
+  struct scratch_mark mark;
   struct at_command_respnse *response;
   int pkt_size;
   int bytes_in_reply = 0;
@@ -114,8 +117,9 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
   logger(MSG_DEBUG, "Packet size is %i, received total size is %i\n",
          packet_size, sz);
 
+  mark = scratch_save();
   cmdsize = buf[18];
-  parsedcmd = calloc(cmdsize + 1, sizeof(char));
+  parsedcmd = scratch_alloc(cmdsize + 1);
   strncpy(parsedcmd, (char *)buf + 19, cmdsize);
 
   logger(MSG_INFO, "%s: AT CMD: %s\n", __func__, parsedcmd);
@@ -124,10 +128,9 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
       cmd_id = at_commands[j].command_id; // Command matched
     }
   }
-  free(parsedcmd);
 
   /* Build initial response data */
-  response = calloc(1, sizeof(struct at_command_respnse));
+  response = scratch_alloc(sizeof(struct at_command_respnse));
   response->qmipkt.ctlid = 0x00;
   response->qmipkt.transaction_id = htole16(qmidev->transaction_id);
   response->qmipkt.msgid = AT_CMD_RES;
@@ -146,6 +149,8 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
   case 111: // QCPowerdown
     sckret = send_pkt(qmidev, response, pkt_size);
     usleep(500);
+    flush_packet_capture();
+    flush_log();
     syscall(SYS_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2,
             LINUX_REBOOT_CMD_POWER_OFF, NULL);
     break;
@@ -168,6 +173,8 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
     break;
   case 115: // Reboot to recovery
     sckret = send_pkt(qmidev, response, pkt_size);
+    flush_packet_capture();
+    flush_log();
     syscall(SYS_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2,
             LINUX_REBOOT_CMD_RESTART2, "recovery");
     break;
@@ -205,6 +212,8 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
     }
     break;
   case 123: // Gracefully restart
+    flush_packet_capture();
+    flush_log();
     syscall(SYS_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2,
             LINUX_REBOOT_CMD_RESTART, NULL);
     sckret = send_pkt(qmidev, response, pkt_size);
@@ -234,6 +243,8 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
     sckret = send_pkt(qmidev, response, pkt_size);
     usleep(
         300); // Give it some time to be able to reach the ADSP before rebooting
+    flush_packet_capture();
+    flush_log();
     syscall(SYS_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2,
             LINUX_REBOOT_CMD_RESTART2, "bootloader");
     break;
@@ -432,7 +443,7 @@ int handle_atfwd_response(struct qmi_device *qmidev, uint8_t *buf,
     logger(MSG_ERROR, "%s: Send pkt failed!\n", __func__);
   }
   qmidev->transaction_id++;
-  free(response);
+  scratch_restore(mark);
   response = NULL;
   return 0;
 }
@@ -445,9 +456,10 @@ int at_send_cmti_urc(struct qmi_device *qmidev) {
   struct at_command_respnse *response;
   int pkt_size;
   int bytes_in_reply = 0;
+  struct scratch_mark mark = scratch_save();
 
   /* Build initial response data */
-  response = calloc(1, sizeof(struct at_command_respnse));
+  response = scratch_alloc(sizeof(struct at_command_respnse));
   response->qmipkt.ctlid = 0x00;
   response->qmipkt.transaction_id = htole16(qmidev->transaction_id);
   response->qmipkt.msgid = AT_CMD_RES;
@@ -475,7 +487,7 @@ int at_send_cmti_urc(struct qmi_device *qmidev) {
   set_notif_pending(true);
 
   qmidev->transaction_id++;
-  free(response);
+  scratch_restore(mark);
   response = NULL;
   return 0;
 }
@@ -485,6 +497,7 @@ int init_atfwd(struct qmi_device *qmidev) {
   int j, ret;
   ssize_t pktsize;
   char *atcmd;
+  struct scratch_mark mark;
   struct timeval tv;
   tv.tv_sec = 1;
   tv.tv_usec = 0;
@@ -508,7 +521,8 @@ int init_atfwd(struct qmi_device *qmidev) {
   }
 
   for (j = 0; j < (sizeof(at_commands) / sizeof(at_commands[0])); j++) {
-    atcmd = calloc(256, sizeof(uint8_t));
+    mark = scratch_save();
+    atcmd = scratch_alloc(256);
 
     logger(MSG_DEBUG, "%s: --> CMD %i: %s ", __func__,
            at_commands[j].command_id, at_commands[j].cmd);
@@ -540,7 +554,7 @@ int init_atfwd(struct qmi_device *qmidev) {
     } else {
       logger(MSG_ERROR, "%s: Unknown response from the DSP \n", __func__, ret);
     }
-    free(atcmd);
+    scratch_restore(mark);
   }
   atcmd = NULL;
 
@@ -60,7 +60,7 @@ void configure_custom_alert_tone(bool en) {
 
 int use_external_codec() {
   int fd;
-  fd = open(EXTERNAL_CODEC_DETECT_PATH, O_RDONLY);
+  fd = open_device(EXTERNAL_CODEC_DETECT_PATH, O_RDONLY);
   if (fd < 0) {
     logger(MSG_INFO, "%s: RT5616 codec not detected \n", __func__);
     return 0;
@@ -268,6 +268,9 @@ void handle_call_pkt(uint8_t *pkt, int sz) {
   /* REDO */
 
   int offset = get_tlv_offset_by_id((uint8_t *)pkt, sz, TLV_CALL_INFO);
+  if (offset > 0 &&
+      get_tlv_len_by_id((uint8_t *)pkt, sz, TLV_CALL_INFO) < META_TLV_LEN)
+    offset = -EINVAL;
   if (offset <= 0) {
     logger(MSG_ERROR, "%s:Couldn't retrieve call metadata \n", __func__);
   } else if (offset > 0) {
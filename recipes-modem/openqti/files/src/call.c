@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: MIT
 
 #include "../inc/call.h"
+#include "../inc/arena.h"
 #include "../inc/atfwd.h"
 #include "../inc/audio.h"
+#include "../inc/capture.h"
 #include "../inc/command.h"
 #include "../inc/config.h"
 #include "../inc/devices.h"
@@ -67,8 +69,11 @@ struct {
 void set_call_simulation_mode(bool en) {
   if (en) {
     call_rt.call_simulation_mode = 1;
+    request_proxy_injection();
   } else {
     call_rt.call_simulation_mode = 0;
+    /* Don't finish the phrase after hanging up */
+    tts_stream_abort();
   }
 }
 void set_looped_message(bool en) {
@@ -98,6 +103,7 @@ void reset_call_state() {
 void set_pending_call_flag(bool en) {
   if (en && !call_rt.call_simulation_mode) {
     call_rt.is_call_pending = true;
+    request_proxy_injection();
   } else {
     call_rt.is_call_pending = false;
   }
@@ -115,7 +121,8 @@ void send_call_request_response(int usbfd, uint16_t transaction_id) {
   int bytes_written;
   int pkt_size = sizeof(struct call_request_response_packet);
   logger(MSG_DEBUG, "%s: Sending Call Request Response\n", __func__);
-  pkt = calloc(1, sizeof(struct call_request_response_packet));
+  struct scratch_mark mark = scratch_save();
+  pkt = scratch_alloc(sizeof(struct call_request_response_packet));
   /* QMUX */
   pkt->qmuxpkt.version = 0x01;
   pkt->qmuxpkt.packet_length = pkt_size - sizeof(uint8_t); // SIZE
@@ -146,11 +153,12 @@ void send_call_request_response(int usbfd, uint16_t transaction_id) {
   pkt->media_id.len = 0x01;
   pkt->media_id.data = 0x03; // Dont know what 0x03 means
 
+  capture_packet(FROM_OPENQTI, pkt, pkt_size);
   bytes_written = write(usbfd, pkt, pkt_size);
   dump_pkt_raw((void *)pkt, sizeof(struct call_request_response_packet));
   logger(MSG_DEBUG, "%s: Sent %i bytes \n", __func__, bytes_written);
 
-  free(pkt);
+  scratch_restore(mark);
   pkt = NULL;
 }
 
@@ -164,7 +172,8 @@ uint8_t send_voice_call_status_event(int usbfd, uint16_t transaction_id,
                            0x35, 0x35, 0x36, 0x36, 0x37, 0x37};
   struct simulated_call_packet *pkt;
   int bytes_written;
-  pkt = calloc(1, sizeof(struct simulated_call_packet));
+  struct scratch_mark mark = scratch_save();
+  pkt = scratch_alloc(sizeof(struct simulated_call_packet));
   int pkt_size = sizeof(struct simulated_call_packet);
 
   // Update last transaction_id
@@ -225,10 +234,11 @@ uint8_t send_voice_call_status_event(int usbfd, uint16_t transaction_id,
   memcpy(pkt->remote_party_extension.phone_number, phone_proto,
          sizeof(phone_proto));
 
+  capture_packet(FROM_OPENQTI, pkt, pkt_size);
   bytes_written = write(usbfd, pkt, pkt_size);
   dump_pkt_raw((void *)pkt, sizeof(struct simulated_call_packet));
   logger(MSG_DEBUG, "%s: Sent %i bytes \n", __func__, bytes_written);
-  free(pkt);
+  scratch_restore(mark);
   pkt = NULL;
   return 0;
 }
@@ -237,7 +247,8 @@ void accept_simulated_call(int usbfd, uint8_t transaction_id) {
   struct call_accept_ack *pkt;
   logger(MSG_DEBUG, "%s: Send QMI call ACCEPT message\n", __func__);
   int bytes_written;
-  pkt = calloc(1, sizeof(struct call_accept_ack));
+  struct scratch_mark mark = scratch_save();
+  pkt = scratch_alloc(sizeof(struct call_accept_ack));
   int pkt_size = sizeof(struct call_accept_ack);
 
   /* QMUX */
@@ -265,11 +276,12 @@ void accept_simulated_call(int usbfd, uint8_t transaction_id) {
   pkt->call_id.len = 0x01;
   pkt->call_id.data = 0x01;
 
+  capture_packet(FROM_OPENQTI, pkt, pkt_size);
   bytes_written = write(usbfd, pkt, pkt_size);
   dump_pkt_raw((void *)pkt, sizeof(struct call_accept_ack));
   logger(MSG_DEBUG, "%s: Sent %i bytes \n", __func__, bytes_written);
 
-  free(pkt);
+  scratch_restore(mark);
   pkt = NULL;
 }
 
@@ -301,7 +313,8 @@ uint8_t send_voice_cal_disconnect_ack(int usbfd, uint16_t transaction_id) {
   struct end_call_response *pkt;
   logger(MSG_DEBUG, "%s: Send QMI call END message\n", __func__);
   int bytes_written;
-  pkt = calloc(1, sizeof(struct end_call_response));
+  struct scratch_mark mark = scratch_save();
+  pkt = scratch_alloc(sizeof(struct end_call_response));
   int pkt_size = sizeof(struct end_call_response);
 
   /* QMUX */
@@ -329,10 +342,11 @@ uint8_t send_voice_cal_disconnect_ack(int usbfd, uint16_t transaction_id) {
   pkt->call_id.len = 0x01;
   pkt->call_id.data = 0x01;
 
+  capture_packet(FROM_OPENQTI, pkt, pkt_size);
   bytes_written = write(usbfd, pkt, pkt_size);
   logger(MSG_DEBUG, "%s: Sent %i bytes \n", __func__, bytes_written);
   dump_pkt_raw((void *)pkt, sizeof(struct end_call_response));
-  free(pkt);
+  scratch_restore(mark);
   pkt = NULL;
   return 0;
 }
@@ -359,6 +373,9 @@ void notify_simulated_call(int usbfd) {
 
 void add_voice_message_to_queue(uint8_t *message, size_t len) {
   int i;
+  /* Text replies can span several SMS now, the voice can't */
+  if (len >= MAX_TTS_TEXT_SIZE)
+    len = MAX_TTS_TEXT_SIZE - 1;
   if (len > 0) {
     for (i = 0; i < QUEUE_SIZE; i++) {
       if (call_rt.msg[i].state == 0) {
@@ -373,13 +390,10 @@ void add_voice_message_to_queue(uint8_t *message, size_t len) {
 }
 
 void *simulated_call_tts_handler() {
-  char *buffer;
-  int size;
-  int num_read;
-  FILE *file;
-  struct pcm *pcm0;
+  struct pcm *pcm0 = NULL;
   int i;
   bool handled;
+  struct scratch_mark mark;
   char *phrase; //[MAX_TTS_TEXT_SIZE];
   /*
    * Open PCM if we're in call simulation mode,
@@ -388,6 +402,8 @@ void *simulated_call_tts_handler() {
 
   if (get_call_simulation_mode()) {
     logger(MSG_INFO, "%s: Started TTS thread\n", __func__);
+    /* Load the voice now instead of on the first phrase */
+    init_tts_engine();
     /* Initial set up of the audio codec */
 
     set_multimedia_mixer();
@@ -412,15 +428,17 @@ void *simulated_call_tts_handler() {
       return NULL;
     }
 
-    if (!pcm0) {
-      logger(MSG_ERROR, "%s: Unable to open PCM device\n", __func__);
+    if (tts_stream_start(pcm0) < 0) {
+      logger(MSG_ERROR, "%s: Can't start the speech stream\n", __func__);
+      pcm_close(pcm0);
       return NULL;
     }
   }
 
   while (get_call_simulation_mode()) {
     handled = false;
-    phrase = malloc(MAX_TTS_TEXT_SIZE * sizeof(char));
+    mark = scratch_save();
+    phrase = scratch_alloc(MAX_TTS_TEXT_SIZE);
     for (i = 0; i < QUEUE_SIZE; i++) {
       if (call_rt.msg[i].state == 1 && call_rt.msg[i].len > 0) {
         snprintf(phrase, MAX_TTS_TEXT_SIZE, "%s", call_rt.msg[i].message);
@@ -440,45 +458,18 @@ void *simulated_call_tts_handler() {
                get_rt_user_name());
       call_rt.empty_message_loop++;
     }
+    /* Returns once it's all synthesized, then wait for the speaker */
     pico2aud(phrase, strlen(phrase));
-    free(phrase);
+    scratch_restore(mark);
     phrase = NULL;
-    file = fopen("/tmp/wave.wav", "r");
-    if (file == NULL) {
-      logger(MSG_ERROR, "%s: Unable to open file\n", __func__);
-      pcm_close(pcm0);
-      return NULL;
-    }
-
-    fseek(file, 44, SEEK_SET);
-    size = pcm_frames_to_bytes(pcm0, pcm_get_buffer_size(pcm0));
-    buffer = malloc(size * 1024);
-
-    if (!buffer) {
-      logger(MSG_ERROR, "Unable to allocate %d bytes\n", size);
-      free(buffer);
-      buffer = NULL;
-      return NULL;
-    }
-
-    do {
-      num_read = fread(buffer, 1, size, file);
-
-      if (num_read > 0) {
-        if (pcm_write(pcm0, buffer, num_read)) {
-          logger(MSG_ERROR, "Error playing sample\n");
-          break;
-        }
-      }
-    } while (num_read > 0 && get_call_simulation_mode());
-    fclose(file);
+    tts_stream_drain();
   }
 
   logger(MSG_INFO, "%s: Cleaning up\n", __func__);
 
-  free(buffer);
-  buffer = NULL;
-  pcm_close(pcm0);
+  tts_stream_stop();
+  if (pcm0)
+    pcm_close(pcm0);
 
   stop_multimedia_mixer();
 
@@ -535,6 +526,9 @@ uint8_t get_num_instances(void *bytes, size_t len) {
   uint8_t instances = 0;
   struct call_status_meta *meta;
   int offset = get_tlv_offset_by_id((uint8_t *)bytes, len, TLV_CALL_INFO);
+  if (offset > 0 &&
+      get_tlv_len_by_id((uint8_t *)bytes, len, TLV_CALL_INFO) < META_TLV_LEN)
+    offset = -EINVAL;
   if (offset <= 0) {
     logger(MSG_ERROR, "%s:Couldn't retrieve call metadata \n", __func__);
   } else if (offset > 0) {
@@ -549,6 +543,9 @@ uint8_t get_call_state(void *bytes, size_t len) {
   uint8_t state = 0;
   struct call_status_meta *meta;
   int offset = get_tlv_offset_by_id((uint8_t *)bytes, len, TLV_CALL_INFO);
+  if (offset > 0 &&
+      get_tlv_len_by_id((uint8_t *)bytes, len, TLV_CALL_INFO) < META_TLV_LEN)
+    offset = -EINVAL;
   if (offset <= 0) {
     logger(MSG_ERROR, "%s:Couldn't retrieve call metadata \n", __func__);
   } else if (offset > 0) {
@@ -565,7 +562,8 @@ void autokill_call(void *bytes, size_t len, uint8_t call_id, int adspfd) {
          __func__, call_id);
   struct encapsulated_qmi_packet *pkt = (struct encapsulated_qmi_packet *)bytes;
   struct call_hangup_request *request;
-  request = calloc(1, sizeof(struct call_hangup_request));
+  struct scratch_mark mark = scratch_save();
+  request = scratch_alloc(sizeof(struct call_hangup_request));
   request->qmuxpkt.version = 0x01;
   request->qmuxpkt.packet_length = 0x10;
   request->qmuxpkt.control = 0x00;
@@ -586,7 +584,7 @@ void autokill_call(void *bytes, size_t len, uint8_t call_id, int adspfd) {
     logger(MSG_INFO, "%s: Payload *SENT*\n", __func__);
   }
 
-  free(request);
+  scratch_restore(mark);
   request = NULL;
   pkt = NULL;
 }
@@ -601,7 +599,7 @@ uint8_t call_service_handler(uint8_t source, void *bytes, size_t len,
   uint8_t our_phone[] = {0x32, 0x32, 0x33, 0x33, 0x34, 0x34,
                          0x35, 0x35, 0x36, 0x36, 0x37, 0x37};
 
-  uint8_t *reply = calloc(MAX_MESSAGE_SIZE, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
 
   // We need the original number to keep track of its state
   uint8_t phone_number[MAX_PHONE_NUMBER_LENGTH];
@@ -769,7 +767,6 @@ uint8_t call_service_handler(uint8_t source, void *bytes, size_t len,
     break;
   }
 
-  free(reply);
   pkt = NULL;
   return needs_rerouting;
 }
\ No newline at end of file
@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/capture.h"
+#include "../inc/config.h"
+#include "../inc/ipc.h"
+#include "../inc/logger.h"
+#include "../inc/openqti.h"
+#include "../inc/qmi.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Packet capture
+ *  Stores every proxied QMI frame in a compact binary file (see
+ *  capture.h for the format) instead of hex dumping it into the log.
+ *  Frames openqti makes up for the host (SMS, simulated calls) are
+ *  stored too, as FROM_OPENQTI, right before they're written.
+ *  Records are appended to an in-memory buffer and written out in
+ *  one go when it fills up or gets old, so the cost per packet is a
+ *  memcpy. The rmnet proxy flushes whatever is left once it has been
+ *  idle for QCAP_FLUSH_INTERVAL_MS. The file is rotated once when it
+ *  reaches QCAP_MAX_FILE_SIZE, so it can stay enabled without filling
+ *  up /var.
+ *  Use tools/qcapdump to read it.
+ */
+struct {
+  bool enabled;
+  pthread_mutex_t mutex;
+  int fd;
+  int persist;
+  off_t file_size;
+  struct timespec last_flush;
+  size_t len;
+  uint8_t buf[QCAP_BUFFER_SIZE];
+} capture_rt = {
+    .enabled = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+    .persist = -1,
+    .len = 0,
+};
+
+static const char *get_capture_path(int persist) {
+  return persist ? PERSISTENT_CAPTURE_PATH : VOLATILE_CAPTURE_PATH;
+}
+
+/* Call with the mutex held */
+static void capture_write_out() {
+  ssize_t ret;
+  size_t pos = 0;
+  while (capture_rt.fd >= 0 && pos < capture_rt.len) {
+    ret = write(capture_rt.fd, capture_rt.buf + pos, capture_rt.len - pos);
+    if (ret <= 0) {
+      logger(MSG_ERROR, "%s: Error writing capture file, %zu bytes lost\n",
+             __func__, capture_rt.len - pos);
+      break;
+    }
+    pos += ret;
+  }
+  capture_rt.file_size += pos;
+  capture_rt.len = 0;
+  clock_gettime(CLOCK_MONOTONIC, &capture_rt.last_flush);
+}
+
+/* Call with the mutex held */
+static void capture_close() {
+  capture_write_out();
+  if (capture_rt.fd >= 0) {
+    close(capture_rt.fd);
+    capture_rt.fd = -1;
+  }
+}
+
+/* Call with the mutex held */
+static int capture_open() {
+  struct qcap_file_header header;
+  struct stat st;
+  const char *path;
+
+  capture_rt.persist = use_persistent_logging() ? 1 : 0;
+  path = get_capture_path(capture_rt.persist);
+  capture_rt.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (capture_rt.fd < 0) {
+    logger(MSG_ERROR, "%s: Cannot open %s\n", __func__, path);
+    return -EIO;
+  }
+
+  capture_rt.file_size = 0;
+  if (fstat(capture_rt.fd, &st) == 0)
+    capture_rt.file_size = st.st_size;
+
+  /* New file, it needs a header */
+  if (capture_rt.file_size == 0) {
+    header.magic = htole32(QCAP_MAGIC);
+    header.version_major = htole16(QCAP_VERSION_MAJOR);
+    header.version_minor = htole16(QCAP_VERSION_MINOR);
+    header.snaplen = htole32(MAX_PACKET_SIZE);
+    header.reserved = 0;
+    memcpy(capture_rt.buf, &header, sizeof(header));
+    capture_rt.len = sizeof(header);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &capture_rt.last_flush);
+  logger(MSG_INFO, "%s: Capturing QMI traffic to %s\n", __func__, path);
+  return 0;
+}
+
+/* Call with the mutex held */
+static void capture_rotate() {
+  char oldpath[64];
+  const char *path = get_capture_path(capture_rt.persist);
+  capture_close();
+  snprintf(oldpath, sizeof(oldpath), "%s.1", path);
+  if (rename(path, oldpath) < 0) {
+    logger(MSG_WARN, "%s: Can't rotate %s, truncating it\n", __func__, path);
+    unlink(path);
+  }
+  capture_open();
+}
+
+void set_packet_capture_state(bool en) {
+  pthread_mutex_lock(&capture_rt.mutex);
+  capture_rt.enabled = en;
+  if (!en) {
+    capture_close();
+  }
+  pthread_mutex_unlock(&capture_rt.mutex);
+}
+
+/* True if there are records waiting to be written */
+bool is_packet_capture_pending() { return capture_rt.len > 0; }
+
+void flush_packet_capture() {
+  pthread_mutex_lock(&capture_rt.mutex);
+  capture_write_out();
+  pthread_mutex_unlock(&capture_rt.mutex);
+}
+
+void capture_packet(uint8_t direction, const void *buf, size_t len) {
+  struct qcap_record_header record;
+  struct timespec now;
+  size_t caplen = len > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : len;
+
+  if (!capture_rt.enabled || len == 0)
+    return;
+
+  pthread_mutex_lock(&capture_rt.mutex);
+  /* Could have been disabled while we waited, or logs moved */
+  if (!capture_rt.enabled) {
+    pthread_mutex_unlock(&capture_rt.mutex);
+    return;
+  }
+  if (capture_rt.fd >= 0 &&
+      capture_rt.persist != (use_persistent_logging() ? 1 : 0)) {
+    capture_close();
+  }
+  if (capture_rt.fd < 0 && capture_open() < 0) {
+    capture_rt.enabled = false; // Don't retry for every packet
+    pthread_mutex_unlock(&capture_rt.mutex);
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  record.ts_sec = htole32((uint32_t)now.tv_sec);
+  record.ts_nsec = htole32((uint32_t)now.tv_nsec);
+  record.direction = direction;
+  record.service = len >= sizeof(struct qmux_packet)
+                       ? ((const struct qmux_packet *)buf)->service
+                       : 0xff;
+  record.reserved = 0;
+  record.caplen = htole32(caplen);
+  record.origlen = htole32(len);
+
+  if (capture_rt.len + sizeof(record) + caplen > QCAP_BUFFER_SIZE) {
+    capture_write_out();
+  }
+  memcpy(capture_rt.buf + capture_rt.len, &record, sizeof(record));
+  memcpy(capture_rt.buf + capture_rt.len + sizeof(record), buf, caplen);
+  capture_rt.len += sizeof(record) + caplen;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((now.tv_sec - capture_rt.last_flush.tv_sec) * 1000 +
+          (now.tv_nsec - capture_rt.last_flush.tv_nsec) / 1000000 >=
+      QCAP_FLUSH_INTERVAL_MS) {
+    capture_write_out();
+  }
+  if (capture_rt.file_size + capture_rt.len >= QCAP_MAX_FILE_SIZE) {
+    capture_rotate();
+  }
+  pthread_mutex_unlock(&capture_rt.mutex);
+}
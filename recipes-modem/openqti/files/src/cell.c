@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: MIT
 
 #include "../inc/cell.h"
+#include "../inc/atchannel.h"
 #include "../inc/config.h"
 #include "../inc/devices.h"
 #include "../inc/helpers.h"
@@ -16,6 +17,7 @@
 #include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_RESPONSE_SZ 4096
@@ -519,36 +521,6 @@ void parse_gsm_neighbour_data(char *orig_string, int len) {
   }
 }
 
-/* Connect to the AT port, send a command, and get a response */
-int get_data_from_command(char *command, size_t len, char *expected_response,
-                          char *response) {
-  int fd;
-  int fnret = 0;
-  fd_set readfds;
-  struct timeval tv;
-  tv.tv_sec = 0;
-  tv.tv_usec = 500000;
-  fd = open(SMD_SEC_AT, O_RDWR);
-  if (fd < 0) {
-    logger(MSG_ERROR, "%s: Cannot open SMD10 entry\n", __func__);
-    return -EINVAL;
-  }
-  fnret = write(fd, command, len);
-  FD_SET(fd, &readfds);
-  fnret = select(MAX_FD, &readfds, NULL, NULL, &tv);
-  if (FD_ISSET(fd, &readfds)) {
-    fnret = read(fd, response, MAX_RESPONSE_SZ);
-    if (strstr(response, expected_response) != NULL) {
-      fnret = 0;
-    }
-  } else {
-    logger(MSG_ERROR, "%s: Missed our window\n", __func__);
-    fnret = -EBADMSG;
-  }
-
-  close(fd);
-  return fnret;
-}
 char *get_report_network_type(int type) {
   if (type == 0) {
     return "GSM";
@@ -631,18 +603,30 @@ void analyze_data() {
   reply = NULL;
 }
 
-/* Data retrieval functions */
-void read_neighbour_cells() {
-  int ret = 0;
-  char *response;
+/*
+ * Data retrieval functions
+ *  These run as callbacks from the AT channel thread, so the proxy
+ *  never waits for the modem to answer. The serving cell request
+ *  chains the neighbour cell request, and once both are in, the
+ *  report is stored and analyzed
+ */
+void store_current_report() {
+  int i;
+  if (report_data.history_sz > 126) {
+    for (i = 1; i < 128; i++) {
+      report_data.history[i - 1] = report_data.history[i];
+    }
+  } else {
+    report_data.history_sz++;
+  }
+  report_data.history[report_data.history_sz] = report_data.current_report;
+}
+
+void neighbour_cells_cb(int result, char *response, size_t len, void *data) {
   char *start, *end;
-  response = malloc(MAX_RESPONSE_SZ * sizeof(char));
-  int command_length = strlen(GET_NEIGHBOUR_CELL);
 
-  logger(MSG_DEBUG, "%s: Read neighbour cell start\n", __func__);
-  ret = get_data_from_command(GET_NEIGHBOUR_CELL, command_length,
-                              GET_QENG_RESPONSE_PROTO, response);
-  if (ret != 0) {
+  if (result != AT_RESULT_OK ||
+      strstr(response, GET_QENG_RESPONSE_PROTO) == NULL) {
     logger(MSG_ERROR, "%s: Command %s failed. Response: %s\n", __func__,
            GET_NEIGHBOUR_CELL, response);
   } else {
@@ -676,21 +660,13 @@ void read_neighbour_cells() {
       start = end + 1;
     }
   }
-  free(response);
-  response = NULL;
+  store_current_report();
+  analyze_data();
 }
 
-void read_serving_cell() {
-  int ret = 0;
-  int i;
-  char *response;
-  response = malloc(MAX_RESPONSE_SZ * sizeof(char));
-  int command_length = strlen(GET_SERVING_CELL);
-
-  logger(MSG_DEBUG, "%s: Read serving cell\n", __func__);
-  ret = get_data_from_command(GET_SERVING_CELL, command_length,
-                              GET_QENG_RESPONSE_PROTO, response);
-  if (ret != 0) {
+void serving_cell_cb(int result, char *response, size_t len, void *data) {
+  if (result != AT_RESULT_OK ||
+      strstr(response, GET_QENG_RESPONSE_PROTO) == NULL) {
     logger(MSG_ERROR, "%s: Command %s failed. Response: %s\n", __func__,
            GET_SERVING_CELL, response);
   } else {
@@ -698,33 +674,28 @@ void read_serving_cell() {
            GET_SERVING_CELL, response);
     if (strlen(response) > 18) {
       report_data.current_report = parse_report_data(response);
-      read_neighbour_cells();
-      if (report_data.history_sz > 126) {
-        for (i = 1; i < 128; i++) {
-          report_data.history[i - 1] = report_data.history[i];
-        }
-      } else {
-        report_data.history_sz++;
+      logger(MSG_DEBUG, "%s: Read neighbour cell start\n", __func__);
+      if (at_send_async(GET_NEIGHBOUR_CELL, strlen(GET_NEIGHBOUR_CELL),
+                        AT_CELL_TIMEOUT_MS, neighbour_cells_cb, NULL) == 0) {
+        return; // The neighbour callback takes it from here
       }
-      report_data.history[report_data.history_sz] = report_data.current_report;
+      store_current_report();
     }
   }
-  free(response);
-  response = NULL;
   analyze_data();
 }
 
-void read_at_cind() {
-  char *response;
-  response = malloc(MAX_RESPONSE_SZ * sizeof(char));
-  int command_length = strlen(GET_COMMON_IND);
-  int ret = 0;
-  logger(MSG_DEBUG, "%s: Read CIND start\n", __func__);
-
-  ret = get_data_from_command(GET_COMMON_IND, command_length,
-                              GET_COMMON_IND_RESPONSE_PROTO, response);
+void read_serving_cell() {
+  logger(MSG_DEBUG, "%s: Read serving cell\n", __func__);
+  if (at_send_async(GET_SERVING_CELL, strlen(GET_SERVING_CELL),
+                    AT_CELL_TIMEOUT_MS, serving_cell_cb, NULL) < 0) {
+    logger(MSG_ERROR, "%s: Can't queue %s\n", __func__, GET_SERVING_CELL);
+  }
+}
 
-  if (ret != 0) {
+void at_cind_cb(int result, char *response, size_t len, void *data) {
+  if (result != AT_RESULT_OK ||
+      strstr(response, GET_COMMON_IND_RESPONSE_PROTO) == NULL) {
     logger(MSG_ERROR, "%s: Command %s failed. Response: %s\n", __func__,
            GET_COMMON_IND, response);
   } else {
@@ -738,8 +709,14 @@ void read_at_cind() {
       net_status.ps_domain = get_int_from_str(response, 21);
     }
   }
-  free(response);
-  response = NULL;
+}
+
+void read_at_cind() {
+  logger(MSG_DEBUG, "%s: Read CIND start\n", __func__);
+  if (at_send_async(GET_COMMON_IND, strlen(GET_COMMON_IND), AT_CELL_TIMEOUT_MS,
+                    at_cind_cb, NULL) < 0) {
+    logger(MSG_ERROR, "%s: Can't queue %s\n", __func__, GET_COMMON_IND);
+  }
 }
 
 void update_network_data(uint8_t network_type, uint8_t signal_level) {
@@ -752,4 +729,84 @@ void update_network_data(uint8_t network_type, uint8_t signal_level) {
     logger(MSG_DEBUG, "%s: Read serving and neighbour cell data\n", __func__);
     read_serving_cell();
   }
-}
\ No newline at end of file
+}
+
+/*
+ * Network state worker
+ *  NAS signal indications come in through the proxy thread, which only
+ *  leaves the latest values here and goes back to forwarding. The
+ *  worker picks them up and refreshes the network data, but never more
+ *  often than NETWORK_REFRESH_INTERVAL_MS: indications that arrive
+ *  while it waits are coalesced, and only the newest one is used.
+ */
+struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool pending;
+  uint8_t network_type;
+  uint8_t signal_level;
+  uint32_t received;
+  uint32_t coalesced;
+  uint32_t refreshed;
+  struct timespec last_refresh;
+} network_rt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .pending = false,
+    .received = 0,
+    .coalesced = 0,
+    .refreshed = 0,
+};
+
+void queue_network_update(uint8_t network_type, uint8_t signal_level) {
+  pthread_mutex_lock(&network_rt.mutex);
+  if (network_rt.pending)
+    network_rt.coalesced++;
+  network_rt.network_type = network_type;
+  network_rt.signal_level = signal_level;
+  network_rt.pending = true;
+  network_rt.received++;
+  pthread_cond_signal(&network_rt.cond);
+  pthread_mutex_unlock(&network_rt.mutex);
+}
+
+void *network_state_thread() {
+  struct timespec now;
+  uint8_t network_type, signal_level;
+  long elapsed_ms;
+
+  logger(MSG_INFO, "%s: Network state worker started\n", __func__);
+  pthread_mutex_lock(&network_rt.mutex);
+  while (1) {
+    while (!network_rt.pending)
+      pthread_cond_wait(&network_rt.cond, &network_rt.mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = (now.tv_sec - network_rt.last_refresh.tv_sec) * 1000 +
+                 (now.tv_nsec - network_rt.last_refresh.tv_nsec) / 1000000;
+    if (network_rt.refreshed > 0 && elapsed_ms >= 0 &&
+        elapsed_ms < NETWORK_REFRESH_INTERVAL_MS) {
+      /* Anything arriving meanwhile just replaces the pending values */
+      pthread_mutex_unlock(&network_rt.mutex);
+      usleep((NETWORK_REFRESH_INTERVAL_MS - elapsed_ms) * 1000);
+      pthread_mutex_lock(&network_rt.mutex);
+      continue;
+    }
+
+    network_type = network_rt.network_type;
+    signal_level = network_rt.signal_level;
+    network_rt.pending = false;
+    network_rt.last_refresh = now;
+    network_rt.refreshed++;
+    logger(MSG_DEBUG, "%s: Refresh %u: %u indications, %u coalesced\n",
+           __func__, network_rt.refreshed, network_rt.received,
+           network_rt.coalesced);
+    pthread_mutex_unlock(&network_rt.mutex);
+
+    update_network_data(network_type, signal_level);
+
+    pthread_mutex_lock(&network_rt.mutex);
+  }
+  pthread_mutex_unlock(&network_rt.mutex);
+  return NULL;
+}
@@ -2,15 +2,22 @@
 
 #include "../inc/command.h"
 #include "../inc/adspfw.h"
+#include "../inc/arena.h"
+#include "../inc/atchannel.h"
 #include "../inc/call.h"
+#include "../inc/capture.h"
 #include "../inc/cell.h"
 #include "../inc/cell_broadcast.h"
 #include "../inc/config.h"
+#include "../inc/dispatch.h"
 #include "../inc/logger.h"
+#include "../inc/nmea.h"
 #include "../inc/proxy.h"
 #include "../inc/scheduler.h"
 #include "../inc/sms.h"
+#include "../inc/sms_store.h"
 #include "../inc/tracking.h"
+#include "../inc/wake.h"
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -144,7 +151,7 @@ int get_memory(uint8_t *output) {
 void set_custom_modem_name(uint8_t *command) {
   int strsz = 0;
   uint8_t *offset;
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   char name[32];
   offset = (uint8_t *)strstr((char *)command, partial_commands[0].cmd);
   if (offset == NULL) {
@@ -161,14 +168,12 @@ void set_custom_modem_name(uint8_t *command) {
     }
   }
   add_message_to_queue(reply, strsz);
-  free(reply);
-  reply = NULL;
 }
 
 void set_custom_user_name(uint8_t *command) {
   int strsz = 0;
   uint8_t *offset;
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   char name[32];
   offset = (uint8_t *)strstr((char *)command, partial_commands[1].cmd);
   if (offset == NULL) {
@@ -185,14 +190,12 @@ void set_custom_user_name(uint8_t *command) {
     }
   }
   add_message_to_queue(reply, strsz);
-  free(reply);
-  reply = NULL;
 }
 
 void delete_task(uint8_t *command) {
   int strsz = 0;
   uint8_t *offset;
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   int taskID;
   char command_args[64];
   offset = (uint8_t *)strstr((char *)command, partial_commands[5].cmd);
@@ -213,12 +216,10 @@ void delete_task(uint8_t *command) {
     }
   }
   add_message_to_queue(reply, strsz);
-  free(reply);
-  reply = NULL;
 }
 void dump_signal_report() {
   int strsz = 0;
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   struct cell_report report = get_current_cell_report();
   if (report.net_type < 0) {
     strsz = snprintf(
@@ -345,28 +346,31 @@ void dump_signal_report() {
     }
   }
   add_message_to_queue(reply, strsz);
-
-  free(reply);
-  reply = NULL;
 }
 
 void *delayed_shutdown() {
   sleep(5);
+  flush_packet_capture();
+  flush_log();
   reboot(0x4321fedc);
   return NULL;
 }
 
 void *delayed_reboot() {
   sleep(5);
+  flush_packet_capture();
+  flush_log();
   reboot(0x01234567);
   return NULL;
 }
 
+/* Takes ownership of cmd, a heap copy of the command text */
 void *schedule_call(void *cmd) {
   int strsz = 0;
   uint8_t *offset;
   uint8_t *command = (uint8_t *)cmd;
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  struct scratch_mark mark = scratch_save();
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   logger(MSG_WARN, "SCH: %s -> %s \n", cmd, command);
 
   int delaysec;
@@ -396,9 +400,8 @@ void *schedule_call(void *cmd) {
       add_message_to_queue(reply, strsz);
     }
   }
-  free(reply);
-  reply = NULL;
-  command = NULL;
+  scratch_restore(mark);
+  free(cmd);
   return NULL;
 }
 
@@ -406,7 +409,7 @@ void render_gsm_signal_data() {
   int strsz = 0;
   struct network_state netstat;
   netstat = get_network_status();
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                     "Network type: ");
   if (get_network_type() >= 0x00 && get_network_type() <= 0x08) {
@@ -423,8 +426,6 @@ void render_gsm_signal_data() {
   strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                     "%s in call \n", netstat.in_call ? "Is" : "Isn't");
   add_message_to_queue(reply, strsz);
-  free(reply);
-  reply = NULL;
 }
 
 /* Syntax:
@@ -440,7 +441,7 @@ void render_gsm_signal_data() {
  */
 void schedule_reminder(uint8_t *command) {
   uint8_t *offset_command;
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   int strsz = 0;
   char temp_str[160];
   char reminder_text[160] = {0};
@@ -458,8 +459,6 @@ void schedule_reminder(uint8_t *command) {
     strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE - strsz,
                      "Command mismatch!\n");
     add_message_to_queue(reply, strsz);
-    free(reply);
-    reply = NULL;
     return;
   }
 
@@ -510,8 +509,6 @@ void schedule_reminder(uint8_t *command) {
         strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                          "First word in command is wrong\n");
         add_message_to_queue(reply, strsz);
-        free(reply);
-        reply = NULL;
         return;
       } else {
         logger(MSG_INFO, "%s: Word ok: %s\n", __func__, current_word);
@@ -524,8 +521,6 @@ void schedule_reminder(uint8_t *command) {
         strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                          "Second word in command is wrong\n");
         add_message_to_queue(reply, strsz);
-        free(reply);
-        reply = NULL;
         return;
       }
       break;
@@ -543,8 +538,6 @@ void schedule_reminder(uint8_t *command) {
                          "Do you want me to remind you *at* a specific time or "
                          "*in* some time from now\n");
         add_message_to_queue(reply, strsz);
-        free(reply);
-        reply = NULL;
         return;
       }
       break;
@@ -571,8 +564,6 @@ void schedule_reminder(uint8_t *command) {
                                "I might not be very smart, but I don't think "
                                "there's enough minutes in an hour \n");
             add_message_to_queue(reply, strsz);
-            free(reply);
-            reply = NULL;
             return;
           }
         }
@@ -585,8 +576,6 @@ void schedule_reminder(uint8_t *command) {
                            "I can't wait for a task that long... %s\n",
                            current_word);
           add_message_to_queue(reply, strsz);
-          free(reply);
-          reply = NULL;
           return;
         } else {
           scheduler_task.time.hh = atoi(current_word);
@@ -627,8 +616,6 @@ void schedule_reminder(uint8_t *command) {
                      " Can't add reminder, my task queue is full!\n");
   }
   add_message_to_queue(reply, strsz);
-  free(reply);
-  reply = NULL;
 }
 
 /* Syntax:
@@ -644,7 +631,7 @@ void schedule_reminder(uint8_t *command) {
  */
 void schedule_wakeup(uint8_t *command) {
   uint8_t *offset_command;
-  uint8_t *reply = calloc(256, sizeof(unsigned char));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   int strsz = 0;
   char temp_str[160];
   char current_word[160] = {0};
@@ -661,8 +648,6 @@ void schedule_wakeup(uint8_t *command) {
     strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE - strsz,
                      "Command mismatch!\n");
     add_message_to_queue(reply, strsz);
-    free(reply);
-    reply = NULL;
     return;
   }
 
@@ -713,8 +698,6 @@ void schedule_wakeup(uint8_t *command) {
         strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                          "First word in command is wrong\n");
         add_message_to_queue(reply, strsz);
-        free(reply);
-        reply = NULL;
         return;
       } else {
         logger(MSG_INFO, "%s: Word ok: %s\n", __func__, current_word);
@@ -727,8 +710,6 @@ void schedule_wakeup(uint8_t *command) {
         strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                          "Second word in command is wrong\n");
         add_message_to_queue(reply, strsz);
-        free(reply);
-        reply = NULL;
         return;
       }
       break;
@@ -739,8 +720,6 @@ void schedule_wakeup(uint8_t *command) {
         strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
                          "Second word in command is wrong\n");
         add_message_to_queue(reply, strsz);
-        free(reply);
-        reply = NULL;
         return;
       }
       break;
@@ -759,8 +738,6 @@ void schedule_wakeup(uint8_t *command) {
                      "Do you want me to wake you up *at* a specific time or "
                      "*in* some time from now?\n");
         add_message_to_queue(reply, strsz);
-        free(reply);
-        reply = NULL;
         return;
       }
       break;
@@ -784,8 +761,6 @@ void schedule_wakeup(uint8_t *command) {
                              "minutes... %s\n",
                              current_word);
           add_message_to_queue(reply, strsz);
-          free(reply);
-          reply = NULL;
           return;
         } else if (scheduler_task.time.mode == SCHED_MODE_TIME_AT) {
           if (scheduler_task.time.hh > 23 && scheduler_task.time.mm > 59) {
@@ -803,8 +778,6 @@ void schedule_wakeup(uint8_t *command) {
                                "I might not be very smart, but I don't think "
                                "there's enough minutes in an hour \n");
             add_message_to_queue(reply, strsz);
-            free(reply);
-            reply = NULL;
             return;
           } else {
             strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
@@ -826,8 +799,6 @@ void schedule_wakeup(uint8_t *command) {
                            "I can't wait for a task that long... %s\n",
                            current_word);
           add_message_to_queue(reply, strsz);
-          free(reply);
-          reply = NULL;
           return;
         } else {
           scheduler_task.time.hh = atoi(current_word);
@@ -844,8 +815,6 @@ void schedule_wakeup(uint8_t *command) {
                                "I might not be very smart, but I don't think "
                                "there's enough hours in a day \n");
               add_message_to_queue(reply, strsz);
-              free(reply);
-              reply = NULL;
               return;
             } else {
               logger(MSG_WARN, "%s: Waiting until %i to call you back\n",
@@ -871,42 +840,218 @@ void schedule_wakeup(uint8_t *command) {
                      " Can't schedule wakeup, my task queue is full!\n");
   }
   add_message_to_queue(reply, strsz);
-  free(reply);
-  reply = NULL;
 }
 
-void set_cb_broadcast(bool en) {
-  char *response = malloc(128 * sizeof(char));
-  uint8_t *reply = calloc(160, sizeof(unsigned char));
+void cb_broadcast_cb(int result, char *response, size_t len, void *data) {
+  bool en = (data != NULL);
+  struct scratch_mark mark = scratch_save();
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   int strsz;
-  int cmd_ret;
+  if (result != AT_RESULT_OK) {
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "Failed to %s cell broadcasting messages\n",
+                     en ? "enable" : "disable");
+  } else {
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "%s Cell broadcast messages\n",
+                     en ? "Enabling" : "Disabling");
+  }
+  add_message_to_queue(reply, strsz);
+  scratch_restore(mark);
+}
+
+/* The reply is sent from the callback once the modem answers */
+void set_cb_broadcast(bool en) {
+  int ret;
   if (en) {
-    cmd_ret = send_at_command(CB_ENABLE_AT_CMD, sizeof(CB_ENABLE_AT_CMD),
-                              response, 128);
-    if (cmd_ret < 0 || (strstr(response, "OK") == NULL)) {
-      strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
-                       "Failed to enable cell broadcasting messages\n");
-    } else {
-      strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
-                       "Enabling Cell broadcast messages\n");
+    ret = at_send_async(CB_ENABLE_AT_CMD, sizeof(CB_ENABLE_AT_CMD),
+                        AT_DEFAULT_TIMEOUT_MS, cb_broadcast_cb, (void *)1);
+  } else {
+    ret = at_send_async(CB_DISABLE_AT_CMD, sizeof(CB_DISABLE_AT_CMD),
+                        AT_DEFAULT_TIMEOUT_MS, cb_broadcast_cb, NULL);
+  }
+  if (ret < 0) {
+    cb_broadcast_cb(AT_RESULT_IO_ERROR, "", 0, en ? (void *)1 : NULL);
+  }
+}
+
+/* p50/p90/p99 in microseconds, for each direction */
+void send_latency_stats(const char *name, struct pkt_stats *stats,
+                        bool has_handler) {
+  static const char *labels[] = {"ADSP->USB", "USB->ADSP", "Handler ADSP",
+                                 "Handler USB"};
+  struct latency_summary *rows[] = {
+      &stats->forward[FROM_DSP], &stats->forward[FROM_HOST],
+      &stats->handler[FROM_DSP], &stats->handler[FROM_HOST]};
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
+  int i, strsz;
+
+  strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                   "%s latency us p50/p90/p99:\n", name);
+  for (i = 0; i < (has_handler ? 4 : 2) && strsz < MAX_MESSAGE_SIZE; i++) {
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
+                      "%s %llu/%llu/%llu\n", labels[i],
+                      (unsigned long long)rows[i]->p50_ns / 1000,
+                      (unsigned long long)rows[i]->p90_ns / 1000,
+                      (unsigned long long)rows[i]->p99_ns / 1000);
+  }
+  if (strsz >= MAX_MESSAGE_SIZE)
+    strsz = MAX_MESSAGE_SIZE - 1;
+  add_message_to_queue(reply, strsz);
+}
+
+/* One line per QMI handler, split in as many messages as needed */
+void send_qmi_handler_stats() {
+  struct qmi_handler_stats stats[DISPATCH_MAX_HANDLERS];
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
+  char line[MAX_MESSAGE_SIZE];
+  int i, num, linesz, strsz = 0;
+
+  num = get_qmi_handler_stats(stats, DISPATCH_MAX_HANDLERS);
+  strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "%s\n",
+                   bot_commands[38].cmd_text);
+  for (i = 0; i < num; i++) {
+    linesz = snprintf(line, sizeof(line), "%s: %u, avg %llu us, max %llu us\n",
+                      stats[i].name, stats[i].calls,
+                      stats[i].calls ? (unsigned long long)(stats[i].total_ns /
+                                                            stats[i].calls /
+                                                            1000)
+                                     : 0ULL,
+                      (unsigned long long)(stats[i].max_ns / 1000));
+    if (strsz + linesz >= MAX_MESSAGE_SIZE) {
+      add_message_to_queue(reply, strsz);
+      strsz = 0;
     }
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz, "%s",
+                      line);
+  }
+  add_message_to_queue(reply, strsz);
+}
+
+/* Whatever the NMEA parser saw last, the GPS port isn't touched */
+void send_gps_fix() {
+  struct nmea_fix fix = get_last_fix();
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
+  int strsz;
+
+  if (fix.updated_ns == 0) {
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "No GPS data yet, is the GPS enabled?\n");
   } else {
-    cmd_ret = send_at_command(CB_DISABLE_AT_CMD, sizeof(CB_DISABLE_AT_CMD),
-                              response, 128);
-    if (cmd_ret < 0 || (strstr(response, "OK") == NULL)) {
-      strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
-                       "Failed to disable cell broadcasting messages\n");
-    } else {
-      strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
-                       "Disabling Cell broadcast messages\n");
+    strsz = snprintf(
+        (char *)reply, MAX_MESSAGE_SIZE,
+        "%s (%s, %llus ago):\n%.6f, %.6f\nAlt: %.1fm\nSpeed: %.1fkm/h\n"
+        "Sats: %u/%u, HDOP %.1f\n",
+        bot_commands[40].cmd_text, fix.valid ? "valid" : "no fix",
+        (unsigned long long)((stats_now_ns() - fix.updated_ns) / 1000000000ULL),
+        fix.latitude, fix.longitude, fix.altitude, fix.speed_knots * 1.852,
+        fix.sats_used, fix.sats_in_view, fix.hdop);
+  }
+  if (strsz >= MAX_MESSAGE_SIZE)
+    strsz = MAX_MESSAGE_SIZE - 1;
+  add_message_to_queue(reply, strsz);
+}
+
+/*
+ * Last messages in the SMS store, from anyone if number is NULL,
+ * newest first and split in as many messages as needed
+ */
+void send_stored_messages(const char *number) {
+  struct sms_store_message *msgs =
+      scratch_alloc(SMS_STORE_QUERY_SIZE * sizeof(struct sms_store_message));
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
+  char line[MAX_MESSAGE_SIZE];
+  struct tm tm;
+  time_t ts;
+  int i, num, linesz, strsz;
+
+  num = get_last_sms_messages(number, msgs, SMS_STORE_QUERY_SIZE);
+  if (number == NULL)
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "%s\n",
+                     bot_commands[41].cmd_text);
+  else
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "%s%s:\n",
+                     partial_commands[6].cmd_text, number);
+  if (num < 0) {
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
+                      "SMS history is not available\n");
+  } else if (num == 0) {
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
+                      "Nothing stored\n");
+  }
+  for (i = 0; i < num; i++) {
+    ts = msgs[i].timestamp;
+    localtime_r(&ts, &tm);
+    linesz = snprintf(line, sizeof(line), "%02d/%02d %02d:%02d %s %s: %s\n",
+                      tm.tm_mday, tm.tm_mon + 1, tm.tm_hour, tm.tm_min,
+                      msgs[i].direction == FROM_DSP ? "<" : ">",
+                      msgs[i].number, msgs[i].text);
+    if (linesz >= (int)sizeof(line))
+      linesz = sizeof(line) - 1;
+    if (strsz + linesz >= MAX_MESSAGE_SIZE) {
+      add_message_to_queue(reply, strsz);
+      strsz = 0;
     }
+    strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz, "%s",
+                      line);
   }
+  if (strsz >= MAX_MESSAGE_SIZE)
+    strsz = MAX_MESSAGE_SIZE - 1;
   add_message_to_queue(reply, strsz);
+}
 
-  free(response);
-  free(reply);
-  response = NULL;
-  reply = NULL;
+void send_messages_from(uint8_t *command) {
+  uint8_t *offset;
+  uint8_t *reply;
+  char number[SMS_STORE_NUMBER_SIZE];
+  int strsz;
+  offset = (uint8_t *)strstr((char *)command, partial_commands[6].cmd);
+  if (offset == NULL ||
+      strlen((char *)offset) <= strlen(partial_commands[6].cmd)) {
+    reply = scratch_alloc(MAX_MESSAGE_SIZE);
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "Whose messages? Try messages from +123456789\n");
+    add_message_to_queue(reply, strsz);
+    return;
+  }
+  snprintf(number, sizeof(number), "%s",
+           (char *)offset + strlen(partial_commands[6].cmd));
+  send_stored_messages(number);
+}
+
+/*
+ * Sends the end of a file, as much of it as the message queue can take
+ * right now. Anything older would be rejected by a full queue anyway
+ */
+/* Chunks of the file go out as concatenated messages of a few parts */
+#define FILE_TAIL_CHUNK (4 * SMS_CONCAT_GSM7_SEPTETS)
+
+static void send_file_tail(FILE *fp) {
+  uint8_t *reply = scratch_alloc(FILE_TAIL_CHUNK + 1);
+  long size, max_bytes;
+  int ret;
+
+  max_bytes = (long)get_sms_queue_free() * SMS_CONCAT_GSM7_SEPTETS;
+  if (max_bytes <= 0) {
+    logger(MSG_WARN, "%s: Message queue is full\n", __func__);
+    return;
+  }
+  fseek(fp, 0L, SEEK_END);
+  size = ftell(fp);
+  if (size > max_bytes) {
+    fseek(fp, size - max_bytes, SEEK_SET);
+  } else {
+    fseek(fp, 0L, SEEK_SET);
+  }
+  do {
+    memset(reply, 0, FILE_TAIL_CHUNK + 1);
+    ret = fread(reply, 1, FILE_TAIL_CHUNK, fp);
+    if (ret > 0 && add_message_to_queue(reply, ret) == -ENOSPC) {
+      logger(MSG_WARN, "%s: Message queue is full, stopping here\n",
+             __func__);
+      break;
+    }
+  } while (ret > 0);
 }
 
 uint8_t parse_command(uint8_t *command) {
@@ -916,10 +1061,15 @@ uint8_t parse_command(uint8_t *command) {
   int cmd_id = -1;
   int strsz = 0;
   struct pkt_stats packet_stats;
+  struct nmea_buffer_stats nmea_stats;
+  struct nmea_parser_stats parser_stats;
+  struct host_wake_stats wake_stats;
   pthread_t disposable_thread;
   char lowercase_cmd[160];
-  uint8_t *tmpbuf = calloc(MAX_MESSAGE_SIZE, sizeof(unsigned char));
-  uint8_t *reply = calloc(MAX_MESSAGE_SIZE, sizeof(unsigned char));
+  char *call_cmd;
+  struct scratch_mark mark = scratch_save();
+  uint8_t *tmpbuf = scratch_alloc(MAX_MESSAGE_SIZE);
+  uint8_t *reply = scratch_alloc(MAX_MESSAGE_SIZE);
   srand(time(NULL));
   for (i = 0; i < command[i]; i++) {
     lowercase_cmd[i] = tolower(command[i]);
@@ -994,9 +1144,17 @@ uint8_t parse_command(uint8_t *command) {
     add_message_to_queue(reply, strsz);
     break;
   case 4:
-    strsz +=
-        snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
-                 "USB Suspend state: %i\n", get_transceiver_suspend_state());
+    wake_stats = get_host_wake_stats();
+    strsz += snprintf(
+        (char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
+        "USB Suspend state: %i\nHeld for the host: %u\nWake ups: %llu "
+        "(%llu pulses)\nDelivered late: %llu (max %llums)\nDropped: %llu\n",
+        get_transceiver_suspend_state(), wake_stats.parked,
+        (unsigned long long)wake_stats.requests,
+        (unsigned long long)wake_stats.pulses,
+        (unsigned long long)wake_stats.delivered,
+        (unsigned long long)wake_stats.max_wait_ms,
+        (unsigned long long)wake_stats.dropped);
     add_message_to_queue(reply, strsz);
     break;
   case 5:
@@ -1013,21 +1171,48 @@ uint8_t parse_command(uint8_t *command) {
     packet_stats = get_rmnet_stats();
     strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                       "RMNET IF stats:\nBypassed: "
-                      "%i\nEmpty:%i\nDiscarded:%i\nFailed:%i\nAllowed:%i",
-                      packet_stats.bypassed, packet_stats.empty,
-                      packet_stats.discarded, packet_stats.failed,
-                      packet_stats.allowed);
+                      "%llu\nEmpty:%llu\nDiscarded:%llu\nFailed:%llu\nAllowed:%llu",
+                      (unsigned long long)packet_stats.bypassed,
+                      (unsigned long long)packet_stats.empty,
+                      (unsigned long long)packet_stats.discarded,
+                      (unsigned long long)packet_stats.failed,
+                      (unsigned long long)packet_stats.allowed);
     add_message_to_queue(reply, strsz);
+    send_latency_stats("RMNET", &packet_stats, true);
     break;
   case 7:
     packet_stats = get_gps_stats();
     strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
                       "GPS IF stats:\nBypassed: "
-                      "%i\nEmpty:%i\nDiscarded:%i\nFailed:%i\nAllowed:%"
-                      "i\nQMI Location svc.: %i",
-                      packet_stats.bypassed, packet_stats.empty,
-                      packet_stats.discarded, packet_stats.failed,
-                      packet_stats.allowed, packet_stats.other);
+                      "%llu\nEmpty:%llu\nDiscarded:%llu\nFailed:%llu\nAllowed:%"
+                      "llu\nQMI Location svc.: %llu",
+                      (unsigned long long)packet_stats.bypassed,
+                      (unsigned long long)packet_stats.empty,
+                      (unsigned long long)packet_stats.discarded,
+                      (unsigned long long)packet_stats.failed,
+                      (unsigned long long)packet_stats.allowed,
+                      (unsigned long long)packet_stats.other);
+    add_message_to_queue(reply, strsz);
+    send_latency_stats("GPS", &packet_stats, false);
+    nmea_stats = get_nmea_buffer_stats();
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "While suspended (%s):\nHeld: %u\nStored: %llu\n"
+                     "Dropped: %llu\nFlushed: %llu in %llu writes",
+                     get_nmea_policy_name(nmea_stats.policy), nmea_stats.size,
+                     (unsigned long long)nmea_stats.stored,
+                     (unsigned long long)nmea_stats.dropped,
+                     (unsigned long long)nmea_stats.flushed,
+                     (unsigned long long)nmea_stats.flushes);
+    add_message_to_queue(reply, strsz);
+    parser_stats = get_nmea_parser_stats();
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                     "NMEA sentences: %llu\nParsed: %llu\nBad checksum: %llu\n"
+                     "Malformed: %llu\nRate limited: %llu",
+                     (unsigned long long)parser_stats.sentences,
+                     (unsigned long long)parser_stats.parsed,
+                     (unsigned long long)parser_stats.bad_checksum,
+                     (unsigned long long)parser_stats.malformed,
+                     (unsigned long long)parser_stats.rate_limited);
     add_message_to_queue(reply, strsz);
     break;
   case 8:
@@ -1111,18 +1296,7 @@ uint8_t parse_command(uint8_t *command) {
     } else {
       strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "OpenQTI Log\n");
       add_message_to_queue(reply, strsz);
-      if (ret > (MAX_MESSAGE_SIZE * QUEUE_SIZE)) {
-        fseek(fp, (ret - (MAX_MESSAGE_SIZE * QUEUE_SIZE)), SEEK_SET);
-      } else {
-        fseek(fp, 0L, SEEK_SET);
-      }
-      do {
-        memset(reply, 0, MAX_MESSAGE_SIZE);
-        ret = fread(reply, 1, MAX_MESSAGE_SIZE - 2, fp);
-        if (ret > 0) {
-          add_message_to_queue(reply, ret);
-        }
-      } while (ret > 0);
+      send_file_tail(fp);
       fclose(fp);
     }
     break;
@@ -1135,20 +1309,7 @@ uint8_t parse_command(uint8_t *command) {
     } else {
       strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "DMESG:\n");
       add_message_to_queue(reply, strsz);
-      fseek(fp, 0L, SEEK_END);
-      ret = ftell(fp);
-      if (ret > (MAX_MESSAGE_SIZE * QUEUE_SIZE)) {
-        fseek(fp, (ret - (MAX_MESSAGE_SIZE * QUEUE_SIZE)), SEEK_SET);
-      } else {
-        fseek(fp, 0L, SEEK_SET);
-      }
-      do {
-        memset(reply, 0, MAX_MESSAGE_SIZE);
-        ret = fread(reply, 1, MAX_MESSAGE_SIZE - 2, fp);
-        if (ret > 0) {
-          add_message_to_queue(reply, ret);
-        }
-      } while (ret > 0);
+      send_file_tail(fp);
       fclose(fp);
     }
     break;
@@ -1299,6 +1460,37 @@ uint8_t parse_command(uint8_t *command) {
     add_message_to_queue(reply, strsz);
     enable_call_waiting_autohangup(0);
     break;
+  case 36:
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "%s\n",
+                     bot_commands[cmd_id].cmd_text);
+    add_message_to_queue(reply, strsz);
+    enable_packet_capture(true);
+    break;
+  case 37:
+    strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "%s\n",
+                     bot_commands[cmd_id].cmd_text);
+    add_message_to_queue(reply, strsz);
+    enable_packet_capture(false);
+    break;
+  case 38:
+    send_qmi_handler_stats();
+    break;
+  case 39:
+    if (write_proxy_stats(VOLATILE_STATS_PATH) == 0) {
+      strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE, "%s %s\n",
+                       bot_commands[cmd_id].cmd_text, VOLATILE_STATS_PATH);
+    } else {
+      strsz = snprintf((char *)reply, MAX_MESSAGE_SIZE,
+                       "Can't write the stats to %s\n", VOLATILE_STATS_PATH);
+    }
+    add_message_to_queue(reply, strsz);
+    break;
+  case 40:
+    send_gps_fix();
+    break;
+  case 41:
+    send_stored_messages(NULL);
+    break;
   case 100:
     set_custom_modem_name(command);
     break;
@@ -1306,8 +1498,13 @@ uint8_t parse_command(uint8_t *command) {
     set_custom_user_name(command);
     break;
   case 102:
-    pthread_create(&disposable_thread, NULL, &schedule_call, command);
-    sleep(2); // our string gets wiped out before we have a chance
+    /* command lives in the caller's scratch arena, give the thread a copy */
+    call_cmd = strdup((char *)command);
+    if (call_cmd == NULL || pthread_create(&disposable_thread, NULL,
+                                           &schedule_call, call_cmd) != 0) {
+      logger(MSG_ERROR, "%s: Can't schedule the call\n", __func__);
+      free(call_cmd);
+    }
     break;
   case 103:
     schedule_reminder(command);
@@ -1318,6 +1515,9 @@ uint8_t parse_command(uint8_t *command) {
   case 105: /* Delete task %i */
     delete_task(command);
 
+    break;
+  case 106:
+    send_messages_from(command);
     break;
   default:
     strsz += snprintf((char *)reply + strsz, MAX_MESSAGE_SIZE - strsz,
@@ -1328,8 +1528,8 @@ uint8_t parse_command(uint8_t *command) {
 
   add_to_history(cmd_id);
 
-  free(tmpbuf);
-  free(reply);
+  /* Releases the replies of every helper called from here too */
+  scratch_restore(mark);
 
   tmpbuf = NULL;
   reply = NULL;
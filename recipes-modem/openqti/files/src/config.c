@@ -1,7 +1,10 @@
 // SPDX-License-Identifier: MIT
 
 #include "../inc/config.h"
+#include "../inc/capture.h"
 #include "../inc/logger.h"
+#include "../inc/nmea.h"
+#include "../inc/sms.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/input.h>
@@ -47,6 +50,11 @@ int set_initial_config() {
   settings->signal_tracking = 0;
   settings->sms_logging = 0;
   settings->callwait_autohangup = 0;
+  settings->packet_capture = 0;
+  settings->gps_suspend_policy = NMEA_SUSPEND_DEFAULT_POLICY;
+  settings->gps_suspend_buffer_kb = NMEA_SUSPEND_DEFAULT_KB;
+  settings->gps_rate_limit_ms = 0;
+  settings->sms_queue_size = QUEUE_SIZE;
   settings->first_boot = false;
   snprintf(settings->user_name, MAX_NAME_SZ, "Admin");
   snprintf(settings->modem_name, MAX_NAME_SZ, "Modem");
@@ -60,10 +68,17 @@ void dump_current_config() {
          "---> Persistent logging: %i\n"
          "---> Signal tracking: %i\n"
          "---> Autokill call waiting: %i\n"
+         "---> Packet capture: %i\n"
+         "---> GPS suspend policy: %i (%i KB)\n"
+         "---> GPS rate limit: %i ms\n"
+         "---> SMS queue size: %i\n"
          "---> User name: %s\n"
          "---> Modem name: %s\n",
          settings->custom_alert_tone, settings->persistent_logging,
          settings->signal_tracking, settings->callwait_autohangup,
+         settings->packet_capture, settings->gps_suspend_policy,
+         settings->gps_suspend_buffer_kb, settings->gps_rate_limit_ms,
+         settings->sms_queue_size,
          settings->user_name, settings->modem_name);
 }
 int parse_line(char *buf) {
@@ -115,6 +130,26 @@ int parse_line(char *buf) {
     settings->callwait_autohangup = atoi(value);
     return 1;
   }
+  if (strcmp(setting, "packet_capture") == 0) {
+    settings->packet_capture = atoi(value);
+    return 1;
+  }
+  if (strcmp(setting, "gps_suspend_policy") == 0) {
+    settings->gps_suspend_policy = atoi(value);
+    return 1;
+  }
+  if (strcmp(setting, "gps_suspend_buffer_kb") == 0) {
+    settings->gps_suspend_buffer_kb = atoi(value);
+    return 1;
+  }
+  if (strcmp(setting, "gps_rate_limit_ms") == 0) {
+    settings->gps_rate_limit_ms = atoi(value);
+    return 1;
+  }
+  if (strcmp(setting, "sms_queue_size") == 0) {
+    settings->sms_queue_size = atoi(value);
+    return 1;
+  }
   if (strcmp(setting, "sms_logging") == 0) {
     settings->sms_logging = atoi(value);
     return 1;
@@ -157,6 +192,11 @@ int write_settings_to_storage() {
   fprintf(fp, "signal_tracking=%i\n", settings->signal_tracking);
   fprintf(fp, "callwait_autohangup=%i\n", settings->callwait_autohangup);
   fprintf(fp, "sms_logging=%i\n", settings->sms_logging);
+  fprintf(fp, "packet_capture=%i\n", settings->packet_capture);
+  fprintf(fp, "gps_suspend_policy=%i\n", settings->gps_suspend_policy);
+  fprintf(fp, "gps_suspend_buffer_kb=%i\n", settings->gps_suspend_buffer_kb);
+  fprintf(fp, "gps_rate_limit_ms=%i\n", settings->gps_rate_limit_ms);
+  fprintf(fp, "sms_queue_size=%i\n", settings->sms_queue_size);
   logger(MSG_INFO, "%s: Close\n", __func__);
   fclose(fp);
   do_sync_fs();
@@ -216,6 +256,16 @@ int is_signal_tracking_enabled() { return settings->signal_tracking; }
 
 int is_sms_logging_enabled() { return settings->sms_logging; }
 
+int is_packet_capture_enabled() { return settings->packet_capture; }
+
+uint8_t get_gps_suspend_policy() { return settings->gps_suspend_policy; }
+
+uint8_t get_gps_suspend_buffer_kb() { return settings->gps_suspend_buffer_kb; }
+
+uint16_t get_gps_rate_limit_ms() { return settings->gps_rate_limit_ms; }
+
+uint16_t get_sms_queue_size() { return settings->sms_queue_size; }
+
 int callwait_auto_hangup_operation_mode() {
   return settings->callwait_autohangup;
 }
@@ -305,3 +355,15 @@ void enable_call_waiting_autohangup(uint8_t en) {
   }
   write_settings_to_storage();
 }
+
+void enable_packet_capture(bool en) {
+  if (en) {
+    logger(MSG_WARN, "Enabling QMI packet capture\n");
+    settings->packet_capture = 1;
+  } else {
+    logger(MSG_WARN, "Disabling QMI packet capture\n");
+    settings->packet_capture = 0;
+  }
+  set_packet_capture_state(en);
+  write_settings_to_storage();
+}
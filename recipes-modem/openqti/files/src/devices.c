@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/devices.h"
+#include "../inc/logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Device emulation
+ *  Normally every path is used as is. When DEVICE_ROOT_ENV is set,
+ *  paths are resolved under that directory instead, so openqti can run
+ *  on a regular Linux host against tools/devemu: sysfs entries become
+ *  plain files, audio nodes can point to /dev/null, and the QMI, AT and
+ *  GPS ports are UNIX sockets. open_device() connects to those with
+ *  SOCK_SEQPACKET so QMI messages keep their boundaries, like they do
+ *  on the real SMD and USB ports.
+ *  Resolved paths are kept in a small table so callers can hold on to
+ *  the returned pointer.
+ */
+struct {
+  bool emulated;
+  pthread_mutex_t mutex;
+  char root[DEVICE_PATH_MAX];
+  int num_entries;
+  struct {
+    char *path;
+    char *resolved;
+  } map[DEVICE_MAP_SIZE];
+} device_rt = {
+    .emulated = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .num_entries = 0,
+};
+
+void init_device_root() {
+  const char *root = getenv(DEVICE_ROOT_ENV);
+  if (root == NULL || strlen(root) == 0)
+    return;
+
+  if (strlen(root) >= DEVICE_PATH_MAX / 2) {
+    logger(MSG_ERROR, "%s: %s is too long, ignoring it\n", __func__,
+           DEVICE_ROOT_ENV);
+    return;
+  }
+  strncpy(device_rt.root, root, DEVICE_PATH_MAX - 1);
+  /* Don't end up with "//dev/..." */
+  if (device_rt.root[strlen(device_rt.root) - 1] == '/')
+    device_rt.root[strlen(device_rt.root) - 1] = 0;
+  device_rt.emulated = true;
+  logger(MSG_WARN, "%s: Device emulation enabled, using devices from %s\n",
+         __func__, device_rt.root);
+}
+
+bool is_device_emulation() { return device_rt.emulated; }
+
+const char *get_device_path(const char *path) {
+  static __thread char overflow[DEVICE_PATH_MAX];
+  const char *resolved = NULL;
+  int i;
+
+  if (!device_rt.emulated || path == NULL)
+    return path;
+
+  pthread_mutex_lock(&device_rt.mutex);
+  for (i = 0; i < device_rt.num_entries; i++) {
+    if (strcmp(device_rt.map[i].path, path) == 0) {
+      resolved = device_rt.map[i].resolved;
+      break;
+    }
+  }
+  if (resolved == NULL && device_rt.num_entries < DEVICE_MAP_SIZE) {
+    i = device_rt.num_entries;
+    device_rt.map[i].path = strdup(path);
+    device_rt.map[i].resolved = malloc(DEVICE_PATH_MAX);
+    if (device_rt.map[i].path && device_rt.map[i].resolved) {
+      snprintf(device_rt.map[i].resolved, DEVICE_PATH_MAX, "%s%s",
+               device_rt.root, path);
+      resolved = device_rt.map[i].resolved;
+      device_rt.num_entries++;
+    } else {
+      free(device_rt.map[i].path);
+      free(device_rt.map[i].resolved);
+    }
+  }
+  pthread_mutex_unlock(&device_rt.mutex);
+
+  /* Never fall back to the real path of the host we're running in */
+  if (resolved == NULL) {
+    logger(MSG_WARN, "%s: Device map is full, %s is only valid until the next "
+                     "call\n",
+           __func__, path);
+    snprintf(overflow, sizeof(overflow), "%s%s", device_rt.root, path);
+    resolved = overflow;
+  }
+  return resolved;
+}
+
+/* Emulated ports are UNIX sockets, opening them fails with ENXIO */
+static int connect_emulated_device(const char *path, int flags) {
+  struct sockaddr_un addr;
+  int fd, type = SOCK_SEQPACKET;
+
+  if (flags & O_CLOEXEC)
+    type |= SOCK_CLOEXEC;
+  fd = socket(AF_UNIX, type, 0);
+  if (fd < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    logger(MSG_ERROR, "%s: Can't connect to %s: %s\n", __func__, path,
+           strerror(errno));
+    close(fd);
+    errno = ENODEV;
+    return -1;
+  }
+  if (flags & O_NONBLOCK)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+int open_device(const char *path, int flags) {
+  const char *resolved = get_device_path(path);
+  int fd = open(resolved, flags);
+  if (fd < 0 && errno == ENXIO && device_rt.emulated)
+    fd = connect_emulated_device(resolved, flags);
+  return fd;
+}
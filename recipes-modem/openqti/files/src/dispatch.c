@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/dispatch.h"
+#include "../inc/arena.h"
+#include "../inc/logger.h"
+#include "../inc/openqti.h"
+#include "../inc/qmi.h"
+#include "../inc/stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * QMI dispatch table
+ *  Handlers are registered for a (service, message, direction) tuple.
+ *  Exact matches live in a small open addressing hash table, and each
+ *  service has a fallback slot per direction for handlers registered
+ *  with QMI_MSGID_ANY, so finding the handler for a message never
+ *  depends on how many there are.
+ *  Every entry keeps how many times it ran and how long it took, so the
+ *  expensive message types can be spotted in a running modem. The proxy
+ *  thread updates those while the command thread reads and resets them,
+ *  so they're atomics.
+ *  Registration is expected to happen before the proxy starts moving
+ *  packets; the table is only read after that.
+ */
+struct dispatch_entry {
+  uint8_t service;
+  int32_t msgid;
+  uint8_t direction;
+  const char *name;
+  qmi_handler_fn handler;
+  _Atomic uint32_t calls;
+  _Atomic uint64_t total_ns;
+  _Atomic uint64_t max_ns;
+};
+
+struct {
+  pthread_mutex_t mutex;
+  int num_entries;
+  struct dispatch_entry entries[DISPATCH_MAX_HANDLERS];
+  /* Entry index + 1, 0 is empty */
+  uint8_t hash[DISPATCH_HASH_SIZE];
+  uint8_t any_msgid[DISPATCH_MAX_SERVICES][2];
+} dispatch_rt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .num_entries = 0,
+};
+
+static uint32_t dispatch_hash(uint8_t service, uint16_t msgid) {
+  uint32_t key = (service << 16) | msgid;
+  key *= 0x9e3779b1; // Fibonacci hashing, top bits are the best mixed
+  return key >> 25;  // 7 bits, DISPATCH_HASH_SIZE
+}
+
+static bool dispatch_dir_match(uint8_t a, uint8_t b) {
+  return a == b || a == QMI_DIR_ANY || b == QMI_DIR_ANY;
+}
+
+/* Returns the slot holding a handler for this message, or the empty
+ * slot where it would go */
+static uint8_t *dispatch_find_slot(uint8_t service, uint16_t msgid,
+                                   uint8_t direction) {
+  uint32_t pos = dispatch_hash(service, msgid);
+  struct dispatch_entry *entry;
+  uint8_t *slot;
+  int i;
+
+  for (i = 0; i < DISPATCH_HASH_SIZE; i++) {
+    slot = &dispatch_rt.hash[(pos + i) & (DISPATCH_HASH_SIZE - 1)];
+    if (*slot == 0)
+      return slot;
+    entry = &dispatch_rt.entries[*slot - 1];
+    if (entry->service == service && entry->msgid == msgid &&
+        dispatch_dir_match(entry->direction, direction))
+      return slot;
+  }
+  return NULL;
+}
+
+int register_qmi_handler(uint8_t service, int32_t msgid, uint8_t direction,
+                         const char *name, qmi_handler_fn handler) {
+  struct dispatch_entry *entry;
+  uint8_t *slots[2] = {NULL, NULL};
+  int ret = 0, i;
+  uint8_t idx;
+
+  if (handler == NULL ||
+      (msgid != QMI_MSGID_ANY && (msgid < 0 || msgid > 0xffff)) ||
+      (direction != FROM_DSP && direction != FROM_HOST &&
+       direction != QMI_DIR_ANY))
+    return -EINVAL;
+
+  pthread_mutex_lock(&dispatch_rt.mutex);
+  if (dispatch_rt.num_entries >= DISPATCH_MAX_HANDLERS) {
+    ret = -ENOSPC;
+    goto out;
+  }
+
+  if (msgid == QMI_MSGID_ANY) {
+    if (direction != FROM_HOST)
+      slots[0] = &dispatch_rt.any_msgid[service][FROM_DSP];
+    if (direction != FROM_DSP)
+      slots[1] = &dispatch_rt.any_msgid[service][FROM_HOST];
+  } else {
+    slots[0] = dispatch_find_slot(service, msgid, direction);
+    if (slots[0] == NULL) {
+      ret = -ENOSPC;
+      goto out;
+    }
+  }
+  for (i = 0; i < 2; i++) {
+    if (slots[i] && *slots[i] != 0) {
+      ret = -EEXIST;
+      goto out;
+    }
+  }
+
+  idx = dispatch_rt.num_entries;
+  entry = &dispatch_rt.entries[idx];
+  memset(entry, 0, sizeof(struct dispatch_entry));
+  entry->service = service;
+  entry->msgid = msgid;
+  entry->direction = direction;
+  entry->name = name;
+  entry->handler = handler;
+  for (i = 0; i < 2; i++) {
+    if (slots[i])
+      *slots[i] = idx + 1;
+  }
+  dispatch_rt.num_entries++;
+
+out:
+  pthread_mutex_unlock(&dispatch_rt.mutex);
+  if (ret < 0)
+    logger(MSG_ERROR, "%s: Can't register %s for 0x%.2x:0x%.4x: %s\n",
+           __func__, name, service, msgid & 0xffff, strerror(-ret));
+  return ret;
+}
+
+static struct dispatch_entry *dispatch_lookup(uint8_t source, uint8_t service,
+                                              uint16_t msgid) {
+  uint8_t *slot = dispatch_find_slot(service, msgid, source);
+
+  if (slot && *slot)
+    return &dispatch_rt.entries[*slot - 1];
+
+  if (dispatch_rt.any_msgid[service][source])
+    return &dispatch_rt.entries[dispatch_rt.any_msgid[service][source] - 1];
+
+  return NULL;
+}
+
+/*
+ * Runs the handler for this message, if there is one, and accounts for
+ * the time it took. Messages nobody cares about just pass through.
+ * Whatever the handler takes from the scratch arena is released here
+ */
+uint8_t dispatch_qmi_message(uint8_t source, uint8_t service, uint16_t msgid,
+                             uint8_t *pkt, size_t len, int adspfd, int usbfd) {
+  struct dispatch_entry *entry;
+  struct scratch_mark mark;
+  struct timespec start, end;
+  uint64_t elapsed, max;
+  uint8_t action;
+
+  if (source != FROM_DSP && source != FROM_HOST)
+    return PACKET_PASS_TRHU;
+
+  entry = dispatch_lookup(source, service, msgid);
+  if (entry == NULL)
+    return PACKET_PASS_TRHU;
+
+  mark = scratch_save();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  action = entry->handler(source, pkt, len, msgid, adspfd, usbfd);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  scratch_restore(mark);
+
+  elapsed = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+            (end.tv_nsec - start.tv_nsec);
+  stat_inc(entry->calls);
+  atomic_fetch_add_explicit(&entry->total_ns, elapsed, memory_order_relaxed);
+  max = stat_read(entry->max_ns);
+  while (elapsed > max &&
+         !atomic_compare_exchange_weak_explicit(&entry->max_ns, &max, elapsed,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+
+  return action;
+}
+
+/* Copies up to max entries into stats, returns how many were copied */
+int get_qmi_handler_stats(struct qmi_handler_stats *stats, int max) {
+  struct dispatch_entry *entry;
+  int i;
+
+  pthread_mutex_lock(&dispatch_rt.mutex);
+  for (i = 0; i < dispatch_rt.num_entries && i < max; i++) {
+    entry = &dispatch_rt.entries[i];
+    stats[i].name = entry->name;
+    stats[i].service = entry->service;
+    stats[i].msgid = entry->msgid;
+    stats[i].direction = entry->direction;
+    stats[i].calls = stat_read(entry->calls);
+    stats[i].total_ns = stat_read(entry->total_ns);
+    stats[i].max_ns = stat_read(entry->max_ns);
+  }
+  pthread_mutex_unlock(&dispatch_rt.mutex);
+  return i;
+}
+
+void reset_qmi_handler_stats() {
+  int i;
+  pthread_mutex_lock(&dispatch_rt.mutex);
+  for (i = 0; i < dispatch_rt.num_entries; i++) {
+    atomic_store_explicit(&dispatch_rt.entries[i].calls, 0,
+                          memory_order_relaxed);
+    atomic_store_explicit(&dispatch_rt.entries[i].total_ns, 0,
+                          memory_order_relaxed);
+    atomic_store_explicit(&dispatch_rt.entries[i].max_ns, 0,
+                          memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&dispatch_rt.mutex);
+}
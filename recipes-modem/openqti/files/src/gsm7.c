@@ -0,0 +1,614 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/gsm7.h"
+#include <string.h>
+
+/*
+ * GSM 7 bit default alphabet codec
+ *  Text is packed and unpacked through a 64 bit accumulator that is
+ *  written and refilled 32 bits at a time, instead of one septet at
+ *  a time. Characters are mapped with lookup tables both ways: the
+ *  ones in the extension table take an escape septet and the second
+ *  one is looked up separately.
+ *  UCS-2 user data doesn't need any of it, so it's copied as is and
+ *  only characters outside of ASCII take a detour through UTF-8.
+ */
+
+/* Define Non-Printable Characters as a question mark */
+#define NPC7 63
+#define NPC8 '?'
+/*
+https://github.com/legatoproject/legato-af/blob/master/components/modemServices/modemDaemon/smsPdu.c
+*/
+/****************************************************************************
+ * This lookup table converts from ISO-8859-1 8-bit ASCII to the
+ * 7 bit "default alphabet" as defined in ETSI GSM 03.38
+ *
+ * ISO-characters that don't have any corresponding character in the
+ * 7-bit alphabet is replaced with the NPC7-character.  If there's
+ * a close match between the ISO-char and a 7-bit character (for example
+ * the letter i with a circumflex and the plain i-character) a substitution
+ * is done.
+ *
+ * There are some character (for example the square brace "]") that must
+ * be converted into a 2 byte 7-bit sequence.  These characters are
+ * marked in the table by having 128 added to its value.
+ ****************************************************************************/
+static const uint8_t Ascii8to7[] = {
+    NPC7,         /*     0      null [NUL]                              */
+    NPC7,         /*     1      start of heading [SOH]                  */
+    NPC7,         /*     2      start of text [STX]                     */
+    NPC7,         /*     3      end of text [ETX]                       */
+    NPC7,         /*     4      end of transmission [EOT]               */
+    NPC7,         /*     5      enquiry [ENQ]                           */
+    NPC7,         /*     6      acknowledge [ACK]                       */
+    NPC7,         /*     7      bell [BEL]                              */
+    NPC7,         /*     8      backspace [BS]                          */
+    NPC7,         /*     9      horizontal tab [HT]                     */
+    10,           /*    10      line feed [LF]                          */
+    NPC7,         /*    11      vertical tab [VT]                       */
+    10 + 128,     /*    12      form feed [FF]                          */
+    13,           /*    13      carriage return [CR]                    */
+    NPC7,         /*    14      shift out [SO]                          */
+    NPC7,         /*    15      shift in [SI]                           */
+    NPC7,         /*    16      data link escape [DLE]                  */
+    NPC7,         /*    17      device control 1 [DC1]                  */
+    NPC7,         /*    18      device control 2 [DC2]                  */
+    NPC7,         /*    19      device control 3 [DC3]                  */
+    NPC7,         /*    20      device control 4 [DC4]                  */
+    NPC7,         /*    21      negative acknowledge [NAK]              */
+    NPC7,         /*    22      synchronous idle [SYN]                  */
+    NPC7,         /*    23      end of trans. block [ETB]               */
+    NPC7,         /*    24      cancel [CAN]                            */
+    NPC7,         /*    25      end of medium [EM]                      */
+    NPC7,         /*    26      substitute [SUB]                        */
+    NPC7,         /*    27      escape [ESC]                            */
+    NPC7,         /*    28      file separator [FS]                     */
+    NPC7,         /*    29      group separator [GS]                    */
+    NPC7,         /*    30      record separator [RS]                   */
+    NPC7,         /*    31      unit separator [US]                     */
+    32,           /*    32      space                                   */
+    33,           /*    33    ! exclamation mark                        */
+    34,           /*    34    " double quotation mark                   */
+    35,           /*    35    # number sign                             */
+    2,            /*    36    $ dollar sign                             */
+    37,           /*    37    % percent sign                            */
+    38,           /*    38    & ampersand                               */
+    39,           /*    39    ' apostrophe                              */
+    40,           /*    40    ( left parenthesis                        */
+    41,           /*    41    ) right parenthesis                       */
+    42,           /*    42    * asterisk                                */
+    43,           /*    43    + plus sign                               */
+    44,           /*    44    , comma                                   */
+    45,           /*    45    - hyphen                                  */
+    46,           /*    46    . period                                  */
+    47,           /*    47    / slash,                                  */
+    48,           /*    48    0 digit 0                                 */
+    49,           /*    49    1 digit 1                                 */
+    50,           /*    50    2 digit 2                                 */
+    51,           /*    51    3 digit 3                                 */
+    52,           /*    52    4 digit 4                                 */
+    53,           /*    53    5 digit 5                                 */
+    54,           /*    54    6 digit 6                                 */
+    55,           /*    55    7 digit 7                                 */
+    56,           /*    56    8 digit 8                                 */
+    57,           /*    57    9 digit 9                                 */
+    58,           /*    58    : colon                                   */
+    59,           /*    59    ; semicolon                               */
+    60,           /*    60    < less-than sign                          */
+    61,           /*    61    = equal sign                              */
+    62,           /*    62    > greater-than sign                       */
+    63,           /*    63    ? question mark                           */
+    0,            /*    64    @ commercial at sign                      */
+    65,           /*    65    A uppercase A                             */
+    66,           /*    66    B uppercase B                             */
+    67,           /*    67    C uppercase C                             */
+    68,           /*    68    D uppercase D                             */
+    69,           /*    69    E uppercase E                             */
+    70,           /*    70    F uppercase F                             */
+    71,           /*    71    G uppercase G                             */
+    72,           /*    72    H uppercase H                             */
+    73,           /*    73    I uppercase I                             */
+    74,           /*    74    J uppercase J                             */
+    75,           /*    75    K uppercase K                             */
+    76,           /*    76    L uppercase L                             */
+    77,           /*    77    M uppercase M                             */
+    78,           /*    78    N uppercase N                             */
+    79,           /*    79    O uppercase O                             */
+    80,           /*    80    P uppercase P                             */
+    81,           /*    81    Q uppercase Q                             */
+    82,           /*    82    R uppercase R                             */
+    83,           /*    83    S uppercase S                             */
+    84,           /*    84    T uppercase T                             */
+    85,           /*    85    U uppercase U                             */
+    86,           /*    86    V uppercase V                             */
+    87,           /*    87    W uppercase W                             */
+    88,           /*    88    X uppercase X                             */
+    89,           /*    89    Y uppercase Y                             */
+    90,           /*    90    Z uppercase Z                             */
+    60 + 128,     /*    91    [ left square bracket                     */
+    47 + 128,     /*    92    \ backslash                               */
+    62 + 128,     /*    93    ] right square bracket                    */
+    20 + 128,     /*    94    ^ circumflex accent                       */
+    17,           /*    95    _ underscore                              */
+    39,           /*    96    ` back apostrophe                         */
+    97,           /*    97    a lowercase a                             */
+    98,           /*    98    b lowercase b                             */
+    99,           /*    99    c lowercase c                             */
+    100,          /*   100    d lowercase d                             */
+    101,          /*   101    e lowercase e                             */
+    102,          /*   102    f lowercase f                             */
+    103,          /*   103    g lowercase g                             */
+    104,          /*   104    h lowercase h                             */
+    105,          /*   105    i lowercase i                             */
+    106,          /*   106    j lowercase j                             */
+    107,          /*   107    k lowercase k                             */
+    108,          /*   108    l lowercase l                             */
+    109,          /*   109    m lowercase m                             */
+    110,          /*   110    n lowercase n                             */
+    111,          /*   111    o lowercase o                             */
+    112,          /*   112    p lowercase p                             */
+    113,          /*   113    q lowercase q                             */
+    114,          /*   114    r lowercase r                             */
+    115,          /*   115    s lowercase s                             */
+    116,          /*   116    t lowercase t                             */
+    117,          /*   117    u lowercase u                             */
+    118,          /*   118    v lowercase v                             */
+    119,          /*   119    w lowercase w                             */
+    120,          /*   120    x lowercase x                             */
+    121,          /*   121    y lowercase y                             */
+    122,          /*   122    z lowercase z                             */
+    40 + 128,     /*   123    { left brace                              */
+    64 + 128,     /*   124    | vertical bar                            */
+    41 + 128,     /*   125    } right brace                             */
+    61 + 128,     /*   126    ~ tilde accent                            */
+    NPC7,         /*   127      delete [DEL]                            */
+    NPC7,         /*   128                                              */
+    NPC7,         /*   129                                              */
+    39,           /*   130      low left rising single quote            */
+    102,          /*   131      lowercase italic f                      */
+    34,           /*   132      low left rising double quote            */
+    NPC7,         /*   133      low horizontal ellipsis                 */
+    NPC7,         /*   134      dagger mark                             */
+    NPC7,         /*   135      double dagger mark                      */
+    NPC7,         /*   136      letter modifying circumflex             */
+    NPC7,         /*   137      per thousand (mille) sign               */
+    83,           /*   138      uppercase S caron or hacek              */
+    39,           /*   139      left single angle quote mark            */
+    214,          /*   140      uppercase OE ligature                   */
+    NPC7,         /*   141                                              */
+    NPC7,         /*   142                                              */
+    NPC7,         /*   143                                              */
+    NPC7,         /*   144                                              */
+    39,           /*   145      left single quotation mark              */
+    39,           /*   146      right single quote mark                 */
+    34,           /*   147      left double quotation mark              */
+    34,           /*   148      right double quote mark                 */
+    42,           /*   149      round filled bullet                     */
+    45,           /*   150      en dash                                 */
+    45,           /*   151      em dash                                 */
+    39,           /*   152      small spacing tilde accent              */
+    NPC7,         /*   153      trademark sign                          */
+    115,          /*   154      lowercase s caron or hacek              */
+    39,           /*   155      right single angle quote mark           */
+    111,          /*   156      lowercase oe ligature                   */
+    NPC7,         /*   157                                              */
+    NPC7,         /*   158                                              */
+    89,           /*   159      uppercase Y dieresis or umlaut          */
+    32,           /*   160      non-breaking space                      */
+    64,           /*   161    ¡ inverted exclamation mark               */
+    99,           /*   162    ¢ cent sign                               */
+    1,            /*   163    £ pound sterling sign                     */
+    36,           /*   164    € general currency sign                   */
+    3,            /*   165    ¥ yen sign                                */
+    33,           /*   166    Š broken vertical bar                     */
+    95,           /*   167    § section sign                            */
+    34,           /*   168    š spacing dieresis or umlaut              */
+    NPC7,         /*   169    © copyright sign                          */
+    NPC7,         /*   170    ª feminine ordinal indicator              */
+    60,           /*   171    « left (double) angle quote               */
+    NPC7,         /*   172    ¬ logical not sign                        */
+    45,           /*   173    ­ soft hyphen                             */
+    NPC7,         /*   174    ® registered trademark sign               */
+    NPC7,         /*   175    ¯ spacing macron (long) accent            */
+    NPC7,         /*   176    ° degree sign                             */
+    NPC7,         /*   177    ± plus-or-minus sign                      */
+    50,           /*   178    ² superscript 2                           */
+    51,           /*   179    ³ superscript 3                           */
+    39,           /*   180    Ž spacing acute accent                    */
+    117,          /*   181    µ micro sign                              */
+    NPC7,         /*   182    ¶ paragraph sign, pilcrow sign            */
+    NPC7,         /*   183    · middle dot, centered dot                */
+    NPC7,         /*   184    ž spacing cedilla                         */
+    49,           /*   185    ¹ superscript 1                           */
+    NPC7,         /*   186    º masculine ordinal indicator             */
+    62,           /*   187    » right (double) angle quote (guillemet)  */
+    NPC7,         /*   188    Œ fraction 1/4                            */
+    NPC7,         /*   189    œ fraction 1/2                            */
+    NPC7,         /*   190    Ÿ fraction 3/4                            */
+    96,           /*   191    ¿ inverted question mark                  */
+    65,           /*   192    À uppercase A grave                       */
+    65,           /*   193    Á uppercase A acute                       */
+    65,           /*   194    Â uppercase A circumflex                  */
+    65,           /*   195    Ã uppercase A tilde                       */
+    91,           /*   196    Ä uppercase A dieresis or umlaut          */
+    14,           /*   197    Å uppercase A ring                        */
+    28,           /*   198    Æ uppercase AE ligature                   */
+    9,            /*   199    Ç uppercase C cedilla                     */
+    31,           /*   200    È uppercase E grave                       */
+    31,           /*   201    É uppercase E acute                       */
+    31,           /*   202    Ê uppercase E circumflex                  */
+    31,           /*   203    Ë uppercase E dieresis or umlaut          */
+    73,           /*   204    Ì uppercase I grave                       */
+    73,           /*   205    Í uppercase I acute                       */
+    73,           /*   206    Î uppercase I circumflex                  */
+    73,           /*   207    Ï uppercase I dieresis or umlaut          */
+    68,           /*   208    Ð uppercase ETH                           */
+    93,           /*   209    Ñ uppercase N tilde                       */
+    79,           /*   210    Ò uppercase O grave                       */
+    79,           /*   211    Ó uppercase O acute                       */
+    79,           /*   212    Ô uppercase O circumflex                  */
+    79,           /*   213    Õ uppercase O tilde                       */
+    92,           /*   214    Ö uppercase O dieresis or umlaut          */
+    42,           /*   215    × multiplication sign                     */
+    11,           /*   216    Ø uppercase O slash                       */
+    85,           /*   217    Ù uppercase U grave                       */
+    85,           /*   218    Ú uppercase U acute                       */
+    85,           /*   219    Û uppercase U circumflex                  */
+    94,           /*   220    Ü uppercase U dieresis or umlaut          */
+    89,           /*   221    Ý uppercase Y acute                       */
+    NPC7,         /*   222    Þ uppercase THORN                         */
+    30,           /*   223    ß lowercase sharp s, sz ligature          */
+    127,          /*   224    à lowercase a grave                       */
+    97,           /*   225    á lowercase a acute                       */
+    97,           /*   226    â lowercase a circumflex                  */
+    97,           /*   227    ã lowercase a tilde                       */
+    123,          /*   228    ä lowercase a dieresis or umlaut          */
+    15,           /*   229    å lowercase a ring                        */
+    29,           /*   230    æ lowercase ae ligature                   */
+    9,            /*   231    ç lowercase c cedilla                     */
+    4,            /*   232    è lowercase e grave                       */
+    5,            /*   233    é lowercase e acute                       */
+    101,          /*   234    ê lowercase e circumflex                  */
+    101,          /*   235    ë lowercase e dieresis or umlaut          */
+    7,            /*   236    ì lowercase i grave                       */
+    7,            /*   237    í lowercase i acute                       */
+    105,          /*   238    î lowercase i circumflex                  */
+    105,          /*   239    ï lowercase i dieresis or umlaut          */
+    NPC7,         /*   240    ð lowercase eth                           */
+    125,          /*   241    ñ lowercase n tilde                       */
+    8,            /*   242    ò lowercase o grave                       */
+    111,          /*   243    ó lowercase o acute                       */
+    111,          /*   244    ô lowercase o circumflex                  */
+    111,          /*   245    õ lowercase o tilde                       */
+    24,           /*   246    ö lowercase o dieresis or umlaut          */
+    47,           /*   247    ÷ division sign                           */
+    12,           /*   248    ø lowercase o slash                       */
+    6,            /*   249    ù lowercase u grave                       */
+    117,          /*   250    ú lowercase u acute                       */
+    117,          /*   251    û lowercase u circumflex                  */
+    126,          /*   252    ü lowercase u dieresis or umlaut          */
+    121,          /*   253    ý lowercase y acute                       */
+    NPC7,         /*   254    þ lowercase thorn                         */
+    121           /*   255    ÿ lowercase y dieresis or umlaut          */
+};
+
+/*
+ * GSM 03.38 default alphabet to ISO-8859-1. Greek capitals have no
+ * equivalent, and a lone escape is shown as a space as the spec says
+ */
+static const uint8_t Gsm7toAscii[128] = {
+    '@',  163,  '$',  165,  232,  233,  249,  236,  /* 0x00 */
+    242,  199,  '\n', 216,  248,  '\r', 197,  229,  /* 0x08 */
+    NPC8, '_',  NPC8, NPC8, NPC8, NPC8, NPC8, NPC8, /* 0x10 */
+    NPC8, NPC8, NPC8, ' ',  198,  230,  223,  201,  /* 0x18 */
+    ' ',  '!',  '"',  '#',  164,  '%',  '&',  '\'', /* 0x20 */
+    '(',  ')',  '*',  '+',  ',',  '-',  '.',  '/',  /* 0x28 */
+    '0',  '1',  '2',  '3',  '4',  '5',  '6',  '7',  /* 0x30 */
+    '8',  '9',  ':',  ';',  '<',  '=',  '>',  '?',  /* 0x38 */
+    161,  'A',  'B',  'C',  'D',  'E',  'F',  'G',  /* 0x40 */
+    'H',  'I',  'J',  'K',  'L',  'M',  'N',  'O',  /* 0x48 */
+    'P',  'Q',  'R',  'S',  'T',  'U',  'V',  'W',  /* 0x50 */
+    'X',  'Y',  'Z',  196,  214,  209,  220,  167,  /* 0x58 */
+    191,  'a',  'b',  'c',  'd',  'e',  'f',  'g',  /* 0x60 */
+    'h',  'i',  'j',  'k',  'l',  'm',  'n',  'o',  /* 0x68 */
+    'p',  'q',  'r',  's',  't',  'u',  'v',  'w',  /* 0x70 */
+    'x',  'y',  'z',  228,  246,  241,  252,  224,  /* 0x78 */
+};
+
+/* Characters after an escape, 0 means use the default alphabet one */
+static const uint8_t Gsm7ExtToAscii[128] = {
+    [0x0a] = '\f', [0x14] = '^', [0x28] = '{', [0x29] = '}', [0x2f] = '\\',
+    [0x3c] = '[',  [0x3d] = '~', [0x3e] = ']', [0x40] = '|', [0x65] = 164,
+};
+
+static inline void store32le(uint8_t *p, uint32_t val) {
+  p[0] = val;
+  p[1] = val >> 8;
+  p[2] = val >> 16;
+  p[3] = val >> 24;
+}
+
+static inline uint32_t load32le(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Septets a character takes once converted, 2 if it needs an escape */
+int gsm7_char_len(uint8_t c) { return Ascii8to7[c] >= 128 ? 2 : 1; }
+
+/*
+ * Converts a string and packs it starting at first_septet. Whatever
+ * is in the buffer before it (the UDH) is left alone, the rest is
+ * overwritten. Returns the number of septets, first_septet included
+ */
+int ascii_to_gsm7(const uint8_t *text, uint8_t *out, int first_septet) {
+  size_t start = (size_t)first_septet * 7;
+  uint8_t *dst = out + start / 8;
+  int bits = start % 8;
+  int septets = first_septet;
+  uint64_t acc = 0;
+  uint8_t c;
+
+  if (bits > 0)
+    acc = *dst & ((1 << bits) - 1);
+  for (; *text != 0; text++) {
+    c = Ascii8to7[*text];
+    if (c >= 128) {
+      acc |= (uint64_t)GSM7_ESCAPE << bits;
+      bits += 7;
+      septets++;
+      c -= 128;
+    }
+    acc |= (uint64_t)c << bits;
+    bits += 7;
+    septets++;
+    if (bits >= 32) {
+      store32le(dst, acc);
+      dst += 4;
+      acc >>= 32;
+      bits -= 32;
+    }
+  }
+  for (; bits > 0; bits -= 8) {
+    *dst++ = acc;
+    acc >>= 8;
+  }
+  return septets;
+}
+
+/*
+ * Unpacks up to count septets starting at first_septet, one per byte.
+ * If the buffer ends halfway through a septet, what's left of it is
+ * returned too. Returns how many it got
+ */
+size_t gsm7_unpack(const uint8_t *in, size_t len, size_t first_septet,
+                   uint8_t *septets, size_t count) {
+  size_t pos = first_septet * 7 / 8;
+  size_t n = 0;
+  uint64_t acc;
+  int bits;
+
+  if (pos >= len)
+    return 0;
+  bits = 8 - (first_septet * 7) % 8;
+  acc = in[pos++] >> (8 - bits);
+  if (bits == 7 && count > 0) {
+    septets[n++] = acc;
+    acc = 0;
+    bits = 0;
+  }
+  /* 7 bytes are exactly 8 septets, so bits stays the same */
+  while (count - n >= 8 && len - pos >= 7) {
+    acc |= ((uint64_t)load32le(in + pos) |
+            (uint64_t)in[pos + 4] << 32 | (uint64_t)in[pos + 5] << 40 |
+            (uint64_t)in[pos + 6] << 48)
+           << bits;
+    pos += 7;
+    septets[n] = acc & 0x7f;
+    septets[n + 1] = (acc >> 7) & 0x7f;
+    septets[n + 2] = (acc >> 14) & 0x7f;
+    septets[n + 3] = (acc >> 21) & 0x7f;
+    septets[n + 4] = (acc >> 28) & 0x7f;
+    septets[n + 5] = (acc >> 35) & 0x7f;
+    septets[n + 6] = (acc >> 42) & 0x7f;
+    septets[n + 7] = (acc >> 49) & 0x7f;
+    acc >>= 56;
+    n += 8;
+  }
+  while (n < count) {
+    if (bits < 7) {
+      if (len - pos >= 4) {
+        acc |= (uint64_t)load32le(in + pos) << bits;
+        pos += 4;
+        bits += 32;
+      } else if (pos < len) {
+        acc |= (uint64_t)in[pos++] << bits;
+        bits += 8;
+      } else {
+        if (bits > 0)
+          septets[n++] = acc & 0x7f;
+        break;
+      }
+    }
+    septets[n++] = acc & 0x7f;
+    acc >>= 7;
+    bits -= 7;
+  }
+  return n;
+}
+
+/*
+ * Unpacks count septets from first_septet on and converts them to
+ * ISO-8859-1 in place. Escaped characters take one byte in the output,
+ * the rest of it is zeroed. Returns the number of septets read
+ */
+size_t gsm7_decode(const uint8_t *in, size_t len, size_t first_septet,
+                   char *out, size_t count) {
+  uint8_t *text = (uint8_t *)out;
+  size_t i, n = 0;
+  uint8_t c;
+
+  count = gsm7_unpack(in, len, first_septet, text, count);
+  if (memchr(text, GSM7_ESCAPE, count) == NULL) {
+    for (i = 0; i < count; i++)
+      text[i] = Gsm7toAscii[text[i]];
+    return count;
+  }
+  for (i = 0; i < count; i++) {
+    c = text[i];
+    if (c == GSM7_ESCAPE && i + 1 < count) {
+      c = text[++i];
+      text[n++] = Gsm7ExtToAscii[c] ? Gsm7ExtToAscii[c] : Gsm7toAscii[c];
+    } else {
+      text[n++] = Gsm7toAscii[c];
+    }
+  }
+  memset(text + n, 0, count - n);
+  return count;
+}
+
+int gsm7_to_ascii(const uint8_t *buffer, int buffer_length, char *output,
+                  int septets) {
+  if (buffer_length <= 0 || septets <= 0)
+    return 0;
+  return gsm7_decode(buffer, buffer_length, 0, output, septets);
+}
+
+/* Big endian UTF-16, invalid sequences become U+FFFD */
+size_t utf8_to_ucs2(const uint8_t *text, size_t len, uint8_t *out) {
+  size_t i = 0, n = 0;
+  uint32_t cp;
+  int extra;
+
+  while (i < len) {
+    cp = text[i++];
+    if (cp < 0x80) {
+      extra = 0;
+    } else if ((cp & 0xe0) == 0xc0) {
+      cp &= 0x1f;
+      extra = 1;
+    } else if ((cp & 0xf0) == 0xe0) {
+      cp &= 0x0f;
+      extra = 2;
+    } else if ((cp & 0xf8) == 0xf0) {
+      cp &= 0x07;
+      extra = 3;
+    } else {
+      cp = 0xfffd;
+      extra = 0;
+    }
+    for (; extra > 0 && i < len && (text[i] & 0xc0) == 0x80; extra--)
+      cp = (cp << 6) | (text[i++] & 0x3f);
+    if (extra > 0 || cp > 0x10ffff)
+      cp = 0xfffd;
+
+    if (cp >= 0x10000) {
+      cp -= 0x10000;
+      out[n++] = 0xd8 | ((cp >> 18) & 0x03);
+      out[n++] = (cp >> 10) & 0xff;
+      out[n++] = 0xdc | ((cp >> 8) & 0x03);
+      out[n++] = cp & 0xff;
+    } else {
+      out[n++] = cp >> 8;
+      out[n++] = cp & 0xff;
+    }
+  }
+  return n;
+}
+
+/*
+ * UCS-2 (or UTF-16) user data to a UTF-8 string. ASCII is copied
+ * straight, and it stops before a character that wouldn't fit.
+ * Returns the length of the string
+ */
+size_t ucs2_to_utf8(const uint8_t *in, size_t len, char *out,
+                    size_t out_size) {
+  size_t i, n = 0;
+  uint32_t cp, low;
+  size_t need;
+
+  if (out_size == 0)
+    return 0;
+  for (i = 0; i + 1 < len; i += 2) {
+    cp = (in[i] << 8) | in[i + 1];
+    if (cp < 0x80) {
+      if (n + 1 >= out_size)
+        break;
+      out[n++] = cp;
+      continue;
+    }
+    if (cp >= 0xd800 && cp < 0xe000) {
+      low = i + 3 < len ? (in[i + 2] << 8) | in[i + 3] : 0;
+      if (cp < 0xdc00 && low >= 0xdc00 && low < 0xe000) {
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        i += 2;
+      } else {
+        cp = 0xfffd;
+      }
+    }
+    need = cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+    if (n + need >= out_size)
+      break;
+    if (need == 2) {
+      out[n++] = 0xc0 | (cp >> 6);
+    } else if (need == 3) {
+      out[n++] = 0xe0 | (cp >> 12);
+      out[n++] = 0x80 | ((cp >> 6) & 0x3f);
+    } else {
+      out[n++] = 0xf0 | (cp >> 18);
+      out[n++] = 0x80 | ((cp >> 12) & 0x3f);
+      out[n++] = 0x80 | ((cp >> 6) & 0x3f);
+    }
+    out[n++] = 0x80 | (cp & 0x3f);
+  }
+  out[n] = 0;
+  return n;
+}
+
+int get_dcs_alphabet(uint8_t dcs) {
+  /* General data coding, with or without automatic deletion */
+  if ((dcs & 0x80) == 0) {
+    switch ((dcs >> 2) & 0x03) {
+    case 1:
+      return SMS_ALPHABET_8BIT;
+    case 2:
+      return SMS_ALPHABET_UCS2;
+    default:
+      return SMS_ALPHABET_GSM7;
+    }
+  }
+  if ((dcs & 0xf0) == 0xe0) // Message waiting indication, UCS-2
+    return SMS_ALPHABET_UCS2;
+  if ((dcs & 0xf0) == 0xf0) // Data coding / message class
+    return (dcs & 0x04) ? SMS_ALPHABET_8BIT : SMS_ALPHABET_GSM7;
+  return SMS_ALPHABET_GSM7;
+}
+
+/*
+ * Turns the user data of a message into a string, whatever its data
+ * coding scheme. udl is the TP-UDL: septets for GSM-7, octets for the
+ * rest. Returns the length of the string
+ */
+size_t decode_user_data(uint8_t dcs, const uint8_t *ud, size_t ud_len,
+                        uint8_t udl, char *out, size_t out_size) {
+  size_t count;
+
+  if (out_size == 0)
+    return 0;
+  switch (get_dcs_alphabet(dcs)) {
+  case SMS_ALPHABET_UCS2:
+    return ucs2_to_utf8(ud, udl < ud_len ? udl : ud_len, out, out_size);
+  case SMS_ALPHABET_8BIT:
+    count = udl < ud_len ? udl : ud_len;
+    if (count > out_size - 1)
+      count = out_size - 1;
+    memcpy(out, ud, count);
+    out[count] = 0;
+    return count;
+  default:
+    count = udl < out_size - 1 ? udl : out_size - 1;
+    count = gsm7_to_ascii(ud, ud_len, out, count);
+    out[count] = 0;
+    return strlen(out);
+  }
+}
@@ -2,6 +2,7 @@
 
 #include "../inc/helpers.h"
 #include "../inc/adspfw.h"
+#include "../inc/atchannel.h"
 #include "../inc/atfwd.h"
 #include "../inc/audio.h"
 #include "../inc/devices.h"
@@ -17,6 +18,7 @@
 #include <linux/input.h>
 #include <linux/reboot.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
@@ -26,7 +28,7 @@
 
 int write_to(const char *path, const char *val, int flags) {
   int ret;
-  int fd = open(path, flags);
+  int fd = open_device(path, flags);
   if (fd < 0) {
     return -ENOENT;
   }
@@ -46,7 +48,7 @@ uint32_t get_curr_timestamp() {
 int is_adb_enabled() {
   int fd;
   char buff[32];
-  fd = open("/dev/mtdblock12", O_RDONLY);
+  fd = open_device("/dev/mtdblock12", O_RDONLY);
   if (fd < 0) {
     logger(MSG_ERROR, "%s: Error opening the misc partition \n", __func__);
     return 1;
@@ -76,7 +78,7 @@ void store_adb_setting(bool en) {
   } else {
     logger(MSG_WARN, "Disabling persistent ADB\n");
   }
-  fd = open("/dev/mtdblock12", O_RDWR);
+  fd = open_device("/dev/mtdblock12", O_RDWR);
   if (fd < 0) {
     logger(MSG_ERROR, "%s: Error opening misc partition to set adb flag \n",
            __func__);
@@ -92,7 +94,7 @@ void store_adb_setting(bool en) {
 int get_audio_mode() {
   int fd;
   char buff[32];
-  fd = open("/dev/mtdblock12", O_RDONLY);
+  fd = open_device("/dev/mtdblock12", O_RDONLY);
   if (fd < 0) {
     logger(MSG_ERROR, "%s: Error opening the misc partition \n", __func__);
     return AUDIO_MODE_I2S;
@@ -122,7 +124,7 @@ void store_audio_output_mode(uint8_t mode) {
   } else {
     logger(MSG_WARN, "Disabling USB audio\n");
   }
-  fd = open("/dev/mtdblock12", O_RDWR);
+  fd = open_device("/dev/mtdblock12", O_RDWR);
   if (fd < 0) {
     logger(MSG_ERROR,
            "%s: Error opening misc partition to set audio output flag \n",
@@ -230,7 +232,7 @@ void prepare_dtr_gpio() {
 uint8_t get_dtr_state() {
   int dtr, ret;
   char dtrval;
-  dtr = open(get_gpio_value_path(GPIO_DTR), O_RDONLY | O_NONBLOCK);
+  dtr = open_device(get_gpio_value_path(GPIO_DTR), O_RDONLY | O_NONBLOCK);
   if (dtr < 0) {
     logger(MSG_WARN, "%s: DTR not available: %s \n", __func__,
            get_gpio_value_path(GPIO_DTR));
@@ -314,7 +316,7 @@ void *power_key_event() {
   memset(&prev, 0, sizeof(struct timeval));
   memset(&cur, 0, sizeof(struct timeval));
 
-  fd = open(INPUT_DEV, O_RDONLY);
+  fd = open_device(INPUT_DEV, O_RDONLY);
   if (fd == -1) {
     logger(MSG_ERROR, "%s: Error opening %s\n", __func__, INPUT_DEV);
     return NULL;
@@ -379,88 +381,99 @@ int read_adsp_version() {
   return element;
 }
 
-int wipe_message_storage() {
-  int fd, sz, i;
-  char command[128];
+/*
+ * Fallback for firmwares rejecting the delete-all flag: one index at a
+ * time, each queued from the callback of the previous one so the AT
+ * queue never fills up and nobody has to wait for it
+ */
+static void wipe_message_index_cb(int result, char *response, size_t len,
+                                  void *data) {
+  int index = (intptr_t)data;
+  char command[32];
+  int sz;
+
+  if (result == AT_RESULT_IO_ERROR) {
+    logger(MSG_ERROR, "%s: Cannot talk to %s\n", __func__, SMD_SEC_AT);
+    return;
+  }
 
-  logger(MSG_INFO, "%s: Wiping message storage\n", __func__);
-  fd = open(SMD_SEC_AT, O_RDWR);
-  if (fd < 0) {
-    logger(MSG_ERROR, "%s: Cannot open SMD10 entry\n", __func__);
-    return -EINVAL;
+  if (++index > MSG_STORAGE_MAX_INDEX) {
+    logger(MSG_INFO, "%s: Message storage cleared\n", __func__);
+    return;
   }
 
-  for (i = 0; i <= 100; i++) {
-    sz = snprintf(command, 128, "%s%i\r\n", MSG_DELETE_PARTIAL_CMD, i);
-    if (write(fd, command, sz) < 0)
-      logger(MSG_ERROR, "%s: Error writing wipe cmd %i\n", __func__, i);
-    usleep(100000);
+  sz = snprintf(command, sizeof(command), "%s%i\r\n", MSG_DELETE_PARTIAL_CMD,
+                index);
+  if (at_send_async(command, sz, AT_DEFAULT_TIMEOUT_MS, wipe_message_index_cb,
+                    (void *)(intptr_t)index) < 0) {
+    logger(MSG_ERROR, "%s: Can't queue deletion of message %i\n", __func__,
+           index);
+  }
+}
+
+static void wipe_message_storage_cb(int result, char *response, size_t len,
+                                    void *data) {
+  switch (result) {
+  case AT_RESULT_OK:
+    logger(MSG_INFO, "%s: Message storage cleared\n", __func__);
+    break;
+  case AT_RESULT_IO_ERROR:
+    logger(MSG_ERROR, "%s: Cannot talk to %s\n", __func__, SMD_SEC_AT);
+    break;
+  default:
+    logger(MSG_WARN, "%s: Bulk delete failed, deleting one by one\n",
+           __func__);
+    wipe_message_index_cb(AT_RESULT_OK, NULL, 0, (void *)(intptr_t)-1);
+    break;
+  }
+}
+
+/* Doesn't wait for the modem, the callbacks log the outcome */
+int wipe_message_storage() {
+  logger(MSG_INFO, "%s: Wiping message storage\n", __func__);
+  if (at_send_async(MSG_DELETE_ALL_CMD, strlen(MSG_DELETE_ALL_CMD),
+                    AT_DEFAULT_TIMEOUT_MS, wipe_message_storage_cb,
+                    NULL) < 0) {
+    logger(MSG_ERROR, "%s: Can't queue %s\n", __func__, MSG_DELETE_ALL_CMD);
+    return -EINVAL;
   }
-  close(fd);
-  logger(MSG_INFO, "%s: Message storage cleared\n", __func__);
 
   return 0;
 }
 
-void add_message_to_queue(uint8_t *message, size_t len) {
+/* Returns -ENOSPC if the SMS queue is full */
+int add_message_to_queue(uint8_t *message, size_t len) {
   if (len <= 0) {
     logger(MSG_ERROR, "%s: Can't parse message, size is %i\n", __func__, len);
-    return;
+    return -EINVAL;
   }
 
   if (get_call_simulation_mode()) {
     add_voice_message_to_queue(message, len);
-  } else {
-    add_sms_to_queue(message, len);
+    return 0;
   }
+  return add_sms_to_queue(message, len);
 }
 
-bool at_if_in_use = false;
+/*
+ * Blocking helper for threads that can afford to wait for the modem.
+ * Don't use it from the proxy threads, use at_send_async() there
+ */
 int send_at_command(char *at_command, size_t cmdlen, char *response,
                     size_t response_sz) {
-  int fd, ret;
-  fd_set readfds;
-  struct timeval tv;
-
-  if (at_if_in_use) {
-    logger(MSG_ERROR, "%s: AT Interface is already in use\n", __func__);
-    return -EAGAIN;
-  }
-
-  at_if_in_use = true;
-  fd = open(SMD_SEC_AT, O_RDWR);
-  if (fd < 0) {
-    logger(MSG_ERROR, "%s: Cannot open %s\n", __func__, SMD_SEC_AT);
-    at_if_in_use = false;
-    return -EINVAL;
-  }
-
+  int ret;
   logger(MSG_DEBUG, "%s: Sending %s\n", __func__, at_command);
-  ret = write(fd, at_command, cmdlen);
-  if (ret < 0) {
-    logger(MSG_ERROR, "%s: Failed to write to %s\n", __func__, SMD_SEC_AT);
-    at_if_in_use = false;
-    return -EIO;
-  }
-  tv.tv_sec = 1;
-  tv.tv_usec = 500000;
-  FD_ZERO(&readfds);
-  FD_SET(fd, &readfds);
-  ret = select(MAX_FD, &readfds, NULL, NULL, &tv);
-  if (FD_ISSET(fd, &readfds)) {
-    ret = read(fd, response, response_sz);
-    if (ret < 0) {
-      logger(MSG_ERROR, "%s: Failed to read from %s\n", __func__, SMD_SEC_AT);
-      at_if_in_use = false;
-      close(fd);
-      return -EIO;
-    }
-  } else {
+  ret = at_send_sync(at_command, cmdlen, response, response_sz,
+                     AT_DEFAULT_TIMEOUT_MS);
+  if (ret == -ETIMEDOUT) {
     logger(MSG_ERROR, "%s: No response in time from %s\n", __func__,
            SMD_SEC_AT);
+    return ret;
+  } else if (ret < 0) {
+    logger(MSG_ERROR, "%s: Sending %s failed: %i\n", __func__, at_command,
+           ret);
+    return ret;
   }
-  at_if_in_use = false;
   logger(MSG_DEBUG, "%s: Received %s\n", __func__, response);
-  close(fd);
   return 0;
 }
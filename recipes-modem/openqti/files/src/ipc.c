@@ -224,7 +224,7 @@ int init_port_mapper_internal() {
     logger(MSG_ERROR, "IOCTL to the IPC1 socket failed \n");
   }
 
-  dpmfd = open(DPM_CTL, O_RDWR);
+  dpmfd = open_device(DPM_CTL, O_RDWR);
   if (dpmfd < 0) {
     logger(MSG_ERROR, "Error opening %s \n", DPM_CTL);
     return -EINVAL;
@@ -309,7 +309,7 @@ int init_port_mapper() {
     logger(MSG_ERROR, "IOCTL to the IPC1 socket failed \n");
   }
 
-  dpmfd = open(DPM_CTL, O_RDWR);
+  dpmfd = open_device(DPM_CTL, O_RDWR);
   if (dpmfd < 0) {
     logger(MSG_ERROR, "Error opening %s \n", DPM_CTL);
     return -EINVAL;
@@ -1,10 +1,18 @@
 // SPDX-License-Identifier: MIT
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "../inc/call.h"
 #include "../inc/config.h"
@@ -16,6 +24,51 @@ bool log_to_file = true;
 uint8_t log_level = 0;
 struct timespec startup_time;
 
+/*
+ * Log ring
+ *  Producers format their line straight into a slot of a bounded
+ *  multi-producer ring (Vyukov style: every slot carries a sequence
+ *  number telling whether it's free or ready) and return. They never
+ *  block and never touch the filesystem: if the ring is full the line
+ *  is dropped and counted.
+ *  A single writer thread drains the ring, batching everything ready
+ *  into one writev() per log file, on fds that stay open until the
+ *  log destination changes.
+ */
+struct log_slot {
+  atomic_uint seq;
+  uint8_t target;
+  uint16_t len;
+  char data[LOG_SLOT_SIZE];
+};
+
+struct {
+  struct log_slot slots[LOG_RING_SLOTS];
+  atomic_uint head;        // Next slot to be claimed by a producer
+  unsigned int tail;       // Next slot to be written, writer side only
+  atomic_uint dropped;     // Lines lost because the ring was full
+  unsigned int dropped_reported;
+  atomic_int writer_idle;  // Writer is (about to be) sleeping
+  int wake_evfd;
+  pthread_once_t once;
+  pthread_mutex_t drain_mutex;
+  int fd[LOG_TARGET_MAX];
+  int fd_persist[LOG_TARGET_MAX];
+} log_ring = {
+    .once = PTHREAD_ONCE_INIT,
+    .drain_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake_evfd = -1,
+    .fd = {-1, -1},
+    .fd_persist = {-1, -1},
+};
+
+static const char *log_paths[LOG_TARGET_MAX][2] = {
+    {VOLATILE_LOGPATH, PERSISTENT_LOGPATH},
+    {VOLATILE_THERMAL_LOGFILE, PERSISTENT_THERMAL_LOGFILE},
+};
+
+static const char log_level_tag[] = {'D', 'I', 'W', 'E'};
+
 void reset_logtime() { clock_gettime(CLOCK_MONOTONIC, &startup_time); }
 
 void set_log_method(bool ttyout) {
@@ -34,6 +87,8 @@ void set_log_level(uint8_t level) {
 
 uint8_t get_log_level() { return log_level; }
 
+uint32_t get_log_dropped_count() { return atomic_load(&log_ring.dropped); }
+
 double get_elapsed_time() {
   struct timespec current_time;
   clock_gettime(CLOCK_MONOTONIC, &current_time);
@@ -42,161 +97,252 @@ double get_elapsed_time() {
          1e9; // in seconds
 }
 
-void logger(uint8_t level, char *format, ...) {
-  FILE *fd;
-  va_list args;
-  double elapsed_time;
-  struct timespec current_time;
-  int persist = use_persistent_logging();
-  clock_gettime(CLOCK_MONOTONIC, &current_time);
-  elapsed_time = (((current_time.tv_sec - startup_time.tv_sec) * 1e9) +
-                  (current_time.tv_nsec - startup_time.tv_nsec)) /
-                 1e9; // in seconds
+/* Get the fd for a target, (re)opening it if the destination changed */
+static int log_get_fd(uint8_t target) {
+  int persist;
+  if (!log_to_file)
+    return STDOUT_FILENO;
 
-  if (level >= log_level) {
-    if (!log_to_file) {
-      fd = stdout;
-    } else {
-      if (persist) {
-        fd = fopen(PERSISTENT_LOGPATH, "a");
-      } else {
-        fd = fopen(VOLATILE_LOGPATH, "a");
-      }
-      if (fd < 0) {
-        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-        fd = stdout;
-      }
+  persist = use_persistent_logging() ? 1 : 0;
+  if (log_ring.fd[target] >= 0 && log_ring.fd_persist[target] == persist)
+    return log_ring.fd[target];
+
+  if (log_ring.fd[target] >= 0)
+    close(log_ring.fd[target]);
+
+  log_ring.fd[target] = open(log_paths[target][persist],
+                             O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  log_ring.fd_persist[target] = persist;
+  if (log_ring.fd[target] < 0) {
+    fprintf(stderr, "[%s] Error opening logfile \n", __func__);
+    return STDOUT_FILENO;
+  }
+  return log_ring.fd[target];
+}
+
+static void log_writev(uint8_t target, struct iovec *iov, int count) {
+  if (count > 0 && writev(log_get_fd(target), iov, count) < 0) {
+    fprintf(stderr, "[%s] Error writing to the logfile \n", __func__);
+  }
+}
+
+/* Write out everything that's ready. Returns the number of lines */
+static int log_drain() {
+  struct iovec iov[LOG_TARGET_MAX][LOG_WRITE_BATCH];
+  int iovcnt[LOG_TARGET_MAX];
+  char drop_msg[96];
+  struct log_slot *slot;
+  unsigned int i, count, dropped, total = 0;
+  uint8_t target;
+
+  pthread_mutex_lock(&log_ring.drain_mutex);
+  do {
+    memset(iovcnt, 0, sizeof(iovcnt));
+    dropped = atomic_load(&log_ring.dropped);
+    if (dropped != log_ring.dropped_reported) {
+      iov[LOG_TARGET_MAIN][0].iov_base = drop_msg;
+      iov[LOG_TARGET_MAIN][0].iov_len =
+          snprintf(drop_msg, sizeof(drop_msg),
+                   "[%.4f] W logger: %u lines dropped, ring was full\n",
+                   get_elapsed_time(), dropped - log_ring.dropped_reported);
+      iovcnt[LOG_TARGET_MAIN] = 1;
+      log_ring.dropped_reported = dropped;
     }
 
-    switch (level) {
-    case 0:
-      fprintf(fd, "[%.4f] D ", elapsed_time);
-      break;
-    case 1:
-      fprintf(fd, "[%.4f] I ", elapsed_time);
-      break;
-    case 2:
-      fprintf(fd, "[%.4f] W ", elapsed_time);
-      break;
-    default:
-      fprintf(fd, "[%.4f] E ", elapsed_time);
-      break;
+    for (count = 0; count < LOG_WRITE_BATCH - 1; count++) {
+      slot = &log_ring.slots[(log_ring.tail + count) & (LOG_RING_SLOTS - 1)];
+      if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+          log_ring.tail + count + 1)
+        break;
+      target = slot->target;
+      iov[target][iovcnt[target]].iov_base = slot->data;
+      iov[target][iovcnt[target]].iov_len = slot->len;
+      iovcnt[target]++;
     }
-    va_start(args, format);
-    vfprintf(fd, format, args);
-    va_end(args);
-    fflush(fd);
-    if (fd != stdout) {
-      fclose(fd);
+
+    for (target = 0; target < LOG_TARGET_MAX; target++)
+      log_writev(target, iov[target], iovcnt[target]);
+
+    /* Only now hand the slots back to the producers */
+    for (i = 0; i < count; i++) {
+      slot = &log_ring.slots[log_ring.tail & (LOG_RING_SLOTS - 1)];
+      atomic_store_explicit(&slot->seq, log_ring.tail + LOG_RING_SLOTS,
+                            memory_order_release);
+      log_ring.tail++;
+    }
+    total += count;
+  } while (count == LOG_WRITE_BATCH - 1);
+  pthread_mutex_unlock(&log_ring.drain_mutex);
+
+  return total;
+}
+
+static bool log_ring_has_data() {
+  struct log_slot *slot = &log_ring.slots[log_ring.tail & (LOG_RING_SLOTS - 1)];
+  return atomic_load(&slot->seq) == log_ring.tail + 1 ||
+         atomic_load(&log_ring.dropped) != log_ring.dropped_reported;
+}
+
+static void *log_writer_thread() {
+  struct pollfd pfd;
+  uint64_t val;
+
+  while (1) {
+    log_drain();
+
+    /* Tell producers to wake us up, then check again before sleeping */
+    atomic_exchange(&log_ring.writer_idle, 1);
+    if (log_ring_has_data()) {
+      atomic_store(&log_ring.writer_idle, 0);
+      continue;
+    }
+    pfd.fd = log_ring.wake_evfd;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, LOG_WRITER_MAX_SLEEP_MS);
+    atomic_store(&log_ring.writer_idle, 0);
+    if (read(log_ring.wake_evfd, &val, sizeof(val)) < 0) {
+      // Timed out, nothing to drain
     }
   }
+  return NULL;
 }
 
-void log_thermal_status(uint8_t level, char *format, ...) {
-  FILE *fd;
-  va_list args;
-  double elapsed_time;
-  struct timespec current_time;
-  int persist = use_persistent_logging();
-  clock_gettime(CLOCK_MONOTONIC, &current_time);
-  elapsed_time = (((current_time.tv_sec - startup_time.tv_sec) * 1e9) +
-                  (current_time.tv_nsec - startup_time.tv_nsec)) /
-                 1e9; // in seconds
+/* Make sure everything queued so far reaches the log */
+void flush_log() { log_drain(); }
 
-  if (level >= log_level) {
-    if (!log_to_file) {
-      fd = stdout;
+static void log_ring_init() {
+  pthread_t writer;
+  int i;
+  for (i = 0; i < LOG_RING_SLOTS; i++)
+    atomic_init(&log_ring.slots[i].seq, i);
+  atomic_init(&log_ring.head, 0);
+  log_ring.tail = 0;
+
+  log_ring.wake_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (log_ring.wake_evfd < 0 ||
+      pthread_create(&writer, NULL, &log_writer_thread, NULL) != 0) {
+    fprintf(stderr, "[%s] Can't start the log writer thread\n", __func__);
+  } else {
+    pthread_detach(writer);
+  }
+  atexit(flush_log);
+}
+
+/* Claim a free slot, or NULL if the ring is full */
+static struct log_slot *log_claim_slot(unsigned int *pos) {
+  struct log_slot *slot;
+  unsigned int seq;
+  int diff;
+
+  pthread_once(&log_ring.once, log_ring_init);
+  *pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+  while (1) {
+    slot = &log_ring.slots[*pos & (LOG_RING_SLOTS - 1)];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (int)(seq - *pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&log_ring.head, pos, *pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        return slot;
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit(&log_ring.dropped, 1, memory_order_relaxed);
+      return NULL;
     } else {
-      if (persist) {
-        fd = fopen(PERSISTENT_THERMAL_LOGFILE, "a");
-      } else {
-        fd = fopen(VOLATILE_THERMAL_LOGFILE, "a");
-      }
-      if (fd < 0) {
-        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-        fd = stdout;
-      }
+      *pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
     }
+  }
+}
 
-    switch (level) {
-    case 0:
-      fprintf(fd, "[%.4f] D ", elapsed_time);
-      break;
-    case 1:
-      fprintf(fd, "[%.4f] I ", elapsed_time);
-      break;
-    case 2:
-      fprintf(fd, "[%.4f] W ", elapsed_time);
-      break;
-    default:
-      fprintf(fd, "[%.4f] E ", elapsed_time);
-      break;
+static void log_commit_slot(struct log_slot *slot, unsigned int pos) {
+  uint64_t val = 1;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  /* Only pay for the syscall if the writer is asleep */
+  if (atomic_exchange(&log_ring.writer_idle, 0) == 1) {
+    if (write(log_ring.wake_evfd, &val, sizeof(val)) < 0) {
+      // The writer will pick it up on its next timeout anyway
     }
+  }
+}
+
+static void log_vprintf(uint8_t target, uint8_t level, char *format,
+                        va_list args) {
+  struct log_slot *slot;
+  unsigned int pos;
+  int len, ret;
+
+  slot = log_claim_slot(&pos);
+  if (slot == NULL)
+    return;
+
+  len = snprintf(slot->data, LOG_SLOT_SIZE, "[%.4f] %c ", get_elapsed_time(),
+                 log_level_tag[level > 3 ? 3 : level]);
+  ret = vsnprintf(slot->data + len, LOG_SLOT_SIZE - len, format, args);
+  if (ret > 0)
+    len += ret;
+  if (len >= LOG_SLOT_SIZE) { // Truncated, but keep the line ending
+    len = LOG_SLOT_SIZE - 1;
+    slot->data[len - 1] = '\n';
+  }
+  slot->target = target;
+  slot->len = len;
+  log_commit_slot(slot, pos);
+}
+
+void logger(uint8_t level, char *format, ...) {
+  va_list args;
+  if (level >= log_level) {
     va_start(args, format);
-    vfprintf(fd, format, args);
+    log_vprintf(LOG_TARGET_MAIN, level, format, args);
     va_end(args);
-    fflush(fd);
-    if (fd != stdout) {
-      fclose(fd);
-    }
   }
 }
+
+void log_thermal_status(uint8_t level, char *format, ...) {
+  va_list args;
+  if (level >= log_level) {
+    va_start(args, format);
+    log_vprintf(log_to_file ? LOG_TARGET_THERMAL : LOG_TARGET_MAIN, level,
+                format, args);
+    va_end(args);
+  }
+}
+
+/* Hex dumps are split in as many lines (slots) as needed */
+static void log_hexdump(char *prefix, uint8_t *buf, int pktsize) {
+  static const char hex[] = "0123456789abcdef";
+  struct log_slot *slot;
+  unsigned int pos;
+  int i = 0, len;
+
+  do {
+    slot = log_claim_slot(&pos);
+    if (slot == NULL)
+      return;
+    len = snprintf(slot->data, LOG_SLOT_SIZE, "%s :", prefix);
+    for (; i < pktsize && len + 6 < LOG_SLOT_SIZE; i++) {
+      slot->data[len++] = '0';
+      slot->data[len++] = 'x';
+      slot->data[len++] = hex[buf[i] >> 4];
+      slot->data[len++] = hex[buf[i] & 0x0f];
+      slot->data[len++] = ' ';
+    }
+    slot->data[len++] = '\n';
+    slot->target = LOG_TARGET_MAIN;
+    slot->len = len;
+    log_commit_slot(slot, pos);
+  } while (i < pktsize);
+}
+
 void dump_packet(char *direction, uint8_t *buf, int pktsize) {
-  int i;
-  FILE *fd;
-  int persist = use_persistent_logging();
   if (log_level == 0) {
-    if (!log_to_file) {
-      fd = stdout;
-    } else {
-      if (persist) {
-        fd = fopen(PERSISTENT_LOGPATH, "a");
-      } else {
-        fd = fopen(VOLATILE_LOGPATH, "a");
-      }
-      if (fd < 0) {
-        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-        fd = stdout;
-      }
-    }
-    fprintf(fd, "%s :", direction);
-    for (i = 0; i < pktsize; i++) {
-      fprintf(fd, "0x%02x ", buf[i]);
-    }
-    fprintf(fd, "\n");
-    if (fd != stdout) {
-      fclose(fd);
-    }
+    log_hexdump(direction, buf, pktsize);
   }
 }
 
 void dump_pkt_raw(uint8_t *buf, int pktsize) {
-  int i;
-  FILE *fd;
-  int persist = use_persistent_logging();
   if (log_level == 0) {
-
-    if (!log_to_file) {
-      fd = stdout;
-    } else {
-      if (persist) {
-        fd = fopen(PERSISTENT_LOGPATH, "a");
-      } else {
-        fd = fopen(VOLATILE_LOGPATH, "a");
-      }
-      if (fd < 0) {
-        fprintf(stderr, "[%s] Error opening logfile \n", __func__);
-        fd = stdout;
-      }
-    }
-    fprintf(fd, "RAW :");
-    for (i = 0; i < pktsize; i++) {
-      fprintf(fd, "0x%02x ", buf[i]);
-    }
-    fprintf(fd, "\n");
-    if (fd != stdout) {
-      fclose(fd);
-    }
+    log_hexdump("RAW", buf, pktsize);
   }
 }
 
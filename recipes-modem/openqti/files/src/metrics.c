@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/metrics.h"
+#include "../inc/cell.h"
+#include "../inc/logger.h"
+#include "../inc/proxy.h"
+#include "../inc/scheduler.h"
+#include "../inc/sms.h"
+#include "../inc/stats.h"
+#include "../inc/thermal.h"
+#include "../inc/tracking.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Metrics page
+ *  Snapshots are built off the page and copied in at once, so the
+ *  sequence counter is only odd for the duration of a memcpy. This
+ *  thread is the only writer.
+ */
+struct {
+  struct openqti_metrics *page;
+  struct openqti_metrics snapshot;
+} metrics_rt;
+
+int init_metrics() {
+  size_t size = sysconf(_SC_PAGESIZE);
+  void *map;
+  int fd;
+
+  if (size < sizeof(struct openqti_metrics))
+    size = sizeof(struct openqti_metrics);
+
+  fd = open(METRICS_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    logger(MSG_ERROR, "%s: Can't open %s: %s\n", __func__, METRICS_PATH,
+           strerror(errno));
+    return -EINVAL;
+  }
+  /* Clear anything a previous instance left behind */
+  if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+    logger(MSG_ERROR, "%s: Can't resize %s: %s\n", __func__, METRICS_PATH,
+           strerror(errno));
+    close(fd);
+    return -EINVAL;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    logger(MSG_ERROR, "%s: Can't map %s: %s\n", __func__, METRICS_PATH,
+           strerror(errno));
+    return -ENOMEM;
+  }
+
+  metrics_rt.page = map;
+  metrics_rt.snapshot.magic = METRICS_MAGIC;
+  metrics_rt.snapshot.version = METRICS_VERSION;
+  metrics_rt.snapshot.size = sizeof(struct openqti_metrics);
+  metrics_rt.snapshot.pid = getpid();
+  metrics_rt.snapshot.update_interval_ms = METRICS_UPDATE_INTERVAL_MS;
+  metrics_rt.snapshot.start_ns = stats_now_ns();
+  return 0;
+}
+
+static void copy_latency(struct metrics_latency *dst,
+                         struct latency_summary *src) {
+  dst->count = src->count;
+  dst->p50_ns = src->p50_ns;
+  dst->p90_ns = src->p90_ns;
+  dst->p99_ns = src->p99_ns;
+  dst->max_ns = src->max_ns;
+}
+
+static void copy_proxy_stats(struct metrics_proxy *dst, struct pkt_stats src) {
+  int i;
+  dst->bypassed = src.bypassed;
+  dst->empty = src.empty;
+  dst->discarded = src.discarded;
+  dst->allowed = src.allowed;
+  dst->failed = src.failed;
+  dst->other = src.other;
+  for (i = 0; i < 2; i++) {
+    copy_latency(&dst->forward[i], &src.forward[i]);
+    copy_latency(&dst->handler[i], &src.handler[i]);
+  }
+}
+
+static void update_snapshot(struct openqti_metrics *m) {
+  struct network_state network = get_network_status();
+  struct sms_queue_stats sms_queue = get_sms_queue_stats();
+
+  copy_proxy_stats(&m->rmnet, get_rmnet_stats());
+  copy_proxy_stats(&m->gps, get_gps_stats());
+
+  m->sms_queue_depth = sms_queue.depth;
+  m->pending_tasks = get_num_pending_tasks();
+  m->tracked_clients = get_num_tracked_clients();
+  m->dirty_reconnects = get_dirty_reconnects();
+  m->log_dropped = get_log_dropped_count();
+  m->usb_suspended = get_transceiver_suspend_state();
+  memset(m->thermal, 0, sizeof(m->thermal));
+  get_thermal_readings(m->thermal, METRICS_THERMAL_ZONES);
+
+  m->network_type = network.network_type;
+  m->signal_level = network.signal_level;
+  m->signal_bars = network.signal_bars;
+  m->in_service = network.in_service;
+  m->in_call = network.in_call;
+
+  m->sms_queue_capacity = sms_queue.capacity;
+  m->sms_queue_high_water = sms_queue.high_water;
+  m->sms_queue_rejected = sms_queue.rejected;
+  m->updated_ns = stats_now_ns();
+}
+
+static void publish_snapshot(struct openqti_metrics *m) {
+  struct openqti_metrics *page = metrics_rt.page;
+  uint32_t seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&page->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  /* Everything before seq, then everything after it */
+  memcpy(page, m, offsetof(struct openqti_metrics, seq));
+  memcpy((uint8_t *)page + offsetof(struct openqti_metrics, updated_ns),
+         (uint8_t *)m + offsetof(struct openqti_metrics, updated_ns),
+         sizeof(struct openqti_metrics) -
+             offsetof(struct openqti_metrics, updated_ns));
+  atomic_store_explicit(&page->seq, seq + 2, memory_order_release);
+}
+
+void *metrics_thread() {
+  if (init_metrics() < 0) {
+    logger(MSG_ERROR, "%s: Metrics page not available\n", __func__);
+    return NULL;
+  }
+  logger(MSG_INFO, "%s: Publishing metrics in %s every %ims\n", __func__,
+         METRICS_PATH, METRICS_UPDATE_INTERVAL_MS);
+  while (1) {
+    update_snapshot(&metrics_rt.snapshot);
+    publish_snapshot(&metrics_rt.snapshot);
+    usleep(METRICS_UPDATE_INTERVAL_MS * 1000);
+  }
+  return NULL;
+}
@@ -32,6 +32,7 @@
 #include <sys/ioctl.h>
 
 #include "../inc/audio.h"
+#include "../inc/devices.h"
 #include "../inc/logger.h"
 
 /* .5 for rounding before casting to non-decmal value */
@@ -48,7 +49,7 @@ struct mixer *mixer_open(const char *device) {
   unsigned n, m;
   int fd;
 
-  fd = open(device, O_RDWR);
+  fd = open_device(device, O_RDWR);
   if (fd < 0) {
     logger(MSG_WARN, "Control open failed\n");
     return 0;
@@ -166,6 +167,8 @@ struct mixer_ctl *mixer_get_nth_control(struct mixer *mixer, unsigned n) {
 struct mixer_ctl *get_ctl(struct mixer *mixer, char *name) {
   char *p;
   unsigned idx = 0;
+  if (!mixer)
+    return 0;
   if (isdigit(name[0]))
     return mixer_get_nth_control(mixer, atoi(name) - 1);
 
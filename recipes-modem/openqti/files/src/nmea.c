@@ -0,0 +1,715 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/nmea.h"
+#include "../inc/logger.h"
+#include "../inc/stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+/* Assembles sentences out of whatever the ADSP sends */
+struct nmea_framer {
+  uint8_t line[NMEA_MAX_SENTENCE];
+  size_t len;
+  bool in_line;
+};
+
+enum {
+  NMEA_FRAME_MORE = 0,   // Keep feeding it
+  NMEA_FRAME_DONE = 1,   // A full sentence is in line, up to len
+  NMEA_FRAME_BROKEN = 2, // A sentence was cut short or was too long
+};
+
+/*
+ * Sentences start with '$' (or '!') and end with a newline, anything
+ * outside of one is thrown away and counted in *dropped
+ */
+static int framer_feed(struct nmea_framer *fr, uint8_t c, size_t *dropped) {
+  int ret = NMEA_FRAME_MORE;
+
+  if (c == '$' || c == '!') {
+    if (fr->in_line) {
+      *dropped += fr->len;
+      ret = NMEA_FRAME_BROKEN;
+    }
+    fr->line[0] = c;
+    fr->len = 1;
+    fr->in_line = true;
+    return ret;
+  }
+  if (!fr->in_line) {
+    *dropped += 1;
+    return NMEA_FRAME_MORE;
+  }
+  if (fr->len >= NMEA_MAX_SENTENCE) {
+    *dropped += fr->len + 1;
+    fr->in_line = false;
+    return NMEA_FRAME_BROKEN;
+  }
+  fr->line[fr->len++] = c;
+  if (c == '\n') {
+    fr->in_line = false;
+    return NMEA_FRAME_DONE;
+  }
+  return NMEA_FRAME_MORE;
+}
+
+/*
+ * NMEA suspend buffer
+ *  While the host is suspended the GPS proxy keeps draining the ADSP
+ *  port (see gps_proxy()), and hands the data over to us instead of
+ *  throwing it away. What we keep depends on the policy:
+ *   - LATEST keeps the last sentence of every type (GSV is split by
+ *     message number), so the host gets one complete, fresh fix.
+ *   - DROP_OLDEST is a ring buffer, old sentences are overwritten.
+ *   - KEEP_ALL appends until the buffer is full and then stops.
+ *  Whole sentences are dropped in every case, so the host never sees
+ *  one cut in half by us.
+ *  On resume everything goes out with a single writev().
+ *  Only the GPS proxy thread stores and flushes, counters can be read
+ *  from anywhere.
+ */
+struct {
+  uint8_t policy;
+
+  /* DROP_OLDEST and KEEP_ALL */
+  uint8_t *ring;
+  size_t capacity;
+  size_t head;
+  size_t len;
+  bool full;
+
+  /* LATEST */
+  struct {
+    char address[NMEA_MAX_ADDRESS + 1];
+    uint8_t data[NMEA_MAX_SENTENCE];
+    uint16_t len;
+    uint32_t seq;
+  } slots[NMEA_LATEST_SLOTS];
+  int num_slots;
+  uint32_t next_seq;
+  struct nmea_framer framer;
+
+  _Atomic uint32_t size;
+  _Atomic uint64_t stored;
+  _Atomic uint64_t dropped;
+  _Atomic uint64_t flushed;
+  _Atomic uint64_t flushes;
+} nmea_rt;
+
+#define nmea_count(counter, val)                                               \
+  atomic_fetch_add_explicit(&(counter), (val), memory_order_relaxed)
+
+static const char *policy_names[] = {"discard", "latest", "drop oldest",
+                                     "keep all"};
+
+const char *get_nmea_policy_name(uint8_t policy) {
+  if (policy > NMEA_SUSPEND_KEEP_ALL)
+    return "unknown";
+  return policy_names[policy];
+}
+
+int init_nmea_buffer(uint8_t policy, size_t max_bytes) {
+  if (policy > NMEA_SUSPEND_KEEP_ALL) {
+    logger(MSG_WARN, "%s: Unknown policy %u, using %s\n", __func__, policy,
+           get_nmea_policy_name(NMEA_SUSPEND_DEFAULT_POLICY));
+    policy = NMEA_SUSPEND_DEFAULT_POLICY;
+  }
+  if (max_bytes < NMEA_MAX_SENTENCE)
+    max_bytes = NMEA_MAX_SENTENCE;
+  if (max_bytes > NMEA_SUSPEND_MAX_KB * 1024)
+    max_bytes = NMEA_SUSPEND_MAX_KB * 1024;
+
+  free(nmea_rt.ring);
+  nmea_rt.ring = NULL;
+  nmea_rt.capacity = 0;
+  if (policy == NMEA_SUSPEND_DROP_OLDEST || policy == NMEA_SUSPEND_KEEP_ALL) {
+    nmea_rt.ring = malloc(max_bytes);
+    if (nmea_rt.ring == NULL) {
+      logger(MSG_ERROR, "%s: Can't allocate %zu bytes, discarding instead\n",
+             __func__, max_bytes);
+      policy = NMEA_SUSPEND_DISCARD;
+    } else {
+      nmea_rt.capacity = max_bytes;
+    }
+  }
+  nmea_rt.policy = policy;
+  nmea_rt.head = nmea_rt.len = 0;
+  nmea_rt.full = false;
+  nmea_rt.num_slots = 0;
+  nmea_rt.framer.in_line = false;
+  atomic_store(&nmea_rt.size, 0);
+  if (nmea_rt.capacity > 0)
+    logger(MSG_INFO, "%s: NMEA data while suspended: %s, up to %zu bytes\n",
+           __func__, get_nmea_policy_name(policy), nmea_rt.capacity);
+  else
+    logger(MSG_INFO, "%s: NMEA data while suspended: %s\n", __func__,
+           get_nmea_policy_name(policy));
+  return 0;
+}
+
+/* Ring buffer */
+static void ring_copy_in(const uint8_t *buf, size_t len) {
+  size_t tail = (nmea_rt.head + nmea_rt.len) % nmea_rt.capacity;
+  size_t first = nmea_rt.capacity - tail;
+
+  if (first > len)
+    first = len;
+  memcpy(nmea_rt.ring + tail, buf, first);
+  memcpy(nmea_rt.ring, buf + first, len - first);
+  nmea_rt.len += len;
+}
+
+static void ring_store_drop_oldest(const uint8_t *buf, size_t len) {
+  size_t need, n;
+  const uint8_t *nl;
+
+  /* Bigger than the whole buffer, keep the end of it */
+  if (len > nmea_rt.capacity) {
+    n = len - nmea_rt.capacity;
+    nl = memchr(buf + n, '\n', nmea_rt.capacity);
+    if (nl != NULL && nl + 1 < buf + len)
+      n = nl + 1 - buf;
+    nmea_count(nmea_rt.dropped, n + nmea_rt.len);
+    buf += n;
+    len -= n;
+    nmea_rt.head = nmea_rt.len = 0;
+  }
+
+  if (nmea_rt.len + len > nmea_rt.capacity) {
+    need = nmea_rt.len + len - nmea_rt.capacity;
+    /* Up to the end of the sentence we're cutting into */
+    for (n = need; n < nmea_rt.len; n++) {
+      if (nmea_rt.ring[(nmea_rt.head + n - 1) % nmea_rt.capacity] == '\n')
+        break;
+    }
+    nmea_rt.head = (nmea_rt.head + n) % nmea_rt.capacity;
+    nmea_rt.len -= n;
+    nmea_count(nmea_rt.dropped, n);
+  }
+  ring_copy_in(buf, len);
+}
+
+static void ring_store_keep_all(const uint8_t *buf, size_t len) {
+  size_t fit;
+
+  if (nmea_rt.full) {
+    nmea_count(nmea_rt.dropped, len);
+    return;
+  }
+  if (nmea_rt.len + len > nmea_rt.capacity) {
+    /* Take whatever complete sentences fit, and stop there */
+    fit = nmea_rt.capacity - nmea_rt.len;
+    while (fit > 0 && buf[fit - 1] != '\n')
+      fit--;
+    nmea_count(nmea_rt.dropped, len - fit);
+    len = fit;
+    nmea_rt.full = true;
+    /* Nothing else fits, don't leave half a sentence at the end */
+    while (len == 0 && nmea_rt.len > 0 &&
+           nmea_rt.ring[(nmea_rt.head + nmea_rt.len - 1) % nmea_rt.capacity] !=
+               '\n') {
+      nmea_rt.len--;
+      nmea_count(nmea_rt.dropped, 1);
+    }
+    logger(MSG_WARN, "%s: NMEA buffer is full, dropping new data\n",
+           __func__);
+  }
+  ring_copy_in(buf, len);
+}
+
+/* Last sentence of each type */
+static void get_sentence_address(const uint8_t *line, size_t len,
+                                 char *address) {
+  size_t i, n = 0;
+
+  for (i = 1; i < len && line[i] != ',' && line[i] != '*' &&
+              n < NMEA_MAX_ADDRESS - 1;
+       i++)
+    address[n++] = line[i];
+  /* Every GSV message carries different satellites */
+  if (n >= 3 && memcmp(address + n - 3, "GSV", 3) == 0) {
+    /* $xxGSV,total,number,... */
+    for (i++; i < len && line[i] != ','; i++)
+      ;
+    if (i + 1 < len && line[i + 1] != ',')
+      address[n++] = line[i + 1];
+  }
+  address[n] = 0;
+}
+
+static void latest_commit_line(const uint8_t *line, size_t len) {
+  char address[NMEA_MAX_ADDRESS + 1];
+  int i, slot = -1, oldest = 0;
+
+  get_sentence_address(line, len, address);
+  for (i = 0; i < nmea_rt.num_slots; i++) {
+    if (strcmp(nmea_rt.slots[i].address, address) == 0) {
+      slot = i;
+      break;
+    }
+    if (nmea_rt.slots[i].seq < nmea_rt.slots[oldest].seq)
+      oldest = i;
+  }
+
+  if (slot < 0 && nmea_rt.num_slots < NMEA_LATEST_SLOTS) {
+    slot = nmea_rt.num_slots++;
+    nmea_rt.slots[slot].len = 0;
+  } else if (slot < 0) {
+    slot = oldest;
+  }
+
+  nmea_count(nmea_rt.dropped, nmea_rt.slots[slot].len);
+  strcpy(nmea_rt.slots[slot].address, address);
+  memcpy(nmea_rt.slots[slot].data, line, len);
+  nmea_rt.slots[slot].len = len;
+  nmea_rt.slots[slot].seq = nmea_rt.next_seq++;
+}
+
+static void latest_store(const uint8_t *buf, size_t len) {
+  struct nmea_framer *fr = &nmea_rt.framer;
+  size_t i, dropped = 0;
+
+  for (i = 0; i < len; i++) {
+    if (framer_feed(fr, buf[i], &dropped) == NMEA_FRAME_DONE)
+      latest_commit_line(fr->line, fr->len);
+  }
+  nmea_count(nmea_rt.dropped, dropped);
+}
+
+static uint32_t get_held_bytes() {
+  uint32_t size = 0;
+  int i;
+
+  if (nmea_rt.policy != NMEA_SUSPEND_LATEST)
+    return nmea_rt.len;
+  for (i = 0; i < nmea_rt.num_slots; i++)
+    size += nmea_rt.slots[i].len;
+  if (nmea_rt.framer.in_line)
+    size += nmea_rt.framer.len;
+  return size;
+}
+
+void nmea_buffer_store(const uint8_t *buf, size_t len) {
+  nmea_count(nmea_rt.stored, len);
+  switch (nmea_rt.policy) {
+  case NMEA_SUSPEND_LATEST:
+    latest_store(buf, len);
+    break;
+  case NMEA_SUSPEND_DROP_OLDEST:
+    ring_store_drop_oldest(buf, len);
+    break;
+  case NMEA_SUSPEND_KEEP_ALL:
+    ring_store_keep_all(buf, len);
+    break;
+  default:
+    nmea_count(nmea_rt.dropped, len);
+    break;
+  }
+  atomic_store_explicit(&nmea_rt.size, get_held_bytes(), memory_order_relaxed);
+}
+
+bool nmea_buffer_pending() {
+  if (nmea_rt.policy == NMEA_SUSPEND_LATEST)
+    return nmea_rt.num_slots > 0 || nmea_rt.framer.in_line;
+  return nmea_rt.len > 0;
+}
+
+/* writev() can be cut short too, keep going from where it stopped */
+static int write_iovec(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t ret;
+  int total = 0;
+
+  while (iovcnt > 0) {
+    ret = writev(fd, iov, iovcnt);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (ret == 0)
+      return -EIO;
+    total += ret;
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return total;
+}
+
+int nmea_buffer_flush(int fd) {
+  struct iovec iov[NMEA_LATEST_SLOTS + 1];
+  int order[NMEA_LATEST_SLOTS];
+  int i, j, tmp, iovcnt = 0;
+  size_t first;
+  int ret;
+
+  if (!nmea_buffer_pending())
+    return 0;
+
+  if (nmea_rt.policy == NMEA_SUSPEND_LATEST) {
+    /* Send them in the order they arrived */
+    for (i = 0; i < nmea_rt.num_slots; i++) {
+      order[i] = i;
+      for (j = i; j > 0 && nmea_rt.slots[order[j - 1]].seq >
+                               nmea_rt.slots[order[j]].seq;
+           j--) {
+        tmp = order[j];
+        order[j] = order[j - 1];
+        order[j - 1] = tmp;
+      }
+    }
+    for (i = 0; i < nmea_rt.num_slots; i++) {
+      iov[iovcnt].iov_base = nmea_rt.slots[order[i]].data;
+      iov[iovcnt++].iov_len = nmea_rt.slots[order[i]].len;
+    }
+    /* The rest of it will come straight from the ADSP */
+    if (nmea_rt.framer.in_line) {
+      iov[iovcnt].iov_base = nmea_rt.framer.line;
+      iov[iovcnt++].iov_len = nmea_rt.framer.len;
+    }
+  } else {
+    first = nmea_rt.capacity - nmea_rt.head;
+    if (first > nmea_rt.len)
+      first = nmea_rt.len;
+    iov[iovcnt].iov_base = nmea_rt.ring + nmea_rt.head;
+    iov[iovcnt++].iov_len = first;
+    if (nmea_rt.len > first) {
+      iov[iovcnt].iov_base = nmea_rt.ring;
+      iov[iovcnt++].iov_len = nmea_rt.len - first;
+    }
+  }
+
+  ret = write_iovec(fd, iov, iovcnt);
+  if (ret < 0) {
+    logger(MSG_ERROR, "%s: Failed to flush NMEA data: %s\n", __func__,
+           strerror(-ret));
+    nmea_count(nmea_rt.dropped, get_held_bytes());
+  } else {
+    logger(MSG_DEBUG, "%s: Sent %i bytes held during suspend\n", __func__,
+           ret);
+    nmea_count(nmea_rt.flushed, ret);
+    nmea_count(nmea_rt.flushes, 1);
+  }
+
+  nmea_rt.head = nmea_rt.len = 0;
+  nmea_rt.full = false;
+  nmea_rt.num_slots = 0;
+  nmea_rt.framer.in_line = false;
+  atomic_store_explicit(&nmea_rt.size, 0, memory_order_relaxed);
+  return ret;
+}
+
+struct nmea_buffer_stats get_nmea_buffer_stats() {
+  struct nmea_buffer_stats stats;
+  stats.policy = nmea_rt.policy;
+  stats.size = atomic_load_explicit(&nmea_rt.size, memory_order_relaxed);
+  stats.stored = atomic_load_explicit(&nmea_rt.stored, memory_order_relaxed);
+  stats.dropped = atomic_load_explicit(&nmea_rt.dropped, memory_order_relaxed);
+  stats.flushed = atomic_load_explicit(&nmea_rt.flushed, memory_order_relaxed);
+  stats.flushes = atomic_load_explicit(&nmea_rt.flushes, memory_order_relaxed);
+  return stats;
+}
+
+/*
+ * NMEA parser
+ *  Everything the ADSP sends goes through here on its way to the host.
+ *  Sentences are framed and their checksum verified, and GGA, RMC, GSA
+ *  and GSV update the last known fix, which anyone can read with
+ *  get_last_fix() without touching the GPS port.
+ *  With gps_rate_limit_ms set, only complete sentences are forwarded,
+ *  and a sentence type (GSV split by message number) is only sent to
+ *  the host if the last one of its kind went out at least that long
+ *  ago. Otherwise the data is passed as is.
+ */
+struct {
+  struct nmea_framer framer;
+  uint64_t rate_limit_ns;
+  struct {
+    char address[NMEA_MAX_ADDRESS + 1];
+    uint64_t last_ns;
+  } limits[NMEA_LATEST_SLOTS];
+  int num_limits;
+  uint8_t out[NMEA_OUT_SIZE];
+
+  pthread_mutex_t mutex;
+  struct nmea_fix fix;
+  struct {
+    char talker[3];
+    uint8_t in_view;
+  } talkers[NMEA_MAX_TALKERS];
+
+  _Atomic uint64_t sentences;
+  _Atomic uint64_t parsed;
+  _Atomic uint64_t bad_checksum;
+  _Atomic uint64_t malformed;
+  _Atomic uint64_t rate_limited;
+} fix_rt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void init_nmea_parser(uint16_t rate_limit_ms) {
+  fix_rt.rate_limit_ns = (uint64_t)rate_limit_ms * 1000000ULL;
+  fix_rt.num_limits = 0;
+  fix_rt.framer.in_line = false;
+  if (rate_limit_ms > 0)
+    logger(MSG_INFO, "%s: Sending each NMEA sentence at most every %ums\n",
+           __func__, rate_limit_ms);
+}
+
+static int hex_value(uint8_t c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Returns the position of the '*' if the checksum is right */
+static int validate_sentence(const uint8_t *line, size_t len) {
+  uint8_t sum = 0;
+  size_t i;
+  int hi, lo;
+
+  for (i = 1; i < len && line[i] != '*'; i++) {
+    if (line[i] == '\r' || line[i] == '\n')
+      return -EINVAL;
+    sum ^= line[i];
+  }
+  if (i + 2 >= len)
+    return -EINVAL;
+  hi = hex_value(line[i + 1]);
+  lo = hex_value(line[i + 2]);
+  if (hi < 0 || lo < 0)
+    return -EINVAL;
+  if (((hi << 4) | lo) != sum)
+    return -EBADMSG;
+  return i;
+}
+
+/* ddmm.mmmm or dddmm.mmmm, plus the hemisphere */
+static bool parse_coordinate(const char *value, const char *hemisphere,
+                             double *degrees) {
+  double raw;
+  int deg;
+
+  if (value[0] == 0)
+    return false;
+  raw = strtod(value, NULL);
+  deg = (int)(raw / 100);
+  *degrees = deg + (raw - deg * 100) / 60.0;
+  if (hemisphere[0] == 'S' || hemisphere[0] == 'W')
+    *degrees = -*degrees;
+  return true;
+}
+
+static void parse_gga(char **fields, int num_fields) {
+  struct nmea_fix *fix = &fix_rt.fix;
+
+  if (num_fields < 10)
+    return;
+  snprintf(fix->utc_time, sizeof(fix->utc_time), "%s", fields[1]);
+  parse_coordinate(fields[2], fields[3], &fix->latitude);
+  parse_coordinate(fields[4], fields[5], &fix->longitude);
+  fix->quality = atoi(fields[6]);
+  fix->sats_used = atoi(fields[7]);
+  if (fields[8][0])
+    fix->hdop = strtof(fields[8], NULL);
+  if (fields[9][0])
+    fix->altitude = strtof(fields[9], NULL);
+  fix->valid = fix->quality > 0;
+}
+
+static void parse_rmc(char **fields, int num_fields) {
+  struct nmea_fix *fix = &fix_rt.fix;
+
+  if (num_fields < 10)
+    return;
+  snprintf(fix->utc_time, sizeof(fix->utc_time), "%s", fields[1]);
+  fix->valid = fields[2][0] == 'A';
+  parse_coordinate(fields[3], fields[4], &fix->latitude);
+  parse_coordinate(fields[5], fields[6], &fix->longitude);
+  if (fields[7][0])
+    fix->speed_knots = strtof(fields[7], NULL);
+  if (fields[8][0])
+    fix->course = strtof(fields[8], NULL);
+  if (fields[9][0])
+    snprintf(fix->date, sizeof(fix->date), "%s", fields[9]);
+}
+
+static void parse_gsa(char **fields, int num_fields) {
+  struct nmea_fix *fix = &fix_rt.fix;
+
+  if (num_fields < 18)
+    return;
+  fix->fix_type = atoi(fields[2]);
+  if (fields[15][0])
+    fix->pdop = strtof(fields[15], NULL);
+  if (fields[16][0])
+    fix->hdop = strtof(fields[16], NULL);
+  if (fields[17][0])
+    fix->vdop = strtof(fields[17], NULL);
+}
+
+/* Every constellation has its own GSV, they add up */
+static void parse_gsv(const char *talker, char **fields, int num_fields) {
+  int i, slot = -1, total = 0;
+
+  if (num_fields < 4)
+    return;
+  for (i = 0; i < NMEA_MAX_TALKERS; i++) {
+    if (fix_rt.talkers[i].talker[0] == 0 ||
+        strncmp(fix_rt.talkers[i].talker, talker, 2) == 0) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0)
+    return;
+  memcpy(fix_rt.talkers[slot].talker, talker, 2);
+  fix_rt.talkers[slot].in_view = atoi(fields[3]);
+  for (i = 0; i < NMEA_MAX_TALKERS && fix_rt.talkers[i].talker[0]; i++)
+    total += fix_rt.talkers[i].in_view;
+  fix_rt.fix.sats_in_view = total > 255 ? 255 : total;
+}
+
+static void parse_sentence(const uint8_t *line, size_t len) {
+  char work[NMEA_MAX_SENTENCE];
+  char *fields[NMEA_MAX_FIELDS];
+  const char *type;
+  int num_fields = 0;
+  int star, i;
+
+  star = validate_sentence(line, len);
+  if (star == -EBADMSG) {
+    nmea_count(fix_rt.bad_checksum, 1);
+    return;
+  } else if (star < 0) {
+    nmea_count(fix_rt.malformed, 1);
+    return;
+  }
+
+  /* Between the '$' and the '*', split in fields */
+  memcpy(work, line + 1, star - 1);
+  work[star - 1] = 0;
+  fields[num_fields++] = work;
+  for (i = 0; i < star - 1 && num_fields < NMEA_MAX_FIELDS; i++) {
+    if (work[i] == ',') {
+      work[i] = 0;
+      fields[num_fields++] = &work[i + 1];
+    }
+  }
+
+  /* Talker ID plus type, proprietary ones ($P...) aren't for us */
+  if (strlen(fields[0]) != 5 || fields[0][0] == 'P')
+    return;
+  type = fields[0] + 2;
+
+  pthread_mutex_lock(&fix_rt.mutex);
+  if (strcmp(type, "GGA") == 0) {
+    parse_gga(fields, num_fields);
+  } else if (strcmp(type, "RMC") == 0) {
+    parse_rmc(fields, num_fields);
+  } else if (strcmp(type, "GSA") == 0) {
+    parse_gsa(fields, num_fields);
+  } else if (strcmp(type, "GSV") == 0) {
+    parse_gsv(fields[0], fields, num_fields);
+  } else {
+    pthread_mutex_unlock(&fix_rt.mutex);
+    return;
+  }
+  fix_rt.fix.updated_ns = stats_now_ns();
+  pthread_mutex_unlock(&fix_rt.mutex);
+  nmea_count(fix_rt.parsed, 1);
+}
+
+static bool is_rate_limited(const uint8_t *line, size_t len, uint64_t now) {
+  char address[NMEA_MAX_ADDRESS + 1];
+  int i;
+
+  get_sentence_address(line, len, address);
+  for (i = 0; i < fix_rt.num_limits; i++) {
+    if (strcmp(fix_rt.limits[i].address, address) == 0)
+      break;
+  }
+  if (i == fix_rt.num_limits) {
+    /* Too many kinds of sentences, just let the new ones pass */
+    if (fix_rt.num_limits == NMEA_LATEST_SLOTS)
+      return false;
+    strcpy(fix_rt.limits[i].address, address);
+    fix_rt.num_limits++;
+  } else if (now - fix_rt.limits[i].last_ns < fix_rt.rate_limit_ns) {
+    return true;
+  }
+  fix_rt.limits[i].last_ns = now;
+  return false;
+}
+
+/*
+ * Returns what should be sent to the host: buf itself, or the complete
+ * sentences that made it through the rate limit. *len is updated.
+ */
+const uint8_t *process_nmea_data(const uint8_t *buf, size_t *len) {
+  struct nmea_framer *fr = &fix_rt.framer;
+  bool filter = fix_rt.rate_limit_ns > 0;
+  uint64_t now = stats_now_ns();
+  size_t i, dropped = 0, out_len = 0;
+
+  for (i = 0; i < *len; i++) {
+    switch (framer_feed(fr, buf[i], &dropped)) {
+    case NMEA_FRAME_BROKEN:
+      nmea_count(fix_rt.malformed, 1);
+      break;
+    case NMEA_FRAME_DONE:
+      nmea_count(fix_rt.sentences, 1);
+      parse_sentence(fr->line, fr->len);
+      if (!filter)
+        break;
+      if (is_rate_limited(fr->line, fr->len, now)) {
+        nmea_count(fix_rt.rate_limited, 1);
+      } else if (out_len + fr->len <= NMEA_OUT_SIZE) {
+        memcpy(fix_rt.out + out_len, fr->line, fr->len);
+        out_len += fr->len;
+      }
+      break;
+    }
+  }
+
+  if (!filter)
+    return buf;
+  *len = out_len;
+  return fix_rt.out;
+}
+
+struct nmea_fix get_last_fix() {
+  struct nmea_fix fix;
+  pthread_mutex_lock(&fix_rt.mutex);
+  fix = fix_rt.fix;
+  pthread_mutex_unlock(&fix_rt.mutex);
+  return fix;
+}
+
+struct nmea_parser_stats get_nmea_parser_stats() {
+  struct nmea_parser_stats stats;
+  stats.sentences =
+      atomic_load_explicit(&fix_rt.sentences, memory_order_relaxed);
+  stats.parsed = atomic_load_explicit(&fix_rt.parsed, memory_order_relaxed);
+  stats.bad_checksum =
+      atomic_load_explicit(&fix_rt.bad_checksum, memory_order_relaxed);
+  stats.malformed =
+      atomic_load_explicit(&fix_rt.malformed, memory_order_relaxed);
+  stats.rate_limited =
+      atomic_load_explicit(&fix_rt.rate_limited, memory_order_relaxed);
+  return stats;
+}
@@ -11,14 +11,18 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include "../inc/atchannel.h"
 #include "../inc/atfwd.h"
 #include "../inc/audio.h"
+#include "../inc/capture.h"
+#include "../inc/cell.h"
 #include "../inc/command.h"
 #include "../inc/config.h"
 #include "../inc/devices.h"
 #include "../inc/helpers.h"
 #include "../inc/ipc.h"
 #include "../inc/logger.h"
+#include "../inc/metrics.h"
 #include "../inc/openqti.h"
 #include "../inc/proxy.h"
 #include "../inc/scheduler.h"
@@ -26,6 +30,7 @@
 #include "../inc/thermal.h"
 #include "../inc/timesync.h"
 #include "../inc/tracking.h"
+#include "../inc/wake.h"
 
 /*
  *                                                                          88
@@ -64,10 +69,15 @@ int main(int argc, char **argv) {
   pthread_t gps_proxy_thread;
   pthread_t rmnet_proxy_thread;
   pthread_t atfwd_thread;
+  pthread_t at_channel_thread_id;
+  pthread_t network_state_thread_id;
   pthread_t time_sync_thread;
   pthread_t pwrkey_thread;
   pthread_t scheduler_thread;
   pthread_t thermal_thread;
+  pthread_t metrics_thread_id;
+  pthread_t suspend_monitor_thread_id;
+  pthread_t host_wake_thread_id;
   struct node_pair rmnet_nodes;
   rmnet_nodes.allow_exit = false;
 
@@ -82,6 +92,7 @@ int main(int argc, char **argv) {
 
   /* Try to read the config file on top of the defaults */
   read_settings_from_file();
+  set_packet_capture_state(is_packet_capture_enabled());
 
   logger(MSG_INFO, "Welcome to OpenQTI Version %s \n", RELEASE_VER);
 
@@ -127,6 +138,9 @@ int main(int argc, char **argv) {
       break;
     }
 
+  /* Before anyone touches a device node */
+  init_device_root();
+
   if ((lockfile = open(LOCKFILE, O_RDWR | O_CREAT | O_TRUNC, 0660)) == -1) {
     fprintf(stderr, "%s: Can't open lockfile!\n", __func__);
     return -ENOENT;
@@ -142,32 +156,35 @@ int main(int argc, char **argv) {
            __func__);
   }
 
-  do {
+  /* Emulated devices don't come with an IPC router */
+  while (!is_device_emulation() && !is_server_active(33, 1)) {
     logger(MSG_DEBUG, "%s: Waiting for ADSP init...\n", __func__);
-  } while (!is_server_active(33, 1));
+  }
   // For whatever reason, the DPM Service port shows as the IMS Application
   // service. I trust more qrtr sources than I do trust Qualcomm and the ADSP
   // firmware in here
-  rmnet_nodes.node1.fd = open(RMNET_CTL, O_RDWR);
+  rmnet_nodes.node1.fd = open_device(RMNET_CTL, O_RDWR);
   if (rmnet_nodes.node1.fd < 0) {
     logger(MSG_ERROR, "Error opening %s \n", RMNET_CTL);
     return -EINVAL;
   }
 
-  /* Set empty IPC security */
-  logger(MSG_DEBUG, "%s: Init: IPC Security settings\n", __func__);
-  if (setup_ipc_security() != 0) {
-    logger(MSG_ERROR, "%s: Error setting up MSM IPC Security!\n", __func__);
-  }
+  if (!is_device_emulation()) {
+    /* Set empty IPC security */
+    logger(MSG_DEBUG, "%s: Init: IPC Security settings\n", __func__);
+    if (setup_ipc_security() != 0) {
+      logger(MSG_ERROR, "%s: Error setting up MSM IPC Security!\n", __func__);
+    }
 
-  /* Try to start DPM */
-  logger(MSG_DEBUG, "%s: Init: Dynamic Port Mapper \n", __func__);
-  if (init_port_mapper() < 0) {
-    logger(MSG_ERROR, "%s: Error setting up port mapper!\n", __func__);
+    /* Try to start DPM */
+    logger(MSG_DEBUG, "%s: Init: Dynamic Port Mapper \n", __func__);
+    if (init_port_mapper() < 0) {
+      logger(MSG_ERROR, "%s: Error setting up port mapper!\n", __func__);
+    }
   }
 
   do {
-    rmnet_nodes.node2.fd = open(SMD_CNTL, O_RDWR);
+    rmnet_nodes.node2.fd = open_device(SMD_CNTL, O_RDWR);
     if (rmnet_nodes.node2.fd < 0) {
       logger(MSG_ERROR, "Error opening %s, retry... \n", SMD_CNTL);
     }
@@ -183,9 +200,29 @@ int main(int argc, char **argv) {
   /* We're not using this anyway */
   /* prepare_dtr_gpio(); */
 
-  logger(MSG_INFO, "%s: Init: AT Command forwarder \n", __func__);
-  if ((ret = pthread_create(&atfwd_thread, NULL, &start_atfwd_thread, NULL))) {
-    logger(MSG_ERROR, "%s: Error creating ATFWD  thread\n", __func__);
+  /* Needs to be there before anyone tries to wake up the proxy */
+  init_proxy_runtime();
+
+  logger(MSG_INFO, "%s: Init: AT Command channel \n", __func__);
+  at_channel_init();
+  if ((ret = pthread_create(&at_channel_thread_id, NULL, &at_channel_thread,
+                            NULL))) {
+    logger(MSG_ERROR, "%s: Error creating AT channel thread\n", __func__);
+  }
+
+  logger(MSG_INFO, "%s: Init: Network state worker \n", __func__);
+  if ((ret = pthread_create(&network_state_thread_id, NULL,
+                            &network_state_thread, NULL))) {
+    logger(MSG_ERROR, "%s: Error creating network state thread\n", __func__);
+  }
+
+  /* ATFWD talks to the DSP through the IPC router too */
+  if (!is_device_emulation()) {
+    logger(MSG_INFO, "%s: Init: AT Command forwarder \n", __func__);
+    if ((ret = pthread_create(&atfwd_thread, NULL, &start_atfwd_thread,
+                              NULL))) {
+      logger(MSG_ERROR, "%s: Error creating ATFWD  thread\n", __func__);
+    }
   }
 
   /* QTI gets line state, then sets modem offline and online
@@ -233,6 +270,20 @@ int main(int argc, char **argv) {
   /* Enable or disable ADB depending on the misc partition setting */
   set_adb_runtime(is_adb_enabled());
 
+  logger(MSG_INFO, "%s: Init: Create USB suspend monitor thread \n",
+         __func__);
+  if ((ret = pthread_create(&suspend_monitor_thread_id, NULL,
+                            &suspend_monitor_thread, NULL))) {
+    logger(MSG_ERROR, "%s: Error creating USB suspend monitor thread\n",
+           __func__);
+  }
+
+  logger(MSG_INFO, "%s: Init: Create host wake up thread \n", __func__);
+  if ((ret = pthread_create(&host_wake_thread_id, NULL, &host_wake_thread,
+                            NULL))) {
+    logger(MSG_ERROR, "%s: Error creating host wake up thread\n", __func__);
+  }
+
   logger(MSG_INFO, "%s: Init: Create GPS runtime thread \n", __func__);
   if ((ret = pthread_create(&gps_proxy_thread, NULL, &gps_proxy, NULL))) {
     logger(MSG_ERROR, "%s: Error creating GPS proxy thread\n", __func__);
@@ -265,6 +316,10 @@ int main(int argc, char **argv) {
                             NULL))) {
     logger(MSG_ERROR, "%s: Error creating thermal monitor thread\n", __func__);
   }
+  logger(MSG_INFO, "%s: Init: Create Metrics thread \n", __func__);
+  if ((ret = pthread_create(&metrics_thread_id, NULL, &metrics_thread, NULL))) {
+    logger(MSG_ERROR, "%s: Error creating metrics thread\n", __func__);
+  }
 
   logger(MSG_INFO, "%s: Switching to powersave mode\n", __func__);
   if (write_to(CPUFREQ_PATH, CPUFREQ_PS, O_WRONLY) < 0) {
@@ -280,7 +335,8 @@ int main(int argc, char **argv) {
      AT command to answer to */
   pthread_join(gps_proxy_thread, NULL);
   pthread_join(rmnet_proxy_thread, NULL);
-  pthread_join(atfwd_thread, NULL);
+  if (!is_device_emulation())
+    pthread_join(atfwd_thread, NULL);
 
   flock(lockfile, LOCK_UN);
   close(lockfile);
@@ -24,6 +24,7 @@
 #include <unistd.h>
 
 #include "../inc/audio.h"
+#include "../inc/devices.h"
 #include "../inc/logger.h"
 
 static inline int param_is_mask(int p) {
@@ -142,6 +143,12 @@ int set_params(struct pcm *pcm, int path) {
     return -ENOMEM;
   }
 
+  /* Nothing to configure in a null sink, keep what the caller set */
+  if (pcm->null_sink) {
+    free(params);
+    return 0;
+  }
+
   param_init(params);
 
   param_set_mask(params, SNDRV_PCM_HW_PARAM_ACCESS,
@@ -241,7 +248,7 @@ struct pcm *pcm_open(unsigned flags, char *device) {
   }
   pcm->flags = flags;
 
-  pcm->fd = open(dname, O_RDWR | O_NONBLOCK);
+  pcm->fd = open_device(dname, O_RDWR | O_NONBLOCK);
   if (pcm->fd < 0) {
     free(pcm->sync_ptr);
     free(pcm);
@@ -261,7 +268,14 @@ struct pcm *pcm_open(unsigned flags, char *device) {
           enable_timer(pcm);*/
 
   if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_INFO, &info)) {
-    logger(MSG_ERROR, "cannot get info - %s", dname);
+    /* Emulated devices can point to anything, take whatever we write */
+    if (is_device_emulation() && errno == ENOTTY) {
+      logger(MSG_INFO, "%s: %s is not a PCM device, using it as a null sink\n",
+             __func__, dname);
+      pcm->null_sink = 1;
+    } else {
+      logger(MSG_ERROR, "cannot get info - %s", dname);
+    }
   }
 
   return pcm;
@@ -279,6 +293,10 @@ int sync_ptr(struct pcm *pcm) {
 }
 
 int pcm_prepare(struct pcm *pcm) {
+  if (pcm->null_sink) {
+    pcm->running = 1;
+    return 0;
+  }
   if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PREPARE)) {
     logger(MSG_ERROR, "cannot prepare channel: errno =%d\n", -errno);
     return -errno;
@@ -295,6 +313,14 @@ static int pcm_write_nmmap(struct pcm *pcm, void *data, unsigned count) {
     return -EINVAL;
   x.buf = data;
   x.frames = (count / (channels * 2));
+  /* Throw the samples away, but take as long as the hardware would */
+  if (pcm->null_sink) {
+    if (write(pcm->fd, data, count) < 0)
+      pcm->underruns++;
+    if (pcm->rate > 0)
+      usleep((uint64_t)x.frames * 1000000 / pcm->rate);
+    return 0;
+  }
   for (;;) {
     if (!pcm->running) {
       if (pcm_prepare(pcm))
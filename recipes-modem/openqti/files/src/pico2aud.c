@@ -14,10 +14,13 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  *
- *   Convert text to .wav using svox text-to-speech system.
+ *   Convert text to speech using svox text-to-speech system, and stream
+ *   it to a PCM device.
  *
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,7 +30,6 @@
 #include "../inc/openqti.h"
 #include <picoapi.h>
 #include <picoapid.h>
-#include <picoos.h>
 
 /* adaptation layer defines */
 #define PICO_MEM_SIZE 2500000
@@ -61,97 +63,111 @@ pico_Resource picoTaResource = NULL;
 pico_Resource picoSgResource = NULL;
 pico_Resource picoUtppResource = NULL;
 pico_Engine picoEngine = NULL;
-pico_Char *picoTaFileName = NULL;
-pico_Char *picoSgFileName = NULL;
-pico_Char *picoUtppFileName = NULL;
-pico_Char *picoTaResourceName = NULL;
-pico_Char *picoSgResourceName = NULL;
-pico_Char *picoUtppResourceName = NULL;
+pico_Char picoTaFileName[PICO_MAX_DATAPATH_NAME_SIZE + PICO_MAX_FILE_NAME_SIZE];
+pico_Char picoSgFileName[PICO_MAX_DATAPATH_NAME_SIZE + PICO_MAX_FILE_NAME_SIZE];
+pico_Char picoTaResourceName[RESOURCE_NAME_SZ];
+pico_Char picoSgResourceName[RESOURCE_NAME_SZ];
 int picoSynthAbort = 0;
 
-// So we need, wave sample pointer, and pointer to the actual text
-
-int pico2aud(char *phrase, size_t len) {
-  char *wavefile = "/tmp/wave.wav";
-  int langIndex = 0;
-  int8_t *buffer;
-  size_t bufferSize = 256;
+/*
+ * The engine is set up the first time it's needed and then kept for
+ * the lifetime of the daemon: loading the lingware and building the
+ * voice takes long enough to be heard as silence in the middle of a
+ * call. It is only reset between phrases, and thrown away if pico
+ * reports an error so the next phrase starts from scratch.
+ */
+pthread_mutex_t pico_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-  char *text = phrase;
-  if (len < 1) {
-    logger(MSG_WARN, "%s: Nothing to say\n", __func__);
-    return 0;
+/* Call with pico_mutex held */
+static void pico_engine_teardown() {
+  if (picoEngine) {
+    pico_disposeEngine(picoSystem, &picoEngine);
+    pico_releaseVoiceDefinition(picoSystem, (pico_Char *)PICO_VOICE_NAME);
+    picoEngine = NULL;
   }
+  if (picoUtppResource) {
+    pico_unloadResource(picoSystem, &picoUtppResource);
+    picoUtppResource = NULL;
+  }
+  if (picoSgResource) {
+    pico_unloadResource(picoSystem, &picoSgResource);
+    picoSgResource = NULL;
+  }
+  if (picoTaResource) {
+    pico_unloadResource(picoSystem, &picoTaResource);
+    picoTaResource = NULL;
+  }
+  if (picoSystem) {
+    pico_terminate(&picoSystem);
+    picoSystem = NULL;
+  }
+  free(picoMemArea);
+  picoMemArea = NULL;
+}
 
-  buffer = malloc(bufferSize);
-
-  int ret, getstatus;
-  pico_Char *inp = NULL;
-  pico_Char *local_text = NULL;
-  short outbuf[MAX_OUTBUF_SIZE / 2];
-  pico_Int16 bytes_sent, bytes_recv, text_remaining, out_data_type;
+/* Call with pico_mutex held */
+static int pico_engine_setup() {
+  int langIndex = 0;
+  int ret;
   pico_Retstring outMessage;
 
-  picoSynthAbort = 0;
+  if (picoEngine)
+    return 0;
+
   logger(MSG_DEBUG, "%s: Starting PicoTTS Engine\n", __func__);
   picoMemArea = malloc(PICO_MEM_SIZE);
+  if (picoMemArea == NULL) {
+    logger(MSG_ERROR, "%s: Cannot allocate memory for pico\n", __func__);
+    return -ENOMEM;
+  }
   if ((ret = pico_initialize(picoMemArea, PICO_MEM_SIZE, &picoSystem))) {
     pico_getSystemStatusMessage(picoSystem, ret, outMessage);
     logger(MSG_ERROR, "Cannot initialize pico (%i): %s\n", ret, outMessage);
-    goto terminate;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Text analysis Lingware resouce file\n", __func__);
-
   /* Load the text analysis Lingware resource file.   */
-  picoTaFileName = (pico_Char *)malloc(PICO_MAX_DATAPATH_NAME_SIZE +
-                                       PICO_MAX_FILE_NAME_SIZE);
-  strcpy((char *)picoTaFileName, PICO_LINGWARE_PATH);
-  strcat((char *)picoTaFileName,
-         (const char *)picoInternalTaLingware[langIndex]);
+  snprintf((char *)picoTaFileName, sizeof(picoTaFileName), "%s%s",
+           PICO_LINGWARE_PATH, picoInternalTaLingware[langIndex]);
   if ((ret = pico_loadResource(picoSystem, picoTaFileName, &picoTaResource))) {
     pico_getSystemStatusMessage(picoSystem, ret, outMessage);
     logger(MSG_ERROR, "Cannot load text analysis resource file (%i): %s\n", ret,
            outMessage);
-    goto unloadTaResource;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Signal generation lingware resource file\n", __func__);
   /* Load the signal generation Lingware resource file.   */
-  picoSgFileName = (pico_Char *)malloc(PICO_MAX_DATAPATH_NAME_SIZE +
-                                       PICO_MAX_FILE_NAME_SIZE);
-  strcpy((char *)picoSgFileName, PICO_LINGWARE_PATH);
-  strcat((char *)picoSgFileName,
-         (const char *)picoInternalSgLingware[langIndex]);
+  snprintf((char *)picoSgFileName, sizeof(picoSgFileName), "%s%s",
+           PICO_LINGWARE_PATH, picoInternalSgLingware[langIndex]);
   if ((ret = pico_loadResource(picoSystem, picoSgFileName, &picoSgResource))) {
     pico_getSystemStatusMessage(picoSystem, ret, outMessage);
     logger(MSG_ERROR,
            "Cannot load signal generation Lingware resource file (%i): %s\n",
            ret, outMessage);
-    goto unloadSgResource;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Text analysis resource file\n", __func__);
   /* Get the text analysis resource name.     */
-  picoTaResourceName = (pico_Char *)malloc(RESOURCE_NAME_SZ);
   if ((ret = pico_getResourceName(picoSystem, picoTaResource,
                                   (char *)picoTaResourceName))) {
     pico_getSystemStatusMessage(picoSystem, ret, outMessage);
     logger(MSG_ERROR, "Cannot get the text analysis resource name (%i): %s\n",
            ret, outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Signal generation resource file\n", __func__);
   /* Get the signal generation resource name. */
-  picoSgResourceName = (pico_Char *)malloc(RESOURCE_NAME_SZ);
   if ((ret = pico_getResourceName(picoSystem, picoSgResource,
                                   (char *)picoSgResourceName))) {
     pico_getSystemStatusMessage(picoSystem, ret, outMessage);
     logger(MSG_ERROR,
            "Cannot get the signal generation resource name (%i): %s\n", ret,
            outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Voice definition\n", __func__);
@@ -161,7 +177,7 @@ int pico2aud(char *phrase, size_t len) {
     pico_getSystemStatusMessage(picoSystem, ret, outMessage);
     logger(MSG_ERROR, "Cannot create voice definition (%i): %s\n", ret,
            outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Add Text analysis resource \n", __func__);
@@ -173,7 +189,7 @@ int pico2aud(char *phrase, size_t len) {
     logger(MSG_ERROR,
            "Cannot add the text analysis resource to the voice (%i): %s\n", ret,
            outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Add Signal generation resource \n", __func__);
@@ -185,7 +201,7 @@ int pico2aud(char *phrase, size_t len) {
     logger(MSG_ERROR,
            "Cannot add the signal generation resource to the voice (%i): %s\n",
            ret, outMessage);
-    goto unloadUtppResource;
+    goto err;
   }
 
   logger(MSG_DEBUG, "%s: Create engine \n", __func__);
@@ -195,37 +211,213 @@ int pico2aud(char *phrase, size_t len) {
     pico_getSystemStatusMessage(picoSystem, ret, outMessage);
     logger(MSG_ERROR, "Cannot create a new pico engine (%i): %s\n", ret,
            outMessage);
-    goto disposeEngine;
+    picoEngine = NULL;
+    goto err;
   }
+  logger(MSG_INFO, "%s: PicoTTS engine ready\n", __func__);
+  return 0;
 
-  local_text = (pico_Char *)text;
-  text_remaining = strlen((const char *)local_text) + 1;
+err:
+  pico_engine_teardown();
+  return ret;
+}
 
-  inp = (pico_Char *)local_text;
+/* Loads the engine ahead of time, so the first phrase doesn't wait */
+int init_tts_engine() {
+  int ret;
+  pthread_mutex_lock(&pico_mutex);
+  ret = pico_engine_setup();
+  pthread_mutex_unlock(&pico_mutex);
+  return ret;
+}
+
+/*
+ * Speech stream
+ *  pico2aud() pushes samples into this ring as soon as pico hands them
+ *  over, and a playback thread feeds them to the PCM, so the first
+ *  words play while the rest of the phrase is still being synthesized.
+ *  The ring is bounded: synthesis simply waits when it's ahead of the
+ *  playback. The thread only writes full chunks, except when the phrase
+ *  is over (tts_stream_drain()), to avoid underruns between chunks.
+ */
+struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  bool running;
+  bool abort;
+  bool draining;
+  bool busy; // Playback thread is inside pcm_write()
+  struct pcm *pcm;
+  size_t head, tail, len;
+  uint8_t ring[TTS_STREAM_RING_SIZE];
+} tts_stream = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .running = false,
+};
+
+static void *tts_playback_thread() {
+  uint8_t chunk[TTS_STREAM_CHUNK];
+  size_t n, first;
+
+  pthread_mutex_lock(&tts_stream.mutex);
+  while (tts_stream.running) {
+    if (tts_stream.len == 0 ||
+        (tts_stream.len < TTS_STREAM_CHUNK && !tts_stream.draining)) {
+      pthread_cond_wait(&tts_stream.cond, &tts_stream.mutex);
+      continue;
+    }
+    n = tts_stream.len < TTS_STREAM_CHUNK ? tts_stream.len : TTS_STREAM_CHUNK;
+    first = TTS_STREAM_RING_SIZE - tts_stream.tail;
+    if (first > n)
+      first = n;
+    memcpy(chunk, tts_stream.ring + tts_stream.tail, first);
+    memcpy(chunk + first, tts_stream.ring, n - first);
+    tts_stream.tail = (tts_stream.tail + n) % TTS_STREAM_RING_SIZE;
+    tts_stream.len -= n;
+    tts_stream.busy = true;
+    pthread_cond_broadcast(&tts_stream.cond);
+    pthread_mutex_unlock(&tts_stream.mutex);
+
+    if (pcm_write(tts_stream.pcm, chunk, n)) {
+      logger(MSG_ERROR, "%s: Error playing sample\n", __func__);
+    }
+
+    pthread_mutex_lock(&tts_stream.mutex);
+    tts_stream.busy = false;
+    pthread_cond_broadcast(&tts_stream.cond);
+  }
+  pthread_mutex_unlock(&tts_stream.mutex);
+  return NULL;
+}
+
+int tts_stream_start(struct pcm *pcm) {
+  int ret;
+  pthread_mutex_lock(&tts_stream.mutex);
+  if (tts_stream.running) {
+    pthread_mutex_unlock(&tts_stream.mutex);
+    return -EBUSY;
+  }
+  tts_stream.pcm = pcm;
+  tts_stream.head = tts_stream.tail = tts_stream.len = 0;
+  tts_stream.abort = false;
+  tts_stream.draining = false;
+  tts_stream.busy = false;
+  tts_stream.running = true;
+  pthread_mutex_unlock(&tts_stream.mutex);
+
+  if ((ret = pthread_create(&tts_stream.thread, NULL, &tts_playback_thread,
+                            NULL))) {
+    logger(MSG_ERROR, "%s: Error creating playback thread\n", __func__);
+    tts_stream.running = false;
+    return -ret;
+  }
+  return 0;
+}
 
-  size_t bufused = 0;
+/* Blocks while the ring is full. Fails if the stream is stopped */
+static int tts_stream_write(const uint8_t *data, size_t len) {
+  size_t n, first;
+  pthread_mutex_lock(&tts_stream.mutex);
+  while (len > 0) {
+    if (!tts_stream.running || tts_stream.abort) {
+      pthread_mutex_unlock(&tts_stream.mutex);
+      return -ECANCELED;
+    }
+    n = TTS_STREAM_RING_SIZE - tts_stream.len;
+    if (n == 0) {
+      pthread_cond_wait(&tts_stream.cond, &tts_stream.mutex);
+      continue;
+    }
+    if (n > len)
+      n = len;
+    first = TTS_STREAM_RING_SIZE - tts_stream.head;
+    if (first > n)
+      first = n;
+    memcpy(tts_stream.ring + tts_stream.head, data, first);
+    memcpy(tts_stream.ring, data + first, n - first);
+    tts_stream.head = (tts_stream.head + n) % TTS_STREAM_RING_SIZE;
+    tts_stream.len += n;
+    data += n;
+    len -= n;
+    if (tts_stream.len >= TTS_STREAM_CHUNK)
+      pthread_cond_broadcast(&tts_stream.cond);
+  }
+  pthread_mutex_unlock(&tts_stream.mutex);
+  return 0;
+}
 
-  picoos_Common common = (picoos_Common)pico_sysGetCommon(picoSystem);
+/* Waits until everything queued so far has been played */
+void tts_stream_drain() {
+  pthread_mutex_lock(&tts_stream.mutex);
+  tts_stream.draining = true;
+  pthread_cond_broadcast(&tts_stream.cond);
+  while (tts_stream.running && !tts_stream.abort &&
+         (tts_stream.len > 0 || tts_stream.busy)) {
+    pthread_cond_wait(&tts_stream.cond, &tts_stream.mutex);
+  }
+  tts_stream.draining = false;
+  pthread_mutex_unlock(&tts_stream.mutex);
+}
+
+/* Drops everything queued and makes pico2aud() give up */
+void tts_stream_abort() {
+  picoSynthAbort = 1;
+  pthread_mutex_lock(&tts_stream.mutex);
+  tts_stream.abort = true;
+  tts_stream.head = tts_stream.tail = tts_stream.len = 0;
+  pthread_cond_broadcast(&tts_stream.cond);
+  pthread_mutex_unlock(&tts_stream.mutex);
+}
+
+void tts_stream_stop() {
+  pthread_mutex_lock(&tts_stream.mutex);
+  if (!tts_stream.running) {
+    pthread_mutex_unlock(&tts_stream.mutex);
+    return;
+  }
+  tts_stream.running = false;
+  pthread_cond_broadcast(&tts_stream.cond);
+  pthread_mutex_unlock(&tts_stream.mutex);
+  pthread_join(tts_stream.thread, NULL);
+  tts_stream.pcm = NULL;
+}
+
+/* Synthesizes the phrase into the speech stream */
+int pico2aud(char *phrase, size_t len) {
+  char *text = phrase;
+  int ret, getstatus;
+  pico_Char *inp = NULL;
+  pico_Char *local_text = NULL;
+  short outbuf[MAX_OUTBUF_SIZE / 2];
+  pico_Int16 bytes_sent, bytes_recv, text_remaining, out_data_type;
+  pico_Retstring outMessage;
 
-  picoos_SDFile sdOutFile = NULL;
+  if (len < 1) {
+    logger(MSG_WARN, "%s: Nothing to say\n", __func__);
+    return 0;
+  }
 
-  picoos_bool done = TRUE;
-  if (TRUE !=
-      (done = picoos_sdfOpenOut(common, &sdOutFile, (picoos_char *)wavefile,
-                                SAMPLE_FREQ_16KHZ, PICOOS_ENC_LIN))) {
-    logger(MSG_ERROR, "Cannot open output wave file\n");
-    ret = 1;
-    goto disposeEngine;
+  pthread_mutex_lock(&pico_mutex);
+  picoSynthAbort = 0;
+  if ((ret = pico_engine_setup())) {
+    pthread_mutex_unlock(&pico_mutex);
+    return ret;
   }
 
+  local_text = (pico_Char *)text;
+  text_remaining = strlen((const char *)local_text) + 1;
+  inp = (pico_Char *)local_text;
+
   /* synthesis loop   */
-  while (text_remaining) {
+  while (text_remaining && !picoSynthAbort) {
     /* Feed the text into the engine.   */
     if ((ret =
              pico_putTextUtf8(picoEngine, inp, text_remaining, &bytes_sent))) {
       pico_getSystemStatusMessage(picoSystem, ret, outMessage);
       logger(MSG_ERROR, "Cannot put Text (%i): %s\n", ret, outMessage);
-      goto disposeEngine;
+      goto engine_error;
     }
 
     text_remaining -= bytes_sent;
@@ -233,98 +425,41 @@ int pico2aud(char *phrase, size_t len) {
 
     do {
       if (picoSynthAbort) {
-        goto disposeEngine;
+        break;
       }
-      /* Retrieve the samples and add them to the buffer. */
+      /* Retrieve the samples and send them to the speaker */
       getstatus = pico_getData(picoEngine, (void *)outbuf, MAX_OUTBUF_SIZE,
                                &bytes_recv, &out_data_type);
       if ((getstatus != PICO_STEP_BUSY) && (getstatus != PICO_STEP_IDLE)) {
         pico_getSystemStatusMessage(picoSystem, getstatus, outMessage);
         logger(MSG_ERROR, "Cannot get Data (%i): %s\n", getstatus, outMessage);
-        goto disposeEngine;
+        ret = getstatus;
+        goto engine_error;
       }
-      if (bytes_recv) {
-        if ((bufused + bytes_recv) <= bufferSize) {
-          memcpy(buffer + bufused, (int8_t *)outbuf, bytes_recv);
-          bufused += bytes_recv;
-        } else {
-          done = picoos_sdfPutSamples(sdOutFile, bufused / 2,
-                                      (picoos_int16 *)(buffer));
-          bufused = 0;
-          memcpy(buffer, (int8_t *)outbuf, bytes_recv);
-          bufused += bytes_recv;
-        }
+      if (bytes_recv &&
+          tts_stream_write((uint8_t *)outbuf, bytes_recv) < 0) {
+        logger(MSG_DEBUG, "%s: Speech stream closed, stopping\n", __func__);
+        picoSynthAbort = 1;
+        ret = -ECANCELED;
       }
     } while (PICO_STEP_BUSY == getstatus);
-    /* This chunk of synthesis is finished; pass the remaining samples. */
-    if (!picoSynthAbort) {
-      done = picoos_sdfPutSamples(sdOutFile, bufused / 2,
-                                  (picoos_int16 *)(buffer));
-    }
-    picoSynthAbort = 0;
-  }
-
-  if (TRUE != (done = picoos_sdfCloseOut(common, &sdOutFile))) {
-    logger(MSG_ERROR, "Cannot close output wave file\n");
-    ret = 1;
-    goto disposeEngine;
   }
+  picoSynthAbort = 0;
 
-disposeEngine:
-  if (picoEngine) {
-    pico_disposeEngine(picoSystem, &picoEngine);
-    pico_releaseVoiceDefinition(picoSystem, (pico_Char *)PICO_VOICE_NAME);
-    picoEngine = NULL;
-  }
-unloadUtppResource:
-  if (picoUtppResource) {
-    pico_unloadResource(picoSystem, &picoUtppResource);
-    picoUtppResource = NULL;
-  }
-unloadSgResource:
-  if (picoSgResource) {
-    pico_unloadResource(picoSystem, &picoSgResource);
-    picoSgResource = NULL;
-  }
-unloadTaResource:
-  if (picoTaResource) {
-    pico_unloadResource(picoSystem, &picoTaResource);
-    picoTaResource = NULL;
+  /* Drop whatever is left in the engine, keep it for the next phrase */
+  if (pico_resetEngine(picoEngine, PICO_RESET_SOFT)) {
+    logger(MSG_WARN, "%s: Soft reset failed, will reload the engine\n",
+           __func__);
+    pico_engine_teardown();
   }
-terminate:
-  if (picoSystem) {
-    pico_terminate(&picoSystem);
-    picoSystem = NULL;
-  }
-
   logger(MSG_DEBUG, "%s: Getting out of pico2aud - %i\n", __func__, ret);
+  pthread_mutex_unlock(&pico_mutex);
+  return ret;
 
-  free(buffer);
-  free(picoMemArea);
-  free(picoTaFileName);
-  free(picoSgFileName);
-  free(picoTaResourceName);
-  free(picoSgResourceName);
-  free(picoSystem);
-  free(picoTaResource);
-  free(picoSgResource);
-  free(picoUtppResource);
-  free(picoEngine);
-  free(picoUtppFileName);
-  free(picoUtppResourceName);
-
-  buffer = NULL;
-  picoMemArea = NULL;
-  picoTaFileName = NULL;
-  picoSgFileName = NULL;
-  picoTaResourceName = NULL;
-  picoSgResourceName = NULL;
-  picoSystem = NULL;
-  picoTaResource = NULL;
-  picoSgResource = NULL;
-  picoUtppResource = NULL;
-  picoEngine = NULL;
-  picoUtppFileName = NULL;
-  picoUtppResourceName = NULL;
+engine_error:
+  /* Start from scratch next time */
+  pico_engine_teardown();
+  logger(MSG_DEBUG, "%s: Getting out of pico2aud - %i\n", __func__, ret);
+  pthread_mutex_unlock(&pico_mutex);
   return ret;
 }
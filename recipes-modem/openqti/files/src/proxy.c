@@ -4,63 +4,313 @@
 #include "../inc/atfwd.h"
 #include "../inc/audio.h"
 #include "../inc/call.h"
+#include "../inc/capture.h"
 #include "../inc/cell.h"
 #include "../inc/config.h"
 #include "../inc/devices.h"
+#include "../inc/dispatch.h"
 #include "../inc/helpers.h"
 #include "../inc/ipc.h"
 #include "../inc/logger.h"
+#include "../inc/nmea.h"
 #include "../inc/openqti.h"
 #include "../inc/qmi.h"
 #include "../inc/sms.h"
 #include "../inc/tracking.h"
+#include "../inc/wake.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
-int is_usb_suspended = 0;
-struct pkt_stats rmnet_packet_stats;
-struct pkt_stats gps_packet_stats;
+struct proxy_stats rmnet_packet_stats;
+struct proxy_stats gps_packet_stats;
+
+/*
+ * The eventfd is created before any thread is spawned, so producers
+ * can always signal it even if the rmnet thread isn't running yet
+ */
+struct {
+  int inject_evfd;
+  pthread_once_t handlers_once;
+} proxy_runtime = {
+    .inject_evfd = -1,
+    .handlers_once = PTHREAD_ONCE_INIT,
+};
+
+static void register_proxy_handlers();
+
+struct {
+  atomic_int is_suspended;
+  pthread_mutex_t mutex;
+  int listeners[SUSPEND_MAX_LISTENERS];
+  uint8_t num_listeners;
+} suspend_monitor = {
+    .is_suspended = 0,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .num_listeners = 0,
+};
+
+void init_proxy_runtime() {
+  pthread_once(&proxy_runtime.handlers_once, register_proxy_handlers);
+  if (proxy_runtime.inject_evfd < 0) {
+    proxy_runtime.inject_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (proxy_runtime.inject_evfd < 0) {
+      logger(MSG_ERROR, "%s: Cannot create the injection eventfd\n",
+             __func__);
+    }
+  }
+}
+
+/*
+ *  request_proxy_injection
+ *    Wakes up rmnet_proxy so it checks is_inject_needed(). Called
+ *    whenever a message or a call is queued, from any thread
+ */
+void request_proxy_injection() {
+  uint64_t val = 1;
+  if (proxy_runtime.inject_evfd < 0)
+    return;
+
+  if (write(proxy_runtime.inject_evfd, &val, sizeof(val)) != sizeof(val) &&
+      errno != EAGAIN) {
+    logger(MSG_ERROR, "%s: Failed to signal the proxy\n", __func__);
+  }
+}
+
+/* Drain an eventfd or a timerfd after it fired */
+static void proxy_drain_fd(int fd) {
+  uint64_t val;
+  if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+    logger(MSG_WARN, "%s: Error draining fd %i\n", __func__, fd);
+  }
+}
+
+/* Arm (periodic) or disarm a timerfd */
+static int proxy_set_timer(int timerfd, bool enable) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (enable) {
+    its.it_value.tv_sec = PROXY_TICK_INTERVAL_MS / 1000;
+    its.it_value.tv_nsec = (PROXY_TICK_INTERVAL_MS % 1000) * 1000000;
+    its.it_interval = its.it_value;
+  }
+  return timerfd_settime(timerfd, 0, &its, NULL);
+}
+
+/* Arm a timerfd to fire once, in timeout_ms, or disarm it if < 0 */
+static int proxy_set_timeout(int timerfd, int timeout_ms) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (timeout_ms >= 0) {
+    if (timeout_ms == 0)
+      timeout_ms = 1; // Zero would disarm it
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  }
+  return timerfd_settime(timerfd, 0, &its, NULL);
+}
+
+static int proxy_epoll_add(int epollfd, int fd) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static struct pkt_stats get_proxy_stats(struct proxy_stats *live) {
+  struct pkt_stats stats;
+  int i;
+
+  stats.bypassed = stat_read(live->bypassed);
+  stats.empty = stat_read(live->empty);
+  stats.discarded = stat_read(live->discarded);
+  stats.allowed = stat_read(live->allowed);
+  stats.failed = stat_read(live->failed);
+  stats.other = stat_read(live->other);
+  for (i = 0; i < 2; i++) {
+    stats.forward[i] = histogram_summary(&live->forward[i]);
+    stats.handler[i] = histogram_summary(&live->handler[i]);
+  }
+  return stats;
+}
 
 struct pkt_stats get_rmnet_stats() {
-  return rmnet_packet_stats;
+  return get_proxy_stats(&rmnet_packet_stats);
 }
 
 struct pkt_stats get_gps_stats() {
-  return gps_packet_stats;
+  return get_proxy_stats(&gps_packet_stats);
+}
+
+static void dump_proxy(FILE *fp, const char *name, struct proxy_stats *live,
+                       bool has_handler) {
+  static const char *dir_names[] = {"dsp", "host"}; // FROM_DSP, FROM_HOST
+  char prefix[64];
+  int i;
+
+  fprintf(fp, "%s.bypassed %llu\n", name,
+          (unsigned long long)stat_read(live->bypassed));
+  fprintf(fp, "%s.empty %llu\n", name,
+          (unsigned long long)stat_read(live->empty));
+  fprintf(fp, "%s.discarded %llu\n", name,
+          (unsigned long long)stat_read(live->discarded));
+  fprintf(fp, "%s.allowed %llu\n", name,
+          (unsigned long long)stat_read(live->allowed));
+  fprintf(fp, "%s.failed %llu\n", name,
+          (unsigned long long)stat_read(live->failed));
+  fprintf(fp, "%s.other %llu\n", name,
+          (unsigned long long)stat_read(live->other));
+  for (i = 0; i < 2; i++) {
+    snprintf(prefix, sizeof(prefix), "%s.forward.%s", name, dir_names[i]);
+    dump_histogram(fp, prefix, &live->forward[i]);
+    if (has_handler) {
+      snprintf(prefix, sizeof(prefix), "%s.handler.%s", name, dir_names[i]);
+      dump_histogram(fp, prefix, &live->handler[i]);
+    }
+  }
+}
+
+/* Machine readable dump, one "key value" pair per line */
+void dump_proxy_stats(FILE *fp) {
+  dump_proxy(fp, "rmnet", &rmnet_packet_stats, true);
+  dump_proxy(fp, "gps", &gps_packet_stats, false);
+}
+
+int write_proxy_stats(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    logger(MSG_ERROR, "%s: Can't open %s: %s\n", __func__, path,
+           strerror(errno));
+    return -errno;
+  }
+  dump_proxy_stats(fp);
+  fclose(fp);
+  return 0;
 }
 
+/*
+ * USB suspend state
+ *  The state is cached in an atomic and kept up to date by
+ *  suspend_monitor_thread(), so the proxies only pay for a load
+ *  per packet. The monitor sleeps in poll(POLLPRI) waiting for the
+ *  driver to sysfs_notify() the attribute. Until we've seen a
+ *  notification actually arrive, we also re-read it periodically
+ *  in case this kernel doesn't send them.
+ */
 int get_transceiver_suspend_state() {
-  int fd, val = 0;
+  return atomic_load_explicit(&suspend_monitor.is_suspended,
+                              memory_order_acquire);
+}
+
+/*
+ * Listeners get their eventfd signalled every time the state changes
+ * (i.e. the GPS proxy, to reopen its port on resume)
+ */
+int add_suspend_state_listener(int evfd) {
+  int ret = -ENOSPC;
+  pthread_mutex_lock(&suspend_monitor.mutex);
+  if (suspend_monitor.num_listeners < SUSPEND_MAX_LISTENERS) {
+    suspend_monitor.listeners[suspend_monitor.num_listeners++] = evfd;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&suspend_monitor.mutex);
+  return ret;
+}
+
+static void notify_suspend_state_listeners() {
+  uint64_t val = 1;
+  int i;
+  pthread_mutex_lock(&suspend_monitor.mutex);
+  for (i = 0; i < suspend_monitor.num_listeners; i++) {
+    if (write(suspend_monitor.listeners[i], &val, sizeof(val)) < 0 &&
+        errno != EAGAIN) {
+      logger(MSG_WARN, "%s: Failed to notify listener %i\n", __func__, i);
+    }
+  }
+  pthread_mutex_unlock(&suspend_monitor.mutex);
+}
+
+/* Returns the value in the attribute, or -EIO */
+static int read_suspend_state_attr(int fd) {
   char readval[6];
-  is_usb_suspended = 0;
-  fd = open("/sys/devices/78d9000.usb/msm_hsusb/isr_suspend_state", O_RDONLY);
-  if (fd < 0) {
-    logger(MSG_ERROR, "%s: Cannot open USB state \n", __func__);
-    return is_usb_suspended;
-  }
-  lseek(fd, 0, SEEK_SET);
-  if (read(fd, &readval, 1) <= 0) {
+  memset(readval, 0, sizeof(readval));
+  /* Reading is what re-arms sysfs_notify for the next poll() */
+  if (pread(fd, readval, sizeof(readval) - 1, 0) <= 0) {
     logger(MSG_ERROR, "%s: Error reading USB Sysfs entry \n", __func__);
-    close(fd);
-    return is_usb_suspended; // return last state
+    return -EIO;
+  }
+  return strtol(readval, NULL, 10) > 0 ? 1 : 0;
+}
+
+static void publish_suspend_state(int val) {
+  if (val < 0 || val == get_transceiver_suspend_state())
+    return;
+
+  if (val == 0) {
+    usleep(100000); // Allow time to finish wakeup, then allow transfers again
   }
-  val = strtol(readval, NULL, 10);
+  atomic_store_explicit(&suspend_monitor.is_suspended, val,
+                        memory_order_release);
+  logger(MSG_DEBUG, "%s: USB is now %s\n", __func__,
+         val ? "suspended" : "awake");
+  notify_suspend_state_listeners();
+}
+
+void *suspend_monitor_thread() {
+  struct pollfd pfd;
+  int fd, ret, val;
+  bool notify_works = false;
 
-  if (val > 0 && is_usb_suspended == 0) {
-    is_usb_suspended = 1; // USB is suspended, stop trying to transfer data
-                          // system("echo mem > /sys/power/state");
-  } else if (val == 0 && is_usb_suspended == 1) {
-    usleep(100000);       // Allow time to finish wakeup
-    is_usb_suspended = 0; // Then allow transfers again
+  logger(MSG_INFO, "%s: Initialize USB suspend monitor thread.\n", __func__);
+  while (1) {
+    fd = open_device(USB_SUSPEND_STATE_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      logger(MSG_ERROR, "%s: Cannot open USB state, retrying \n", __func__);
+      sleep(5);
+      continue;
+    }
+
+    publish_suspend_state(read_suspend_state_attr(fd));
+    while (1) {
+      pfd.fd = fd;
+      pfd.events = POLLPRI | POLLERR;
+      pfd.revents = 0;
+      ret = poll(&pfd, 1, notify_works ? -1 : SUSPEND_POLL_FALLBACK_MS);
+      if (ret < 0) {
+        if (errno == EINTR)
+          continue;
+        logger(MSG_ERROR, "%s: poll failed: %i\n", __func__, errno);
+        break;
+      }
+      if (pfd.revents & POLLNVAL)
+        break;
+
+      val = read_suspend_state_attr(fd);
+      if (val < 0)
+        break;
+      if (ret > 0 && !notify_works &&
+          val != get_transceiver_suspend_state()) {
+        logger(MSG_INFO, "%s: Got a sysfs notification, stop polling\n",
+               __func__);
+        notify_works = true;
+      }
+      publish_suspend_state(val);
+    }
+    close(fd);
+    sleep(1);
   }
-  close(fd);
-  return is_usb_suspended;
+
+  return NULL;
 }
 
 /*
@@ -72,7 +322,10 @@ int get_transceiver_suspend_state() {
  *  Since we don't want to kill user's GPS session, but at
  *  the same time we don't want the modem to die, we just
  *  allow the buffer to slowly drain of NMEA messages but
- *  we ignore them without sending them to the USB port.
+ *  we don't send them to the USB port. Depending on the
+ *  gps_suspend_policy setting they're thrown away or kept
+ *  in a bounded buffer (see nmea.c), which is flushed as
+ *  soon as the port is back so the host gets a fresh fix.
  *  When phone wakes up again (assuming something was
  *  using it), GPS is still active and won't need resyncing
  */
@@ -80,82 +333,140 @@ int get_transceiver_suspend_state() {
 void *gps_proxy() {
   struct node_pair *nodes;
   nodes = calloc(1, sizeof(struct node_pair));
-  int ret;
-  fd_set readfds;
+  int ret, i, nevents, epollfd, timerfd, resume_evfd;
+  bool timer_armed = false;
+  bool usb_skip_logged = false;
+  bool needs_retry;
+  uint64_t read_ns;
+  struct epoll_event events[PROXY_MAX_EVENTS];
   uint8_t buf[MAX_PACKET_SIZE];
-  struct timeval tv;
+  const uint8_t *nmea;
+  size_t nmea_len;
   logger(MSG_INFO, "%s: Initialize GPS proxy thread.\n", __func__);
 
   nodes->node1.fd = -1;
   nodes->node2.fd = -1;
 
-  while (1) {
-    FD_ZERO(&readfds);
-    memset(buf, 0, sizeof(buf));
+  epollfd = epoll_create1(EPOLL_CLOEXEC);
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  resume_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epollfd < 0 || timerfd < 0 || resume_evfd < 0 ||
+      proxy_epoll_add(epollfd, timerfd) < 0 ||
+      proxy_epoll_add(epollfd, resume_evfd) < 0) {
+    logger(MSG_ERROR, "%s: Cannot set up the event loop\n", __func__);
+    return NULL;
+  }
+  if (add_suspend_state_listener(resume_evfd) < 0) {
+    logger(MSG_ERROR, "%s: Cannot listen to USB suspend events\n", __func__);
+  }
+  init_nmea_buffer(get_gps_suspend_policy(),
+                   get_gps_suspend_buffer_kb() * 1024);
+  init_nmea_parser(get_gps_rate_limit_ms());
 
+  while (1) {
+    /* Closed fds leave the epoll set by themselves, reopen them here */
     if (nodes->node1.fd < 0) {
-      nodes->node1.fd = open(SMD_GPS, O_RDWR);
+      nodes->node1.fd = open_device(SMD_GPS, O_RDWR);
       if (nodes->node1.fd < 0) {
         logger(MSG_ERROR, "%s: Error opening %s \n", __func__, SMD_GPS);
+      } else if (proxy_epoll_add(epollfd, nodes->node1.fd) < 0) {
+        logger(MSG_ERROR, "%s: Cannot watch %s\n", __func__, SMD_GPS);
       }
     }
 
     if (!get_transceiver_suspend_state() && nodes->node2.fd < 0) {
-      nodes->node2.fd = open(USB_GPS, O_RDWR);
+      nodes->node2.fd = open_device(USB_GPS, O_RDWR);
       if (nodes->node2.fd < 0) {
         logger(MSG_ERROR, "%s: Error opening %s \n", __func__, USB_GPS);
+      } else if (proxy_epoll_add(epollfd, nodes->node2.fd) < 0) {
+        logger(MSG_ERROR, "%s: Cannot watch %s\n", __func__, USB_GPS);
       }
-    } else if (nodes->node2.fd < 0) {
+      usb_skip_logged = false;
+    } else if (nodes->node2.fd < 0 && !usb_skip_logged) {
       logger(MSG_WARN, "%s: Not trying to open USB GPS \n", __func__);
+      usb_skip_logged = true;
     }
 
-    FD_SET(nodes->node1.fd, &readfds);
-    if (nodes->node2.fd > 0) {
-      FD_SET(nodes->node2.fd, &readfds);
+    /* Back from suspend, catch the host up before anything else */
+    if (!get_transceiver_suspend_state() && nodes->node2.fd >= 0 &&
+        nmea_buffer_pending())
+      nmea_buffer_flush(nodes->node2.fd);
+
+    /*
+     * Only tick while we have a port to retry. While suspended, the
+     * monitor wakes us up on resume so we don't need to
+     */
+    needs_retry = nodes->node1.fd < 0 ||
+                  (nodes->node2.fd < 0 && !get_transceiver_suspend_state());
+    if (needs_retry != timer_armed) {
+      timer_armed = needs_retry;
+      proxy_set_timer(timerfd, timer_armed);
     }
 
-    tv.tv_sec = 0;
-    tv.tv_usec = 500000;
-    select(MAX_FD, &readfds, NULL, NULL, &tv);
-    if (FD_ISSET(nodes->node1.fd, &readfds)) {
-      ret = read(nodes->node1.fd, &buf, MAX_PACKET_SIZE);
-      if (ret > 0) {
-        dump_packet("GPS_SMD-->USB", buf, ret);
-        if (!get_transceiver_suspend_state() && nodes->node2.fd >= 0) {
-          gps_packet_stats.allowed++;
-          ret = write(nodes->node2.fd, buf, ret);
-          if (ret == 0) {
-            gps_packet_stats.failed++;
-            logger(MSG_ERROR, "%s: [GPS_TRACK Failed to write to USB\n",
-                   __func__);
+    nevents = epoll_wait(epollfd, events, PROXY_MAX_EVENTS, -1);
+    if (nevents < 0) {
+      if (errno != EINTR)
+        logger(MSG_ERROR, "%s: epoll_wait failed: %i\n", __func__, errno);
+      continue;
+    }
+
+    for (i = 0; i < nevents; i++) {
+      if (events[i].data.fd == timerfd || events[i].data.fd == resume_evfd) {
+        proxy_drain_fd(events[i].data.fd);
+      } else if (events[i].data.fd == nodes->node1.fd) {
+        ret = read(nodes->node1.fd, &buf, MAX_PACKET_SIZE);
+        read_ns = stats_now_ns();
+        if (ret > 0) {
+          dump_packet("GPS_SMD-->USB", buf, ret);
+          nmea_len = ret;
+          nmea = process_nmea_data(buf, &nmea_len);
+          if (nmea_len == 0) {
+            /* Rate limited, or only half a sentence so far */
+            stat_inc(gps_packet_stats.bypassed);
+          } else if (!get_transceiver_suspend_state() &&
+                     nodes->node2.fd >= 0) {
+            stat_inc(gps_packet_stats.allowed);
+            ret = write(nodes->node2.fd, nmea, nmea_len);
+            if (ret == 0) {
+              stat_inc(gps_packet_stats.failed);
+              logger(MSG_ERROR, "%s: [GPS_TRACK Failed to write to USB\n",
+                     __func__);
+            } else {
+              histogram_record_since(&gps_packet_stats.forward[FROM_DSP],
+                                     read_ns);
+            }
+          } else {
+            stat_inc(gps_packet_stats.discarded);
+            nmea_buffer_store(nmea, nmea_len);
           }
         } else {
-          gps_packet_stats.discarded++;
+          stat_inc(gps_packet_stats.empty);
+          logger(MSG_WARN, "%s: Closing at the ADSP side \n", __func__);
+          close(nodes->node1.fd);
+          nodes->node1.fd = -1;
         }
-      } else {
-        gps_packet_stats.empty++;
-        logger(MSG_WARN, "%s: Closing at the ADSP side \n", __func__);
-        close(nodes->node1.fd);
-        nodes->node1.fd = -1;
-      }
-    } else if (!get_transceiver_suspend_state() && nodes->node2.fd >= 0 &&
-               FD_ISSET(nodes->node2.fd, &readfds)) {
-
-      ret = read(nodes->node2.fd, &buf, MAX_PACKET_SIZE);
-      if (ret > 0) {
-        gps_packet_stats.allowed++;
-        dump_packet("GPS_SMD<--USB", buf, ret);
-        ret = write(nodes->node1.fd, buf, ret);
-        if (ret == 0) {
-          gps_packet_stats.failed++;
-          logger(MSG_ERROR, "%s: Failed to write to the ADSP\n", __func__);
+      } else if (events[i].data.fd == nodes->node2.fd &&
+                 !get_transceiver_suspend_state()) {
+        ret = read(nodes->node2.fd, &buf, MAX_PACKET_SIZE);
+        read_ns = stats_now_ns();
+        if (ret > 0) {
+          stat_inc(gps_packet_stats.allowed);
+          dump_packet("GPS_SMD<--USB", buf, ret);
+          ret = write(nodes->node1.fd, buf, ret);
+          if (ret == 0) {
+            stat_inc(gps_packet_stats.failed);
+            logger(MSG_ERROR, "%s: Failed to write to the ADSP\n", __func__);
+          } else {
+            histogram_record_since(&gps_packet_stats.forward[FROM_HOST],
+                                   read_ns);
+          }
+        } else {
+          stat_inc(gps_packet_stats.empty);
+          logger(MSG_ERROR, "%s: Closing at the USB side \n", __func__);
+          nodes->allow_exit = true;
+          close(nodes->node2.fd);
+          nodes->node2.fd = -1;
         }
-      } else {
-        gps_packet_stats.empty++;
-        logger(MSG_ERROR, "%s: Closing at the USB side \n", __func__);
-        nodes->allow_exit = true;
-        close(nodes->node2.fd);
-        nodes->node2.fd = -1;
       }
     }
   }
@@ -210,17 +521,102 @@ void send_hello_world() {
   add_message_to_queue((uint8_t *)message, strlen(message));
 }
 
+/*
+ * QMI message handlers
+ *  Registered in the dispatch table by register_proxy_handlers(), they
+ *  return what process_packet() should do with the message
+ */
+static uint8_t handle_ctl_client(uint8_t source, uint8_t *pkt, size_t len,
+                                 uint16_t msgid, int adspfd, int usbfd) {
+  logger(MSG_DEBUG, "%s Control packet \n", __func__);
+  // reroute to the tracker for further inspection
+  track_client_count(pkt, source, len, adspfd, usbfd);
+  return PACKET_PASS_TRHU;
+}
+
+static uint8_t handle_nas_signal(uint8_t source, uint8_t *pkt, size_t len,
+                                 uint16_t msgid, int adspfd, int usbfd) {
+  struct nas_signal_lev *level = (struct nas_signal_lev *)pkt;
+  uint8_t action = PACKET_PASS_TRHU;
+
+  logger(MSG_DEBUG, "%s: Network Access service\n", __func__);
+  if (len >= sizeof(struct nas_signal_lev) && level->signal.id == 0x10) {
+    /* The network state worker does the slow part */
+    queue_network_update(level->signal.network_type,
+                         level->signal.signal_level);
+    if (is_first_boot()) {
+      send_hello_world();
+    }
+    if (get_call_simulation_mode()) {
+      logger(MSG_INFO, "%s: Skip signall level reporting while in call\n",
+             __func__);
+      action = PACKET_BYPASS;
+    }
+  }
+  return action;
+}
+
+/* Here we'll trap messages to the Modem */
+/* FIXME: Track message notifications too */
+static uint8_t handle_wms(uint8_t source, uint8_t *pkt, size_t len,
+                          uint16_t msgid, int adspfd, int usbfd) {
+  logger(MSG_DEBUG, "%s WMS Packet\n", __func__);
+  if (check_wms_message(source, pkt, len, adspfd, usbfd)) {
+    return PACKET_BYPASS; // We bypass response
+  } else if (check_wms_indication_message(pkt, len, adspfd, usbfd)) {
+    return PACKET_BYPASS; // Held until the host wakes up
+  } else if (check_cb_message(pkt, len, adspfd, usbfd)) {
+    return PACKET_FORCED_PT;
+  } else if (process_wms_packet(pkt, len, adspfd, usbfd)) {
+    return PACKET_BYPASS; // We bypass response
+  }
+  return PACKET_FORCED_PT;
+}
+
+/* Here we'll handle in call audio and simulated voicecalls */
+/* REMEMBER: 0x002e -> Call indication
+             0x0024 -> All Call information */
+static uint8_t handle_voice(uint8_t source, uint8_t *pkt, size_t len,
+                            uint16_t msgid, int adspfd, int usbfd) {
+  if (call_service_handler(source, pkt, len, msgid, adspfd, usbfd)) {
+    return PACKET_BYPASS; // in case user is calling us specifically
+  }
+  return PACKET_FORCED_PT;
+}
+
+static uint8_t handle_location(uint8_t source, uint8_t *pkt, size_t len,
+                               uint16_t msgid, int adspfd, int usbfd) {
+  logger(MSG_DEBUG, "%s Location service packet, MSG ID = %.4x \n", __func__,
+         msgid);
+  stat_inc(gps_packet_stats.other);
+  return PACKET_PASS_TRHU;
+}
+
+static void register_proxy_handlers() {
+  register_qmi_handler(0, 0x0022, QMI_DIR_ANY, "CTL client alloc",
+                       handle_ctl_client);
+  register_qmi_handler(0, 0x0023, QMI_DIR_ANY, "CTL client release",
+                       handle_ctl_client);
+  register_qmi_handler(3, 0x0002, QMI_DIR_ANY, "NAS signal level",
+                       handle_nas_signal);
+  register_qmi_handler(5, QMI_MSGID_ANY, QMI_DIR_ANY, "WMS", handle_wms);
+  register_qmi_handler(9, QMI_MSGID_ANY, QMI_DIR_ANY, "Voice", handle_voice);
+  register_qmi_handler(16, QMI_MSGID_ANY, QMI_DIR_ANY, "Location",
+                       handle_location);
+}
+
 /* Node1 -> RMNET , Node2 -> SMD */
 /*
  *  process_packet()
  *    Looks at the QMI message to get the service type
  *    and if needed, moves the message somewhere else
- *    for further processing
+ *    for further processing through the dispatch table
  */
 uint8_t process_packet(uint8_t source, uint8_t *pkt, size_t pkt_size,
                        int adspfd, int usbfd) {
   struct encapsulated_qmi_packet *packet;
   struct encapsulated_control_packet *ctl_packet;
+  uint16_t msgid;
 
   // By default everything should just go to its place
   int action = PACKET_PASS_TRHU;
@@ -232,6 +628,7 @@ uint8_t process_packet(uint8_t source, uint8_t *pkt, size_t pkt_size,
            pkt_size);
   }
   dump_packet(source == FROM_HOST ? "HOST->SMD" : "HOST<-SMD", pkt, pkt_size);
+  capture_packet(source, pkt, pkt_size);
 
   if (pkt_size == 0) {   // Port was closed
     return PACKET_EMPTY; // Abort processing
@@ -255,74 +652,23 @@ uint8_t process_packet(uint8_t source, uint8_t *pkt, size_t pkt_size,
          pkt_size, packet->qmux.packet_length,
          get_service_name(packet->qmux.service));
 
-  /* In the future we can use this as a router inside the application.
-   * For now we only do some simple tasks depending on service, so no
-   * need to do too much
-   */
-  switch (ctl_packet->qmux.service) {
-  case 0: // Control packet with no service
-    logger(MSG_DEBUG, "%s Control packet \n",
-           __func__); // reroute to the tracker for further inspection
-    if (ctl_packet->qmi.msgid == 0x0022 || ctl_packet->qmi.msgid == 0x0023) {
-      track_client_count(pkt, source, pkt_size, adspfd, usbfd);
-    }
-    break;
-
-  case 3:
-    logger(MSG_DEBUG, "%s: Network Access service\n", __func__);
-    struct nas_signal_lev *level = (struct nas_signal_lev *)pkt;
-    if (level->qmipkt.msgid == 0x0002 && level->signal.id == 0x10) {
-      update_network_data(level->signal.network_type,
-                          level->signal.signal_level);
-      if (is_first_boot()) {
-        send_hello_world();
-      }
-      if (get_call_simulation_mode()) {
-        logger(MSG_INFO, "%s: Skip signall level reporting while in call\n",
-               __func__);
-        action = PACKET_BYPASS;
-      }
-    }
-    level = NULL;
-    break;
-  /* Here we'll trap messages to the Modem */
-  /* FIXME->FIXED: HERE ONLY MESSAGES TO OUR CUSTOM TARGET! */
-  /* FIXME: Track message notifications too */
-  case 5: // Message for the WMS service
-    action = PACKET_FORCED_PT;
-    logger(MSG_DEBUG, "%s WMS Packet\n", __func__);
-    if (check_wms_message(source, pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_BYPASS; // We bypass response
-    } else if (check_wms_indication_message(pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_FORCED_PT;
-    } else if (check_cb_message(pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_FORCED_PT;
-    } else if (process_wms_packet(pkt, pkt_size, adspfd, usbfd)) {
-      action = PACKET_BYPASS; // We bypass response
-    }
-
-    break;
-
-  /* Here we'll handle in call audio and simulated voicecalls */
-  /* REMEMBER: 0x002e -> Call indication
-               0x0024 -> All Call information */
-  case 9: // Voice service
-    action = PACKET_FORCED_PT;
-    if (call_service_handler(source, pkt, pkt_size, packet->qmi.msgid, adspfd,
-                             usbfd)) {
-      action = PACKET_BYPASS; // in case user is calling us specifically
+  if (packet->qmux.service == 0) {
+    msgid = ctl_packet->qmi.msgid;
+  } else {
+    /* Control messages have a shorter header, only index the rest */
+    if (pin_tlv_index(pkt, pkt_size) < 0) {
+      /* Handlers can't trust anything in it, it goes through untouched */
+      logger(MSG_WARN, "%s: Broken TLV chain in %s message 0x%.4x\n",
+             __func__, get_service_name(packet->qmux.service),
+             packet->qmi.msgid);
+      return PACKET_PASS_TRHU;
     }
-    break;
-
-  case 16: // Location service
-    logger(MSG_DEBUG, "%s Location service packet, MSG ID = %.4x \n", __func__,
-           packet->qmi.msgid);
-    gps_packet_stats.other++;
-    break;
-
-  default:
-    break;
+    msgid = packet->qmi.msgid;
   }
+  action = dispatch_qmi_message(source, packet->qmux.service, msgid, pkt,
+                                pkt_size, adspfd, usbfd);
+
+  unpin_tlv_index();
   packet = NULL;
   ctl_packet = NULL;
   return action; // 1 == Pass through
@@ -353,72 +699,147 @@ uint8_t is_inject_needed() {
   return 0;
 }
 
+/*
+ *  get_inject_timeout_ms
+ *    How long rmnet_proxy can sleep before it needs to inject again,
+ *    or -1 if it can wait for someone to request it. Simulated calls
+ *    need the regular tick, the message queue only needs to be looked
+ *    at when the host is late to answer
+ */
+static int get_inject_timeout_ms() {
+  int timeout_ms;
+
+  if (get_call_pending() || get_call_simulation_mode())
+    return PROXY_TICK_INTERVAL_MS;
+  if (!is_message_pending())
+    return -1;
+  if (get_notification_source() != MSG_INTERNAL)
+    return PROXY_TICK_INTERVAL_MS;
+  timeout_ms = get_sms_retry_timeout_ms();
+  /* It couldn't be sent just now or the queue just emptied, come back */
+  if (timeout_ms <= 0)
+    return PROXY_TICK_INTERVAL_MS;
+  return timeout_ms;
+}
+
 /*
  *  rmnet_proxy
  *    Moves QMI messages between the host and the baseband firmware
  *    It also handles routing to internal (simulated) call and message
  *    functions.
+ *    The loop sleeps in epoll_wait until one of the ports has data or
+ *    someone calls request_proxy_injection(). While there's something
+ *    to inject, a one shot timerfd is armed for the next time it needs
+ *    attention (a message retry, the simulated call tick); when idle,
+ *    it's disarmed.
  */
 void *rmnet_proxy(void *node_data) {
   struct node_pair *nodes = (struct node_pair *)node_data;
-  uint8_t sourcefd, targetfd;
-  size_t bytes_read, bytes_written;
+  int sourcefd, targetfd;
+  int i, nevents, epollfd, timerfd, resume_evfd, timeout_ms;
+  bool check_inject;
+  ssize_t bytes_read, bytes_written;
   int8_t source;
-  fd_set readfds;
+  uint8_t action;
+  uint64_t read_ns;
+  struct epoll_event events[PROXY_MAX_EVENTS];
   uint8_t buf[MAX_PACKET_SIZE];
-  struct timeval tv;
 
   logger(MSG_INFO, "%s: Initialize RMNET proxy thread.\n", __func__);
 
+  init_proxy_runtime();
+  epollfd = epoll_create1(EPOLL_CLOEXEC);
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  resume_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epollfd < 0 || timerfd < 0 || resume_evfd < 0) {
+    logger(MSG_ERROR, "%s: Cannot set up the event loop\n", __func__);
+    return NULL;
+  }
+  if (proxy_epoll_add(epollfd, nodes->node2.fd) < 0 || // ADSP
+      proxy_epoll_add(epollfd, nodes->node1.fd) < 0 || // USB
+      proxy_epoll_add(epollfd, proxy_runtime.inject_evfd) < 0 ||
+      proxy_epoll_add(epollfd, timerfd) < 0 ||
+      proxy_epoll_add(epollfd, resume_evfd) < 0) {
+    logger(MSG_ERROR, "%s: Cannot add fds to the event loop\n", __func__);
+    return NULL;
+  }
+  /* To send what was held for the host as soon as it's back */
+  if (add_suspend_state_listener(resume_evfd) < 0) {
+    logger(MSG_ERROR, "%s: Cannot listen to USB suspend events\n", __func__);
+  }
+
+  /* Something might have been queued before we got here */
+  request_proxy_injection();
+
   while (1) {
-    source = -1;
-    sourcefd = -1;
-    targetfd = -1;
-    FD_ZERO(&readfds);
-    memset(buf, 0, sizeof(buf));
-    FD_SET(nodes->node2.fd, &readfds); // Always add ADSP
-    FD_SET(nodes->node1.fd, &readfds); // Testing: add usb always too
-
-    tv.tv_sec = 0;
-    tv.tv_usec = 500000;
-    select(MAX_FD, &readfds, NULL, NULL, &tv);
-    if (FD_ISSET(nodes->node2.fd, &readfds)) {
-      source = FROM_DSP;
-      sourcefd = nodes->node2.fd;
-      targetfd = nodes->node1.fd;
-    } else if (FD_ISSET(nodes->node1.fd, &readfds)) {
-      source = FROM_HOST;
-      sourcefd = nodes->node1.fd;
-      targetfd = nodes->node2.fd;
-    } else if (is_inject_needed()) {
-      source = FROM_OPENQTI;
-      logger(MSG_DEBUG, "%s: OpenQTI needs to inject data into USB \n",
-             __func__);
-      process_simulated_packet(source, nodes->node2.fd, nodes->node1.fd);
+    /* Only wake up on our own if there's capture data to write out */
+    nevents = epoll_wait(epollfd, events, PROXY_MAX_EVENTS,
+                         is_packet_capture_pending() ? QCAP_FLUSH_INTERVAL_MS
+                                                     : -1);
+    if (nevents < 0) {
+      if (errno != EINTR)
+        logger(MSG_ERROR, "%s: epoll_wait failed: %i\n", __func__, errno);
+      continue;
+    }
+    if (nevents == 0) {
+      flush_packet_capture();
+      continue;
     }
 
-    /* We've set it all up, now we do the work */
-    if (source == FROM_HOST || source == FROM_DSP) {
+    /* Anything held while suspended goes out before newer packets */
+    if (host_indications_parked() && !get_transceiver_suspend_state())
+      deliver_parked_indications(nodes->node1.fd);
+
+    check_inject = false;
+    for (i = 0; i < nevents; i++) {
+      source = -1;
+      sourcefd = -1;
+      targetfd = -1;
+      if (events[i].data.fd == nodes->node2.fd) {
+        source = FROM_DSP;
+        sourcefd = nodes->node2.fd;
+        targetfd = nodes->node1.fd;
+      } else if (events[i].data.fd == nodes->node1.fd) {
+        source = FROM_HOST;
+        sourcefd = nodes->node1.fd;
+        targetfd = nodes->node2.fd;
+      } else {
+        proxy_drain_fd(events[i].data.fd);
+        check_inject = true;
+        continue;
+      }
+
+      /* We've set it all up, now we do the work */
+      memset(buf, 0, sizeof(buf));
       bytes_read = read(sourcefd, &buf, MAX_PACKET_SIZE);
-      switch (process_packet(source, buf, bytes_read, nodes->node2.fd,
-                             nodes->node1.fd)) {
+      read_ns = stats_now_ns();
+      if (bytes_read < 0) {
+        bytes_read = 0;
+      }
+      action = process_packet(source, buf, bytes_read, nodes->node2.fd,
+                              nodes->node1.fd);
+      histogram_record_since(&rmnet_packet_stats.handler[source], read_ns);
+      switch (action) {
       case PACKET_EMPTY:
         logger(MSG_WARN, "%s Empty packet on %s, (device closed?)\n", __func__,
                (source == FROM_HOST ? "HOST" : "ADSP"));
-        rmnet_packet_stats.empty++;
+        stat_inc(rmnet_packet_stats.empty);
         break;
       case PACKET_PASS_TRHU:
         logger(MSG_DEBUG, "%s Pass through\n", __func__); // MSG_DEBUG
         if (!get_transceiver_suspend_state() || source == FROM_HOST) {
-          rmnet_packet_stats.allowed++;
+          stat_inc(rmnet_packet_stats.allowed);
           bytes_written = write(targetfd, buf, bytes_read);
           if (bytes_written < 1) {
             logger(MSG_WARN, "%s Error writing to %s\n", __func__,
                    (source == FROM_HOST ? "ADSP" : "HOST"));
-            rmnet_packet_stats.failed++;
+            stat_inc(rmnet_packet_stats.failed);
+          } else {
+            histogram_record_since(&rmnet_packet_stats.forward[source],
+                                   read_ns);
           }
         } else {
-          rmnet_packet_stats.discarded++;
+          stat_inc(rmnet_packet_stats.discarded);
           logger(MSG_DEBUG, "%s Data discarded from %s to %s\n", __func__,
                  (source == FROM_HOST ? "HOST" : "ADSP"),
                  (source == FROM_HOST ? "ADSP" : "HOST"));
@@ -426,16 +847,18 @@ void *rmnet_proxy(void *node_data) {
         break;
       case PACKET_FORCED_PT:
         logger(MSG_DEBUG, "%s Force pass through\n", __func__); // MSG_DEBUG
-        rmnet_packet_stats.allowed++;
+        stat_inc(rmnet_packet_stats.allowed);
         bytes_written = write(targetfd, buf, bytes_read);
         if (bytes_written < 1) {
           logger(MSG_WARN, "%s [FPT] Error writing to %s\n", __func__,
                  (source == FROM_HOST ? "ADSP" : "HOST"));
-          rmnet_packet_stats.failed++;
+          stat_inc(rmnet_packet_stats.failed);
+        } else {
+          histogram_record_since(&rmnet_packet_stats.forward[source], read_ns);
         }
         break;
       case PACKET_BYPASS:
-        rmnet_packet_stats.bypassed++;
+        stat_inc(rmnet_packet_stats.bypassed);
         logger(MSG_DEBUG, "%s Packet bypassed\n", __func__);
         break;
 
@@ -444,6 +867,19 @@ void *rmnet_proxy(void *node_data) {
         break;
       }
     }
+
+    /* Woken up by a producer or by the retry tick */
+    if (check_inject) {
+      timeout_ms = -1;
+      if (is_inject_needed()) {
+        logger(MSG_DEBUG, "%s: OpenQTI needs to inject data into USB \n",
+               __func__);
+        process_simulated_packet(FROM_OPENQTI, nodes->node2.fd,
+                                 nodes->node1.fd);
+        timeout_ms = get_inject_timeout_ms();
+      }
+      proxy_set_timeout(timerfd, timeout_ms);
+    }
   } // end of infinite loop
 
   return NULL;
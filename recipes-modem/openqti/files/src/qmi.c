@@ -40,40 +40,123 @@ uint16_t get_transaction_id(void *bytes, size_t len) {
   return pkt->qmi.transaction_id;
 }
 
-/* Looks for the request TLV, and if found, it returns the offset
- * so it can be casted later
- * Not all the modem handling daemons send TLVs in the same order,
- * This allows us to avoid having to hardcode every possible combination
+/*
+ * TLV index
+ *  Walks the TLV chain of a QMI message once, checking every length
+ *  field against the size of the packet, and records where each TLV
+ *  is. If an ID is repeated, the first one wins, like it always did.
+ *  Messages with a broken chain are rejected as a whole here, so the
+ *  handlers never have to trust a length field on their own.
+ *  Returns the number of TLVs or -EINVAL
  */
-uint16_t get_tlv_offset_by_id(uint8_t *bytes, size_t len, uint8_t tlvid) {
-  uint16_t cur_byte;
-  uint8_t *arr = (uint8_t *)bytes;
-  struct empty_tlv *this_tlv;
-  if (len < sizeof(struct encapsulated_qmi_packet) + 4) {
+int build_tlv_index(struct qmi_tlv_index *index, uint8_t *bytes, size_t len) {
+  struct encapsulated_qmi_packet *pkt = (struct encapsulated_qmi_packet *)bytes;
+  struct tlv_header *this_tlv;
+  size_t cur_byte, end;
+  uint16_t tlv_len;
+
+  index->pkt = NULL;
+  index->pkt_len = 0;
+  index->num_tlvs = 0;
+  memset(index->offset, 0, sizeof(index->offset));
+
+  if (len < sizeof(struct encapsulated_qmi_packet)) {
     logger(MSG_ERROR, "%s: Packet is too small \n", __func__);
     return -EINVAL;
   }
 
+  /* TLVs end where the QMI message says, anything past that is padding */
+  end = sizeof(struct encapsulated_qmi_packet) + le16toh(pkt->qmi.length);
+  if (end > len || end > UINT16_MAX) {
+    logger(MSG_ERROR, "%s: QMI message length exceeds the packet size\n",
+           __func__);
+    return -EINVAL;
+  }
+
   cur_byte = sizeof(struct encapsulated_qmi_packet);
-  while ((cur_byte) < len) {
-    this_tlv = (struct empty_tlv *)(arr + cur_byte);
-    if (this_tlv->id == tlvid) {
-      logger(MSG_DEBUG,
-             "Found TLV with ID 0x%.2x at offset %i with size 0x%.4x\n",
-             this_tlv->id, cur_byte, le16toh(this_tlv->len));
-      arr = NULL;
-      this_tlv = NULL;
-      return cur_byte;
+  while (cur_byte < end) {
+    if (end - cur_byte < sizeof(struct tlv_header)) {
+      logger(MSG_ERROR, "%s: Truncated TLV header at offset %zu\n", __func__,
+             cur_byte);
+      return -EINVAL;
     }
-    cur_byte += le16toh(this_tlv->len) + sizeof(uint8_t) + sizeof(uint16_t);
-    if (cur_byte <= 0 || cur_byte > len) {
-      logger(MSG_ERROR, "Current byte is less than or exceeds size\n");
-      arr = NULL;
-      this_tlv = NULL;
+    this_tlv = (struct tlv_header *)(bytes + cur_byte);
+    tlv_len = le16toh(this_tlv->len);
+    if (tlv_len > end - cur_byte - sizeof(struct tlv_header)) {
+      logger(MSG_ERROR, "%s: TLV 0x%.2x at offset %zu exceeds the packet\n",
+             __func__, this_tlv->id, cur_byte);
       return -EINVAL;
     }
+    if (index->offset[this_tlv->id] == 0) {
+      index->offset[this_tlv->id] = cur_byte;
+      index->len[this_tlv->id] = tlv_len;
+    }
+    index->num_tlvs++;
+    cur_byte += sizeof(struct tlv_header) + tlv_len;
+  }
+
+  index->pkt = bytes;
+  index->pkt_len = len;
+  return index->num_tlvs;
+}
+
+/*
+ * process_packet() pins the index of the message it's handling, so
+ * every lookup the handlers make on it is just a table read. Lookups
+ * on any other buffer build a throwaway index instead. If the chain
+ * is broken nothing is pinned, and the message never reaches them.
+ */
+static __thread struct {
+  bool pinned;
+  struct qmi_tlv_index index;
+} tlv_rt;
+
+int pin_tlv_index(uint8_t *bytes, size_t len) {
+  int ret = build_tlv_index(&tlv_rt.index, bytes, len);
+  tlv_rt.pinned = ret >= 0;
+  return ret;
+}
+
+void unpin_tlv_index() {
+  tlv_rt.pinned = false;
+  tlv_rt.index.pkt = NULL;
+}
+
+static int lookup_tlv(uint8_t *bytes, size_t len, uint8_t tlvid,
+                      uint16_t *tlv_len) {
+  struct qmi_tlv_index local;
+  struct qmi_tlv_index *index = &tlv_rt.index;
+
+  if (!tlv_rt.pinned || index->pkt != bytes || index->pkt_len != len) {
+    index = &local;
+    if (build_tlv_index(index, bytes, len) < 0)
+      return -EINVAL;
   }
-  arr = NULL;
-  this_tlv = NULL;
-  return -EINVAL;
+
+  if (index->offset[tlvid] == 0)
+    return -EINVAL;
+
+  logger(MSG_DEBUG, "Found TLV with ID 0x%.2x at offset %i with size 0x%.4x\n",
+         tlvid, index->offset[tlvid], index->len[tlvid]);
+  if (tlv_len)
+    *tlv_len = index->len[tlvid];
+  return index->offset[tlvid];
+}
+
+/* Looks for the request TLV, and if found, it returns the offset
+ * so it can be casted later
+ * Not all the modem handling daemons send TLVs in the same order,
+ * This allows us to avoid having to hardcode every possible combination
+ */
+int get_tlv_offset_by_id(uint8_t *bytes, size_t len, uint8_t tlvid) {
+  return lookup_tlv(bytes, len, tlvid, NULL);
+}
+
+/* Size of the TLV's payload, already checked against the packet */
+int get_tlv_len_by_id(uint8_t *bytes, size_t len, uint8_t tlvid) {
+  uint16_t tlv_len;
+  int ret = lookup_tlv(bytes, len, tlvid, &tlv_len);
+  if (ret < 0)
+    return ret;
+  return tlv_len;
 }
@@ -29,6 +29,15 @@ struct {
  *
  */
 
+int get_num_pending_tasks() {
+  int i, num = 0;
+  for (i = 0; i < MAX_NUM_TASKS; i++) {
+    if (sch_runtime.tasks[i].status == STATUS_PENDING)
+      num++;
+  }
+  return num;
+}
+
 int find_free_task_slot() {
   for (int i = 0; i < MAX_NUM_TASKS; i++) {
     if (sch_runtime.tasks[i].status == 0) {
@@ -1,23 +1,33 @@
 // SPDX-License-Identifier: MIT
 
 #include <asm-generic/errno-base.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../inc/arena.h"
 #include "../inc/atfwd.h"
 #include "../inc/call.h"
+#include "../inc/capture.h"
 #include "../inc/cell_broadcast.h"
 #include "../inc/command.h"
 #include "../inc/config.h"
+#include "../inc/gsm7.h"
 #include "../inc/helpers.h"
 #include "../inc/ipc.h"
 #include "../inc/logger.h"
 #include "../inc/proxy.h"
 #include "../inc/qmi.h"
 #include "../inc/sms.h"
+#include "../inc/sms_store.h"
+#include "../inc/stats.h"
 #include "../inc/timesync.h"
+#include "../inc/tpdu.h"
+#include "../inc/wake.h"
 
 /*
  * NOTE:
@@ -36,10 +46,10 @@
  */
 
 /*
- *  Array elem is #msg id
+ *  Slot index is #msg id
  *  pkt is whole packet
  *  send_state: 1 Notify | 2 Send | 3 DEL REQ | 4 Del SUCCESS
- *    On Del success wipe from array
+ *    On Del success the slot goes back to the ring
  */
 struct message {
   char pkt[MAX_MESSAGE_SIZE]; // JUST TEXT
@@ -48,125 +58,236 @@ struct message {
   uint8_t tp_dcs;
   uint8_t state; // message sending status
   uint8_t retries;
-  struct timespec timestamp; // to know when to give up
+  uint8_t concat_ref;   // Concatenated SMS reference
+  uint8_t concat_parts; // 0 or 1 if it's not part of a longer message
+  uint8_t concat_part;  // Starts at 1
+  uint64_t deadline_ns;  // CLOCK_MONOTONIC, when to stop waiting for the host
+  _Atomic uint32_t seq;  // Ring position this slot is waiting for
 };
 
+/*
+ * Bounded ring, as in Dmitry Vyukov's MPMC queue, but with only one
+ * consumer: the proxy thread, the only one talking to the host.
+ *  Any thread can add messages. Producers claim a position by moving
+ *  tail forward, fill the slot and then publish it by setting its seq
+ *  to position + 1. When the consumer is done with the message at head
+ *  it hands the slot back by setting seq to position + capacity.
+ *  If the slot at tail still belongs to the previous lap, the queue is
+ *  full and the message is rejected instead of overwriting anything.
+ *  The host sees the slot index as the message id, so ids stay below
+ *  the capacity like they used to.
+ */
 struct message_queue {
-  bool needs_intercept;
-  int queue_pos;
-  // max QUEUE_SIZE message to keep, we use the array as MSGID
-  struct message msg[QUEUE_SIZE];
+  struct message *msg;
+  uint32_t capacity; // Power of two
+  uint32_t mask;
+  _Atomic uint32_t head; // Oldest message still being delivered
+  _Atomic uint32_t tail; // Next position to be claimed
+  _Atomic uint32_t high_water;
+  _Atomic uint64_t enqueued;
+  _Atomic uint64_t rejected;
+  _Atomic uint8_t next_concat_ref;
 };
 
 struct {
-  bool notif_pending;
-  uint8_t source;
+  atomic_bool notif_pending;
+  _Atomic uint8_t source;
   uint32_t current_message_id;
   uint16_t curr_transaction_id;
   struct message_queue queue;
 } sms_runtime;
 
+static uint32_t queue_capacity_for(uint16_t size) {
+  uint32_t capacity = 2;
+
+  if (size > SMS_QUEUE_MAX_SIZE)
+    size = SMS_QUEUE_MAX_SIZE;
+  while (capacity < size)
+    capacity <<= 1;
+  return capacity;
+}
+
 void reset_sms_runtime() {
+  uint32_t capacity = queue_capacity_for(get_sms_queue_size());
+  uint32_t i;
+
   sms_runtime.notif_pending = false;
   sms_runtime.curr_transaction_id = 0;
   sms_runtime.source = -1;
-  sms_runtime.queue.queue_pos = -1;
   sms_runtime.current_message_id = 0;
-}
 
-void set_notif_pending(bool pending) { sms_runtime.notif_pending = pending; }
-
-void set_pending_notification_source(uint8_t source) {
-  sms_runtime.source = source;
+  if (sms_runtime.queue.msg == NULL || sms_runtime.queue.capacity != capacity) {
+    free(sms_runtime.queue.msg);
+    sms_runtime.queue.msg = calloc(capacity, sizeof(struct message));
+    if (sms_runtime.queue.msg == NULL) {
+      logger(MSG_ERROR, "%s: Can't allocate the message queue\n", __func__);
+      capacity = 0;
+    }
+  }
+  sms_runtime.queue.capacity = capacity;
+  sms_runtime.queue.mask = capacity - 1;
+  for (i = 0; i < capacity; i++) {
+    memset(&sms_runtime.queue.msg[i], 0, sizeof(struct message));
+    atomic_init(&sms_runtime.queue.msg[i].seq, i);
+  }
+  atomic_store(&sms_runtime.queue.head, 0);
+  atomic_store(&sms_runtime.queue.tail, 0);
+  atomic_store(&sms_runtime.queue.high_water, 0);
+  atomic_store(&sms_runtime.queue.enqueued, 0);
+  atomic_store(&sms_runtime.queue.rejected, 0);
 }
 
-uint8_t get_notification_source() { return sms_runtime.source; }
-
-bool is_message_pending() { return sms_runtime.notif_pending; }
-
-int gsm7_to_ascii(const unsigned char *buffer, int buffer_length,
-                  char *output_sms_text, int sms_text_length) {
-  int output_text_length = 0;
-  if (buffer_length > 0)
-    output_sms_text[output_text_length++] = BITMASK_7BITS & buffer[0];
+int get_sms_queue_depth() {
+  uint32_t head, tail;
 
-  int carry_on_bits = 1;
-  int i = 1;
-  for (; i < buffer_length; ++i) {
-
-    output_sms_text[output_text_length++] =
-        BITMASK_7BITS &
-        ((buffer[i] << carry_on_bits) | (buffer[i - 1] >> (8 - carry_on_bits)));
+  /* Head first, it can only move towards tail */
+  head = atomic_load_explicit(&sms_runtime.queue.head, memory_order_acquire);
+  tail = atomic_load_explicit(&sms_runtime.queue.tail, memory_order_acquire);
+  if (tail - head > sms_runtime.queue.capacity)
+    return sms_runtime.queue.capacity;
+  return tail - head;
+}
 
-    if (output_text_length == sms_text_length)
-      break;
+int get_sms_queue_free() {
+  int depth = get_sms_queue_depth();
+  return depth < sms_runtime.queue.capacity
+             ? sms_runtime.queue.capacity - depth
+             : 0;
+}
 
-    carry_on_bits++;
+struct sms_queue_stats get_sms_queue_stats() {
+  struct sms_queue_stats stats;
+  stats.capacity = sms_runtime.queue.capacity;
+  stats.depth = get_sms_queue_depth();
+  stats.high_water = atomic_load_explicit(&sms_runtime.queue.high_water,
+                                          memory_order_relaxed);
+  stats.enqueued =
+      atomic_load_explicit(&sms_runtime.queue.enqueued, memory_order_relaxed);
+  stats.rejected =
+      atomic_load_explicit(&sms_runtime.queue.rejected, memory_order_relaxed);
+  return stats;
+}
 
-    if (carry_on_bits == 8) {
-      carry_on_bits = 1;
-      output_sms_text[output_text_length++] = buffer[i] & BITMASK_7BITS;
-      if (output_text_length == sms_text_length)
-        break;
+/*
+ * Claims count consecutive slots at the tail, so the parts of a long
+ * message are never interleaved with others. Slots are handed back in
+ * order, so if the last one is free all of them are. Returns -ENOSPC
+ * if they don't fit, otherwise the caller has to fill every slot from
+ * pos onwards and publish_slot() them
+ */
+static int claim_slots(uint32_t count, uint32_t *pos) {
+  struct message *last;
+  uint32_t seq;
+  int32_t diff;
+
+  if (count == 0 || count > sms_runtime.queue.capacity)
+    return -ENOSPC;
+
+  *pos = atomic_load_explicit(&sms_runtime.queue.tail, memory_order_relaxed);
+  for (;;) {
+    last = &sms_runtime.queue.msg[(*pos + count - 1) & sms_runtime.queue.mask];
+    seq = atomic_load_explicit(&last->seq, memory_order_acquire);
+    diff = (int32_t)(seq - (*pos + count - 1));
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &sms_runtime.queue.tail, pos, *pos + count,
+              memory_order_relaxed, memory_order_relaxed))
+        return 0;
+    } else if (diff < 0) {
+      return -ENOSPC; // Still in use from the previous lap
+    } else {
+      *pos = atomic_load_explicit(&sms_runtime.queue.tail,
+                                  memory_order_relaxed);
     }
   }
-  if (output_text_length < sms_text_length) // Add last remainder.
-    output_sms_text[output_text_length++] =
-        buffer[i - 1] >> (8 - carry_on_bits);
-
-  return output_text_length;
 }
 
-static inline void Write7Bits(uint8_t *bufferPtr, uint8_t val, uint32_t pos) {
-  val &= 0x7F;
-  uint8_t idx = pos / 8;
+static void publish_slot(struct message *slot, uint32_t pos) {
+  uint32_t depth, high_water;
+
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  atomic_fetch_add_explicit(&sms_runtime.queue.enqueued, 1,
+                            memory_order_relaxed);
+  depth = get_sms_queue_depth();
+  high_water = atomic_load_explicit(&sms_runtime.queue.high_water,
+                                    memory_order_relaxed);
+  while (depth > high_water &&
+         !atomic_compare_exchange_weak_explicit(
+             &sms_runtime.queue.high_water, &high_water, depth,
+             memory_order_relaxed, memory_order_relaxed))
+    ;
+  set_pending_notification_source(MSG_INTERNAL);
+  set_notif_pending(true);
+}
 
-  if (!(pos & 7)) {
-    bufferPtr[idx] = val;
-  } else if ((pos & 7) == 1) {
-    bufferPtr[idx] = bufferPtr[idx] | (val << 1);
-  } else {
-    bufferPtr[idx] = bufferPtr[idx] | (val << (pos & 7));
-    bufferPtr[idx + 1] = (val >> (8 - (pos & 7)));
-  }
+/* Message at the head of the queue, if it has been published yet */
+static struct message *get_head_message() {
+  uint32_t head =
+      atomic_load_explicit(&sms_runtime.queue.head, memory_order_relaxed);
+  struct message *slot;
+
+  if (sms_runtime.queue.capacity == 0)
+    return NULL;
+  slot = &sms_runtime.queue.msg[head & sms_runtime.queue.mask];
+  if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1)
+    return NULL;
+  return slot;
 }
-/**
- * Convert an ascii array into a 7bits array
- * length is the number of bytes in the ascii buffer
- *
- * @return the size of the a7bit string (in 7bit chars!), or LE_OVERFLOW if
- * a7bitPtr is too small.
- */
-uint8_t ascii_to_gsm7(const uint8_t *a8bitPtr, ///< [IN] 8bits array to convert
-                      uint8_t *a7bitPtr        ///< [OUT] 7bits array result
-) {
-  int read;
-  int write = 0;
-  int size = 0;
-  int pos = 0;
-  int length = strlen((char *)a8bitPtr);
-
-  for (read = pos; read < length + pos; ++read) {
-    uint8_t byte = Ascii8to7[a8bitPtr[read]];
-
-    /* Escape */
-    if (byte >= 128) {
-      Write7Bits(a7bitPtr, 0x1B, write * 7);
-      write++;
-      byte -= 128;
-    }
 
-    Write7Bits(a7bitPtr, byte, write * 7);
-    write++;
+/* Message the host is asking for, if it is still in the queue */
+static struct message *get_queued_message(uint32_t message_id) {
+  struct message *slot;
+  uint32_t seq;
+
+  if (message_id >= sms_runtime.queue.capacity)
+    return NULL;
+  slot = &sms_runtime.queue.msg[message_id];
+  seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if ((seq & sms_runtime.queue.mask) !=
+      ((message_id + 1) & sms_runtime.queue.mask))
+    return NULL;
+  return slot;
+}
 
-    /* Number of 8 bit chars */
-    size = (write * 7);
-    size = (size % 8 != 0) ? (size / 8 + 1) : (size / 8);
+/*
+ * Hands finished messages at the head back to the producers. The host
+ * can read them out of order, so there might be more than one
+ */
+static void release_finished_messages() {
+  struct message *slot;
+  uint32_t head;
+
+  while ((slot = get_head_message()) != NULL && slot->state == 9) {
+    head = atomic_load_explicit(&sms_runtime.queue.head, memory_order_relaxed);
+    slot->state = 0;
+    slot->retries = 0;
+    slot->len = 0;
+    atomic_store_explicit(&sms_runtime.queue.head, head + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, head + sms_runtime.queue.capacity,
+                          memory_order_release);
   }
+  /* Don't wait for the retry timer to start with the next one */
+  if (get_head_message() != NULL)
+    request_proxy_injection();
+}
+
+void set_notif_pending(bool pending) {
+  sms_runtime.notif_pending = pending;
+  if (pending)
+    request_proxy_injection();
+}
 
-  return write;
+void set_pending_notification_source(uint8_t source) {
+  sms_runtime.source = source;
+  if (source != MSG_NONE)
+    request_proxy_injection();
 }
 
+uint8_t get_notification_source() { return sms_runtime.source; }
+
+bool is_message_pending() { return sms_runtime.notif_pending; }
+
 uint8_t swap_byte(uint8_t source) {
   uint8_t parsed = 0;
   parsed = (parsed << 4) + (source % 10);
@@ -174,40 +295,14 @@ uint8_t swap_byte(uint8_t source) {
   return parsed;
 }
 
-int decode_phone_number(uint8_t *buffer, int len, char *out) {
-  char output[127];
-  int i = 0, j = 0;
-  bool is_international = false;
-  while (i < len) {
-    if (i == 0 &&
-        buffer[j] ==
-            0x91) { // 0x91 == international number, no need to print it
-      j++;
-      is_international = true;
-    }
-    if (i % 2 == 0) {
-      output[i] = (buffer[j] & 0x0f) + '0';
-    } else {
-      output[i] = ((buffer[j] & 0xf0) >> 4) + '0';
-      j++;
-    }
-    i++;
-  }
-  output[len] = '\0';
-  if (is_international) {
-    snprintf(out, 128, "+%s", output);
-  } else {
-    snprintf(out, 128, "%s", output);
-  }
-  return len;
-}
 /*
  * This sends a notification message, ModemManager should answer it
  * with a request to get the actual message
  */
 uint8_t generate_message_notification(int fd, uint32_t message_id) {
   struct wms_message_indication_packet *notif_pkt;
-  notif_pkt = calloc(1, sizeof(struct wms_message_indication_packet));
+  struct scratch_mark mark = scratch_save();
+  notif_pkt = scratch_alloc(sizeof(struct wms_message_indication_packet));
   sms_runtime.curr_transaction_id = 0;
   notif_pkt->qmuxpkt.version = 0x01;
   notif_pkt->qmuxpkt.packet_length =
@@ -236,6 +331,8 @@ uint8_t generate_message_notification(int fd, uint32_t message_id) {
   notif_pkt->ims.tlv_sms_on_ims_size = htole16(1);
   notif_pkt->ims.is_sms_sent_over_ims = 0x00; // Nah, we don't
 
+  capture_packet(FROM_OPENQTI, notif_pkt,
+                 sizeof(struct wms_message_indication_packet));
   if (write(fd, notif_pkt, sizeof(struct wms_message_indication_packet)) < 0) {
     logger(MSG_ERROR, "%s: Error sending new message notification\n", __func__);
   } else {
@@ -243,7 +340,7 @@ uint8_t generate_message_notification(int fd, uint32_t message_id) {
   }
   dump_pkt_raw((uint8_t *)notif_pkt,
                sizeof(struct wms_message_indication_packet));
-  free(notif_pkt);
+  scratch_restore(mark);
   notif_pkt = NULL;
   return 0;
 }
@@ -256,7 +353,8 @@ uint8_t generate_message_notification(int fd, uint32_t message_id) {
 uint8_t process_message_deletion(int fd, uint32_t message_id,
                                  uint8_t indication) {
   struct wms_message_delete_packet *ctl_pkt;
-  ctl_pkt = calloc(1, sizeof(struct wms_message_delete_packet));
+  struct scratch_mark mark = scratch_save();
+  ctl_pkt = scratch_alloc(sizeof(struct wms_message_delete_packet));
 
   ctl_pkt->qmuxpkt.version = 0x01;
   ctl_pkt->qmuxpkt.packet_length = sizeof(struct wms_message_delete_packet) - 1;
@@ -279,14 +377,27 @@ uint8_t process_message_deletion(int fd, uint32_t message_id,
     ctl_pkt->indication.response = 0x00;
   }
 
+  capture_packet(FROM_OPENQTI, ctl_pkt,
+                 sizeof(struct wms_message_delete_packet));
   if (write(fd, ctl_pkt, sizeof(struct wms_message_delete_packet)) < 0) {
     logger(MSG_ERROR, "%s: Error deleting message\n", __func__);
   }
 
-  free(ctl_pkt);
+  scratch_restore(mark);
   ctl_pkt = NULL;
   return 0;
 }
+/* UDH for one part of a concatenated SMS, with an 8 bit reference */
+static int write_concat_udh(const struct message *msg, uint8_t *out) {
+  out[0] = SMS_CONCAT_UDH_SIZE - 1; // UDHL
+  out[1] = 0x00;                    // IEI: Concatenated SMS, 8 bit ref
+  out[2] = 0x03;                    // IEDL
+  out[3] = msg->concat_ref;
+  out[4] = msg->concat_parts;
+  out[5] = msg->concat_part;
+  return SMS_CONCAT_UDH_SIZE;
+}
+
 /*
  * Build and send SMS
  *  Gets message ID, builds the QMI messages and sends it
@@ -297,16 +408,25 @@ uint8_t process_message_deletion(int fd, uint32_t message_id,
  */
 int build_and_send_message(int fd, uint32_t message_id) {
   struct wms_build_message *this_sms;
-  this_sms = calloc(1, sizeof(struct wms_build_message));
-  int ret, fullpktsz;
+  struct scratch_mark mark = scratch_save();
+  this_sms = scratch_alloc(sizeof(struct wms_build_message));
+  int ret, octets, fullpktsz;
   uint8_t tmpyear;
 
   time_t t = time(NULL);
   struct tm tm = *localtime(&t);
-  uint8_t msgoutput[160] = {0};
-  ret = ascii_to_gsm7((uint8_t *)sms_runtime.queue.msg[message_id].pkt,
-                      msgoutput);
-  logger(MSG_DEBUG, "%s: Bytes to write %i\n", __func__, ret);
+  struct message *msg = &sms_runtime.queue.msg[message_id];
+  uint8_t msgoutput[MAX_MESSAGE_SIZE] = {0};
+  int first_septet = 0;
+  /* The UDH is padded to a septet boundary, text starts after it */
+  if (msg->concat_parts > 1) {
+    write_concat_udh(msg, msgoutput);
+    first_septet = SMS_CONCAT_UDH_SEPTETS;
+  }
+  ret = ascii_to_gsm7((uint8_t *)msg->pkt, msgoutput, first_septet);
+  octets = (ret * 7 + 7) / 8;
+  logger(MSG_DEBUG, "%s: Septets to write %i (%i bytes)\n", __func__, ret,
+         octets);
   /* QMUX */
   this_sms->qmuxpkt.version = 0x01;
   this_sms->qmuxpkt.packet_length = 0x00; // SIZE
@@ -346,6 +466,8 @@ int build_and_send_message(int fd, uint32_t message_id) {
   this_sms->data.smsc.number[5] = 0x77;
 
   this_sms->data.unknown = 0x04; // This is still unknown
+  if (msg->concat_parts > 1)
+    this_sms->data.unknown |= SMS_TP_UDHI;
 
   // We leave all this hardcoded, we will only worry about ourselves
   /* We need a hardcoded number so when a reply comes we can catch it,
@@ -392,15 +514,14 @@ int build_and_send_message(int fd, uint32_t message_id) {
   }
 
   /* CONTENTS */
-  memcpy(this_sms->data.contents.contents, msgoutput, ret);
+  memcpy(this_sms->data.contents.contents, msgoutput, octets);
   /* SIZES AND LENGTHS */
 
   // Total packet size to send
   fullpktsz = sizeof(struct qmux_packet) + sizeof(struct qmi_packet) +
               sizeof(struct qmi_generic_result_ind) +
               sizeof(struct wms_raw_message_header) +
-              sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE +
-              ret; // ret == msgsize
+              sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE + octets;
   // QMUX packet size
   this_sms->qmuxpkt.packet_length =
       fullpktsz - sizeof(uint8_t); // ret == msgsize, last uint qmux ctlid
@@ -408,7 +529,7 @@ int build_and_send_message(int fd, uint32_t message_id) {
   this_sms->qmipkt.length = sizeof(struct qmi_generic_result_ind) +
                             sizeof(struct wms_raw_message_header) +
                             sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE +
-                            ret;
+                            octets;
   // Header size: QMI - indication size - uint16_t size element itself - header
   // tlv
   this_sms->header.size = this_sms->qmipkt.length -
@@ -419,17 +540,17 @@ int build_and_send_message(int fd, uint32_t message_id) {
       this_sms->qmipkt.length - sizeof(struct qmi_generic_result_ind) -
       sizeof(struct wms_raw_message_header) - (3 * sizeof(uint8_t));
 
-  /* Content size is the number of bytes _after_ conversion
-   * from GSM7 to ASCII bytes (not the actual size of string)
+  /* Content size is the number of septets, UDH included, the
+   * way it will be once unpacked (not the actual size of string)
    */
 
-  this_sms->data.contents.content_sz =
-      strlen((char *)sms_runtime.queue.msg[message_id].pkt);
+  this_sms->data.contents.content_sz = ret;
 
+  capture_packet(FROM_OPENQTI, this_sms, fullpktsz);
   ret = write(fd, (uint8_t *)this_sms, fullpktsz);
   dump_pkt_raw((uint8_t *)this_sms, fullpktsz);
 
-  free(this_sms);
+  scratch_restore(mark);
   this_sms = NULL;
   return ret;
 }
@@ -444,8 +565,10 @@ int build_and_send_message(int fd, uint32_t message_id) {
  */
 int build_and_send_raw_message(int fd, uint32_t message_id) {
   struct wms_build_message *this_sms;
-  this_sms = calloc(1, sizeof(struct wms_build_message));
-  int ret, fullpktsz;
+  struct scratch_mark mark = scratch_save();
+  this_sms = scratch_alloc(sizeof(struct wms_build_message));
+  struct message *msg = &sms_runtime.queue.msg[message_id];
+  int ret, fullpktsz, udh = 0, payload;
   uint8_t tmpyear;
 
   time_t t = time(NULL);
@@ -490,6 +613,8 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
 
   // ENCODING TEST
   this_sms->data.unknown = 0x04; // This is still unknown
+  if (msg->concat_parts > 1)
+    this_sms->data.unknown |= SMS_TP_UDHI;
 
   // We leave all this hardcoded, we will only worry about ourselves
   /* We need a hardcoded number so when a reply comes we can catch it,
@@ -517,10 +642,11 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
       sms_runtime.queue.msg[message_id].len++;
     } 
   }
-    /* CONTENTS */
-  memcpy(this_sms->data.contents.contents,
-         sms_runtime.queue.msg[message_id].pkt,
-         sms_runtime.queue.msg[message_id].len);
+  /* CONTENTS */
+  if (msg->concat_parts > 1)
+    udh = write_concat_udh(msg, this_sms->data.contents.contents);
+  memcpy(this_sms->data.contents.contents + udh, msg->pkt, msg->len);
+  payload = udh + msg->len;
 
   /*
    * tm_year should return number of years from 1900
@@ -554,7 +680,7 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
               sizeof(struct qmi_generic_result_ind) +
               sizeof(struct wms_raw_message_header) +
               sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE +
-              sms_runtime.queue.msg[message_id].len; // ret == msgsize
+              payload; // ret == msgsize
   // QMUX packet size
   this_sms->qmuxpkt.packet_length =
       fullpktsz - sizeof(uint8_t); // ret == msgsize, last uint qmux ctlid
@@ -562,7 +688,7 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
   this_sms->qmipkt.length = sizeof(struct qmi_generic_result_ind) +
                             sizeof(struct wms_raw_message_header) +
                             sizeof(struct wms_user_data) - MAX_MESSAGE_SIZE +
-                            sms_runtime.queue.msg[message_id].len;
+                            payload;
   // Header size: QMI - indication size - uint16_t size element itself - header
   // tlv
   this_sms->header.size = this_sms->qmipkt.length -
@@ -574,17 +700,22 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
       sizeof(struct wms_raw_message_header) - (3 * sizeof(uint8_t));
 
   /* In this case we leave the size alone, this ain't gsm-7 */
-  this_sms->data.contents.content_sz =
-      sms_runtime.queue.msg[message_id].len;
+  this_sms->data.contents.content_sz = payload;
 
+  capture_packet(FROM_OPENQTI, this_sms, fullpktsz);
   ret = write(fd, (uint8_t *)this_sms, fullpktsz);
   dump_pkt_raw((uint8_t *)this_sms, fullpktsz);
 
-  free(this_sms);
+  scratch_restore(mark);
   this_sms = NULL;
   return ret;
 }
 
+/* The host has SMS_ACK_TIMEOUT_MS to answer before we try again */
+static void arm_retry_deadline(struct message *msg) {
+  msg->deadline_ns = stats_now_ns() + SMS_ACK_TIMEOUT_MS * 1000000ULL;
+}
+
 /*
  * 1. Send new message notification
  * 2. Wait for answer from the Pinephone for a second (retry if no answer)
@@ -598,7 +729,7 @@ int build_and_send_raw_message(int fd, uint32_t message_id) {
  *  This func does the entire transaction
  */
 int handle_message_state(int fd, uint32_t message_id) {
-  if (message_id > QUEUE_SIZE) {
+  if (get_queued_message(message_id) == NULL) {
     logger(MSG_ERROR, "%s: Attempting to read invalid message ID: %i\n",
            __func__, message_id);
     return 0;
@@ -611,8 +742,7 @@ int handle_message_state(int fd, uint32_t message_id) {
   case 0: // Generate -> RECEIVE TID
     logger(MSG_DEBUG, "%s: Notify Message ID: %i\n", __func__, message_id);
     generate_message_notification(fd, message_id);
-    clock_gettime(CLOCK_MONOTONIC,
-                  &sms_runtime.queue.msg[message_id].timestamp);
+    arm_retry_deadline(&sms_runtime.queue.msg[message_id]);
     sms_runtime.queue.msg[message_id].state = 1;
     sms_runtime.current_message_id =
         sms_runtime.queue.msg[message_id].message_id;
@@ -639,8 +769,7 @@ int handle_message_state(int fd, uint32_t message_id) {
                message_id);
       }
     }
-    clock_gettime(CLOCK_MONOTONIC,
-                  &sms_runtime.queue.msg[message_id].timestamp);
+    arm_retry_deadline(&sms_runtime.queue.msg[message_id]);
     break;
   case 3: // GET TID AND DELETE MESSAGE
     logger(MSG_DEBUG, "%s: Waiting for ACK %i: state %i\n", __func__,
@@ -654,12 +783,8 @@ int handle_message_state(int fd, uint32_t message_id) {
     } else {
       process_message_deletion(fd, 0, 1);
     }
-    clock_gettime(CLOCK_MONOTONIC,
-                  &sms_runtime.queue.msg[message_id].timestamp);
     sms_runtime.queue.msg[message_id].state = 9;
-    memset(sms_runtime.queue.msg[message_id].pkt, 0, MAX_MESSAGE_SIZE);
-    sms_runtime.queue.msg[message_id].len = 0;
-    sms_runtime.current_message_id++;
+    release_finished_messages();
     break;
   default:
     logger(MSG_WARN, "%s: Unknown task for message ID: %i (%i) \n", __func__,
@@ -668,16 +793,19 @@ int handle_message_state(int fd, uint32_t message_id) {
   }
   return 0;
 }
+/*
+ * Called once the queue is empty. Someone might have added a message
+ * since we looked, so check again after clearing the flags
+ */
 void wipe_queue() {
   logger(MSG_DEBUG, "%s: Wipe status. \n", __func__);
-  for (int i = 0; i <= sms_runtime.queue.queue_pos; i++) {
-    sms_runtime.queue.msg[i].state = 0;
-    sms_runtime.queue.msg[i].retries = 0;
-  }
   set_notif_pending(false);
   set_pending_notification_source(MSG_NONE);
-  sms_runtime.queue.queue_pos = -1;
   sms_runtime.current_message_id = 0;
+  if (get_head_message() != NULL) {
+    set_pending_notification_source(MSG_INTERNAL);
+    set_notif_pending(true);
+  }
 }
 
 /*
@@ -691,8 +819,8 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
   pkt = (struct encapsulated_qmi_packet *)bytes;
   sms_runtime.curr_transaction_id = pkt->qmi.transaction_id;
   logger(MSG_INFO, "%s: Messages in queue: %i\n", __func__,
-         sms_runtime.queue.queue_pos + 1);
-  if (sms_runtime.queue.queue_pos < 0) {
+         get_sms_queue_depth());
+  if (get_head_message() == NULL) {
     logger(MSG_DEBUG, "%s: Nothing to do \n", __func__);
     return;
   }
@@ -744,11 +872,13 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
         sms_runtime.current_message_id = request->storage.message_id;
       }
       request = NULL;
+      if (get_queued_message(sms_runtime.current_message_id) == NULL) {
+        logger(MSG_WARN, "%s: Message %i is not in the queue anymore\n",
+               __func__, sms_runtime.current_message_id);
+        break;
+      }
       sms_runtime.queue.msg[sms_runtime.current_message_id].state = 2;
       handle_message_state(fd, sms_runtime.current_message_id);
-      clock_gettime(
-          CLOCK_MONOTONIC,
-          &sms_runtime.queue.msg[sms_runtime.current_message_id].timestamp);
       //    request = NULL;
     } else {
       logger(MSG_DEBUG,
@@ -762,17 +892,15 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
   case WMS_DELETE:
     logger(MSG_DEBUG, "%s: WMS_DELETE for message %i. ID %.4x\n", __func__,
            sms_runtime.current_message_id, pkt->qmi.msgid);
-    if (sms_runtime.queue.msg[sms_runtime.current_message_id].state != 3) {
+    if (get_queued_message(sms_runtime.current_message_id) == NULL ||
+        sms_runtime.queue.msg[sms_runtime.current_message_id].state != 3) {
+      /* It was already handed back to the queue, just say it's gone */
       logger(MSG_INFO, "%s: Requested to delete previous message \n", __func__);
-      if (sms_runtime.current_message_id > 0) {
-        sms_runtime.current_message_id--;
-      }
+      process_message_deletion(fd, 0, 1);
+      break;
     }
     sms_runtime.queue.msg[sms_runtime.current_message_id].state = 4;
     handle_message_state(fd, sms_runtime.current_message_id);
-    clock_gettime(
-        CLOCK_MONOTONIC,
-        &sms_runtime.queue.msg[sms_runtime.current_message_id].timestamp);
     break;
   default:
     logger(MSG_DEBUG, "%s: Unknown event received: %.4x\n", __func__,
@@ -790,114 +918,226 @@ void notify_wms_event(uint8_t *bytes, size_t len, int fd) {
  *
  */
 int process_message_queue(int fd) {
-  int i;
-  struct timespec cur_time;
-  double elapsed_time;
-
-  clock_gettime(CLOCK_MONOTONIC, &cur_time);
+  struct message *msg;
 
-  if (sms_runtime.queue.queue_pos < 0) {
-    logger(MSG_INFO, "%s: Nothing yet \n", __func__);
+  msg = get_head_message();
+  if (msg == NULL) {
+    logger(MSG_INFO, "%s: Nothing left in the queue \n", __func__);
+    wipe_queue();
     return 0;
   }
 
-  if (sms_runtime.current_message_id > sms_runtime.queue.queue_pos + 1) {
-    logger(MSG_INFO, "%s: We finished the queue \n", __func__);
+  switch (msg->state) {
+  case 0: // We're beginning, we need to send the notification
+    sms_runtime.current_message_id = msg->message_id;
+    handle_message_state(fd, sms_runtime.current_message_id);
+    break;
+  case 2: // For whatever reason we're here with a message send pending
+  case 4:
+    handle_message_state(fd, sms_runtime.current_message_id);
+    break;
+  case 1: // We're here but we're waiting for an ACK
+  case 3:
+    if (stats_now_ns() < msg->deadline_ns) {
+      logger(MSG_DEBUG, "-->%s: Waiting on message for %i \n", __func__,
+             msg->message_id);
+    } else if (msg->retries < SMS_MAX_RETRIES) {
+      logger(MSG_WARN, "-->%s: Retrying message id %i \n", __func__,
+             msg->message_id);
+      msg->retries++;
+      msg->state--;
+      sms_runtime.current_message_id = msg->message_id;
+      handle_message_state(fd, sms_runtime.current_message_id);
+    } else {
+      logger(MSG_ERROR, "-->%s: Message %i timed out, killing it \n",
+             __func__, msg->message_id);
+      msg->state = 9;
+      release_finished_messages();
+    }
+    break;
+  default: // Read and deleted out of order, the host is done with it
+    release_finished_messages();
+    break;
   }
+  return 0;
+}
 
-  if (sms_runtime.queue.queue_pos >= 0) {
-    for (i = 0; i <= sms_runtime.queue.queue_pos; i++) {
+/*
+ * How long the proxy can sleep before process_message_queue() has
+ * anything to do: 0 if it should be called again now, -1 if there is
+ * nothing in the queue
+ */
+int get_sms_retry_timeout_ms() {
+  struct message *msg = get_head_message();
+  uint64_t now;
 
-      elapsed_time =
-          (((cur_time.tv_sec - sms_runtime.queue.msg[i].timestamp.tv_sec) *
-            1e9) +
-           (cur_time.tv_nsec - sms_runtime.queue.msg[i].timestamp.tv_nsec)) /
-          1e9;
-      if (elapsed_time < 0) {
-        clock_gettime(CLOCK_MONOTONIC, &sms_runtime.queue.msg[i].timestamp);
-      }
-      switch (sms_runtime.queue.msg[i].state) {
-      case 0: // We're beginning, we need to send the notification
-        sms_runtime.current_message_id = sms_runtime.queue.msg[i].message_id;
-        handle_message_state(fd, sms_runtime.current_message_id);
-        return 0;
-      case 2: // For whatever reason we're here with a message send pending
-        handle_message_state(fd, sms_runtime.current_message_id);
-        return 0;
-      case 4:
-        handle_message_state(fd, sms_runtime.current_message_id);
-        return 0;
-      case 1: // We're here but we're waiting for an ACK
-      case 3:
-        if (elapsed_time > 5 && sms_runtime.queue.msg[i].retries < 3) {
-          logger(MSG_WARN, "-->%s: Retrying message id %i \n", __func__, i);
-          sms_runtime.queue.msg[i].retries++;
-          sms_runtime.queue.msg[i].state--;
-        } else if (elapsed_time > 5 && sms_runtime.queue.msg[i].retries >= 3) {
-          logger(MSG_ERROR, "-->%s: Message %i timed out, killing it \n",
-                 __func__, i);
-          memset(sms_runtime.queue.msg[i].pkt, 0, MAX_MESSAGE_SIZE);
-          sms_runtime.queue.msg[i].state = 9;
-          sms_runtime.queue.msg[i].retries = 0;
-          sms_runtime.queue.msg[i].len = 0;
-          sms_runtime.current_message_id++;
-        } else {
-          logger(MSG_WARN, "-->%s: Waiting on message for %i \n", __func__, i);
-        }
-        return 0;
-      }
+  if (msg == NULL)
+    return -1;
+  if (msg->state != 1 && msg->state != 3)
+    return 0;
+  now = stats_now_ns();
+  if (now >= msg->deadline_ns)
+    return 0;
+  return (msg->deadline_ns - now + 999999ULL) / 1000000ULL;
+}
+
+/* Copies a message, or one part of it, into a claimed slot */
+static void fill_slot(struct message *slot, uint32_t pos, const uint8_t *data,
+                      size_t len, uint8_t tp_dcs) {
+  memset(slot->pkt, 0, MAX_MESSAGE_SIZE);
+  memcpy(slot->pkt, data, len);
+  slot->message_id = pos & sms_runtime.queue.mask;
+  slot->len = len;
+  slot->tp_dcs = tp_dcs;
+  slot->state = 0;
+  slot->retries = 0;
+  slot->concat_ref = 0;
+  slot->concat_parts = 0;
+  slot->concat_part = 0;
+  slot->deadline_ns = 0;
+}
+
+/*
+ * How many bytes of data fit in one SMS. Text is packed as GSM-7,
+ * where escaped characters take two septets, and it has to stay a
+ * string in the slot. UCS-2 can't be split in a surrogate pair
+ */
+static size_t fit_in_sms(const uint8_t *data, size_t len, uint8_t tp_dcs,
+                         bool concat) {
+  size_t i, max;
+  int need, used = 0;
+
+  if (tp_dcs == SMS_DCS_UCS2) {
+    max = concat ? SMS_CONCAT_UCS2_OCTETS : SMS_UCS2_MAX_OCTETS;
+    if (len <= max)
+      return len;
+    if ((data[max - 2] & 0xfc) == 0xd8)
+      return max - 2;
+    return max;
+  }
+
+  max = concat ? SMS_CONCAT_GSM7_SEPTETS : SMS_GSM7_MAX_SEPTETS;
+  for (i = 0; i < len && i < MAX_MESSAGE_SIZE - 1; i++) {
+    need = gsm7_char_len(data[i]);
+    if (used + need > max)
+      break;
+    used += need;
+  }
+  return i;
+}
+
+/*
+ * Queues data as one message or, if it doesn't fit in one, as a
+ * concatenated SMS: every part carries a UDH with the same reference,
+ * the number of parts and its own number, and the host shows them as
+ * a single message (3GPP TS 23.040, 9.2.3.24.1). All the parts are
+ * queued or none of them is
+ */
+static int queue_message(const uint8_t *data, size_t len, uint8_t tp_dcs) {
+  struct message *slot;
+  size_t offset, fit;
+  uint32_t parts = 0, pos, i;
+  uint8_t ref = 0;
+
+  if (fit_in_sms(data, len, tp_dcs, false) == len) {
+    parts = 1;
+  } else {
+    for (offset = 0; offset < len; offset += fit) {
+      fit = fit_in_sms(data + offset, len - offset, tp_dcs, true);
+      if (fit == 0)
+        return -EINVAL;
+      parts++;
     }
   }
+  if (parts > SMS_CONCAT_MAX_PARTS) {
+    logger(MSG_ERROR, "%s: Message is too long (%u parts)\n", __func__, parts);
+    return -EINVAL;
+  }
+  if (claim_slots(parts, &pos) < 0) {
+    atomic_fetch_add_explicit(&sms_runtime.queue.rejected, 1,
+                              memory_order_relaxed);
+    logger(MSG_ERROR, "%s: Queue is full!\n", __func__);
+    return -ENOSPC;
+  }
 
-  logger(MSG_INFO, "%s: Nothing left in the queue \n", __func__);
-  wipe_queue();
+  logger(MSG_INFO, "%s: Adding message to queue (%i, %u parts)\n", __func__,
+         pos & sms_runtime.queue.mask, parts);
+  if (parts > 1)
+    ref = atomic_fetch_add_explicit(&sms_runtime.queue.next_concat_ref, 1,
+                                    memory_order_relaxed);
+  offset = 0;
+  for (i = 0; i < parts; i++) {
+    slot = &sms_runtime.queue.msg[(pos + i) & sms_runtime.queue.mask];
+    fit = parts == 1 ? len : fit_in_sms(data + offset, len - offset, tp_dcs,
+                                        true);
+    fill_slot(slot, pos + i, data + offset, fit, tp_dcs);
+    /* Text is sent as a string, len is only used for raw data */
+    if (tp_dcs == 0x00)
+      slot->len = 0;
+    if (parts > 1) {
+      slot->concat_ref = ref;
+      slot->concat_parts = parts;
+      slot->concat_part = i + 1;
+    }
+    publish_slot(slot, pos + i);
+    offset += fit;
+  }
   return 0;
 }
 
 /*
  * Update message queue and add new message text
- * to the array
+ * to the ring. Plain ASCII goes as GSM-7, anything else is
+ * taken as UTF-8 and sent as UCS-2. Long texts are split in a
+ * concatenated SMS. Returns -ENOSPC if it's full, so whoever is
+ * generating a burst of messages knows when to stop
  */
-void add_sms_to_queue(uint8_t *message, size_t len) {
-  if (sms_runtime.queue.queue_pos > QUEUE_SIZE - 2) {
-    logger(MSG_ERROR, "%s: Queue is full!\n", __func__);
-    return;
-  }
-  if (len > 0) {
-    set_notif_pending(true);
-    set_pending_notification_source(MSG_INTERNAL);
-    logger(MSG_INFO, "%s: Adding message to queue (%i)\n", __func__,
-           sms_runtime.queue.queue_pos + 1);
-    sms_runtime.queue.queue_pos++;
-    memcpy(sms_runtime.queue.msg[sms_runtime.queue.queue_pos].pkt, message,
-           len);
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].message_id =
-        sms_runtime.queue.queue_pos;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].tp_dcs = 0x00;
-  } else {
+int add_sms_to_queue(uint8_t *message, size_t len) {
+  struct scratch_mark mark;
+  uint8_t *ucs2;
+  size_t i;
+  int ret;
+
+  if (len == 0) {
     logger(MSG_ERROR, "%s: Size of message is 0\n", __func__);
+    return -EINVAL;
   }
+  for (i = 0; i < len && message[i] < 0x80; i++)
+    ;
+  if (i == len)
+    return queue_message(message, len, 0x00);
+
+  mark = scratch_save();
+  ucs2 = scratch_alloc(len * 2);
+  ret = queue_message(ucs2, utf8_to_ucs2(message, len, ucs2), SMS_DCS_UCS2);
+  scratch_restore(mark);
+  return ret;
 }
-void add_raw_sms_to_queue(uint8_t *message, size_t len, uint8_t tp_dcs) {
-  if (sms_runtime.queue.queue_pos > QUEUE_SIZE - 2) {
-    logger(MSG_ERROR, "%s: Queue is full!\n", __func__);
-    return;
-  }
-  if (len > 0) {
-    set_notif_pending(true);
-    set_pending_notification_source(MSG_INTERNAL);
-    logger(MSG_INFO, "%s: Adding message to queue (%i)\n", __func__,
-           sms_runtime.queue.queue_pos + 1);
-    sms_runtime.queue.queue_pos++;
-    memcpy(sms_runtime.queue.msg[sms_runtime.queue.queue_pos].pkt, message,
-           len);
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].message_id = sms_runtime.queue.queue_pos;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].len = len;
-    sms_runtime.queue.msg[sms_runtime.queue.queue_pos].tp_dcs = tp_dcs;
-    logger(MSG_INFO, "RAW MESSAGE: %s -> %s | %i\n", message, sms_runtime.queue.msg[sms_runtime.queue.queue_pos].pkt, sms_runtime.queue.msg[sms_runtime.queue.queue_pos].len);
-  } else {
+
+int add_raw_sms_to_queue(uint8_t *message, size_t len, uint8_t tp_dcs) {
+  struct message *slot;
+  uint32_t pos;
+
+  if (len == 0) {
     logger(MSG_ERROR, "%s: Size of message is 0\n", __func__);
+    return -EINVAL;
+  }
+  if (claim_slots(1, &pos) < 0) {
+    atomic_fetch_add_explicit(&sms_runtime.queue.rejected, 1,
+                              memory_order_relaxed);
+    logger(MSG_ERROR, "%s: Queue is full!\n", __func__);
+    return -ENOSPC;
   }
+  if (len > MAX_MESSAGE_SIZE)
+    len = MAX_MESSAGE_SIZE;
+  logger(MSG_INFO, "%s: Adding message to queue (%i)\n", __func__,
+         pos & sms_runtime.queue.mask);
+  slot = &sms_runtime.queue.msg[pos & sms_runtime.queue.mask];
+  fill_slot(slot, pos, message, len, tp_dcs);
+  logger(MSG_INFO, "RAW MESSAGE: %s -> %s | %i\n", message, slot->pkt,
+         slot->len);
+  publish_slot(slot, pos);
+  return 0;
 }
 
 /* Generate a notification indication */
@@ -921,7 +1161,8 @@ uint8_t send_outgoing_msg_ack(uint16_t transaction_id, int usbfd,
                               uint16_t message_id) {
   int ret;
   struct sms_received_ack *receive_ack;
-  receive_ack = calloc(1, sizeof(struct sms_received_ack));
+  struct scratch_mark mark = scratch_save();
+  receive_ack = scratch_alloc(sizeof(struct sms_received_ack));
   receive_ack->qmuxpkt.version = 0x01;
   receive_ack->qmuxpkt.packet_length = 0x0018; // SIZE
   receive_ack->qmuxpkt.control = 0x80;
@@ -943,244 +1184,158 @@ uint8_t send_outgoing_msg_ack(uint16_t transaction_id, int usbfd,
       0x0021; // this one gets ignored both by ModemManager and oFono
   logger(MSG_DEBUG, "%s: Sending Host->Modem SMS ACK\n", __func__);
   dump_pkt_raw((uint8_t *)receive_ack, sizeof(struct sms_received_ack));
+  capture_packet(FROM_OPENQTI, receive_ack, sizeof(struct sms_received_ack));
   ret = write(usbfd, receive_ack, sizeof(struct sms_received_ack));
-  free(receive_ack);
+  scratch_restore(mark);
   return ret;
 }
 
 /* Intercept and ACK a message */
-uint8_t intercept_and_parse(void *bytes, size_t len, int adspfd, int usbfd) {
-  uint8_t *output;
-  uint8_t ret;
-  struct outgoing_sms_packet *pkt;
-  struct outgoing_no_validity_period_sms_packet *nodate_pkt;
-
-  output = calloc(MAX_MESSAGE_SIZE, sizeof(uint8_t));
-  if (len >= sizeof(struct outgoing_sms_packet) - (MAX_MESSAGE_SIZE + 2)) {
-    pkt = (struct outgoing_sms_packet *)bytes;
-    nodate_pkt = (struct outgoing_no_validity_period_sms_packet *)bytes;
-    /* This will need to be rebuilt for oFono, probably
-     *  0x31 -> Most of ModemManager stuff
-     *  0x11 -> From jeremy, still keeps 0x21
-     *  0x01 -> Skips the 0x21 and jumps to content
-     */
-    if (pkt->pdu_type >= 0x11) {
-      ret = gsm7_to_ascii(pkt->contents.contents,
-                          strlen((char *)pkt->contents.contents),
-                          (char *)output, pkt->contents.content_sz);
-      if (ret < 0) {
-        logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
-               __LINE__);
-      }
-    } else if (pkt->pdu_type == 0x01) {
-      ret = gsm7_to_ascii(nodate_pkt->contents.contents,
-                          strlen((char *)nodate_pkt->contents.contents),
-                          (char *)output, nodate_pkt->contents.content_sz);
-      if (ret < 0) {
-        logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
-               __LINE__);
-      }
-    } else {
-      set_log_level(0);
-
-      logger(MSG_ERROR,
-             "%s: Don't know how to handle this. Please contact biktorgj and "
-             "get him the following dump:\n",
-             __func__);
-      dump_pkt_raw(bytes, len);
-      logger(MSG_ERROR,
-             "%s: Don't know how to handle this. Please contact biktorgj and "
-             "get him the following dump:\n",
-             __func__);
-      set_log_level(1);
-    }
-
-    send_outgoing_msg_ack(pkt->qmipkt.transaction_id, usbfd, 0x0000);
-    parse_command(output);
-  }
-  pkt = NULL;
-  nodate_pkt = NULL;
-  free(output);
-  return 0;
+static void intercept_and_parse(void *bytes, size_t len,
+                                const struct tpdu *tpdu, int usbfd) {
+  struct scratch_mark mark = scratch_save();
+  char *output = scratch_alloc(MAX_MESSAGE_SIZE);
+
+  tpdu_text(tpdu, output, MAX_MESSAGE_SIZE);
+  send_outgoing_msg_ack(get_transaction_id(bytes, len), usbfd, 0x0000);
+  parse_command((uint8_t *)output);
+  scratch_restore(mark);
 }
 
-int pdu_decode(uint8_t *buffer, int buffer_length,
-               char *output_sender_phone_number, uint8_t *output_sms_text) {
-  if (buffer_length <= 0)
-    return -1;
-
-  int sender_phone_number_size = 128;
-  int sms_text_size = 160;
-  const int sms_deliver_start = 1 + buffer[0];
-  if (sms_deliver_start + 1 > buffer_length)
-    return -1;
-  if ((buffer[sms_deliver_start] & 0x04) != 0x04) {
-    logger(MSG_ERROR, "%s: buf not 0x04\n", __func__);
-    return -1;
-  }
-
-  const int sender_number_length = buffer[sms_deliver_start + 1];
-  if (sender_number_length + 1 > sender_phone_number_size)
-    return -1; // Buffer too small to hold decoded phone number.
-
-  decode_phone_number(buffer + sms_deliver_start + 3, sender_number_length,
-                      output_sender_phone_number);
-
-  const int sms_pid_start =
-      sms_deliver_start + 3 + (buffer[sms_deliver_start + 1] + 1) / 2;
-  logger(MSG_ERROR, "%s: Looking for contents\n", __func__);
-
-  const int sms_start = sms_pid_start + 2 + 7;
-  if (sms_start + 1 > buffer_length) {
-    logger(MSG_ERROR, "%s: Invalid input buffer\n", __func__);
-    return -1; // Invalid input buffer.
-  }
-
-  const int output_sms_text_length = buffer[sms_start];
-  if (sms_text_size < output_sms_text_length) {
-    logger(MSG_ERROR, "%s: Cant hold buffer\n", __func__);
-    return -1; // Cannot hold decoded buffer.
-  }
-  const int decoded_sms_text_size =
-      gsm7_to_ascii(buffer + sms_start + 1, buffer_length - (sms_start + 1),
-                    (char *)output_sms_text, output_sms_text_length);
-
-  if (decoded_sms_text_size != output_sms_text_length) {
-    logger(MSG_ERROR, "%s: Invalid decoded length\n", __func__);
-
-    return -1; // Decoder length is not as expected.
-  }
-
-  // Add a C string end.
-  if (output_sms_text_length < sms_text_size)
-    output_sms_text[output_sms_text_length] = 0;
+/* Sniff on an sms */
+static void log_message_contents(const struct tpdu *tpdu) {
+  char number[TPDU_ADDRESS_STRING_SIZE];
+  struct scratch_mark mark = scratch_save();
+  char *text = scratch_alloc(TPDU_TEXT_SIZE);
+  uint16_t ref;
+  uint8_t parts, part;
+
+  tpdu_address_to_string(&tpdu->address, number, sizeof(number));
+  tpdu_text(tpdu, text, TPDU_TEXT_SIZE);
+  if (tpdu_get_concat(tpdu, &ref, &parts, &part))
+    logger(MSG_INFO, "[SMS] Part %u of %u (ref %u)\n", part, parts, ref);
+  if (tpdu->mti == TPDU_SUBMIT)
+    logger(MSG_INFO, "[SMS] From User to %s | Contents: %s\n", number, text);
   else
-    output_sms_text[sms_text_size - 1] = 0;
-
-  return output_sms_text_length;
+    logger(MSG_INFO, "[SMS] From %s to User | Contents: %s\n", number, text);
+  store_sms_message(tpdu->mti == TPDU_SUBMIT ? FROM_HOST : FROM_DSP, number,
+                    text);
+  scratch_restore(mark);
 }
 
-/* Sniff on an sms */
-uint8_t log_message_contents(uint8_t source, void *bytes, size_t len) {
-  uint8_t *output;
-  uint8_t ret;
-  char phone_numb[128];
-  output = calloc(MAX_MESSAGE_SIZE, sizeof(uint8_t));
-  if (source == FROM_HOST) {
-    struct outgoing_sms_packet *pkt;
-    struct outgoing_no_validity_period_sms_packet *nodate_pkt;
-    if (len >= sizeof(struct outgoing_sms_packet) - (MAX_MESSAGE_SIZE + 2)) {
-      pkt = (struct outgoing_sms_packet *)bytes;
-      nodate_pkt = (struct outgoing_no_validity_period_sms_packet *)bytes;
-      ret = decode_phone_number(pkt->target.phone_number, pkt->target.sz,
-                                phone_numb);
-      /* This will need to be rebuilt for oFono, probably
-       *  0x31 -> Most of ModemManager stuff
-       *  0x11 -> From jeremy, still keeps 0x21
-       *  0x01 -> Skips the 0x21 and jumps to content
-       */
-      if (pkt->pdu_type >= 0x11) {
-        ret = gsm7_to_ascii(pkt->contents.contents,
-                            strlen((char *)pkt->contents.contents),
-                            (char *)output, pkt->contents.content_sz);
-        if (ret < 0) {
-          logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
-                 __LINE__);
-        }
-      } else if (pkt->pdu_type == 0x01) {
-        ret = gsm7_to_ascii(nodate_pkt->contents.contents,
-                            strlen((char *)nodate_pkt->contents.contents),
-                            (char *)output, nodate_pkt->contents.content_sz);
-        if (ret < 0) {
-          logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
-                 __LINE__);
-        }
-      } else {
-        logger(MSG_ERROR, "%s: Unimplemented PDU type (0x%.2x)\n", __func__,
-               pkt->pdu_type);
-      }
-      logger(MSG_INFO, "[SMS] From User to %s | Contents: %s\n", phone_numb,
-             output);
-    }
-    pkt = NULL;
-    nodate_pkt = NULL;
-  } else if (source == FROM_DSP) {
-    int offset = get_tlv_offset_by_id(bytes, len, 0x01);
-    if (offset > 0) {
-      struct empty_tlv *pdu = (struct empty_tlv *)(bytes + offset);
-      /*
-      |------------------------------------------------------------------------|
-      |4 byte |  1-12 bytes   | 1  | 2-12 |  1  |  1  | 0||1||7 | 1   | 0-140  |
-      |------------------------------------------------------------------------|
-      | ???   |SCA | PDU Type | MR |  DA  | PID | DCS |    VP   | UDL |   UD   |
-      |------------------------------------------------------------------------|
-      */
-      pdu_decode(pdu->data + 4, le16toh(pdu->len) - 4, phone_numb, output);
-      pdu = NULL;
-      logger(MSG_INFO, "[SMS] From %s to User | Contents: %s\n", phone_numb,
-             output);
+/*
+ * Finds the PDU in a raw send request or a read response, and
+ * decodes it. Returns -ENOENT if the packet doesn't carry one
+ */
+static int get_wms_tpdu(uint8_t source, uint8_t *bytes, size_t len,
+                        struct tpdu *tpdu) {
+  struct empty_tlv *tlv;
+  uint16_t msgid = get_message_id(bytes, len);
+  int offset, tlv_len, skip;
+  uint16_t pdu_len;
 
-    } else {
-      logger(MSG_ERROR, "%s: Failed to find PDU offset from the data TLV\n",
-             __func__);
-    }
-  }
-  free(output);
-  return 0;
+  /*
+   * Raw send: format, length and the PDU
+   * Read response: storage tag, format, length and the PDU
+   */
+  if (source == FROM_HOST && msgid == WMS_RAW_SEND)
+    skip = 3;
+  else if (source == FROM_DSP && msgid == WMS_READ_MESSAGE)
+    skip = 4;
+  else
+    return -ENOENT;
+
+  offset = get_tlv_offset_by_id(bytes, len, 0x01);
+  tlv_len = get_tlv_len_by_id(bytes, len, 0x01);
+  if (offset < 0 || tlv_len < skip)
+    return -ENOENT;
+  tlv = (struct empty_tlv *)(bytes + offset);
+  if (tlv->data[skip - 3] != WMS_MESSAGE_FORMAT_GW_PP)
+    return -ENOENT;
+  pdu_len = tlv->data[skip - 2] | (tlv->data[skip - 1] << 8);
+  if (pdu_len > tlv_len - skip)
+    return -EINVAL;
+  return tpdu_decode(tlv->data + skip, pdu_len, true, tpdu);
 }
+
+/*
+ * Every message is decoded once here, then checked to see if it's
+ * for us and logged from the same decode
+ */
 int check_wms_message(uint8_t source, void *bytes, size_t len, int adspfd,
                       int usbfd) {
-  uint8_t our_phone[] = {0x91, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77};
+  static const uint8_t our_phone[] = {0x22, 0x33, 0x44, 0x55, 0x66, 0x77};
+  struct tpdu tpdu;
   int needs_rerouting = 0;
-  struct outgoing_sms_packet *pkt;
-  if (len >= sizeof(struct outgoing_sms_packet) - (MAX_MESSAGE_SIZE + 2)) {
-    pkt = (struct outgoing_sms_packet *)bytes;
-    // is it for us?
-    if (memcmp(pkt->target.phone_number, our_phone,
-               sizeof(pkt->target.phone_number)) == 0) {
-      logger(MSG_DEBUG, "%s: We got a message \n", __func__);
-      intercept_and_parse(bytes, len, adspfd, usbfd);
-      needs_rerouting = 1;
-    }
-    if (is_sms_logging_enabled() && (pkt->qmipkt.msgid == WMS_READ_MESSAGE ||
-                                     pkt->qmipkt.msgid == WMS_RAW_SEND)) {
-      log_message_contents(source, bytes, len);
-    }
+  int ret;
+
+  ret = get_wms_tpdu(source, bytes, len, &tpdu);
+  if (ret == -ENOENT)
+    return 0;
+  if (ret == -ENOTSUP) { // Status reports and friends, nothing to do
+    logger(MSG_DEBUG, "%s: Passing through a non DELIVER/SUBMIT PDU\n",
+           __func__);
+    return 0;
   }
+  if (ret < 0) {
+    logger(MSG_WARN, "%s: Ignoring a message we can't decode (%i)\n",
+           __func__, ret);
+    return 0;
+  }
+
+  // is it for us?
+  if (tpdu.mti == TPDU_SUBMIT &&
+      tpdu.address.type == TYPE_OF_ADDRESS_INTERNATIONAL_PHONE &&
+      tpdu.address.size == sizeof(our_phone) &&
+      memcmp(tpdu.address.value, our_phone, sizeof(our_phone)) == 0) {
+    logger(MSG_DEBUG, "%s: We got a message \n", __func__);
+    intercept_and_parse(bytes, len, &tpdu, usbfd);
+    needs_rerouting = 1;
+  }
+  if (is_sms_logging_enabled())
+    log_message_contents(&tpdu);
   return needs_rerouting;
 }
 
+/*
+ * New message indications that arrive while the host is suspended
+ * are held until it wakes up, instead of being written to a port
+ * nobody is reading. Returns 1 if the packet was kept
+ */
 int check_wms_indication_message(void *bytes, size_t len, int adspfd,
                                  int usbfd) {
-  int needs_pass_through = 0;
   struct wms_message_indication_packet *pkt;
-  if (len >= sizeof(struct wms_message_indication_packet)) {
-    pkt = (struct wms_message_indication_packet *)bytes;
-    // is it for us?
-    if (pkt->qmipkt.msgid == WMS_EVENT_REPORT &&
-        get_transceiver_suspend_state()) {
-      logger(MSG_INFO, "%s: Attempting to wake up the host", __func__);
-      pulse_ring_in(); // try to wake the host
-      sleep(3);        // sleep for 5s
-      // Enqueue an incoming notification
-      set_pending_notification_source(MSG_EXTERNAL);
-      set_notif_pending(true);
-      needs_pass_through = 1;
-      set_sms_notification_pending_state(true);
-    }
+  if (len < sizeof(struct wms_message_indication_packet))
+    return 0;
+
+  pkt = (struct wms_message_indication_packet *)bytes;
+  if (pkt->qmipkt.msgid != WMS_EVENT_REPORT ||
+      !get_transceiver_suspend_state())
+    return 0;
+
+  if (park_host_indication(bytes, len) < 0) {
+    /* Let it through, the host might be back by the time it's read */
+    request_host_wakeup();
+    return 0;
   }
-  return needs_pass_through;
+  request_host_wakeup();
+  return 1;
 }
 
 /* Intercept and ACK a message */
 uint8_t intercept_cb_message(void *bytes, size_t len) {
+  const size_t page_offset = offsetof(struct cell_broadcast_message_prototype,
+                                      message.pdu.contents);
   uint8_t *output;
   uint8_t ret;
   uint8_t strsz = 0;
+  size_t page_size;
+  int septets;
   struct cell_broadcast_message_prototype *pkt;
-  uint8_t *reply = calloc(MAX_CB_MESSAGE_SIZE, sizeof(unsigned char));
+  struct scratch_mark mark = scratch_save();
+  uint8_t *reply = scratch_alloc(MAX_CB_MESSAGE_SIZE);
 
-  output = calloc(MAX_CB_MESSAGE_SIZE, sizeof(uint8_t));
+  output = scratch_alloc(MAX_CB_MESSAGE_SIZE);
 
   if (len >= sizeof(struct cell_broadcast_message_prototype) -
                  (MAX_CB_MESSAGE_SIZE + 2)) {
@@ -1241,9 +1396,13 @@ uint8_t intercept_cb_message(void *bytes, size_t len) {
             add_raw_sms_to_queue(output, sz, sms_dcs);
 
           } else {
-            ret = gsm7_to_ascii(pkt->message.pdu.contents,
-                                  strlen((char *)pkt->message.pdu.contents),
-                                  (char *)output, pkt->message.len); // 2 ui16, 2 ui8
+            /* The page ends with the packet, it isn't a string */
+            page_size = len > page_offset ? len - page_offset : 0;
+            septets = pkt->message.len < MAX_CB_MESSAGE_SIZE - 1
+                          ? pkt->message.len
+                          : MAX_CB_MESSAGE_SIZE - 1;
+            ret = gsm7_to_ascii(pkt->message.pdu.contents, page_size,
+                                (char *)output, septets);
               if (ret < 0) {
                 logger(MSG_ERROR, "%s: %i: Failed to convert to ASCII\n", __func__,
                       __LINE__);
@@ -1256,7 +1415,7 @@ uint8_t intercept_cb_message(void *bytes, size_t len) {
     }
   }
   pkt = NULL;
-  free(output);
+  scratch_restore(mark);
   return 0;
 }
 
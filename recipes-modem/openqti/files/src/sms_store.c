@@ -0,0 +1,567 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/sms_store.h"
+#include "../inc/config.h"
+#include "../inc/logger.h"
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * SMS store
+ *  With SMS logging enabled, every message that goes through is also
+ *  appended to its own store (see sms_store.h for the format), so old
+ *  messages can be looked up without digging through the log.
+ *  Messages go to the newest segment, and a new one is started when it
+ *  reaches SMS_STORE_SEGMENT_SIZE or SMS_STORE_SEGMENT_RECORDS. Only the
+ *  last SMS_STORE_MAX_SEGMENTS are kept, older ones are deleted whole.
+ *  The index of every segment is loaded in memory, along with a copy
+ *  sorted by the hash of the number, so the last messages from someone
+ *  are a binary search away and only the ones shown are read back.
+ *  It lives in /persist when persistent logging is on, like the logs.
+ *  The partition is remounted when that setting changes, never here.
+ */
+
+struct stored_ref {
+  uint32_t segment;
+  uint32_t offset;
+  uint32_t number_hash;
+};
+
+/* Sorted by hash, then by sequence number */
+struct sender_key {
+  uint32_t number_hash;
+  uint32_t seq;
+};
+
+struct {
+  pthread_mutex_t mutex;
+  int persist; // Where it's loaded from, -1 if it isn't
+  bool failed;
+  int fd[SMS_STORE_MAX_SEGMENTS]; // .msg of each segment, by segment % max
+  int idx_fd;                     // .idx of the newest one
+  uint32_t first_segment;
+  uint32_t last_segment;
+  off_t last_size;
+  uint32_t last_records;
+  uint32_t first_seq; // Messages in memory are [first_seq, next_seq)
+  uint32_t next_seq;
+  struct stored_ref refs[SMS_STORE_MAX_RECORDS]; // By seq % max
+  uint32_t num_keys;
+  struct sender_key by_sender[SMS_STORE_MAX_RECORDS];
+} sms_store_rt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .persist = -1,
+    .idx_fd = -1,
+};
+
+static uint32_t hash_number(const char *number, size_t len) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash ^= (uint8_t)number[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void get_segment_path(char *path, size_t size, uint32_t segment,
+                             const char *ext) {
+  snprintf(path, size, "%s/%08x.%s",
+           sms_store_rt.persist ? PERSISTENT_SMS_STORE_PATH
+                                : VOLATILE_SMS_STORE_PATH,
+           segment, ext);
+}
+
+/* NNNNNNNN.msg or NNNNNNNN.idx */
+static bool parse_segment_name(const char *name, uint32_t *segment) {
+  char *end;
+  *segment = strtoul(name, &end, 16);
+  return end - name == 8 && (strcmp(end, ".msg") == 0 || strcmp(end, ".idx") == 0);
+}
+
+static void remove_segment_files(uint32_t segment) {
+  char path[64];
+  get_segment_path(path, sizeof(path), segment, "msg");
+  unlink(path);
+  get_segment_path(path, sizeof(path), segment, "idx");
+  unlink(path);
+}
+
+static int write_header(int fd, uint32_t magic, uint32_t segment) {
+  struct sms_store_file_header header = {
+      .magic = htole32(magic),
+      .version = htole16(SMS_STORE_VERSION),
+      .reserved = 0,
+      .segment = htole32(segment),
+  };
+  if (write(fd, &header, sizeof(header)) != sizeof(header))
+    return -EIO;
+  return 0;
+}
+
+static bool check_header(int fd, uint32_t magic, uint32_t segment) {
+  struct sms_store_file_header header;
+  return pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+         le32toh(header.magic) == magic &&
+         le16toh(header.version) == SMS_STORE_VERSION &&
+         le32toh(header.segment) == segment;
+}
+
+/* Size of the record at offset, if all of it is there */
+static int get_record_size(int fd, uint32_t offset, off_t file_size,
+                           struct sms_store_record *record) {
+  size_t size;
+  if (pread(fd, record, sizeof(*record), offset) != sizeof(*record) ||
+      record->number_len >= SMS_STORE_NUMBER_SIZE ||
+      le16toh(record->text_len) >= SMS_STORE_TEXT_SIZE)
+    return -EINVAL;
+  size = sizeof(*record) + record->number_len + le16toh(record->text_len);
+  if (offset + size > file_size)
+    return -EINVAL;
+  return size;
+}
+
+static void add_ref(uint32_t segment, uint32_t offset, uint32_t number_hash) {
+  struct sender_key *keys = sms_store_rt.by_sender;
+  uint32_t seq = sms_store_rt.next_seq++;
+  uint32_t lo = 0, hi = sms_store_rt.num_keys, mid;
+
+  sms_store_rt.refs[seq % SMS_STORE_MAX_RECORDS].segment = segment;
+  sms_store_rt.refs[seq % SMS_STORE_MAX_RECORDS].offset = offset;
+  sms_store_rt.refs[seq % SMS_STORE_MAX_RECORDS].number_hash = number_hash;
+
+  /* Newest for its hash, so it goes after every other one with it */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (keys[mid].number_hash <= number_hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  memmove(&keys[lo + 1], &keys[lo],
+          (sms_store_rt.num_keys - lo) * sizeof(struct sender_key));
+  keys[lo].number_hash = number_hash;
+  keys[lo].seq = seq;
+  sms_store_rt.num_keys++;
+}
+
+static void remove_last_ref() {
+  uint32_t seq = --sms_store_rt.next_seq;
+  uint32_t i;
+  for (i = 0; i < sms_store_rt.num_keys; i++) {
+    if (sms_store_rt.by_sender[i].seq == seq) {
+      memmove(&sms_store_rt.by_sender[i], &sms_store_rt.by_sender[i + 1],
+              (sms_store_rt.num_keys - i - 1) * sizeof(struct sender_key));
+      sms_store_rt.num_keys--;
+      break;
+    }
+  }
+}
+
+/* Indexes a record that made it to the .msg file but not to the .idx */
+static int recover_record(int fd, uint32_t segment, uint32_t offset,
+                          off_t file_size) {
+  struct sms_store_record record;
+  struct sms_store_index_entry entry;
+  char number[SMS_STORE_NUMBER_SIZE];
+  int size;
+
+  size = get_record_size(fd, offset, file_size, &record);
+  if (size < 0 || pread(fd, number, record.number_len,
+                        offset + sizeof(record)) != record.number_len)
+    return -EINVAL;
+  entry.timestamp = record.timestamp;
+  entry.number_hash = htole32(hash_number(number, record.number_len));
+  entry.offset = htole32(offset);
+  if (write(sms_store_rt.idx_fd, &entry, sizeof(entry)) != sizeof(entry))
+    logger(MSG_WARN, "%s: Can't update the index of segment %u\n", __func__,
+           segment);
+  add_ref(segment, offset, le32toh(entry.number_hash));
+  return size;
+}
+
+/*
+ * Loads the index of a segment, checking it against its .msg file.
+ * Whatever didn't make it to the index is added to it, and a record
+ * that was only half written is cut
+ */
+static int load_segment(uint32_t segment) {
+  struct sms_store_index_entry entry;
+  struct sms_store_record record;
+  uint32_t offset, records = 0;
+  off_t end = sizeof(struct sms_store_file_header);
+  off_t pos = sizeof(struct sms_store_file_header);
+  struct stat st;
+  char path[64];
+  int fd, size;
+
+  get_segment_path(path, sizeof(path), segment, "msg");
+  fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+  if (fd < 0)
+    return -ENOENT;
+  if (fstat(fd, &st) < 0 || !check_header(fd, SMS_STORE_MAGIC, segment)) {
+    logger(MSG_WARN, "%s: Removing damaged segment %s\n", __func__, path);
+    close(fd);
+    remove_segment_files(segment);
+    return -EINVAL;
+  }
+
+  if (sms_store_rt.idx_fd >= 0)
+    close(sms_store_rt.idx_fd);
+  get_segment_path(path, sizeof(path), segment, "idx");
+  sms_store_rt.idx_fd =
+      open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (sms_store_rt.idx_fd < 0) {
+    close(fd);
+    return -EIO;
+  }
+
+  /* Entries have to be in order and point inside the file */
+  if (check_header(sms_store_rt.idx_fd, SMS_STORE_INDEX_MAGIC, segment)) {
+    while (records < SMS_STORE_SEGMENT_RECORDS &&
+           pread(sms_store_rt.idx_fd, &entry, sizeof(entry), pos) ==
+               sizeof(entry)) {
+      offset = le32toh(entry.offset);
+      if (offset < end || offset >= st.st_size)
+        break;
+      add_ref(segment, offset, le32toh(entry.number_hash));
+      end = offset + 1;
+      records++;
+      pos += sizeof(entry);
+    }
+    /* Only the last one needs reading, to know where the next one goes */
+    if (records > 0) {
+      offset = sms_store_rt.refs[(sms_store_rt.next_seq - 1) %
+                                 SMS_STORE_MAX_RECORDS]
+                   .offset;
+      size = get_record_size(fd, offset, st.st_size, &record);
+      if (size < 0) {
+        remove_last_ref();
+        records--;
+        pos -= sizeof(entry);
+        end = offset;
+      } else {
+        end = offset + size;
+      }
+    }
+  } else {
+    pos = 0;
+  }
+  if (ftruncate(sms_store_rt.idx_fd, pos) < 0 ||
+      (pos == 0 &&
+       write_header(sms_store_rt.idx_fd, SMS_STORE_INDEX_MAGIC, segment) < 0)) {
+    logger(MSG_WARN, "%s: Can't fix the index of segment %u\n", __func__,
+           segment);
+  }
+
+  while (records < SMS_STORE_SEGMENT_RECORDS &&
+         (size = recover_record(fd, segment, end, st.st_size)) > 0) {
+    end += size;
+    records++;
+  }
+  if (end < st.st_size && ftruncate(fd, end) < 0)
+    logger(MSG_WARN, "%s: Can't cut segment %u\n", __func__, segment);
+
+  sms_store_rt.fd[segment % SMS_STORE_MAX_SEGMENTS] = fd;
+  sms_store_rt.last_segment = segment;
+  sms_store_rt.last_size = end;
+  sms_store_rt.last_records = records;
+  return 0;
+}
+
+static int start_segment(uint32_t segment) {
+  char path[64];
+  int fd;
+
+  if (sms_store_rt.idx_fd >= 0)
+    close(sms_store_rt.idx_fd);
+  sms_store_rt.idx_fd = -1;
+
+  get_segment_path(path, sizeof(path), segment, "msg");
+  fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0 || write_header(fd, SMS_STORE_MAGIC, segment) < 0) {
+    logger(MSG_ERROR, "%s: Cannot create %s\n", __func__, path);
+    if (fd >= 0)
+      close(fd);
+    return -EIO;
+  }
+  get_segment_path(path, sizeof(path), segment, "idx");
+  sms_store_rt.idx_fd =
+      open(path, O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (sms_store_rt.idx_fd < 0 ||
+      write_header(sms_store_rt.idx_fd, SMS_STORE_INDEX_MAGIC, segment) < 0) {
+    logger(MSG_ERROR, "%s: Cannot create %s\n", __func__, path);
+    close(fd);
+    return -EIO;
+  }
+
+  sms_store_rt.fd[segment % SMS_STORE_MAX_SEGMENTS] = fd;
+  sms_store_rt.last_segment = segment;
+  sms_store_rt.last_size = sizeof(struct sms_store_file_header);
+  sms_store_rt.last_records = 0;
+  return 0;
+}
+
+static void drop_oldest_segment() {
+  uint32_t segment = sms_store_rt.first_segment;
+  uint32_t i, kept = 0;
+  int *fd = &sms_store_rt.fd[segment % SMS_STORE_MAX_SEGMENTS];
+
+  while (sms_store_rt.first_seq != sms_store_rt.next_seq &&
+         sms_store_rt.refs[sms_store_rt.first_seq % SMS_STORE_MAX_RECORDS]
+                 .segment == segment)
+    sms_store_rt.first_seq++;
+  for (i = 0; i < sms_store_rt.num_keys; i++) {
+    if (sms_store_rt.by_sender[i].seq >= sms_store_rt.first_seq)
+      sms_store_rt.by_sender[kept++] = sms_store_rt.by_sender[i];
+  }
+  sms_store_rt.num_keys = kept;
+
+  if (*fd >= 0)
+    close(*fd);
+  *fd = -1;
+  remove_segment_files(segment);
+  sms_store_rt.first_segment++;
+}
+
+static int rotate_store() {
+  if (sms_store_rt.last_segment - sms_store_rt.first_segment + 1 >=
+      SMS_STORE_MAX_SEGMENTS)
+    drop_oldest_segment();
+  return start_segment(sms_store_rt.last_segment + 1);
+}
+
+static void close_store() {
+  int i;
+  /* fds are only valid once it has been loaded */
+  for (i = 0; i < SMS_STORE_MAX_SEGMENTS; i++) {
+    if (sms_store_rt.fd[i] >= 0 && sms_store_rt.persist >= 0)
+      close(sms_store_rt.fd[i]);
+    sms_store_rt.fd[i] = -1;
+  }
+  if (sms_store_rt.idx_fd >= 0)
+    close(sms_store_rt.idx_fd);
+  sms_store_rt.idx_fd = -1;
+  sms_store_rt.first_seq = sms_store_rt.next_seq = 0;
+  sms_store_rt.num_keys = 0;
+  sms_store_rt.persist = -1;
+}
+
+static int load_store(int persist) {
+  const char *path =
+      persist ? PERSISTENT_SMS_STORE_PATH : VOLATILE_SMS_STORE_PATH;
+  uint32_t segment, first, last = 0;
+  bool found = false, loaded = false;
+  struct dirent *de;
+  DIR *dir;
+
+  close_store();
+  sms_store_rt.persist = persist;
+  if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+    logger(MSG_ERROR, "%s: Cannot create %s\n", __func__, path);
+    return -EIO;
+  }
+  dir = opendir(path);
+  if (dir == NULL) {
+    logger(MSG_ERROR, "%s: Cannot open %s\n", __func__, path);
+    return -EIO;
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (parse_segment_name(de->d_name, &segment) &&
+        (!found || segment > last)) {
+      last = segment;
+      found = true;
+    }
+  }
+  first = last >= SMS_STORE_MAX_SEGMENTS - 1
+              ? last - (SMS_STORE_MAX_SEGMENTS - 1)
+              : 0;
+  rewinddir(dir);
+  while ((de = readdir(dir)) != NULL) {
+    if (parse_segment_name(de->d_name, &segment) && segment < first)
+      remove_segment_files(segment);
+  }
+  closedir(dir);
+
+  for (segment = first; found && segment <= last; segment++) {
+    if (load_segment(segment) == 0 && !loaded) {
+      sms_store_rt.first_segment = segment;
+      loaded = true;
+    }
+  }
+  if (!loaded) {
+    sms_store_rt.first_segment = found ? last + 1 : 0;
+    if (start_segment(sms_store_rt.first_segment) < 0)
+      return -EIO;
+  }
+  logger(MSG_INFO, "%s: %u messages stored in %s\n", __func__,
+         sms_store_rt.next_seq - sms_store_rt.first_seq, path);
+  return 0;
+}
+
+/* Call with the mutex held. (Re)loads it if logs moved */
+static int check_store() {
+  int persist = use_persistent_logging() ? 1 : 0;
+  if (sms_store_rt.persist == persist)
+    return sms_store_rt.failed ? -EIO : 0;
+  sms_store_rt.failed = load_store(persist) < 0;
+  return sms_store_rt.failed ? -EIO : 0;
+}
+
+int store_sms_message(uint8_t direction, const char *number,
+                      const char *text) {
+  struct sms_store_record record;
+  struct sms_store_index_entry entry;
+  struct iovec iov[3];
+  size_t number_len = strnlen(number, SMS_STORE_NUMBER_SIZE - 1);
+  size_t text_len = strnlen(text, SMS_STORE_TEXT_SIZE - 1);
+  size_t size;
+  int fd, ret = 0;
+
+  /* Don't cut a UTF-8 character in half */
+  if (text_len == SMS_STORE_TEXT_SIZE - 1) {
+    while (text_len > 0 && (text[text_len] & 0xc0) == 0x80)
+      text_len--;
+  }
+  size = sizeof(record) + number_len + text_len;
+
+  pthread_mutex_lock(&sms_store_rt.mutex);
+  if (check_store() < 0) {
+    pthread_mutex_unlock(&sms_store_rt.mutex);
+    return -EIO;
+  }
+  if ((sms_store_rt.last_size + size > SMS_STORE_SEGMENT_SIZE ||
+       sms_store_rt.last_records >= SMS_STORE_SEGMENT_RECORDS) &&
+      rotate_store() < 0) {
+    sms_store_rt.failed = true;
+    pthread_mutex_unlock(&sms_store_rt.mutex);
+    return -EIO;
+  }
+
+  record.timestamp = htole32((uint32_t)time(NULL));
+  record.direction = direction;
+  record.number_len = number_len;
+  record.text_len = htole16(text_len);
+  iov[0].iov_base = &record;
+  iov[0].iov_len = sizeof(record);
+  iov[1].iov_base = (void *)number;
+  iov[1].iov_len = number_len;
+  iov[2].iov_base = (void *)text;
+  iov[2].iov_len = text_len;
+  fd = sms_store_rt.fd[sms_store_rt.last_segment % SMS_STORE_MAX_SEGMENTS];
+  if (writev(fd, iov, 3) != size) {
+    logger(MSG_ERROR, "%s: Error writing the message\n", __func__);
+    if (ftruncate(fd, sms_store_rt.last_size) < 0)
+      sms_store_rt.failed = true; // Next load will cut it
+    pthread_mutex_unlock(&sms_store_rt.mutex);
+    return -EIO;
+  }
+
+  entry.timestamp = record.timestamp;
+  entry.number_hash = htole32(hash_number(number, number_len));
+  entry.offset = htole32(sms_store_rt.last_size);
+  if (write(sms_store_rt.idx_fd, &entry, sizeof(entry)) != sizeof(entry)) {
+    /* The message is there, it will be indexed when it's loaded again */
+    logger(MSG_WARN, "%s: Error writing the index\n", __func__);
+    ret = -EIO;
+  }
+  add_ref(sms_store_rt.last_segment, sms_store_rt.last_size,
+          le32toh(entry.number_hash));
+  sms_store_rt.last_size += size;
+  sms_store_rt.last_records++;
+  pthread_mutex_unlock(&sms_store_rt.mutex);
+  return ret;
+}
+
+/* Call with the mutex held */
+static int read_message(uint32_t seq, struct sms_store_message *msg) {
+  struct stored_ref *ref = &sms_store_rt.refs[seq % SMS_STORE_MAX_RECORDS];
+  uint8_t buf[sizeof(struct sms_store_record) + SMS_STORE_NUMBER_SIZE +
+              SMS_STORE_TEXT_SIZE];
+  struct sms_store_record *record = (struct sms_store_record *)buf;
+  int fd = sms_store_rt.fd[ref->segment % SMS_STORE_MAX_SEGMENTS];
+  ssize_t ret;
+  size_t text_len;
+
+  ret = pread(fd, buf, sizeof(buf), ref->offset);
+  if (ret < (ssize_t)sizeof(*record))
+    return -EIO;
+  text_len = le16toh(record->text_len);
+  if (record->number_len >= SMS_STORE_NUMBER_SIZE ||
+      text_len >= SMS_STORE_TEXT_SIZE ||
+      sizeof(*record) + record->number_len + text_len > ret)
+    return -EINVAL;
+
+  msg->timestamp = le32toh(record->timestamp);
+  msg->direction = record->direction;
+  memcpy(msg->number, buf + sizeof(*record), record->number_len);
+  msg->number[record->number_len] = 0;
+  memcpy(msg->text, buf + sizeof(*record) + record->number_len, text_len);
+  msg->text[text_len] = 0;
+  return 0;
+}
+
+/*
+ * Fills out with the last count messages, newest first, from number
+ * or from anyone if it's NULL. Returns how many it found
+ */
+int get_last_sms_messages(const char *number, struct sms_store_message *out,
+                          int count) {
+  struct sender_key *keys = sms_store_rt.by_sender;
+  uint32_t hash, seq, lo, hi, mid;
+  int found = 0;
+
+  pthread_mutex_lock(&sms_store_rt.mutex);
+  if (check_store() < 0) {
+    pthread_mutex_unlock(&sms_store_rt.mutex);
+    return -EIO;
+  }
+
+  if (number == NULL) {
+    for (seq = sms_store_rt.next_seq;
+         seq != sms_store_rt.first_seq && found < count;) {
+      if (read_message(--seq, &out[found]) == 0)
+        found++;
+    }
+    pthread_mutex_unlock(&sms_store_rt.mutex);
+    return found;
+  }
+
+  hash = hash_number(number, strlen(number));
+  lo = 0;
+  hi = sms_store_rt.num_keys;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (keys[mid].number_hash <= hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  /* Different numbers can share a hash */
+  while (lo > 0 && keys[lo - 1].number_hash == hash && found < count) {
+    lo--;
+    if (read_message(keys[lo].seq, &out[found]) == 0 &&
+        strcmp(out[found].number, number) == 0)
+      found++;
+  }
+  pthread_mutex_unlock(&sms_store_rt.mutex);
+  return found;
+}
+
+uint32_t get_sms_store_count() {
+  uint32_t count;
+  pthread_mutex_lock(&sms_store_rt.mutex);
+  count = sms_store_rt.next_seq - sms_store_rt.first_seq;
+  pthread_mutex_unlock(&sms_store_rt.mutex);
+  return count;
+}
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/stats.h"
+#include <time.h>
+
+/*
+ * Statistics helpers
+ *  Counters and histograms are plain 64 bit atomics, updated with
+ *  relaxed ordering from the thread that owns them and read from any
+ *  other without taking a lock. A reader can see a histogram halfway
+ *  through an update, which is off by one sample at most.
+ */
+uint64_t stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int histogram_bucket(uint64_t ns) {
+  unsigned int msb, shift, bucket;
+
+  if (ns < (1 << (STATS_HIST_SUB_BITS + 1)))
+    return ns;
+
+  msb = 63 - __builtin_clzll(ns);
+  shift = msb - STATS_HIST_SUB_BITS;
+  bucket = (shift << STATS_HIST_SUB_BITS) + (ns >> shift);
+  if (bucket >= STATS_HIST_BUCKETS)
+    bucket = STATS_HIST_BUCKETS - 1;
+  return bucket;
+}
+
+/* Middle of the range of values that fall in the bucket */
+static uint64_t histogram_bucket_value(unsigned int bucket) {
+  unsigned int shift, mantissa;
+  uint64_t low;
+
+  if (bucket < (1 << (STATS_HIST_SUB_BITS + 1)))
+    return bucket;
+
+  shift = (bucket >> STATS_HIST_SUB_BITS) - 1;
+  mantissa = (bucket & ((1 << STATS_HIST_SUB_BITS) - 1)) +
+             (1 << STATS_HIST_SUB_BITS);
+  low = (uint64_t)mantissa << shift;
+  return low + ((1ULL << shift) >> 1);
+}
+
+void histogram_record(struct latency_histogram *hist, uint64_t ns) {
+  uint64_t max = stat_read(hist->max_ns);
+
+  stat_inc(hist->buckets[histogram_bucket(ns)]);
+  atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+  while (ns > max &&
+         !atomic_compare_exchange_weak_explicit(&hist->max_ns, &max, ns,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+  stat_inc(hist->count);
+}
+
+void histogram_record_since(struct latency_histogram *hist, uint64_t start_ns) {
+  histogram_record(hist, stats_now_ns() - start_ns);
+}
+
+/* permille: 500 for the median, 990 for p99... */
+uint64_t histogram_percentile(struct latency_histogram *hist,
+                              uint32_t permille) {
+  uint64_t count = 0, target, seen = 0, value, max;
+  unsigned int i;
+
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    count += stat_read(hist->buckets[i]);
+  if (count == 0)
+    return 0;
+
+  target = (count * permille + 999) / 1000;
+  if (target == 0)
+    target = 1;
+  for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+    seen += stat_read(hist->buckets[i]);
+    if (seen >= target)
+      break;
+  }
+  if (i == STATS_HIST_BUCKETS)
+    i = STATS_HIST_BUCKETS - 1;
+
+  /* Never report more than what was actually seen */
+  value = histogram_bucket_value(i);
+  max = stat_read(hist->max_ns);
+  return value > max ? max : value;
+}
+
+struct latency_summary histogram_summary(struct latency_histogram *hist) {
+  struct latency_summary summary;
+  summary.count = stat_read(hist->count);
+  summary.avg_ns = summary.count ? stat_read(hist->sum_ns) / summary.count : 0;
+  summary.p50_ns = histogram_percentile(hist, 500);
+  summary.p90_ns = histogram_percentile(hist, 900);
+  summary.p99_ns = histogram_percentile(hist, 990);
+  summary.max_ns = stat_read(hist->max_ns);
+  return summary;
+}
+
+void histogram_reset(struct latency_histogram *hist) {
+  unsigned int i;
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    atomic_store_explicit(&hist->buckets[i], 0, memory_order_relaxed);
+  atomic_store_explicit(&hist->count, 0, memory_order_relaxed);
+  atomic_store_explicit(&hist->sum_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&hist->max_ns, 0, memory_order_relaxed);
+}
+
+/* One "name.field value" pair per line */
+void dump_histogram(FILE *fp, const char *name, struct latency_histogram *hist) {
+  struct latency_summary summary = histogram_summary(hist);
+  fprintf(fp, "%s.count %llu\n", name, (unsigned long long)summary.count);
+  fprintf(fp, "%s.avg_ns %llu\n", name, (unsigned long long)summary.avg_ns);
+  fprintf(fp, "%s.p50_ns %llu\n", name, (unsigned long long)summary.p50_ns);
+  fprintf(fp, "%s.p90_ns %llu\n", name, (unsigned long long)summary.p90_ns);
+  fprintf(fp, "%s.p99_ns %llu\n", name, (unsigned long long)summary.p99_ns);
+  fprintf(fp, "%s.max_ns %llu\n", name, (unsigned long long)summary.max_ns);
+}
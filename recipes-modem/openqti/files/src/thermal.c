@@ -3,6 +3,7 @@
 #include "../inc/call.h"
 #include "../inc/cell.h"
 #include "../inc/config.h"
+#include "../inc/devices.h"
 #include "../inc/helpers.h"
 #include "../inc/logger.h"
 #include "../inc/openqti.h"
@@ -20,10 +21,22 @@
 #include <time.h>
 #include <unistd.h>
 
+/* Last readings, for the metrics page */
+struct {
+  int sensors[NO_OF_SENSORS];
+} thermal_rt;
+
+int get_thermal_readings(int *temps, int max) {
+  int i;
+  for (i = 0; i < NO_OF_SENSORS && i < max; i++)
+    temps[i] = thermal_rt.sensors[i];
+  return i;
+}
+
 int get_temperature(char *sensor_path) {
   int fd, val = 0;
   char readval[6];
-  fd = open(sensor_path, O_RDONLY);
+  fd = open_device(sensor_path, O_RDONLY);
   if (fd < 0) {
     logger(MSG_ERROR, "%s: Cannot open sysfs entry %s\n", __func__,
            sensor_path);
@@ -55,6 +68,7 @@ void *thermal_monitoring_thread() {
                THRM_ZONE_TRAIL);
       prev_sensor_reading[i] = sensors[i];
       sensors[i] = get_temperature(sensor_path);
+      thermal_rt.sensors[i] = sensors[i];
     }
     if (round % 2 == 0) {
       log_thermal_status(MSG_INFO, "Zones 0-6: %iC %iC %iC %iC %iC %iC %iC \n",
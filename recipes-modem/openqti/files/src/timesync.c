@@ -98,7 +98,7 @@ void *time_sync() {
       logger(MSG_DEBUG, "%s: Send CCLK\n", __func__);
       sleep(1);
       cmd_ret = send_at_command(GET_CCLK, sizeof(GET_CCLK), response, 128);
-      if (strstr(response, "+CCLK: ") != NULL) {
+      if (cmd_ret == 0 && strstr(response, "+CCLK: ") != NULL) {
         begin = strchr(response, '"');
         if (begin != NULL) {
           tmp = get_int_from_str(begin, 1);
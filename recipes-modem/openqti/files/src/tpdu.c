@@ -0,0 +1,263 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/tpdu.h"
+#include "../inc/gsm7.h"
+#include <errno.h>
+#include <string.h>
+
+/*
+ * SMS TPDU decoder (3GPP TS 23.040, 9.2)
+ *  Decodes SMS-DELIVER and SMS-SUBMIT PDUs as QMI carries them, with or
+ *  without the SMSC address in front. Every length in the PDU is checked
+ *  against what's actually there before it's used, and the result only
+ *  points into the PDU: nothing is copied until someone asks for the
+ *  address or the text as a string.
+ *  Anything that doesn't add up is rejected with -EINVAL, and PDUs that
+ *  aren't a DELIVER or a SUBMIT with -ENOTSUP.
+ */
+
+static int parse_smsc(const uint8_t *pdu, size_t len, size_t *pos,
+                      struct tpdu_address *smsc) {
+  uint8_t size = pdu[*pos];
+
+  memset(smsc, 0, sizeof(*smsc));
+  if (size > TPDU_MAX_SMSC_SIZE || len - *pos - 1 < size)
+    return -EINVAL;
+  if (size > 0) {
+    smsc->type = pdu[*pos + 1];
+    smsc->value = pdu + *pos + 2;
+    smsc->size = size - 1;
+    smsc->digits = smsc->size * 2; // Filler, if any, is skipped later
+  }
+  *pos += 1 + size;
+  return 0;
+}
+
+/* Length in semi-octets, type of address, and the value */
+static int parse_address(const uint8_t *pdu, size_t len, size_t *pos,
+                         struct tpdu_address *address) {
+  uint8_t digits, size;
+
+  if (len - *pos < 2)
+    return -EINVAL;
+  digits = pdu[*pos];
+  size = (digits + 1) / 2;
+  if (digits > TPDU_MAX_ADDRESS_DIGITS || len - *pos - 2 < size ||
+      !(pdu[*pos + 1] & 0x80))
+    return -EINVAL;
+  address->type = pdu[*pos + 1];
+  address->digits = digits;
+  address->value = pdu + *pos + 2;
+  address->size = size;
+  *pos += 2 + size;
+  return 0;
+}
+
+/* Swapped BCD, the sign of the time zone is the only bit allowed out */
+static bool is_valid_timestamp(const uint8_t *ts) {
+  int i;
+  for (i = 0; i < TPDU_TIMESTAMP_SIZE; i++) {
+    if ((ts[i] >> 4) > 9 ||
+        (ts[i] & (i == TPDU_TIMESTAMP_SIZE - 1 ? 0x07 : 0x0f)) > 9)
+      return false;
+  }
+  return true;
+}
+
+static int parse_validity(const uint8_t *pdu, size_t len, size_t *pos,
+                          struct tpdu *tpdu) {
+  tpdu->validity = NULL;
+  tpdu->validity_size = 0;
+  switch (tpdu->first_octet & TPDU_VPF_MASK) {
+  case 0x00: // Not present
+    return 0;
+  case 0x10: // Relative
+    tpdu->validity_size = 1;
+    break;
+  case 0x08: // Enhanced
+  case 0x18: // Absolute
+    tpdu->validity_size = TPDU_TIMESTAMP_SIZE;
+    break;
+  }
+  if (len - *pos < tpdu->validity_size)
+    return -EINVAL;
+  tpdu->validity = pdu + *pos;
+  if ((tpdu->first_octet & TPDU_VPF_MASK) == 0x18 &&
+      !is_valid_timestamp(tpdu->validity))
+    return -EINVAL;
+  *pos += tpdu->validity_size;
+  return 0;
+}
+
+/* The header has to fit in the user data and its elements in it */
+static int parse_udh(struct tpdu *tpdu) {
+  size_t offset = 0, header;
+  uint8_t udhl;
+
+  if (tpdu->ud_size < 1)
+    return -EINVAL;
+  udhl = tpdu->ud[0];
+  if (udhl + 1 > tpdu->ud_size)
+    return -EINVAL;
+  tpdu->udh = tpdu->ud + 1;
+  tpdu->udh_size = udhl;
+  while (offset < udhl) {
+    if (udhl - offset < 2 || tpdu->udh[offset + 1] > udhl - offset - 2)
+      return -EINVAL;
+    offset += 2 + tpdu->udh[offset + 1];
+  }
+
+  /* In GSM-7 the text starts at the next septet boundary */
+  header = udhl + 1;
+  if (tpdu->alphabet == SMS_ALPHABET_GSM7)
+    header = (header * 8 + 6) / 7;
+  if (header > tpdu->udl)
+    return -EINVAL;
+  tpdu->text_start = header;
+  tpdu->text_len = tpdu->udl - header;
+  return 0;
+}
+
+int tpdu_decode(const uint8_t *pdu, size_t len, bool with_smsc,
+                struct tpdu *tpdu) {
+  size_t pos = 0, size;
+
+  memset(tpdu, 0, sizeof(*tpdu));
+  if (pdu == NULL || len < 1)
+    return -EINVAL;
+  if (with_smsc && parse_smsc(pdu, len, &pos, &tpdu->smsc) < 0)
+    return -EINVAL;
+  if (pos >= len)
+    return -EINVAL;
+  tpdu->first_octet = pdu[pos++];
+  tpdu->mti = tpdu->first_octet & TPDU_MTI_MASK;
+
+  switch (tpdu->mti) {
+  case TPDU_DELIVER:
+    if (parse_address(pdu, len, &pos, &tpdu->address) < 0 || len - pos < 2)
+      return -EINVAL;
+    tpdu->pid = pdu[pos++];
+    tpdu->dcs = pdu[pos++];
+    if (len - pos < TPDU_TIMESTAMP_SIZE || !is_valid_timestamp(pdu + pos))
+      return -EINVAL;
+    tpdu->timestamp = pdu + pos;
+    pos += TPDU_TIMESTAMP_SIZE;
+    break;
+  case TPDU_SUBMIT:
+    if (pos >= len)
+      return -EINVAL;
+    tpdu->message_ref = pdu[pos++];
+    if (parse_address(pdu, len, &pos, &tpdu->address) < 0 || len - pos < 2)
+      return -EINVAL;
+    tpdu->pid = pdu[pos++];
+    tpdu->dcs = pdu[pos++];
+    if (parse_validity(pdu, len, &pos, tpdu) < 0)
+      return -EINVAL;
+    break;
+  default:
+    return -ENOTSUP;
+  }
+
+  if (pos >= len)
+    return -EINVAL;
+  tpdu->udl = pdu[pos++];
+  tpdu->alphabet = get_dcs_alphabet(tpdu->dcs);
+  if (tpdu->alphabet == SMS_ALPHABET_GSM7) {
+    if (tpdu->udl > TPDU_MAX_UD_SIZE * 8 / 7)
+      return -EINVAL;
+    size = GSM7_PACKED_SIZE(tpdu->udl);
+  } else {
+    if (tpdu->udl > TPDU_MAX_UD_SIZE)
+      return -EINVAL;
+    size = tpdu->udl;
+  }
+  if (len - pos < size)
+    return -EINVAL;
+  tpdu->ud = pdu + pos;
+  tpdu->ud_size = size;
+  tpdu->text_len = tpdu->udl;
+  if (tpdu->first_octet & TPDU_UDHI)
+    return parse_udh(tpdu);
+  return 0;
+}
+
+/* Walks the UDH, returns 0 once there are no more elements */
+int tpdu_next_ie(const struct tpdu *tpdu, size_t *offset, struct tpdu_ie *ie) {
+  if (tpdu->udh == NULL || *offset + 2 > tpdu->udh_size)
+    return 0;
+  ie->iei = tpdu->udh[*offset];
+  ie->size = tpdu->udh[*offset + 1];
+  ie->data = tpdu->udh + *offset + 2;
+  *offset += 2 + ie->size;
+  return 1;
+}
+
+/* Reference, number of parts and this one, if it's part of a longer SMS */
+bool tpdu_get_concat(const struct tpdu *tpdu, uint16_t *ref, uint8_t *parts,
+                     uint8_t *part) {
+  struct tpdu_ie ie;
+  size_t offset = 0;
+
+  while (tpdu_next_ie(tpdu, &offset, &ie)) {
+    if (ie.iei == TPDU_IEI_CONCAT_8BIT && ie.size == 3) {
+      *ref = ie.data[0];
+    } else if (ie.iei == TPDU_IEI_CONCAT_16BIT && ie.size == 4) {
+      *ref = (ie.data[0] << 8) | ie.data[1];
+      ie.data++;
+    } else {
+      continue;
+    }
+    *parts = ie.data[1];
+    *part = ie.data[2];
+    if (*parts > 0 && *part > 0 && *part <= *parts)
+      return true;
+  }
+  return false;
+}
+
+size_t tpdu_address_to_string(const struct tpdu_address *address, char *out,
+                              size_t out_size) {
+  static const char bcd_digits[] = "0123456789*#abc";
+  size_t n = 0, i, count;
+  uint8_t digit;
+
+  if (out_size == 0)
+    return 0;
+  if ((address->type & TPDU_TON_MASK) == TPDU_TON_ALPHANUMERIC) {
+    count = address->digits * 4 / 7;
+    if (count > out_size - 1)
+      count = out_size - 1;
+    count = gsm7_decode(address->value, address->size, 0, out, count);
+    out[count] = 0;
+    return strlen(out);
+  }
+
+  if ((address->type & TPDU_TON_MASK) == TPDU_TON_INTERNATIONAL &&
+      out_size > 1)
+    out[n++] = '+';
+  for (i = 0; i < address->digits && n + 1 < out_size; i++) {
+    digit = address->value[i / 2];
+    digit = i % 2 ? digit >> 4 : digit & 0x0f;
+    if (digit == 0x0f) // Filler
+      break;
+    out[n++] = bcd_digits[digit];
+  }
+  out[n] = 0;
+  return n;
+}
+
+/* The text of the message, without the UDH, as a string */
+size_t tpdu_text(const struct tpdu *tpdu, char *out, size_t out_size) {
+  size_t count;
+
+  if (out_size == 0)
+    return 0;
+  if (tpdu->alphabet != SMS_ALPHABET_GSM7)
+    return decode_user_data(tpdu->dcs, tpdu->ud + tpdu->text_start,
+                            tpdu->text_len, tpdu->text_len, out, out_size);
+
+  count = tpdu->text_len < out_size - 1 ? tpdu->text_len : out_size - 1;
+  count = gsm7_decode(tpdu->ud, tpdu->ud_size, tpdu->text_start, out, count);
+  out[count] = 0;
+  return strlen(out);
+}
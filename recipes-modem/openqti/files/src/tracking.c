@@ -35,6 +35,16 @@ void reset_client_handler() {
 void reset_dirty_reconnects() { client_tracking.dirty_reconnects = 0; }
 
 uint8_t get_dirty_reconnects() { return client_tracking.dirty_reconnects; }
+
+int get_num_tracked_clients() {
+  int i, num = 0;
+  for (i = 0; i < 32; i++) {
+    if (client_tracking.services[i].service != 0 ||
+        client_tracking.services[i].instance != 0)
+      num++;
+  }
+  return num;
+}
 int get_num_instances_for_service(int service) {
   int i;
   int svcs = 0;
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: MIT
+
+#include "../inc/wake.h"
+#include "../inc/atfwd.h"
+#include "../inc/helpers.h"
+#include "../inc/logger.h"
+#include "../inc/proxy.h"
+#include "../inc/stats.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Host wake up
+ *  When something the host needs to see arrives while the USB port is
+ *  suspended, the proxy thread parks it here and asks for a wake up.
+ *  This worker sends the RING_IN pulse and waits for the host to come
+ *  back, pulsing again a couple of times if it doesn't, while the proxy
+ *  keeps forwarding everything else. Once the suspend monitor reports
+ *  the port is back, rmnet_proxy() sends the parked indications before
+ *  anything else it reads.
+ *  Only the rmnet proxy thread parks and delivers, the worker only
+ *  looks at the count to know if it should keep trying.
+ */
+struct parked_indication {
+  uint64_t parked_ns;
+  size_t len;
+  uint8_t pkt[WAKE_MAX_PARKED_SIZE];
+};
+
+struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool requested;
+  struct parked_indication parked[WAKE_MAX_PARKED];
+  uint8_t head;
+  _Atomic uint32_t count;
+  _Atomic uint64_t requests;
+  _Atomic uint64_t pulses;
+  _Atomic uint64_t delivered;
+  _Atomic uint64_t dropped;
+  _Atomic uint64_t max_wait_ms;
+} wake_rt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .requested = false,
+    .head = 0,
+    .count = 0,
+};
+
+/* Never blocks, the pulse is sent from host_wake_thread() */
+void request_host_wakeup() {
+  pthread_mutex_lock(&wake_rt.mutex);
+  wake_rt.requested = true;
+  pthread_cond_signal(&wake_rt.cond);
+  pthread_mutex_unlock(&wake_rt.mutex);
+  atomic_fetch_add_explicit(&wake_rt.requests, 1, memory_order_relaxed);
+}
+
+/* Keeps a copy of the packet until the host is back, or -ENOSPC */
+int park_host_indication(const uint8_t *pkt, size_t len) {
+  struct parked_indication *slot;
+  uint32_t count;
+
+  count = atomic_load_explicit(&wake_rt.count, memory_order_relaxed);
+  if (len > WAKE_MAX_PARKED_SIZE || count >= WAKE_MAX_PARKED) {
+    atomic_fetch_add_explicit(&wake_rt.dropped, 1, memory_order_relaxed);
+    logger(MSG_WARN, "%s: Can't hold a %zu byte indication (%u parked)\n",
+           __func__, len, count);
+    return -ENOSPC;
+  }
+  slot = &wake_rt.parked[(wake_rt.head + count) % WAKE_MAX_PARKED];
+  memcpy(slot->pkt, pkt, len);
+  slot->len = len;
+  slot->parked_ns = stats_now_ns();
+  atomic_store_explicit(&wake_rt.count, count + 1, memory_order_release);
+  logger(MSG_INFO, "%s: Holding indication until the host wakes up (%u)\n",
+         __func__, count + 1);
+  return 0;
+}
+
+bool host_indications_parked() {
+  return atomic_load_explicit(&wake_rt.count, memory_order_acquire) > 0;
+}
+
+/* Sends everything parked, in order. Returns how many were sent */
+int deliver_parked_indications(int usbfd) {
+  struct parked_indication *slot;
+  uint64_t wait_ms, max_wait_ms;
+  int sent = 0;
+
+  while (host_indications_parked()) {
+    slot = &wake_rt.parked[wake_rt.head];
+    if (write(usbfd, slot->pkt, slot->len) < 1) {
+      logger(MSG_ERROR, "%s: Error writing a parked indication\n", __func__);
+      atomic_fetch_add_explicit(&wake_rt.dropped, 1, memory_order_relaxed);
+    } else {
+      atomic_fetch_add_explicit(&wake_rt.delivered, 1, memory_order_relaxed);
+      sent++;
+    }
+    wait_ms = (stats_now_ns() - slot->parked_ns) / 1000000ULL;
+    max_wait_ms =
+        atomic_load_explicit(&wake_rt.max_wait_ms, memory_order_relaxed);
+    if (wait_ms > max_wait_ms)
+      atomic_store_explicit(&wake_rt.max_wait_ms, wait_ms,
+                            memory_order_relaxed);
+    wake_rt.head = (wake_rt.head + 1) % WAKE_MAX_PARKED;
+    atomic_fetch_sub_explicit(&wake_rt.count, 1, memory_order_release);
+  }
+
+  if (sent > 0) {
+    logger(MSG_INFO, "%s: Host is back, sent %i parked indications\n",
+           __func__, sent);
+    /* And let ATFWD send the +CMTI too */
+    set_sms_notification_pending_state(true);
+  }
+  return sent;
+}
+
+struct host_wake_stats get_host_wake_stats() {
+  struct host_wake_stats stats;
+  stats.parked = atomic_load_explicit(&wake_rt.count, memory_order_relaxed);
+  stats.requests =
+      atomic_load_explicit(&wake_rt.requests, memory_order_relaxed);
+  stats.pulses = atomic_load_explicit(&wake_rt.pulses, memory_order_relaxed);
+  stats.delivered =
+      atomic_load_explicit(&wake_rt.delivered, memory_order_relaxed);
+  stats.dropped = atomic_load_explicit(&wake_rt.dropped, memory_order_relaxed);
+  stats.max_wait_ms =
+      atomic_load_explicit(&wake_rt.max_wait_ms, memory_order_relaxed);
+  return stats;
+}
+
+/* Returns once the host is awake, or after timeout_ms */
+static void wait_for_resume(int evfd, int timeout_ms) {
+  struct pollfd pfd;
+  uint64_t start = stats_now_ns(), elapsed_ms;
+  uint64_t val;
+
+  while (get_transceiver_suspend_state()) {
+    elapsed_ms = (stats_now_ns() - start) / 1000000ULL;
+    if (elapsed_ms >= timeout_ms)
+      return;
+    if (evfd < 0) {
+      usleep(SUSPEND_POLL_FALLBACK_MS * 1000);
+      continue;
+    }
+    pfd.fd = evfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout_ms - elapsed_ms) > 0 &&
+        read(evfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+      logger(MSG_WARN, "%s: Error reading the resume event\n", __func__);
+  }
+}
+
+void *host_wake_thread() {
+  int evfd, pulses;
+
+  logger(MSG_INFO, "%s: Host wake up worker started\n", __func__);
+  evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (evfd < 0 || add_suspend_state_listener(evfd) < 0) {
+    logger(MSG_ERROR, "%s: Cannot listen to USB suspend events, polling\n",
+           __func__);
+    if (evfd >= 0)
+      close(evfd);
+    evfd = -1;
+  }
+
+  pthread_mutex_lock(&wake_rt.mutex);
+  while (1) {
+    while (!wake_rt.requested)
+      pthread_cond_wait(&wake_rt.cond, &wake_rt.mutex);
+    wake_rt.requested = false;
+    pthread_mutex_unlock(&wake_rt.mutex);
+
+    for (pulses = 0; pulses < WAKE_MAX_PULSES &&
+                     get_transceiver_suspend_state() &&
+                     host_indications_parked();
+         pulses++) {
+      logger(MSG_INFO, "%s: Attempting to wake up the host\n", __func__);
+      pulse_ring_in();
+      atomic_fetch_add_explicit(&wake_rt.pulses, 1, memory_order_relaxed);
+      wait_for_resume(evfd, WAKE_RESUME_TIMEOUT_MS);
+    }
+    if (get_transceiver_suspend_state() && host_indications_parked())
+      logger(MSG_WARN, "%s: Host is still asleep, holding %u indications\n",
+             __func__, get_host_wake_stats().parked);
+
+    pthread_mutex_lock(&wake_rt.mutex);
+  }
+  pthread_mutex_unlock(&wake_rt.mutex);
+  return NULL;
+}
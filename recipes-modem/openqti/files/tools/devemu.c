@@ -0,0 +1,568 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * devemu
+ *  Host side emulator for the devices openqti talks to, so the whole
+ *  daemon can run, be profiled and load tested on a workstation. It
+ *  builds a fake root filesystem under the given directory and serves
+ *  it until interrupted:
+ *   - SMD_CNTL:   ADSP QMI responder. Allocates client IDs, answers
+ *                 every request with a generic success and sends a NAS
+ *                 signal indication every -i milliseconds
+ *   - RMNET_CTL:  Host side. Optionally sends -r requests per second
+ *                 to the ADSP through openqti and measures the replies
+ *   - SMD_SEC_AT: AT responder with canned answers for what openqti
+ *                 asks for, OK for everything else
+ *   - SMD_GPS:    NMEA generator, one fix per second
+ *   - USB_GPS:    NMEA sink, just counts what openqti forwards
+ *   - sysfs:      Plain files with sane defaults (USB, thermal zones..)
+ *   - Audio:      Symlinks to /dev/null, openqti uses them as null sinks
+ *  Ports are SOCK_SEQPACKET UNIX sockets, one client each.
+ *
+ *  Build: make devemu
+ *  Usage: devemu [-r rate] [-i interval_ms] [-q] root_dir
+ *  Then:  OPENQTI_DEVROOT=root_dir openqti -d
+ *
+ *  openqti doesn't need root to run like this, and shouldn't have it:
+ *  some chat commands reboot the machine it runs on.
+ */
+
+#include "../inc/devices.h"
+#include "../inc/ipc.h"
+#include "../inc/openqti.h"
+#include "../inc/qmi.h"
+#include "../inc/thermal.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMU_TICK_MS 10
+#define EMU_AT_BUF_SIZE 1024
+#define EMU_TXN_SLOTS 65536
+
+enum {
+  EMU_HOST_QMI = 0,
+  EMU_ADSP_QMI,
+  EMU_AT,
+  EMU_ADSP_GPS,
+  EMU_USB_GPS,
+  EMU_NODES,
+};
+
+static const char *emu_node_paths[EMU_NODES] = {
+    RMNET_CTL, SMD_CNTL, SMD_SEC_AT, SMD_GPS, USB_GPS,
+};
+
+static const struct {
+  const char *path;
+  const char *value;
+} emu_files[] = {
+    {USB_SUSPEND_STATE_PATH, "0\n"},
+    {SUSPEND_INHIBIT_PATH, "0\n"},
+    {USB_EN_PATH, "1\n"},
+    {USB_FUNC_PATH, "diag,serial,rmnet\n"},
+    {USB_SERIAL_TRANSPORTS_PATH, "smd,tty\n"},
+    {CPUFREQ_PATH, "powersave\n"},
+    {GPIO_EXPORT_PATH, ""},
+    {GPIO_UNEXPORT_PATH, ""},
+    {DPM_CTL, ""},
+};
+
+/* Audio nodes, pcm_open() adds the direction suffix */
+static const char *emu_null_nodes[] = {
+    SND_CTL,
+    PCM_DEV_HIFI "p",
+    PCM_DEV_VOCS "p",
+    PCM_DEV_VOCS "c",
+    PCM_DEV_VOLTE "p",
+    PCM_DEV_VOLTE "c",
+};
+
+static const struct {
+  const char *cmd;
+  const char *response;
+} emu_at_responses[] = {
+    {"AT+CIND?", "\r\n+CIND: 0,4,1,0,0,0,0,0\r\n\r\nOK\r\n"},
+    {"AT+CIMI", "\r\n001010123456789\r\n\r\nOK\r\n"},
+    {"AT+QENG=\"servingcell\"",
+     "\r\n+QENG: \"servingcell\",\"NOCONN\",\"LTE\",\"FDD\",001,01,1A2D001,"
+     "123,1850,3,5,5,1F4,-95,-10,-65,15,40\r\n\r\nOK\r\n"},
+    {"AT+QENG=\"neighbourcell\"",
+     "\r\n+QENG: \"neighbourcell intra\",\"LTE\",1850,123,-10,-95,-65,0,40,"
+     "2,10,6,2\r\n\r\nOK\r\n"},
+};
+
+struct {
+  char root[DEVICE_PATH_MAX];
+  int listen_fd[EMU_NODES];
+  int fd[EMU_NODES];
+  unsigned int rate;        // Host requests per second
+  unsigned int ind_interval; // ms between NAS indications
+  bool quiet;
+  uint8_t next_client_id;
+  uint16_t host_txn;
+  char at_buf[EMU_AT_BUF_SIZE];
+  size_t at_len;
+  uint64_t *txn_sent_ns;
+  /* Counters, reset every report */
+  uint64_t host_tx, host_rx, host_lat_ns, host_lat_max_ns;
+  uint64_t adsp_rx, adsp_tx, at_cmds, gps_tx_bytes, gps_rx_bytes;
+} emu;
+
+static volatile sig_atomic_t emu_stop;
+
+static void emu_signal(int sig) { emu_stop = 1; }
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void emu_path(char *buf, size_t len, const char *path) {
+  snprintf(buf, len, "%s%s", emu.root, path);
+}
+
+static int mkdir_parents(const char *path) {
+  char tmp[DEVICE_PATH_MAX];
+  char *p;
+  strncpy(tmp, path, sizeof(tmp) - 1);
+  tmp[sizeof(tmp) - 1] = 0;
+  for (p = tmp + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = 0;
+    if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
+      fprintf(stderr, "Cannot create %s: %s\n", tmp, strerror(errno));
+      return -1;
+    }
+    *p = '/';
+  }
+  return 0;
+}
+
+static int create_file(const char *path, const void *data, size_t len,
+                       bool overwrite) {
+  char full[DEVICE_PATH_MAX];
+  int fd;
+  emu_path(full, sizeof(full), path);
+  if (mkdir_parents(full) < 0)
+    return -1;
+  if (!overwrite && access(full, F_OK) == 0)
+    return 0;
+  fd = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create %s: %s\n", full, strerror(errno));
+    return -1;
+  }
+  if (len > 0 && write(fd, data, len) < 0)
+    fprintf(stderr, "Cannot write %s\n", full);
+  close(fd);
+  return 0;
+}
+
+static int create_listener(const char *path) {
+  char full[DEVICE_PATH_MAX];
+  struct sockaddr_un addr;
+  int fd;
+
+  emu_path(full, sizeof(full), path);
+  if (mkdir_parents(full) < 0)
+    return -1;
+  if (strlen(full) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s is too long for a socket path\n", full);
+    return -1;
+  }
+  unlink(full);
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, full, strlen(full) + 1);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    fprintf(stderr, "Cannot listen on %s: %s\n", full, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int build_tree() {
+  char path[DEVICE_PATH_MAX], full[DEVICE_PATH_MAX];
+  uint8_t misc[128] = {0};
+  size_t i;
+
+  for (i = 0; i < sizeof(emu_files) / sizeof(emu_files[0]); i++) {
+    if (create_file(emu_files[i].path, emu_files[i].value,
+                    strlen(emu_files[i].value), true) < 0)
+      return -1;
+  }
+  for (i = 0; i < NO_OF_SENSORS; i++) {
+    snprintf(path, sizeof(path), "%s%zu%s", THRM_ZONE_PATH, i,
+             THRM_ZONE_TRAIL);
+    if (create_file(path, "38\n", 3, true) < 0)
+      return -1;
+  }
+  /* Keep the misc partition between runs, it holds settings */
+  if (create_file("/dev/mtdblock12", misc, sizeof(misc), false) < 0)
+    return -1;
+
+  for (i = 0; i < sizeof(emu_null_nodes) / sizeof(emu_null_nodes[0]); i++) {
+    emu_path(full, sizeof(full), emu_null_nodes[i]);
+    if (mkdir_parents(full) < 0)
+      return -1;
+    unlink(full);
+    if (symlink("/dev/null", full) < 0) {
+      fprintf(stderr, "Cannot link %s: %s\n", full, strerror(errno));
+      return -1;
+    }
+  }
+
+  for (i = 0; i < EMU_NODES; i++) {
+    emu.fd[i] = -1;
+    emu.listen_fd[i] = create_listener(emu_node_paths[i]);
+    if (emu.listen_fd[i] < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static void emu_send(int node, const void *buf, size_t len) {
+  if (emu.fd[node] < 0)
+    return;
+  if (write(emu.fd[node], buf, len) < 0 && errno != EAGAIN) {
+    close(emu.fd[node]);
+    emu.fd[node] = -1;
+  }
+}
+
+/* Builds a QMUX+QMI frame, returns its size */
+static size_t build_qmi(uint8_t *buf, uint8_t service, uint8_t instance,
+                        uint8_t ctlid, uint16_t txn, uint16_t msgid,
+                        const uint8_t *tlvs, size_t tlv_len) {
+  struct encapsulated_qmi_packet *pkt = (struct encapsulated_qmi_packet *)buf;
+  pkt->qmux.version = 0x01;
+  pkt->qmux.packet_length = htole16(sizeof(*pkt) - 1 + tlv_len);
+  pkt->qmux.control = 0x80;
+  pkt->qmux.service = service;
+  pkt->qmux.instance_id = instance;
+  pkt->qmi.ctlid = ctlid;
+  pkt->qmi.transaction_id = htole16(txn);
+  pkt->qmi.msgid = htole16(msgid);
+  pkt->qmi.length = htole16(tlv_len);
+  memcpy(buf + sizeof(*pkt), tlvs, tlv_len);
+  return sizeof(*pkt) + tlv_len;
+}
+
+/* ADSP side: answer everything openqti forwards */
+static void handle_adsp_qmi(uint8_t *buf, size_t len) {
+  struct encapsulated_control_packet *ctl;
+  struct encapsulated_qmi_packet *req;
+  uint8_t resp[MAX_PACKET_SIZE];
+  uint8_t tlvs[16] = {0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00};
+  size_t tlv_len = 7, resp_len;
+
+  emu.adsp_rx++;
+  if (len < sizeof(struct encapsulated_control_packet))
+    return;
+
+  ctl = (struct encapsulated_control_packet *)buf;
+  if (ctl->qmux.service == 0) {
+    /* Allocate client ID: echo the service, hand out a new client */
+    if (le16toh(ctl->qmi.msgid) == 0x0022 &&
+        len >= sizeof(*ctl) + sizeof(struct tlv_header) + 1) {
+      tlvs[7] = 0x01;
+      tlvs[8] = 0x02;
+      tlvs[9] = 0x00;
+      tlvs[10] = buf[sizeof(*ctl) + sizeof(struct tlv_header)];
+      tlvs[11] = ++emu.next_client_id;
+      tlv_len += 5;
+    }
+    memcpy(resp, buf, sizeof(*ctl));
+    ctl = (struct encapsulated_control_packet *)resp;
+    ctl->qmux.control = 0x80;
+    ctl->qmux.packet_length = htole16(sizeof(*ctl) - 1 + tlv_len);
+    ctl->qmi.ctlid = 0x01;
+    ctl->qmi.length = htole16(tlv_len);
+    memcpy(resp + sizeof(*ctl), tlvs, tlv_len);
+    emu_send(EMU_ADSP_QMI, resp, sizeof(*ctl) + tlv_len);
+    emu.adsp_tx++;
+    return;
+  }
+
+  if (len < sizeof(struct encapsulated_qmi_packet))
+    return;
+  req = (struct encapsulated_qmi_packet *)buf;
+  if (req->qmi.ctlid != 0x00) // Only requests get a response
+    return;
+  resp_len = build_qmi(resp, req->qmux.service, req->qmux.instance_id, 0x02,
+                       le16toh(req->qmi.transaction_id),
+                       le16toh(req->qmi.msgid), tlvs, tlv_len);
+  emu_send(EMU_ADSP_QMI, resp, resp_len);
+  emu.adsp_tx++;
+}
+
+static void send_nas_indication() {
+  uint8_t frame[64];
+  /* Signal strength TLV: level (dBm), radio interface (LTE) */
+  uint8_t tlvs[] = {0x10, 0x02, 0x00, 0xb5, 0x08};
+  tlvs[3] = 0xb0 + (rand() % 16);
+  emu_send(EMU_ADSP_QMI, frame,
+           build_qmi(frame, 3, 1, 0x04, 0, 0x0002, tlvs, sizeof(tlvs)));
+  emu.adsp_tx++;
+}
+
+/* Host side: WDS Get packet statistics, answered by the ADSP responder */
+static void send_host_request() {
+  uint8_t frame[64];
+  uint8_t tlvs[] = {0x01, 0x04, 0x00, 0xff, 0x00, 0x00, 0x00};
+  uint16_t txn = ++emu.host_txn;
+  if (emu.fd[EMU_HOST_QMI] < 0)
+    return;
+  emu.txn_sent_ns[txn] = now_ns();
+  emu_send(EMU_HOST_QMI, frame,
+           build_qmi(frame, 1, 1, 0x00, txn, 0x0024, tlvs, sizeof(tlvs)));
+  emu.host_tx++;
+}
+
+static void handle_host_qmi(uint8_t *buf, size_t len) {
+  struct encapsulated_qmi_packet *pkt = (struct encapsulated_qmi_packet *)buf;
+  uint64_t lat;
+  uint16_t txn;
+
+  if (len < sizeof(*pkt) || pkt->qmux.service != 1 || pkt->qmi.ctlid != 0x02)
+    return;
+  txn = le16toh(pkt->qmi.transaction_id);
+  if (emu.txn_sent_ns[txn] == 0)
+    return;
+  lat = now_ns() - emu.txn_sent_ns[txn];
+  emu.txn_sent_ns[txn] = 0;
+  emu.host_rx++;
+  emu.host_lat_ns += lat;
+  if (lat > emu.host_lat_max_ns)
+    emu.host_lat_max_ns = lat;
+}
+
+static void handle_at(uint8_t *buf, size_t len) {
+  const char *response;
+  char *line, *end;
+  size_t i;
+
+  if (emu.at_len + len >= sizeof(emu.at_buf))
+    emu.at_len = 0; // Garbage, start over
+  memcpy(emu.at_buf + emu.at_len, buf, len);
+  emu.at_len += len;
+  emu.at_buf[emu.at_len] = 0;
+
+  line = emu.at_buf;
+  while ((end = strpbrk(line, "\r\n")) != NULL) {
+    *end = 0;
+    if (strlen(line) > 0) {
+      response = "\r\nOK\r\n";
+      for (i = 0; i < sizeof(emu_at_responses) / sizeof(emu_at_responses[0]);
+           i++) {
+        if (strcasecmp(line, emu_at_responses[i].cmd) == 0) {
+          response = emu_at_responses[i].response;
+          break;
+        }
+      }
+      emu_send(EMU_AT, response, strlen(response));
+      emu.at_cmds++;
+    }
+    line = end + 1;
+  }
+  emu.at_len = strlen(line);
+  memmove(emu.at_buf, line, emu.at_len);
+}
+
+static void send_nmea_sentence(const char *body) {
+  char sentence[128];
+  uint8_t sum = 0;
+  size_t i;
+  for (i = 0; body[i]; i++)
+    sum ^= body[i];
+  snprintf(sentence, sizeof(sentence), "$%s*%02X\r\n", body, sum);
+  emu_send(EMU_ADSP_GPS, sentence, strlen(sentence));
+  emu.gps_tx_bytes += strlen(sentence);
+}
+
+static void send_nmea_fix() {
+  char body[96], hms[8];
+  time_t now = time(NULL);
+  strftime(hms, sizeof(hms), "%H%M%S", gmtime(&now));
+  snprintf(body, sizeof(body),
+           "GPGGA,%s.00,4025.0000,N,00342.0000,W,1,08,0.9,650.0,M,51.0,M,,",
+           hms);
+  send_nmea_sentence(body);
+  snprintf(body, sizeof(body),
+           "GPRMC,%s.00,A,4025.0000,N,00342.0000,W,0.0,0.0,,,,A", hms);
+  send_nmea_sentence(body);
+}
+
+static void report() {
+  printf("host tx %llu rx %llu", (unsigned long long)emu.host_tx,
+         (unsigned long long)emu.host_rx);
+  if (emu.host_rx > 0)
+    printf(" (avg %llu us, max %llu us)",
+           (unsigned long long)(emu.host_lat_ns / emu.host_rx / 1000),
+           (unsigned long long)(emu.host_lat_max_ns / 1000));
+  printf(" | adsp rx %llu tx %llu | at %llu | gps tx %llu rx %llu bytes\n",
+         (unsigned long long)emu.adsp_rx, (unsigned long long)emu.adsp_tx,
+         (unsigned long long)emu.at_cmds, (unsigned long long)emu.gps_tx_bytes,
+         (unsigned long long)emu.gps_rx_bytes);
+  fflush(stdout);
+  emu.host_tx = emu.host_rx = emu.host_lat_ns = emu.host_lat_max_ns = 0;
+  emu.adsp_rx = emu.adsp_tx = emu.at_cmds = 0;
+  emu.gps_tx_bytes = emu.gps_rx_bytes = 0;
+}
+
+static void handle_input(int node) {
+  uint8_t buf[MAX_PACKET_SIZE];
+  ssize_t ret = read(emu.fd[node], buf, sizeof(buf));
+  if (ret <= 0) {
+    fprintf(stderr, "%s disconnected\n", emu_node_paths[node]);
+    close(emu.fd[node]);
+    emu.fd[node] = -1;
+    if (node == EMU_AT)
+      emu.at_len = 0;
+    return;
+  }
+  switch (node) {
+  case EMU_HOST_QMI:
+    handle_host_qmi(buf, ret);
+    break;
+  case EMU_ADSP_QMI:
+    handle_adsp_qmi(buf, ret);
+    break;
+  case EMU_AT:
+    handle_at(buf, ret);
+    break;
+  case EMU_USB_GPS:
+    emu.gps_rx_bytes += ret;
+    break;
+  default: // Whatever the host sends to the GPS, drop it
+    break;
+  }
+}
+
+int main(int argc, char **argv) {
+  struct pollfd pfd[2 * EMU_NODES + 1];
+  struct itimerspec tick = {0};
+  uint64_t expirations, ticks = 0, host_credit = 0;
+  int timer_fd, opt, i, n;
+
+  emu.ind_interval = 5000;
+  while ((opt = getopt(argc, argv, "r:i:q?")) != -1) {
+    switch (opt) {
+    case 'r':
+      emu.rate = strtoul(optarg, NULL, 0);
+      break;
+    case 'i':
+      emu.ind_interval = strtoul(optarg, NULL, 0);
+      break;
+    case 'q':
+      emu.quiet = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-r rate] [-i interval_ms] [-q] root_dir\n",
+              argv[0]);
+      fprintf(stderr, " -r: Host QMI requests per second (0)\n");
+      fprintf(stderr, " -i: ms between NAS signal indications, 0 is off "
+                      "(5000)\n");
+      fprintf(stderr, " -q: Don't print stats every second\n");
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-r rate] [-i interval_ms] [-q] root_dir\n",
+            argv[0]);
+    return 1;
+  }
+  if (realpath(argv[optind], emu.root) == NULL) {
+    fprintf(stderr, "Cannot use %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  emu.txn_sent_ns = calloc(EMU_TXN_SLOTS, sizeof(uint64_t));
+  if (emu.txn_sent_ns == NULL || build_tree() < 0)
+    return 1;
+
+  signal(SIGINT, emu_signal);
+  signal(SIGTERM, emu_signal);
+  signal(SIGPIPE, SIG_IGN);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  tick.it_value.tv_nsec = EMU_TICK_MS * 1000000;
+  tick.it_interval.tv_nsec = EMU_TICK_MS * 1000000;
+  timerfd_settime(timer_fd, 0, &tick, NULL);
+  fprintf(stderr, "Emulating devices in %s, run openqti with %s=%s\n",
+          emu.root, DEVICE_ROOT_ENV, emu.root);
+
+  while (!emu_stop) {
+    n = 0;
+    pfd[n].fd = timer_fd;
+    pfd[n++].events = POLLIN;
+    for (i = 0; i < EMU_NODES; i++) {
+      pfd[n].fd = emu.listen_fd[i];
+      pfd[n++].events = POLLIN;
+      pfd[n].fd = emu.fd[i];
+      pfd[n++].events = POLLIN;
+    }
+    if (poll(pfd, n, -1) < 0)
+      continue;
+
+    for (i = 0; i < EMU_NODES; i++) {
+      if (pfd[1 + 2 * i].revents & POLLIN) {
+        /* One client per port, the newest one wins */
+        if (emu.fd[i] >= 0)
+          close(emu.fd[i]);
+        emu.fd[i] = accept(emu.listen_fd[i], NULL, NULL);
+        fprintf(stderr, "%s connected\n", emu_node_paths[i]);
+      } else if (pfd[2 + 2 * i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        handle_input(i);
+      }
+    }
+
+    if (!(pfd[0].revents & POLLIN) ||
+        read(timer_fd, &expirations, sizeof(expirations)) <= 0)
+      continue;
+    while (expirations-- > 0) {
+      ticks++;
+      /* Spread the host requests over the ticks */
+      host_credit += emu.rate;
+      while (host_credit >= 1000 / EMU_TICK_MS) {
+        send_host_request();
+        host_credit -= 1000 / EMU_TICK_MS;
+      }
+      if (emu.ind_interval > 0 &&
+          ticks % (emu.ind_interval < EMU_TICK_MS
+                       ? 1
+                       : emu.ind_interval / EMU_TICK_MS) ==
+              0)
+        send_nas_indication();
+      if (ticks % (1000 / EMU_TICK_MS) == 0) {
+        send_nmea_fix();
+        if (!emu.quiet)
+          report();
+      }
+    }
+  }
+
+  for (i = 0; i < EMU_NODES; i++) {
+    if (emu.fd[i] >= 0)
+      close(emu.fd[i]);
+    close(emu.listen_fd[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * gsm7bench
+ *  Host side check and benchmark for the SMS text codec in src/gsm7.c.
+ *  It first round trips a small corpus through every path (GSM-7 with
+ *  and without a UDH in front, escaped characters, UCS-2 with BMP and
+ *  astral characters) and compares the packing with the bit at a time
+ *  codec openqti used before, then times both of them.
+ *  Exits with an error if anything doesn't match.
+ *
+ *  Build: make gsm7bench
+ *  Usage: gsm7bench [-n iterations]
+ */
+
+#include "../inc/gsm7.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_TEXT_SIZE 160
+#define BENCH_BUF_SIZE 512
+
+static const char *gsm7_corpus[] = {
+    "",
+    "A",
+    "Hello world!",
+    "1234567",
+    "12345678",
+    "@ $ _ : ; < = > ? ! \" # % & ' ( ) * + , - . /",
+    "Braces {like} [these] and ~tilde~ |pipes| ^caret^ \\backslash\\",
+    "The quick brown fox jumps over the lazy dog 0123456789 times, "
+    "and then it does it again until the message is exactly one hundred "
+    "and sixty characters lon",
+};
+
+static const char *ucs2_corpus[] = {
+    "",
+    "plain ascii",
+    "caf\xc3\xa9 cr\xc3\xa8me br\xc3\xbbl\xc3\xa9\x65",
+    "\xe2\x82\xac 10, \xe4\xbd\xa0\xe5\xa5\xbd",
+    "emoji \xf0\x9f\x98\x80 and \xf0\x9f\x93\xb1 surrogates",
+};
+
+/* The codec as it was, one septet at a time */
+static inline void legacy_write7bits(uint8_t *buf, uint8_t val, uint32_t pos) {
+  uint8_t idx = pos / 8;
+
+  val &= 0x7f;
+  if (!(pos & 7)) {
+    buf[idx] = val;
+  } else if ((pos & 7) == 1) {
+    buf[idx] = buf[idx] | (val << 1);
+  } else {
+    buf[idx] = buf[idx] | (val << (pos & 7));
+    buf[idx + 1] = (val >> (8 - (pos & 7)));
+  }
+}
+
+static int legacy_pack(const uint8_t *septets, int count, uint8_t *out) {
+  int i;
+  for (i = 0; i < count; i++)
+    legacy_write7bits(out, septets[i], i * 7);
+  return count;
+}
+
+static int legacy_unpack(const uint8_t *buffer, int buffer_length,
+                         uint8_t *output, int septets) {
+  int n = 0, carry = 1, i = 1;
+
+  if (buffer_length > 0)
+    output[n++] = buffer[0] & 0x7f;
+  for (; i < buffer_length; ++i) {
+    output[n++] = 0x7f & ((buffer[i] << carry) | (buffer[i - 1] >> (8 - carry)));
+    if (n == septets)
+      break;
+    carry++;
+    if (carry == 8) {
+      carry = 1;
+      output[n++] = buffer[i] & 0x7f;
+      if (n == septets)
+        break;
+    }
+  }
+  if (n < septets)
+    output[n++] = buffer[i - 1] >> (8 - carry);
+  return n;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int check_gsm7(const char *text) {
+  uint8_t packed[BENCH_BUF_SIZE], legacy[BENCH_BUF_SIZE];
+  uint8_t septets[BENCH_BUF_SIZE];
+  char decoded[BENCH_BUF_SIZE];
+  int count, size, errors = 0;
+
+  /* Plain */
+  memset(packed, 0xaa, sizeof(packed));
+  count = ascii_to_gsm7((const uint8_t *)text, packed, 0);
+  size = GSM7_PACKED_SIZE(count);
+  gsm7_to_ascii(packed, size, decoded, count);
+  decoded[count] = 0;
+  if (strcmp(decoded, text) != 0) {
+    printf("FAIL gsm7 round trip: \"%s\" -> \"%s\"\n", text, decoded);
+    errors++;
+  }
+
+  /* Same bits as the old encoder */
+  if (gsm7_unpack(packed, size, 0, septets, count) != count) {
+    printf("FAIL gsm7 unpack count: \"%s\"\n", text);
+    errors++;
+  }
+  memset(legacy, 0, sizeof(legacy));
+  legacy_pack(septets, count, legacy);
+  if (memcmp(legacy, packed, size) != 0) {
+    printf("FAIL gsm7 packing differs from the legacy one: \"%s\"\n", text);
+    errors++;
+  }
+  if (count > 0 && legacy_unpack(packed, size, (uint8_t *)decoded, count) !=
+                       count) {
+    printf("FAIL legacy unpack count: \"%s\"\n", text);
+    errors++;
+  } else if (count > 0 && memcmp(decoded, septets, count) != 0) {
+    printf("FAIL gsm7 unpack differs from the legacy one: \"%s\"\n", text);
+    errors++;
+  }
+
+  /* Behind a concatenation UDH, which must be left alone */
+  memset(packed, 0xaa, sizeof(packed));
+  memcpy(packed, "\x05\x00\x03\x42\x02\x01", 6);
+  packed[6] = 0;
+  if (ascii_to_gsm7((const uint8_t *)text, packed, 7) != count + 7) {
+    printf("FAIL gsm7 with UDH septet count: \"%s\"\n", text);
+    errors++;
+  }
+  if (memcmp(packed, "\x05\x00\x03\x42\x02\x01", 6) != 0 ||
+      (packed[6] & 0x01) != 0) {
+    printf("FAIL gsm7 overwrote the UDH: \"%s\"\n", text);
+    errors++;
+  }
+  if (gsm7_unpack(packed, GSM7_PACKED_SIZE(count + 7), 7, (uint8_t *)decoded,
+                  count) != count ||
+      memcmp(decoded, septets, count) != 0) {
+    printf("FAIL gsm7 with UDH unpacks differently: \"%s\"\n", text);
+    errors++;
+  }
+  return errors;
+}
+
+/* Any bit pattern and length unpacks the same as it used to */
+static int check_unpack() {
+  uint8_t packed[BENCH_BUF_SIZE], legacy[BENCH_BUF_SIZE];
+  uint8_t septets[BENCH_BUF_SIZE];
+  int i, count;
+
+  srand(7);
+  for (i = 0; i < BENCH_BUF_SIZE; i++)
+    packed[i] = rand();
+  for (count = 1; count <= BENCH_TEXT_SIZE; count++) {
+    if (gsm7_unpack(packed, GSM7_PACKED_SIZE(count), 0, septets, count) !=
+            count ||
+        legacy_unpack(packed, GSM7_PACKED_SIZE(count), legacy, count) !=
+            count ||
+        memcmp(septets, legacy, count) != 0) {
+      printf("FAIL gsm7 unpack of %i random septets\n", count);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int check_ucs2(const char *text) {
+  uint8_t ucs2[BENCH_BUF_SIZE];
+  char decoded[BENCH_BUF_SIZE];
+  size_t size;
+
+  size = utf8_to_ucs2((const uint8_t *)text, strlen(text), ucs2);
+  decode_user_data(0x08, ucs2, size, size, decoded, sizeof(decoded));
+  if (strcmp(decoded, text) != 0) {
+    printf("FAIL ucs2 round trip: \"%s\" -> \"%s\"\n", text, decoded);
+    return 1;
+  }
+  /* Truncating never leaves half a character */
+  ucs2_to_utf8(ucs2, size, decoded, 8);
+  if (strlen(decoded) > 7 || strncmp(decoded, text, strlen(decoded)) != 0) {
+    printf("FAIL ucs2 truncation: \"%s\" -> \"%s\"\n", text, decoded);
+    return 1;
+  }
+  return 0;
+}
+
+static void bench(int iterations) {
+  uint8_t packed[BENCH_BUF_SIZE], septets[BENCH_BUF_SIZE];
+  uint8_t text[BENCH_TEXT_SIZE + 1];
+  char decoded[BENCH_BUF_SIZE];
+  uint64_t start, legacy_enc, new_enc, legacy_dec, new_dec;
+  volatile uint8_t sink = 0;
+  int i, count, size;
+
+  for (i = 0; i < BENCH_TEXT_SIZE; i++)
+    text[i] = 'a' + i % 26;
+  text[BENCH_TEXT_SIZE] = 0;
+  count = ascii_to_gsm7(text, packed, 0);
+  size = GSM7_PACKED_SIZE(count);
+  gsm7_unpack(packed, size, 0, septets, count);
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    memset(packed, 0, size);
+    legacy_pack(septets, count, packed);
+    sink ^= packed[i % size];
+  }
+  legacy_enc = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    ascii_to_gsm7(text, packed, 0);
+    sink ^= packed[i % size];
+  }
+  new_enc = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    legacy_unpack(packed, size, (uint8_t *)decoded, count);
+    sink ^= decoded[i % count];
+  }
+  legacy_dec = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    gsm7_to_ascii(packed, size, decoded, count);
+    sink ^= decoded[i % count];
+  }
+  new_dec = now_ns() - start;
+
+  printf("%i messages of %i characters\n", iterations, BENCH_TEXT_SIZE);
+  printf(" pack:   legacy %6.1f ns/msg (septets only), table %6.1f ns/msg\n",
+         (double)legacy_enc / iterations, (double)new_enc / iterations);
+  printf(" unpack: legacy %6.1f ns/msg (no mapping),   table %6.1f ns/msg\n",
+         (double)legacy_dec / iterations, (double)new_dec / iterations);
+  (void)sink;
+}
+
+int main(int argc, char **argv) {
+  int iterations = 1000000;
+  int opt, errors = 0;
+  size_t i;
+
+  while ((opt = getopt(argc, argv, "n:?")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = strtol(optarg, NULL, 0);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  for (i = 0; i < sizeof(gsm7_corpus) / sizeof(gsm7_corpus[0]); i++)
+    errors += check_gsm7(gsm7_corpus[i]);
+  errors += check_unpack();
+  for (i = 0; i < sizeof(ucs2_corpus) / sizeof(ucs2_corpus[0]); i++)
+    errors += check_ucs2(ucs2_corpus[i]);
+  if (errors > 0) {
+    printf("%i checks failed\n", errors);
+    return 1;
+  }
+  printf("All checks passed\n");
+  if (iterations > 0)
+    bench(iterations);
+  return 0;
+}
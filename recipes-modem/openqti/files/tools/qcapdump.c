@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * qcapdump
+ *  Host side decoder for the QMI capture files written by openqti
+ *  (see inc/capture.h). Prints one line per frame with the QMUX and
+ *  QMI headers, followed by the TLVs it carries.
+ *
+ *  Build: make qcapdump
+ *  Usage: qcapdump [-s service] [-x] file.qcap
+ */
+
+#include "../inc/capture.h"
+#include "../inc/ipc.h"
+#include "../inc/openqti.h"
+#include "../inc/qmi.h"
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *get_direction_name(uint8_t direction) {
+  switch (direction) {
+  case FROM_DSP:
+    return "HOST<-ADSP";
+  case FROM_HOST:
+    return "HOST->ADSP";
+  case FROM_OPENQTI:
+    return "HOST<-OQTI";
+  }
+  return "??????????";
+}
+
+const char *get_service_name(uint8_t service) {
+  for (int i = 0; i < (sizeof(common_names) / sizeof(common_names[0])); i++) {
+    if (common_names[i].service == service) {
+      return common_names[i].name;
+    }
+  }
+  return "Unknown service";
+}
+
+static void print_hex(const uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    printf("%02x ", buf[i]);
+  }
+}
+
+static void decode_tlvs(const uint8_t *buf, size_t len, size_t offset) {
+  const struct tlv_header *tlv;
+  uint16_t tlvlen;
+
+  while (offset + sizeof(struct tlv_header) <= len) {
+    tlv = (const struct tlv_header *)(buf + offset);
+    tlvlen = le16toh(tlv->len);
+    offset += sizeof(struct tlv_header);
+    printf("    TLV 0x%02x (%u bytes): ", tlv->id, tlvlen);
+    if (offset + tlvlen > len) {
+      printf("[truncated, %zu bytes left] ", len - offset);
+      print_hex(buf + offset, len - offset);
+      printf("\n");
+      return;
+    }
+    print_hex(buf + offset, tlvlen);
+    printf("\n");
+    offset += tlvlen;
+  }
+  if (offset < len) {
+    printf("    Trailing data: ");
+    print_hex(buf + offset, len - offset);
+    printf("\n");
+  }
+}
+
+static void decode_frame(const uint8_t *buf, size_t len) {
+  const struct qmux_packet *qmux = (const struct qmux_packet *)buf;
+  const struct qmi_packet *qmi;
+  const struct ctl_qmi_packet *ctl;
+
+  if (len < sizeof(struct qmux_packet)) {
+    printf("  Too short for a QMUX header\n");
+    return;
+  }
+  printf("  QMUX: len %u, ctl 0x%02x, svc 0x%02x (%s), instance %u\n",
+         le16toh(qmux->packet_length), qmux->control, qmux->service,
+         get_service_name(qmux->service), qmux->instance_id);
+
+  /* The control service uses a 1 byte transaction ID */
+  if (qmux->service == 0) {
+    if (len < sizeof(struct encapsulated_control_packet)) {
+      printf("  Too short for a QMI control header\n");
+      return;
+    }
+    ctl = (const struct ctl_qmi_packet *)(buf + sizeof(struct qmux_packet));
+    printf("  QMI:  flags 0x%02x, txn 0x%02x, msg 0x%04x, len %u\n", ctl->ctlid,
+           ctl->transaction_id, le16toh(ctl->msgid), le16toh(ctl->length));
+    decode_tlvs(buf, len, sizeof(struct encapsulated_control_packet));
+  } else {
+    if (len < sizeof(struct encapsulated_qmi_packet)) {
+      printf("  Too short for a QMI header\n");
+      return;
+    }
+    qmi = (const struct qmi_packet *)(buf + sizeof(struct qmux_packet));
+    printf("  QMI:  flags 0x%02x, txn 0x%04x, msg 0x%04x, len %u\n",
+           qmi->ctlid, le16toh(qmi->transaction_id), le16toh(qmi->msgid),
+           le16toh(qmi->length));
+    decode_tlvs(buf, len, sizeof(struct encapsulated_qmi_packet));
+  }
+}
+
+int main(int argc, char **argv) {
+  struct qcap_file_header header;
+  struct qcap_record_header record;
+  uint8_t *buf;
+  uint32_t caplen, snaplen;
+  int service_filter = -1;
+  int hexdump = 0;
+  unsigned long frame = 0;
+  struct tm *tm;
+  time_t ts;
+  char timestr[32];
+  FILE *fp;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:x?")) != -1) {
+    switch (opt) {
+    case 's':
+      service_filter = strtol(optarg, NULL, 0);
+      break;
+    case 'x':
+      hexdump = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s service] [-x] file.qcap\n", argv[0]);
+      fprintf(stderr, " -s: Only show frames for this QMUX service\n");
+      fprintf(stderr, " -x: Also print every frame in hex\n");
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-s service] [-x] file.qcap\n", argv[0]);
+    return 1;
+  }
+
+  fp = fopen(argv[optind], "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      le32toh(header.magic) != QCAP_MAGIC) {
+    fprintf(stderr, "%s is not a QMI capture file\n", argv[optind]);
+    fclose(fp);
+    return 1;
+  }
+  if (le16toh(header.version_major) != QCAP_VERSION_MAJOR) {
+    fprintf(stderr, "Unsupported capture version %u.%u\n",
+            le16toh(header.version_major), le16toh(header.version_minor));
+    fclose(fp);
+    return 1;
+  }
+  snaplen = le32toh(header.snaplen);
+  buf = malloc(snaplen);
+  if (buf == NULL) {
+    fclose(fp);
+    return 1;
+  }
+
+  while (fread(&record, sizeof(record), 1, fp) == 1) {
+    frame++;
+    caplen = le32toh(record.caplen);
+    if (caplen > snaplen) {
+      fprintf(stderr, "Frame %lu: bad length %u, file is corrupted\n", frame,
+              caplen);
+      break;
+    }
+    if (fread(buf, 1, caplen, fp) != caplen) {
+      fprintf(stderr, "Frame %lu is truncated\n", frame);
+      break;
+    }
+    if (service_filter >= 0 && record.service != service_filter)
+      continue;
+
+    ts = le32toh(record.ts_sec);
+    tm = localtime(&ts);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", tm);
+    printf("#%lu %s.%06u %s %u bytes", frame, timestr,
+           le32toh(record.ts_nsec) / 1000, get_direction_name(record.direction),
+           le32toh(record.origlen));
+    if (le32toh(record.origlen) != caplen)
+      printf(" (%u captured)", caplen);
+    printf("\n");
+    if (hexdump) {
+      printf("  ");
+      print_hex(buf, caplen);
+      printf("\n");
+    }
+    decode_frame(buf, caplen);
+  }
+
+  free(buf);
+  fclose(fp);
+  return 0;
+}
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * qmetrics
+ *  Prints the metrics page openqti publishes in METRICS_PATH (see
+ *  inc/metrics.h). The page is only mapped and read, so it can be
+ *  sampled as often as needed without openqti noticing.
+ *
+ *  Build: make qmetrics
+ *  Usage: qmetrics [-p path] [-w ms]
+ */
+
+#include "../inc/metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QMETRICS_MAX_RETRIES 1000
+
+static const char *direction_names[] = {"dsp", "host"};
+
+/* Seqlock read: retry while openqti is writing or wrote meanwhile */
+static int read_metrics(struct openqti_metrics *page,
+                        struct openqti_metrics *out) {
+  uint32_t seq, seq2;
+  int i;
+
+  for (i = 0; i < QMETRICS_MAX_RETRIES; i++) {
+    seq = atomic_load_explicit(&page->seq, memory_order_acquire);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(out, page, sizeof(*out));
+    atomic_thread_fence(memory_order_acquire);
+    seq2 = atomic_load_explicit(&page->seq, memory_order_relaxed);
+    if (seq == seq2)
+      return seq == 0 ? -EAGAIN : 0;
+  }
+  return -EBUSY;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_proxy(const char *name, struct metrics_proxy *p) {
+  int i;
+  printf("%s.bypassed=%llu\n", name, (unsigned long long)p->bypassed);
+  printf("%s.empty=%llu\n", name, (unsigned long long)p->empty);
+  printf("%s.discarded=%llu\n", name, (unsigned long long)p->discarded);
+  printf("%s.allowed=%llu\n", name, (unsigned long long)p->allowed);
+  printf("%s.failed=%llu\n", name, (unsigned long long)p->failed);
+  printf("%s.other=%llu\n", name, (unsigned long long)p->other);
+  for (i = 0; i < 2; i++) {
+    printf("%s.forward.%s: n=%llu p50=%lluus p90=%lluus p99=%lluus "
+           "max=%lluus\n",
+           name, direction_names[i], (unsigned long long)p->forward[i].count,
+           (unsigned long long)p->forward[i].p50_ns / 1000,
+           (unsigned long long)p->forward[i].p90_ns / 1000,
+           (unsigned long long)p->forward[i].p99_ns / 1000,
+           (unsigned long long)p->forward[i].max_ns / 1000);
+  }
+  for (i = 0; i < 2; i++) {
+    if (p->handler[i].count == 0)
+      continue;
+    printf("%s.handler.%s: n=%llu p50=%lluus p90=%lluus p99=%lluus "
+           "max=%lluus\n",
+           name, direction_names[i], (unsigned long long)p->handler[i].count,
+           (unsigned long long)p->handler[i].p50_ns / 1000,
+           (unsigned long long)p->handler[i].p90_ns / 1000,
+           (unsigned long long)p->handler[i].p99_ns / 1000,
+           (unsigned long long)p->handler[i].max_ns / 1000);
+  }
+}
+
+static void print_metrics(struct openqti_metrics *m) {
+  uint64_t now = now_ns();
+  int i;
+
+  printf("pid=%u\n", m->pid);
+  printf("uptime=%llus\n",
+         (unsigned long long)(m->updated_ns - m->start_ns) / 1000000000ULL);
+  printf("age=%llums\n", now > m->updated_ns
+                             ? (unsigned long long)(now - m->updated_ns) /
+                                   1000000ULL
+                             : 0ULL);
+  print_proxy("rmnet", &m->rmnet);
+  print_proxy("gps", &m->gps);
+  printf("sms.queue=%u/%u\n", m->sms_queue_depth, m->sms_queue_capacity);
+  printf("sms.queue.high_water=%u\n", m->sms_queue_high_water);
+  printf("sms.queue.rejected=%llu\n",
+         (unsigned long long)m->sms_queue_rejected);
+  printf("tasks.pending=%u\n", m->pending_tasks);
+  printf("clients.tracked=%u\n", m->tracked_clients);
+  printf("clients.dirty_reconnects=%u\n", m->dirty_reconnects);
+  printf("log.dropped=%u\n", m->log_dropped);
+  printf("usb.suspended=%u\n", m->usb_suspended);
+  for (i = 0; i < METRICS_THERMAL_ZONES; i++) {
+    if (m->thermal[i] != 0)
+      printf("thermal.%i=%i\n", i, m->thermal[i]);
+  }
+  printf("network.type=%u\n", m->network_type);
+  printf("network.signal=%u\n", m->signal_level);
+  printf("network.bars=%u\n", m->signal_bars);
+  printf("network.in_service=%u\n", m->in_service);
+  printf("network.in_call=%u\n", m->in_call);
+}
+
+int main(int argc, char **argv) {
+  const char *path = METRICS_PATH;
+  struct openqti_metrics snapshot, *page;
+  struct stat st;
+  int watch_ms = 0;
+  int opt, fd, ret;
+
+  while ((opt = getopt(argc, argv, "p:w:?")) != -1) {
+    switch (opt) {
+    case 'p':
+      path = optarg;
+      break;
+    case 'w':
+      watch_ms = strtol(optarg, NULL, 0);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-p path] [-w ms]\n", argv[0]);
+      fprintf(stderr, " -p: Metrics page (default %s)\n", METRICS_PATH);
+      fprintf(stderr, " -w: Print it again every ms milliseconds\n");
+      return 1;
+    }
+  }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct openqti_metrics)) {
+    fprintf(stderr, "%s is too small, is openqti running?\n", path);
+    close(fd);
+    return 1;
+  }
+  page = mmap(NULL, sizeof(struct openqti_metrics), PROT_READ, MAP_SHARED, fd,
+              0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  do {
+    ret = read_metrics(page, &snapshot);
+    if (ret < 0) {
+      fprintf(stderr, "Can't get a consistent copy of %s (%s)\n", path,
+              ret == -EAGAIN ? "not published yet" : "writer busy");
+      return 1;
+    }
+    if (snapshot.magic != METRICS_MAGIC) {
+      fprintf(stderr, "%s is not an openqti metrics page\n", path);
+      return 1;
+    }
+    if (snapshot.version != METRICS_VERSION) {
+      fprintf(stderr, "%s: Version %u, this reader understands %u\n", path,
+              snapshot.version, METRICS_VERSION);
+      return 1;
+    }
+    print_metrics(&snapshot);
+    if (watch_ms > 0) {
+      printf("\n");
+      fflush(stdout);
+      usleep(watch_ms * 1000);
+    }
+  } while (watch_ms > 0);
+
+  munmap(page, sizeof(struct openqti_metrics));
+  return 0;
+}
@@ -0,0 +1,686 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * qmireplay
+ *  Host side benchmark for the QMI forwarding path. It builds the proxy
+ *  core from src/ (everything but main() and the TTS engine), and feeds
+ *  it a recorded QMI stream (a .qcap file written by the packet capture)
+ *  or a synthetic one. It runs in two stages:
+ *
+ *   1. Direct: calls process_packet() for every frame and times each
+ *      call, grouped by QMUX service, and shows the counters of the
+ *      dispatch table. Also times is_inject_needed().
+ *   2. Proxy: starts rmnet_proxy() on two SOCK_SEQPACKET socketpairs
+ *      standing in for /dev/rmnet_ctrl and /dev/smdcntl8, pushes every
+ *      frame through the right side and matches what comes out on the
+ *      other to get packets per second and latency percentiles for
+ *      each direction.
+ *
+ *  Heap allocations made by openqti code are counted in both stages
+ *  (malloc and friends are wrapped at link time). QMI handlers are
+ *  expected to work from the scratch arenas, so -a makes qmireplay exit
+ *  with an error if there are more than that many per frame.
+ *
+ *  Build: make qmireplay
+ *  Usage: qmireplay [-n iterations] [-g frames] [-L logfile] [-a allocs]
+ *                   [-d] [-s] [file]
+ */
+
+#include "../inc/arena.h"
+#include "../inc/atfwd.h"
+#include "../inc/audio.h"
+#include "../inc/call.h"
+#include "../inc/capture.h"
+#include "../inc/command.h"
+#include "../inc/config.h"
+#include "../inc/dispatch.h"
+#include "../inc/gsm7.h"
+#include "../inc/ipc.h"
+#include "../inc/logger.h"
+#include "../inc/openqti.h"
+#include "../inc/proxy.h"
+#include "../inc/qmi.h"
+#include "../inc/sms.h"
+#include "../inc/tracking.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_MAX_LOOKAHEAD 1024
+#define REPLAY_IDLE_TIMEOUT_MS 300
+#define REPLAY_INJECT_LOOPS 100000
+
+/* Allocation counters, see the --wrap flags in the Makefile */
+atomic_ulong alloc_count;
+atomic_ulong free_count;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+  atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr != NULL)
+    atomic_fetch_add_explicit(&free_count, 1, memory_order_relaxed);
+  __real_free(ptr);
+}
+
+/* The TTS engine isn't built in, simulated calls just stay silent */
+int init_tts_engine() { return 0; }
+int pico2aud(char *text, size_t len) { return 0; }
+int tts_stream_start(struct pcm *pcm) { return 0; }
+void tts_stream_drain() {}
+void tts_stream_abort() {}
+void tts_stream_stop() {}
+
+struct replay_frame {
+  uint8_t direction;
+  uint16_t len;
+  uint8_t *data;
+};
+
+struct replay_side {
+  int fd;            // Our end of the socketpair
+  uint8_t direction; // Direction of the frames we expect to read here
+  size_t cursor;     // Next sequence number we haven't matched yet
+  uint64_t *latency; // ns, one per matched frame
+  size_t matched;
+  size_t skipped; // Not forwarded (bypassed, discarded...)
+  size_t generated; // Not sent by us: responses made up by openqti
+};
+
+struct {
+  struct replay_frame *frames;
+  size_t count;
+  unsigned int iterations;
+  size_t total;         // count * iterations
+  uint64_t *sent_ns;    // Indexed by sequence number
+  atomic_size_t sent;   // Sequence numbers published so far
+  atomic_bool done;
+  atomic_ulong last_rx_ns;
+  FILE *out;
+  bool dump_stats;   // -s
+  double max_allocs; // -a, per frame. Negative if not checked
+  bool failed;
+} replay;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int add_frame(uint8_t direction, const uint8_t *data, size_t len) {
+  struct replay_frame *frames;
+  if (len == 0 || len > MAX_PACKET_SIZE)
+    return 0;
+
+  frames = realloc(replay.frames, (replay.count + 1) * sizeof(*frames));
+  if (frames == NULL)
+    return -ENOMEM;
+  replay.frames = frames;
+  frames[replay.count].direction = direction;
+  frames[replay.count].len = len;
+  frames[replay.count].data = malloc(len);
+  if (frames[replay.count].data == NULL)
+    return -ENOMEM;
+  memcpy(frames[replay.count].data, data, len);
+  replay.count++;
+  return 0;
+}
+
+static int load_capture(const char *path) {
+  struct qcap_file_header header;
+  struct qcap_record_header record;
+  uint8_t buf[MAX_PACKET_SIZE];
+  uint32_t caplen;
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return -ENOENT;
+  }
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      le32toh(header.magic) != QCAP_MAGIC ||
+      le16toh(header.version_major) != QCAP_VERSION_MAJOR) {
+    fprintf(stderr, "%s is not a supported capture file\n", path);
+    fclose(fp);
+    return -EINVAL;
+  }
+
+  while (fread(&record, sizeof(record), 1, fp) == 1) {
+    caplen = le32toh(record.caplen);
+    if (caplen > sizeof(buf) || fread(buf, 1, caplen, fp) != caplen)
+      break;
+    /* Injected frames are openqti's own output, not input */
+    if (record.direction != FROM_HOST && record.direction != FROM_DSP)
+      continue;
+    if (caplen != le32toh(record.origlen))
+      continue;
+    if (add_frame(record.direction, buf, caplen) < 0)
+      break;
+  }
+  fclose(fp);
+  return replay.count > 0 ? 0 : -ENODATA;
+}
+
+/*
+ * Threads get their scratch arena from the heap the first time they use
+ * it. That's once per thread, not per frame, so it's done before counting
+ */
+static void warm_scratch_arena() {
+  struct scratch_mark mark = scratch_save();
+  scratch_alloc(1);
+  scratch_restore(mark);
+}
+
+static void *proxy_thread(void *data) {
+  warm_scratch_arena();
+  return rmnet_proxy(data);
+}
+
+/* Fails the run if a stage made more heap allocations than allowed */
+static void check_allocs(const char *stage, uint64_t allocs, size_t frames) {
+  double per_frame = (double)allocs / frames;
+
+  if (replay.max_allocs < 0 || per_frame <= replay.max_allocs)
+    return;
+  fprintf(replay.out, "  FAIL: %s stage made %.2f allocations per frame, "
+                      "%.2f allowed\n",
+          stage, per_frame, replay.max_allocs);
+  replay.failed = true;
+}
+
+/* A WMS message with the payload in TLV 0x01, as the host or the DSP send it */
+static void add_wms_frame(uint8_t direction, uint16_t msgid, uint16_t txn,
+                          const uint8_t *tlv, size_t tlv_len) {
+  uint8_t buf[MAX_PACKET_SIZE];
+  struct encapsulated_qmi_packet *pkt = (struct encapsulated_qmi_packet *)buf;
+  struct tlv_header *header =
+      (struct tlv_header *)(buf + sizeof(struct encapsulated_qmi_packet));
+  size_t len = sizeof(*pkt) + sizeof(*header) + tlv_len;
+
+  pkt->qmux.version = 0x01;
+  pkt->qmux.packet_length = htole16(len - 1);
+  pkt->qmux.control = direction == FROM_DSP ? 0x80 : 0x00;
+  pkt->qmux.service = 0x05;
+  pkt->qmux.instance_id = 0x01;
+  pkt->qmi.ctlid = direction == FROM_DSP ? 0x02 : 0x00;
+  pkt->qmi.transaction_id = htole16(txn);
+  pkt->qmi.msgid = htole16(msgid);
+  pkt->qmi.length = htole16(sizeof(*header) + tlv_len);
+  header->id = 0x01;
+  header->len = htole16(tlv_len);
+  memcpy(buf + sizeof(*pkt) + sizeof(*header), tlv, tlv_len);
+  add_frame(direction, buf, len);
+}
+
+/*
+ * SMS traffic: the host sending a message to someone, the host asking
+ * the bot for its name, and the DSP answering a read request
+ */
+static void add_sms_frame(size_t i) {
+  /* Raw send: format, PDU length, then a SUBMIT without SMSC */
+  uint8_t raw_send[64] = {0x06, 0x00, 0x00, 0x00, 0x11, 0x00, 0x0c,
+                          0x91, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                          0x00, 0x00, 0xa7};
+  /* Read response: storage tag, format, PDU length, then a DELIVER */
+  uint8_t read_resp[] = {0x01, 0x06, 0x24, 0x00, 0x07, 0x91, 0x13, 0x26,
+                         0x04, 0x00, 0x00, 0xf0, 0x04, 0x0b, 0x91, 0x13,
+                         0x46, 0x61, 0x00, 0x89, 0xf6, 0x00, 0x00, 0x20,
+                         0x80, 0x62, 0x91, 0x73, 0x14, 0x80, 0x0a, 0xe8,
+                         0x32, 0x9b, 0xfd, 0x46, 0x97, 0xd9, 0xec, 0x37};
+  const char *text = "name";
+  size_t len = 17;
+  int septets;
+
+  switch ((i / 64) % 3) {
+  case 0: // To the bot, the number is the one it answers to
+    break;
+  case 1: // To anyone else, just forwarded
+    raw_send[8] = 0x21;
+    text = "See you at eight";
+    break;
+  default:
+    add_wms_frame(FROM_DSP, WMS_READ_MESSAGE, i, read_resp,
+                  sizeof(read_resp));
+    return;
+  }
+  septets = ascii_to_gsm7((const uint8_t *)text, raw_send + len + 1, 0);
+  raw_send[len] = septets;
+  len += 1 + GSM7_PACKED_SIZE(septets);
+  raw_send[1] = len - 3;
+  add_wms_frame(FROM_HOST, WMS_RAW_SEND, i, raw_send, len);
+}
+
+/*
+ * Synthetic traffic: the kind of frames that are just forwarded most
+ * of the time (data session stats, signal indications, location), some
+ * voice indications so the call handler runs too, and a few SMS so the
+ * bot commands get their turn
+ */
+static void generate_frames(size_t count) {
+  uint8_t wds_req[] = {0x01, 0x12, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00,
+                       0x24, 0x00, 0x07, 0x00, 0x01, 0x04, 0x00, 0xff, 0x00,
+                       0x00, 0x00};
+  uint8_t wds_resp[] = {0x01, 0x1a, 0x00, 0x80, 0x01, 0x01, 0x02, 0x00, 0x00,
+                        0x24, 0x00, 0x0f, 0x00, 0x02, 0x04, 0x00, 0x00, 0x00,
+                        0x00, 0x00, 0x10, 0x04, 0x00, 0x10, 0x27, 0x00, 0x00,
+                        0x00};
+  uint8_t nas_ind[] = {0x01, 0x11, 0x00, 0x80, 0x03, 0x01, 0x04, 0x00,
+                       0x00, 0x02, 0x00, 0x05, 0x00, 0x10, 0x02, 0x00,
+                       0xb5, 0x08};
+  uint8_t loc_ind[] = {0x01, 0x17, 0x00, 0x80, 0x10, 0x01, 0x04, 0x00,
+                       0x00, 0x26, 0x00, 0x0b, 0x00, 0x01, 0x08, 0x00,
+                       0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88};
+  uint8_t voice_ind[] = {0x01, 0x11, 0x00, 0x80, 0x09, 0x02, 0x04, 0x00,
+                         0x00, 0x55, 0x00, 0x05, 0x00, 0x10, 0x02, 0x00,
+                         0x01, 0x00};
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    switch (i % 8) {
+    case 0:
+    case 2:
+    case 4:
+      wds_req[7] = i & 0xff;
+      add_frame(FROM_HOST, wds_req, sizeof(wds_req));
+      break;
+    case 1:
+    case 3:
+    case 5:
+      wds_resp[7] = i & 0xff;
+      add_frame(FROM_DSP, wds_resp, sizeof(wds_resp));
+      break;
+    case 6:
+      if (i & 8) {
+        voice_ind[7] = i & 0xff;
+        add_frame(FROM_DSP, voice_ind, sizeof(voice_ind));
+        break;
+      }
+      nas_ind[16] = 0xb0 + (i & 0x0f);
+      add_frame(FROM_DSP, nas_ind, sizeof(nas_ind));
+      break;
+    default:
+      if (i % 64 == 7) {
+        add_sms_frame(i);
+        break;
+      }
+      loc_ind[16] = i & 0xff;
+      add_frame(FROM_DSP, loc_ind, sizeof(loc_ind));
+      break;
+    }
+  }
+}
+
+static void reset_openqti_state() {
+  reset_sms_runtime();
+  reset_call_state();
+  set_cmd_runtime_defaults();
+  set_atfwd_runtime_default();
+  reset_client_handler();
+  reset_dirty_reconnects();
+}
+
+/* Reads and throws away everything, for the direct stage */
+static void *drain_thread(void *data) {
+  int fd = *(int *)data;
+  uint8_t buf[MAX_PACKET_SIZE];
+  while (read(fd, buf, sizeof(buf)) > 0) {
+  }
+  return NULL;
+}
+
+static void run_direct_stage() {
+  uint64_t ns[256] = {0}, max_ns[256] = {0}, calls[256] = {0};
+  uint64_t t0, t1, allocs;
+  uint8_t buf[MAX_PACKET_SIZE];
+  int adsp_pair[2], usb_pair[2];
+  pthread_t drain_adsp, drain_usb;
+  struct qmi_handler_stats handlers[DISPATCH_MAX_HANDLERS];
+  size_t num_handlers;
+  unsigned int it;
+  size_t i;
+  uint8_t service;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, adsp_pair) < 0 ||
+      socketpair(AF_UNIX, SOCK_SEQPACKET, 0, usb_pair) < 0) {
+    fprintf(stderr, "Cannot create socketpairs\n");
+    return;
+  }
+  pthread_create(&drain_adsp, NULL, drain_thread, &adsp_pair[1]);
+  pthread_create(&drain_usb, NULL, drain_thread, &usb_pair[1]);
+
+  reset_qmi_handler_stats();
+  warm_scratch_arena();
+  allocs = atomic_load(&alloc_count);
+  for (it = 0; it < replay.iterations; it++) {
+    for (i = 0; i < replay.count; i++) {
+      memcpy(buf, replay.frames[i].data, replay.frames[i].len);
+      service = replay.frames[i].len >= sizeof(struct qmux_packet)
+                    ? ((struct qmux_packet *)buf)->service
+                    : 0;
+      t0 = now_ns();
+      process_packet(replay.frames[i].direction, buf, replay.frames[i].len,
+                     adsp_pair[0], usb_pair[0]);
+      t1 = now_ns();
+      ns[service] += t1 - t0;
+      calls[service]++;
+      if (t1 - t0 > max_ns[service])
+        max_ns[service] = t1 - t0;
+    }
+  }
+  allocs = atomic_load(&alloc_count) - allocs;
+
+  fprintf(replay.out, "\nDirect process_packet() calls:\n");
+  fprintf(replay.out, "  %-4s %-40s %10s %10s %10s\n", "svc", "name", "calls",
+          "avg ns", "max ns");
+  for (i = 0; i < 256; i++) {
+    if (calls[i] == 0)
+      continue;
+    fprintf(replay.out, "  0x%02zx %-40.40s %10llu %10llu %10llu\n", i,
+            get_service_name(i), (unsigned long long)calls[i],
+            (unsigned long long)(ns[i] / calls[i]),
+            (unsigned long long)max_ns[i]);
+  }
+  fprintf(replay.out, "  Allocations: %llu (%.2f per frame)\n",
+          (unsigned long long)allocs,
+          (double)allocs / (replay.count * replay.iterations));
+  check_allocs("Direct", allocs, replay.count * replay.iterations);
+
+  num_handlers = get_qmi_handler_stats(handlers, DISPATCH_MAX_HANDLERS);
+  fprintf(replay.out, "\nDispatch table handlers:\n");
+  fprintf(replay.out, "  %-4s %-6s %-4s %-29s %10s %10s %10s\n", "svc", "msg",
+          "dir", "name", "calls", "avg ns", "max ns");
+  for (i = 0; i < num_handlers; i++) {
+    char msgid[8] = "any";
+    if (handlers[i].msgid != QMI_MSGID_ANY)
+      snprintf(msgid, sizeof(msgid), "0x%04x", handlers[i].msgid);
+    fprintf(replay.out, "  0x%02x %-6s %-4s %-29.29s %10u %10llu %10llu\n",
+            handlers[i].service, msgid,
+            handlers[i].direction == FROM_DSP    ? "dsp"
+            : handlers[i].direction == FROM_HOST ? "host"
+                                                 : "any",
+            handlers[i].name, handlers[i].calls,
+            handlers[i].calls ? (unsigned long long)(handlers[i].total_ns /
+                                                     handlers[i].calls)
+                              : 0ULL,
+            (unsigned long long)handlers[i].max_ns);
+  }
+
+  t0 = now_ns();
+  for (i = 0; i < REPLAY_INJECT_LOOPS; i++) {
+    is_inject_needed();
+  }
+  t1 = now_ns();
+  fprintf(replay.out, "  is_inject_needed(): %llu ns per call\n",
+          (unsigned long long)((t1 - t0) / REPLAY_INJECT_LOOPS));
+
+  shutdown(adsp_pair[0], SHUT_RDWR);
+  shutdown(usb_pair[0], SHUT_RDWR);
+  pthread_join(drain_adsp, NULL);
+  pthread_join(drain_usb, NULL);
+  close(adsp_pair[0]);
+  close(adsp_pair[1]);
+  close(usb_pair[0]);
+  close(usb_pair[1]);
+}
+
+/* Match what came out of the proxy against what we sent */
+static void match_frame(struct replay_side *side, uint8_t *buf, size_t len,
+                        uint64_t rx_ns) {
+  size_t seq, sent = atomic_load(&replay.sent);
+  size_t limit = side->cursor + REPLAY_MAX_LOOKAHEAD;
+  struct replay_frame *frame;
+
+  for (seq = side->cursor; seq < sent && seq < limit; seq++) {
+    frame = &replay.frames[seq % replay.count];
+    if (frame->direction != side->direction || frame->len != len ||
+        memcmp(frame->data, buf, len) != 0)
+      continue;
+
+    /* Everything we went past in this direction was not forwarded */
+    for (; side->cursor < seq; side->cursor++) {
+      if (replay.frames[side->cursor % replay.count].direction ==
+          side->direction)
+        side->skipped++;
+    }
+    side->cursor = seq + 1;
+    side->latency[side->matched++] = rx_ns - replay.sent_ns[seq];
+    return;
+  }
+  side->generated++;
+}
+
+static void *reader_thread(void *data) {
+  struct replay_side *side = (struct replay_side *)data;
+  uint8_t buf[MAX_PACKET_SIZE];
+  struct pollfd pfd;
+  ssize_t ret;
+  uint64_t rx_ns;
+
+  pfd.fd = side->fd;
+  pfd.events = POLLIN;
+  while (1) {
+    ret = poll(&pfd, 1, REPLAY_IDLE_TIMEOUT_MS);
+    if (ret == 0 && atomic_load(&replay.done))
+      break;
+    if (ret <= 0)
+      continue;
+    ret = read(side->fd, buf, sizeof(buf));
+    if (ret <= 0)
+      break;
+    rx_ns = now_ns();
+    atomic_store(&replay.last_rx_ns, rx_ns);
+    match_frame(side, buf, ret, rx_ns);
+  }
+
+  /* Whatever is left in our direction never made it */
+  for (; side->cursor < replay.total; side->cursor++) {
+    if (replay.frames[side->cursor % replay.count].direction ==
+        side->direction)
+      side->skipped++;
+  }
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_side(const char *name, struct replay_side *side) {
+  uint64_t *lat = side->latency;
+  size_t n = side->matched;
+  fprintf(replay.out, "  %s: %zu forwarded, %zu not forwarded\n", name, n,
+          side->skipped);
+  if (n == 0)
+    return;
+  qsort(lat, n, sizeof(uint64_t), compare_u64);
+  fprintf(replay.out,
+          "    latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+          lat[n / 2] / 1000.0, lat[n * 90 / 100] / 1000.0,
+          lat[n * 99 / 100] / 1000.0, lat[n * 999 / 1000] / 1000.0,
+          lat[n - 1] / 1000.0);
+}
+
+static void run_proxy_stage() {
+  int adsp_pair[2], usb_pair[2];
+  struct node_pair nodes;
+  struct replay_side host_side, dsp_side;
+  pthread_t proxy, host_reader, dsp_reader;
+  struct replay_frame *frame;
+  uint64_t start, allocs;
+  size_t seq;
+  int fd;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, adsp_pair) < 0 ||
+      socketpair(AF_UNIX, SOCK_SEQPACKET, 0, usb_pair) < 0) {
+    fprintf(stderr, "Cannot create socketpairs\n");
+    return;
+  }
+  nodes.node1.fd = usb_pair[0];  // RMNET_CTL
+  nodes.node2.fd = adsp_pair[0]; // SMD_CNTL
+  nodes.allow_exit = false;
+
+  memset(&host_side, 0, sizeof(host_side));
+  memset(&dsp_side, 0, sizeof(dsp_side));
+  host_side.fd = usb_pair[1];
+  host_side.direction = FROM_DSP; // What the host receives
+  dsp_side.fd = adsp_pair[1];
+  dsp_side.direction = FROM_HOST;
+  host_side.latency = calloc(replay.total, sizeof(uint64_t));
+  dsp_side.latency = calloc(replay.total, sizeof(uint64_t));
+  replay.sent_ns = calloc(replay.total, sizeof(uint64_t));
+  if (!host_side.latency || !dsp_side.latency || !replay.sent_ns) {
+    fprintf(stderr, "Not enough memory\n");
+    return;
+  }
+
+  reset_openqti_state();
+  pthread_create(&proxy, NULL, proxy_thread, &nodes);
+  pthread_create(&host_reader, NULL, reader_thread, &host_side);
+  pthread_create(&dsp_reader, NULL, reader_thread, &dsp_side);
+  usleep(100000); // Let the proxy set up its event loop
+
+  allocs = atomic_load(&alloc_count);
+  start = now_ns();
+  for (seq = 0; seq < replay.total; seq++) {
+    frame = &replay.frames[seq % replay.count];
+    fd = frame->direction == FROM_HOST ? usb_pair[1] : adsp_pair[1];
+    replay.sent_ns[seq] = now_ns();
+    atomic_store(&replay.sent, seq + 1);
+    if (write(fd, frame->data, frame->len) < 0) {
+      fprintf(stderr, "Write failed: %s\n", strerror(errno));
+      break;
+    }
+  }
+  atomic_store(&replay.done, true);
+  pthread_join(host_reader, NULL);
+  pthread_join(dsp_reader, NULL);
+  allocs = atomic_load(&alloc_count) - allocs;
+
+  fprintf(replay.out, "\nProxy (rmnet_proxy over socketpairs):\n");
+  fprintf(replay.out, "  %zu frames in %.3f s: %.0f packets per second\n",
+          replay.total, (atomic_load(&replay.last_rx_ns) - start) / 1e9,
+          replay.total / ((atomic_load(&replay.last_rx_ns) - start) / 1e9));
+  print_side("HOST->ADSP", &dsp_side);
+  print_side("ADSP->HOST", &host_side);
+  fprintf(replay.out, "  Frames generated by openqti: %zu\n",
+          host_side.generated + dsp_side.generated);
+  fprintf(replay.out, "  Allocations: %llu (%.2f per frame), frees: %lu\n",
+          (unsigned long long)allocs, (double)allocs / replay.total,
+          atomic_load(&free_count));
+  check_allocs("Proxy", allocs, replay.total);
+  if (replay.dump_stats) {
+    fprintf(replay.out, "\nopenqti's own proxy stats:\n");
+    dump_proxy_stats(replay.out);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *logfile = "/dev/null";
+  struct scratch_stats scratch;
+  size_t synthetic = 0;
+  bool debug = false;
+  int opt, fd;
+
+  replay.iterations = 1;
+  replay.max_allocs = -1;
+  while ((opt = getopt(argc, argv, "n:g:L:a:ds?")) != -1) {
+    switch (opt) {
+    case 'n':
+      replay.iterations = strtoul(optarg, NULL, 0);
+      break;
+    case 'g':
+      synthetic = strtoul(optarg, NULL, 0);
+      break;
+    case 'L':
+      logfile = optarg;
+      break;
+    case 'a':
+      replay.max_allocs = strtod(optarg, NULL);
+      break;
+    case 'd':
+      debug = true;
+      break;
+    case 's':
+      replay.dump_stats = true;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-n iterations] [-g frames] [-L logfile] "
+              "[-a allocs] [-d] [-s] [file.qcap]\n",
+              argv[0]);
+      fprintf(stderr, " -n: Replay the stream this many times\n");
+      fprintf(stderr, " -g: Use this many synthetic frames instead\n");
+      fprintf(stderr, " -L: Send openqti's log here (/dev/null)\n");
+      fprintf(stderr, " -a: Fail if any stage makes more heap allocations "
+                      "per frame\n");
+      fprintf(stderr, " -d: Debug log level (hex dumps every packet)\n");
+      fprintf(stderr, " -s: Also print openqti's own proxy stats\n");
+      return 1;
+    }
+  }
+  if (replay.iterations == 0)
+    replay.iterations = 1;
+
+  if (synthetic > 0) {
+    generate_frames(synthetic);
+  } else if (optind >= argc || load_capture(argv[optind]) < 0) {
+    fprintf(stderr, "Need a capture file or -g\n");
+    return 1;
+  }
+  replay.total = replay.count * replay.iterations;
+
+  /* openqti logs to stdout, keep it away from the report */
+  replay.out = fdopen(dup(STDOUT_FILENO), "w");
+  fd = open(logfile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (replay.out == NULL || fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+    fprintf(stderr, "Cannot redirect the log to %s\n", logfile);
+    return 1;
+  }
+  close(fd);
+
+  set_initial_config();
+  reset_logtime();
+  set_log_method(true);
+  set_log_level(debug ? 0 : 1);
+  init_proxy_runtime();
+  reset_openqti_state();
+
+  fprintf(replay.out, "Replaying %zu frames x %u iterations\n", replay.count,
+          replay.iterations);
+  run_direct_stage();
+  run_proxy_stage();
+  scratch = get_scratch_stats();
+  fprintf(replay.out, "\nScratch arenas: %u threads, high water %u bytes, "
+                      "%llu overflows\n",
+          scratch.threads, scratch.high_water,
+          (unsigned long long)scratch.overflows);
+  fflush(replay.out);
+  flush_log();
+  return replay.failed ? 1 : 0;
+}